@@ -35,6 +35,7 @@
 #include <limits>
 #include <memory>
 #include <stdexcept>
+#include <string>
 #include <type_traits>
 #include <utility>
 #include <vector>
@@ -56,6 +57,10 @@
 #include <string_view>
 #endif
 
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
 #ifdef TSL_DEBUG
 #define tsl_ah_assert(expr) assert(expr)
 #else
@@ -69,34 +74,196 @@
  */
 namespace tsl {
 
+namespace detail_array_hash {
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && \
+    __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define TSL_AH_BIG_ENDIAN
+#endif
+
+/**
+ * Little-endian reads of 8 and 4 bytes at any alignment.
+ */
+inline std::uint64_t read_le64(const unsigned char* p) noexcept {
+  std::uint64_t value;
+  std::memcpy(&value, p, sizeof(value));
+#ifdef TSL_AH_BIG_ENDIAN
+  value = __builtin_bswap64(value);
+#endif
+  return value;
+}
+
+inline std::uint64_t read_le32(const unsigned char* p) noexcept {
+  std::uint32_t value;
+  std::memcpy(&value, p, sizeof(value));
+#ifdef TSL_AH_BIG_ENDIAN
+  value = __builtin_bswap32(value);
+#endif
+  return value;
+}
+
+/**
+ * Full 64x64 -> 128 bits multiplication, the low half is stored in `a` and
+ * the high half in `b`.
+ */
+inline void multiply_128(std::uint64_t& a, std::uint64_t& b) noexcept {
+#if defined(__SIZEOF_INT128__)
+  __extension__ typedef unsigned __int128 uint128;
+  const uint128 r = static_cast<uint128>(a) * b;
+  a = static_cast<std::uint64_t>(r);
+  b = static_cast<std::uint64_t>(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  a = _umul128(a, b, &b);
+#else
+  const std::uint64_t ha = a >> 32, hb = b >> 32;
+  const std::uint64_t la = static_cast<std::uint32_t>(a);
+  const std::uint64_t lb = static_cast<std::uint32_t>(b);
+  const std::uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+
+  const std::uint64_t t = rl + (rm0 << 32);
+  std::uint64_t carry = (t < rl) ? 1 : 0;
+  const std::uint64_t lo = t + (rm1 << 32);
+  carry += (lo < t) ? 1 : 0;
+
+  a = lo;
+  b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+inline std::uint64_t multiply_mix(std::uint64_t a, std::uint64_t b) noexcept {
+  multiply_128(a, b);
+  return a ^ b;
+}
+
+/**
+ * Hash of `len` bytes based on wyhash (Wang Yi, public domain). The bytes are
+ * read by words in little-endian order and all the code paths of
+ * multiply_128 give the same result, the hash of a byte sequence is thus the
+ * same on every platform.
+ */
+inline std::uint64_t wyhash(const void* data, std::size_t len) noexcept {
+  static const std::uint64_t secret[4] = {
+      0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull,
+      0x589965cc75374cc3ull};
+
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  std::uint64_t seed = multiply_mix(secret[0], secret[1]);
+  std::uint64_t a;
+  std::uint64_t b;
+
+  if (len <= 16) {
+    if (len >= 4) {
+      const std::size_t middle = (len >> 3) << 2;
+      a = (read_le32(p) << 32) | read_le32(p + middle);
+      b = (read_le32(p + len - 4) << 32) | read_le32(p + len - 4 - middle);
+    } else if (len > 0) {
+      a = (std::uint64_t(p[0]) << 16) | (std::uint64_t(p[len >> 1]) << 8) |
+          p[len - 1];
+      b = 0;
+    } else {
+      a = 0;
+      b = 0;
+    }
+  } else {
+    std::size_t i = len;
+    if (i > 48) {
+      std::uint64_t seed1 = seed;
+      std::uint64_t seed2 = seed;
+      do {
+        seed = multiply_mix(read_le64(p) ^ secret[1], read_le64(p + 8) ^ seed);
+        seed1 = multiply_mix(read_le64(p + 16) ^ secret[2],
+                             read_le64(p + 24) ^ seed1);
+        seed2 = multiply_mix(read_le64(p + 32) ^ secret[3],
+                             read_le64(p + 40) ^ seed2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+
+      seed ^= seed1 ^ seed2;
+    }
+
+    while (i > 16) {
+      seed = multiply_mix(read_le64(p) ^ secret[1], read_le64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+
+    a = read_le64(p + i - 16);
+    b = read_le64(p + i - 8);
+  }
+
+  a ^= secret[1];
+  b ^= seed;
+  multiply_128(a, b);
+
+  return multiply_mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+}  // namespace detail_array_hash
+
 namespace ah {
 
+/**
+ * Default hash function. It hashes the bytes of the key word by word with a
+ * bundled wyhash, which gives the same hash for the same key on every
+ * platform and in every C++ language mode.
+ */
 template <class CharT>
 struct str_hash {
-#ifdef TSL_AH_HAS_STRING_VIEW
   std::size_t operator()(const CharT* key, std::size_t key_size) const {
-    return std::hash<std::basic_string_view<CharT>>()(
-        std::basic_string_view<CharT>(key, key_size));
+    return static_cast<std::size_t>(
+        detail_array_hash::wyhash(key, key_size * sizeof(CharT)));
   }
-#else
-  /**
-   * FNV-1a hash
-   */
-  std::size_t operator()(const CharT* key, std::size_t key_size) const {
-    static const std::size_t init = std::size_t(
-        (sizeof(std::size_t) == 8) ? 0xcbf29ce484222325 : 0x811c9dc5);
-    static const std::size_t multiplier =
-        std::size_t((sizeof(std::size_t) == 8) ? 0x100000001b3 : 0x1000193);
+};
+
+/**
+ * Incremental hash function. The hash of a key can be computed one character
+ * at a time from a state:
+ *
+ * - `state_type init() const` gives the state of the empty key.
+ * - `void update(state_type& state, CharT c) const` appends c to the key.
+ * - `std::size_t finalize(const state_type& state, std::size_t key_size)
+ *   const` gives the hash of the key of key_size characters.
+ *
+ * and `operator()(key, key_size)` gives the same hash as the successive calls
+ * on the characters of key. The hashes of all the prefixes of a key are then
+ * computed in one pass, which is used by `longest_prefix` and
+ * `for_each_prefix_of` of `tsl::htrie_map` and `tsl::htrie_set`. Any hash
+ * function providing these methods is used the same way.
+ *
+ * The state is a FNV-1a hash of the bytes of the characters, the final hash
+ * mixes it with the key size through a 128 bits multiplication. It is slower
+ * than str_hash on long keys for other operations.
+ */
+template <class CharT>
+struct str_prefix_hash {
+  using state_type = std::uint64_t;
 
-    std::size_t hash = init;
-    for (std::size_t i = 0; i < key_size; ++i) {
-      hash ^= key[i];
-      hash *= multiplier;
+  state_type init() const noexcept { return 0xcbf29ce484222325ull; }
+
+  void update(state_type& state, CharT c) const noexcept {
+    // Bytes in little-endian order to be the same on every platform.
+    const std::uint64_t value =
+        static_cast<typename std::make_unsigned<CharT>::type>(c);
+    for (std::size_t i = 0; i < sizeof(CharT); i++) {
+      state = (state ^ ((value >> (8 * i)) & 0xff)) * 0x100000001b3ull;
     }
+  }
 
-    return hash;
+  std::size_t finalize(const state_type& state,
+                       std::size_t key_size) const noexcept {
+    return static_cast<std::size_t>(detail_array_hash::multiply_mix(
+        state ^ 0xa0761d6478bd642full, key_size ^ 0xe7037ed1a0b428dbull));
+  }
+
+  std::size_t operator()(const CharT* key, std::size_t key_size) const {
+    state_type state = init();
+    for (std::size_t i = 0; i < key_size; i++) {
+      update(state, key[i]);
+    }
+
+    return finalize(state, key_size);
   }
-#endif
 };
 
 template <class CharT>
@@ -126,6 +293,20 @@ static constexpr bool is_power_of_two(std::size_t value) {
   return value != 0 && (value & (value - 1)) == 0;
 }
 
+/**
+ * Hint the processor to load the cache line of address in advance. Does
+ * nothing if the compiler doesn't provide a prefetch intrinsic.
+ */
+inline void prefetch(const void* address) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(address);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+  static_cast<void>(address);
+#endif
+}
+
 template <typename T, typename U>
 static T numeric_cast(U value,
                       const char* error_message = "numeric_cast() failed.") {
@@ -164,7 +345,8 @@ static T deserialize_value(Deserializer& deserializer) {
 
 /**
  * For each string in the bucket, store the size of the string, the chars of the
- * string and T, if it's not void. T should be either void or an unsigned type.
+ * string and T, if it's not void. T should be either void or an unsigned type,
+ * or a trivially copyable type if InlineValue is true.
  *
  * End the buffer with END_OF_BUCKET flag. END_OF_BUCKET has the same type as
  * the string size variable.
@@ -176,31 +358,86 @@ static T deserialize_value(Deserializer& deserializer) {
  *
  * m_buffer is null if there is no string in the bucket.
  *
- * KeySizeT and T are extended to be a multiple of CharT when stored in the
- * buffer.
+ * If StoreHashFingerprint is true, a fingerprint of the hash of the string
+ * (its most significant byte) is stored between the size of the string and
+ * the string. On a search, the strings with a different fingerprint are
+ * skipped without being compared.
+ *
+ * KeySizeT, the fingerprint and T are extended to be a multiple of CharT when
+ * stored in the buffer.
+ *
+ * If VarintKeySize is true, the size of each string is instead stored as a
+ * variable-length integer of CharT units: 'size + 1' split in groups of
+ * (bits of CharT - 1) bits, least significant group first, the most
+ * significant bit of a unit being set if another unit follows. The strings
+ * shorter than 127 chars (with a char CharT) thus only need one unit. A single
+ * unit of value 0 is used as END_OF_BUCKET.
  *
- * Use std::malloc and std::free instead of new and delete so we can have access
- * to std::realloc.
+ * If InlineValue is true, T is the value of the map itself instead of an index
+ * and can be accessed in place (see value_address). The value is aligned on
+ * alignof(T) by padding it and each entry is padded to a multiple of
+ * alignof(T), so all the values stay aligned as long as the buffer is.
+ *
+ * The buffer is allocated with Allocator (which must have CharT as value_type).
+ * With the default std::allocator, use std::malloc and std::free instead so we
+ * can have access to std::realloc. The allocator is kept in the bucket, it
+ * doesn't take any space if it's stateless.
+ *
+ * If AmortizedGrowth is false, the buffer is reallocated on each append to the
+ * exact size needed. Otherwise its capacity is stored in front of it and grows
+ * geometrically, shrink_to_fit removes the unused capacity.
+ *
+ * If SlabStorage is true, the buffer may also be a part of a slab shared by
+ * multiple buckets (see the slab constructors). Such a buffer has a stored
+ * capacity of 0, it's never reallocated nor deallocated by the bucket. The
+ * bucket moves its content to its own buffer if it needs more space.
  */
 template <class CharT, class T, class KeyEqual, class KeySizeT,
-          bool StoreNullTerminator>
-class array_bucket {
+          bool StoreNullTerminator, bool StoreHashFingerprint,
+          bool AmortizedGrowth, bool SlabStorage, bool VarintKeySize,
+          bool InlineValue, class Allocator = std::allocator<CharT>>
+class array_bucket : private Allocator {
   template <typename U>
   using has_mapped_type =
       typename std::integral_constant<bool, !std::is_same<U, void>::value>;
 
-  static_assert(!has_mapped_type<T>::value || std::is_unsigned<T>::value,
+  static_assert(!has_mapped_type<T>::value || InlineValue ||
+                    std::is_unsigned<T>::value,
                 "T should be either void or an unsigned type.");
 
+  static_assert(!has_mapped_type<T>::value || !InlineValue ||
+                    std::is_trivially_copyable<T>::value,
+                "T should be trivially copyable to be stored in the bucket.");
+
   static_assert(std::is_unsigned<KeySizeT>::value,
                 "KeySizeT should be an unsigned type.");
 
+  static_assert(std::is_same<typename Allocator::value_type, CharT>::value,
+                "Allocator::value_type should be CharT.");
+
+  /**
+   * The buffer of a bucket may be reallocated on each insertion, use
+   * std::realloc when we know the allocator is std::allocator.
+   */
+  using use_realloc = std::is_same<Allocator, std::allocator<CharT>>;
+  using allocator_traits = std::allocator_traits<Allocator>;
+
+  /**
+   * The capacity of the buffer is needed to grow it geometrically. It's also
+   * needed to give the allocated size back to the allocator as the buffer may
+   * shrink on erase without any reallocation.
+   */
+  using store_capacity =
+      std::integral_constant<bool, AmortizedGrowth || SlabStorage ||
+                                       !use_realloc::value>;
+
  public:
   template <bool IsConst>
   class array_bucket_iterator;
 
   using char_type = CharT;
   using key_size_type = KeySizeT;
+  using fingerprint_type = unsigned char;
   using mapped_type = T;
   using size_type = std::size_t;
   using key_equal = KeyEqual;
@@ -239,13 +476,122 @@ class array_bucket {
     return sizeof_in_buff<U>() / sizeof(CharT);
   }
 
+  /**
+   * Unit of the variable-length encoding of the key sizes if VarintKeySize is
+   * true.
+   */
+  using varint_unit = typename std::make_unsigned<CharT>::type;
+
+  static const size_type VARINT_PAYLOAD_BITS =
+      std::numeric_limits<varint_unit>::digits - 1;
+  static const varint_unit VARINT_CONTINUATION_BIT =
+      varint_unit(varint_unit(1) << VARINT_PAYLOAD_BITS);
+  static const varint_unit VARINT_PAYLOAD_MASK =
+      varint_unit(VARINT_CONTINUATION_BIT - 1);
+
+  static varint_unit read_varint_unit(const CharT* buffer) noexcept {
+    return static_cast<varint_unit>(*buffer);
+  }
+
+  /**
+   * Size, in number of CharT, of the header storing the key size 'key_size'.
+   */
+  static size_type key_size_header_size(size_type key_size) noexcept {
+    if (!VarintKeySize) {
+      return size_as_char_t<key_size_type>();
+    }
+
+    size_type nb_units = 1;
+    for (size_type value = (key_size + 1) >> VARINT_PAYLOAD_BITS; value != 0;
+         value >>= VARINT_PAYLOAD_BITS) {
+      nb_units++;
+    }
+
+    return nb_units;
+  }
+
+  /**
+   * Size, in number of CharT, of the header storing the key size of the entry
+   * starting at buffer.
+   */
+  static size_type read_key_size_header_size(const CharT* buffer) noexcept {
+    if (!VarintKeySize) {
+      return size_as_char_t<key_size_type>();
+    }
+
+    size_type nb_units = 1;
+    while ((read_varint_unit(buffer) & VARINT_CONTINUATION_BIT) != 0) {
+      nb_units++;
+      buffer++;
+    }
+
+    return nb_units;
+  }
+
+  /**
+   * Offset, in number of CharT, of the string from the start of an entry with
+   * a key of size 'key_size'.
+   */
+  static size_type key_offset(size_type key_size) noexcept {
+    return key_size_header_size(key_size) +
+           (StoreHashFingerprint ? size_as_char_t<fingerprint_type>() : 0);
+  }
+
+  /**
+   * Offset, in number of CharT, of the string from the start of the entry
+   * starting at buffer.
+   */
+  static size_type read_key_offset(const CharT* buffer) noexcept {
+    return read_key_size_header_size(buffer) +
+           (StoreHashFingerprint ? size_as_char_t<fingerprint_type>() : 0);
+  }
+
   static key_size_type read_key_size(const CharT* buffer) noexcept {
+    if (VarintKeySize) {
+      return read_varint_key_size(buffer);
+    }
+
     key_size_type key_size;
     std::memcpy(&key_size, buffer, sizeof(key_size));
 
     return key_size;
   }
 
+  static key_size_type read_varint_key_size(const CharT* buffer) noexcept {
+    varint_unit unit = read_varint_unit(buffer);
+    if ((unit & VARINT_CONTINUATION_BIT) == 0) {
+      return key_size_type(unit - 1);
+    }
+
+    size_type value = 0;
+    size_type shift = 0;
+    do {
+      unit = read_varint_unit(buffer++);
+      value |= size_type(unit & VARINT_PAYLOAD_MASK) << shift;
+      shift += VARINT_PAYLOAD_BITS;
+    } while ((unit & VARINT_CONTINUATION_BIT) != 0);
+
+    return key_size_type(value - 1);
+  }
+
+  static void write_key_size(key_size_type key_size, CharT* buffer) noexcept {
+    if (!VarintKeySize) {
+      std::memcpy(buffer, &key_size, sizeof(key_size));
+      return;
+    }
+
+    size_type value = size_type(key_size) + 1;
+    while (value > VARINT_PAYLOAD_MASK) {
+      const varint_unit unit =
+          varint_unit((value & VARINT_PAYLOAD_MASK) | VARINT_CONTINUATION_BIT);
+      std::memcpy(buffer++, &unit, sizeof(unit));
+      value >>= VARINT_PAYLOAD_BITS;
+    }
+
+    const varint_unit unit = varint_unit(value);
+    std::memcpy(buffer, &unit, sizeof(unit));
+  }
+
   static mapped_type read_value(const CharT* buffer) noexcept {
     mapped_type value;
     std::memcpy(&value, buffer, sizeof(value));
@@ -253,30 +599,112 @@ class array_bucket {
     return value;
   }
 
+  static fingerprint_type read_fingerprint(const CharT* buffer) noexcept {
+    fingerprint_type fingerprint;
+    std::memcpy(&fingerprint, buffer + read_key_size_header_size(buffer),
+                sizeof(fingerprint));
+
+    return fingerprint;
+  }
+
   static bool is_end_of_bucket(const CharT* buffer) noexcept {
-    return read_key_size(buffer) == END_OF_BUCKET;
+    return VarintKeySize ? read_varint_unit(buffer) == 0
+                         : read_key_size(buffer) == END_OF_BUCKET;
+  }
+
+  /**
+   * Size, in number of CharT, of the END_OF_BUCKET marker.
+   */
+  static constexpr size_type end_of_bucket_size() noexcept {
+    return VarintKeySize ? 1 : size_as_char_t<decltype(END_OF_BUCKET)>();
+  }
+
+  static constexpr size_type end_of_bucket_bytes() noexcept {
+    return end_of_bucket_size() * sizeof(CharT);
+  }
+
+  static void write_end_of_bucket(CharT* buffer) noexcept {
+    if (VarintKeySize) {
+      *buffer = CharT(0);
+    } else {
+      const auto end_of_bucket = END_OF_BUCKET;
+      std::memcpy(buffer, &end_of_bucket, sizeof(end_of_bucket));
+    }
   }
 
  public:
+  /**
+   * Use the most significant byte of the hash, the least significant bits are
+   * the ones used to select the bucket with a power of two growth policy.
+   */
+  static fingerprint_type fingerprint_for_hash(std::size_t hash) noexcept {
+    return static_cast<fingerprint_type>(
+        hash >> (std::numeric_limits<std::size_t>::digits -
+                 std::numeric_limits<fingerprint_type>::digits));
+  }
+
   /**
    * Return the size required for an entry with a key of size 'key_size'.
    */
   template <class U = T, typename std::enable_if<
                              !has_mapped_type<U>::value>::type* = nullptr>
   static size_type entry_required_bytes(size_type key_size) noexcept {
-    return sizeof_in_buff<key_size_type>() +
-           (key_size + KEY_EXTRA_SIZE) * sizeof(CharT);
+    return (key_offset(key_size) + key_size + KEY_EXTRA_SIZE) * sizeof(CharT);
   }
 
   template <class U = T,
             typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
   static size_type entry_required_bytes(size_type key_size) noexcept {
-    return sizeof_in_buff<key_size_type>() +
-           (key_size + KEY_EXTRA_SIZE) * sizeof(CharT) +
-           sizeof_in_buff<mapped_type>();
+    return align_value_offset(value_offset(key_size) + value_size()) *
+           sizeof(CharT);
   }
 
  private:
+  using value_storage_type =
+      typename std::conditional<has_mapped_type<T>::value, T, char>::type;
+
+  /**
+   * Alignment, in number of CharT, of the values and of the entries. Without
+   * InlineValue the values are only accessed with std::memcpy and aren't
+   * aligned.
+   */
+  static constexpr size_type value_alignment() noexcept {
+    return (!InlineValue || alignof(value_storage_type) <= sizeof(CharT))
+               ? 1
+               : alignof(value_storage_type) / sizeof(CharT);
+  }
+
+  static constexpr size_type align_value_offset(size_type offset) noexcept {
+    return (offset + value_alignment() - 1) / value_alignment() *
+           value_alignment();
+  }
+
+  /**
+   * Size, in number of CharT, of T in the buffer.
+   */
+  template <class U = T>
+  static constexpr size_type value_size() noexcept {
+    return (sizeof(U) + sizeof(CharT) - 1) / sizeof(CharT);
+  }
+
+  /**
+   * Offset, in number of CharT, of the value from the start of an entry with
+   * a key of size 'key_size'.
+   */
+  static size_type value_offset(size_type key_size) noexcept {
+    return align_value_offset(key_offset(key_size) + key_size +
+                              KEY_EXTRA_SIZE);
+  }
+
+  /**
+   * Offset, in number of CharT, of the value from the start of the entry
+   * starting at buffer.
+   */
+  static size_type read_value_offset(const CharT* buffer) noexcept {
+    return align_value_offset(read_key_offset(buffer) + read_key_size(buffer) +
+                              KEY_EXTRA_SIZE);
+  }
+
   /**
    * Return the size of the current entry in buffer.
    */
@@ -306,7 +734,7 @@ class array_bucket {
     array_bucket_iterator() noexcept : m_position(nullptr) {}
 
     const CharT* key() const {
-      return m_position + size_as_char_t<key_size_type>();
+      return m_position + read_key_offset(m_position);
     }
 
     size_type key_size() const { return read_key_size(m_position); }
@@ -314,17 +742,26 @@ class array_bucket {
     template <class U = T, typename std::enable_if<
                                has_mapped_type<U>::value>::type* = nullptr>
     U value() const {
-      return read_value(m_position + size_as_char_t<key_size_type>() +
-                        key_size() + KEY_EXTRA_SIZE);
+      return read_value(m_position + read_value_offset(m_position));
     }
 
     template <class U = T, typename std::enable_if<
                                has_mapped_type<U>::value && !IsConst &&
                                std::is_same<U, T>::value>::type* = nullptr>
     void set_value(U value) noexcept {
-      std::memcpy(m_position + size_as_char_t<key_size_type>() + key_size() +
-                      KEY_EXTRA_SIZE,
-                  &value, sizeof(value));
+      std::memcpy(m_position + read_value_offset(m_position), &value,
+                  sizeof(value));
+    }
+
+    /**
+     * Address of the value stored in place, only if InlineValue is true.
+     */
+    template <class U = T,
+              typename std::enable_if<has_mapped_type<U>::value &&
+                                      InlineValue>::type* = nullptr>
+    const U* value_address() const noexcept {
+      return reinterpret_cast<const U*>(m_position +
+                                        read_value_offset(m_position));
     }
 
     array_bucket_iterator& operator++() {
@@ -362,63 +799,119 @@ class array_bucket {
   static const_iterator cend_it() noexcept { return const_iterator(nullptr); }
 
  public:
-  array_bucket() : m_buffer(nullptr) {}
+  explicit array_bucket(const Allocator& alloc = Allocator())
+      : Allocator(alloc), m_buffer(nullptr) {}
 
   /**
-   * Reserve 'size' in the buffer of the bucket. The created bucket is empty.
+   * Return how many bytes a bucket needs in a slab to be able to store 'size'
+   * bytes of entries.
+   */
+  static size_type slab_required_bytes(size_type size) noexcept {
+    return (size == 0) ? 0
+                       : align_value_offset(header_size() +
+                                            size / sizeof(CharT) +
+                                            end_of_bucket_size()) *
+                             sizeof(CharT);
+  }
+
+  /**
+   * Create an empty bucket which can store up to 'size' bytes of entries in
+   * the slab_required_bytes(size) bytes at slab_position. The bucket doesn't
+   * own this memory.
    */
-  array_bucket(std::size_t size) : m_buffer(nullptr) {
+  array_bucket(CharT* slab_position, std::size_t size, const Allocator& alloc)
+      : Allocator(alloc), m_buffer(nullptr) {
     if (size == 0) {
       return;
     }
 
-    m_buffer = static_cast<CharT*>(std::malloc(
-        size * sizeof(CharT) + sizeof_in_buff<decltype(END_OF_BUCKET)>()));
-    if (m_buffer == nullptr) {
-      throw std::bad_alloc();
+    write_capacity(slab_position, 0);
+    m_buffer = slab_position + header_size();
+
+    write_end_of_bucket(m_buffer);
+  }
+
+  /**
+   * Copy the entries of other in the slab_required_bytes(other.size_bytes())
+   * bytes at slab_position. The bucket doesn't own this memory.
+   */
+  array_bucket(const array_bucket& other, CharT* slab_position,
+               const Allocator& alloc)
+      : array_bucket(slab_position, other.size_bytes(), alloc) {
+    if (m_buffer != nullptr) {
+      std::memcpy(m_buffer, other.m_buffer, other.size_bytes());
+
+      write_end_of_bucket(m_buffer + other.size());
+    }
+  }
+
+  /**
+   * Reserve 'size' in the buffer of the bucket. The created bucket is empty.
+   */
+  array_bucket(std::size_t size, const Allocator& alloc)
+      : Allocator(alloc), m_buffer(nullptr) {
+    if (size == 0) {
+      return;
     }
 
-    const auto end_of_bucket = END_OF_BUCKET;
-    std::memcpy(m_buffer, &end_of_bucket, sizeof(end_of_bucket));
+    m_buffer = allocate_buffer(size * sizeof(CharT) +
+                               end_of_bucket_bytes());
+
+    write_end_of_bucket(m_buffer);
   }
 
   ~array_bucket() { clear(); }
 
-  array_bucket(const array_bucket& other) {
+  array_bucket(const array_bucket& other)
+      : array_bucket(other, other.get_allocator()) {}
+
+  array_bucket(const array_bucket& other, const Allocator& alloc)
+      : Allocator(alloc), m_buffer(nullptr) {
     if (other.m_buffer == nullptr) {
-      m_buffer = nullptr;
       return;
     }
 
     const size_type other_buffer_size = other.size();
-    m_buffer = static_cast<CharT*>(
-        std::malloc(other_buffer_size * sizeof(CharT) +
-                    sizeof_in_buff<decltype(END_OF_BUCKET)>()));
-    if (m_buffer == nullptr) {
-      throw std::bad_alloc();
-    }
+    m_buffer = allocate_buffer(other_buffer_size * sizeof(CharT) +
+                               end_of_bucket_bytes());
 
     std::memcpy(m_buffer, other.m_buffer, other_buffer_size * sizeof(CharT));
 
-    const auto end_of_bucket = END_OF_BUCKET;
-    std::memcpy(m_buffer + other_buffer_size, &end_of_bucket,
-                sizeof(end_of_bucket));
+    write_end_of_bucket(m_buffer + other_buffer_size);
   }
 
-  array_bucket(array_bucket&& other) noexcept : m_buffer(other.m_buffer) {
+  array_bucket(array_bucket&& other) noexcept
+      : Allocator(std::move(static_cast<Allocator&>(other))),
+        m_buffer(other.m_buffer) {
     other.m_buffer = nullptr;
   }
 
-  array_bucket& operator=(array_bucket other) noexcept {
-    other.swap(*this);
+  /**
+   * The bucket keeps its allocator on assignment, a buffer must always be
+   * deallocated with the allocator which allocated it.
+   */
+  array_bucket& operator=(const array_bucket& other) {
+    if (&other != this) {
+      array_bucket tmp(other, get_allocator());
+      std::swap(m_buffer, tmp.m_buffer);
+    }
 
     return *this;
   }
 
-  void swap(array_bucket& other) noexcept {
-    std::swap(m_buffer, other.m_buffer);
+  array_bucket& operator=(array_bucket&& other) {
+    if (get_allocator() == other.get_allocator()) {
+      std::swap(m_buffer, other.m_buffer);
+      other.clear();
+    } else {
+      *this = static_cast<const array_bucket&>(other);
+    }
+
+    return *this;
   }
 
+  Allocator get_allocator() const { return static_cast<const Allocator&>(*this); }
+
   iterator begin() noexcept { return iterator(m_buffer); }
   iterator end() noexcept { return iterator(nullptr); }
   const_iterator begin() const noexcept { return cbegin(); }
@@ -433,20 +926,39 @@ class array_bucket {
    *
    * The boolean of the pair is set to true if the key is there, false
    * otherwise.
+   *
+   * The hash of the key is only used if StoreHashFingerprint is true.
    */
   std::pair<const_iterator, bool> find_or_end_of_bucket(
-      const CharT* key, size_type key_size) const noexcept {
+      const CharT* key, size_type key_size, std::size_t hash) const noexcept {
     if (m_buffer == nullptr) {
       return std::make_pair(cend(), false);
     }
 
     const CharT* buffer_ptr_in_out = m_buffer;
     const bool found =
-        find_or_end_of_bucket_impl(key, key_size, buffer_ptr_in_out);
+        find_or_end_of_bucket_impl(key, key_size, hash, buffer_ptr_in_out);
 
     return std::make_pair(const_iterator(buffer_ptr_in_out), found);
   }
 
+  /**
+   * Return an iterator to the position past the last element of the bucket,
+   * end() if the bucket has not be initialized yet. See append.
+   */
+  const_iterator end_of_bucket() const noexcept {
+    if (m_buffer == nullptr) {
+      return cend();
+    }
+
+    const CharT* buffer_ptr = m_buffer;
+    while (!is_end_of_bucket(buffer_ptr)) {
+      buffer_ptr += entry_size_bytes(buffer_ptr) / sizeof(CharT);
+    }
+
+    return const_iterator(buffer_ptr);
+  }
+
   /**
    * Append the element 'key' with its potential value at the end of the bucket.
    * 'end_of_bucket' should point past the end of the last element in the
@@ -457,21 +969,20 @@ class array_bucket {
    */
   template <class... ValueArgs>
   const_iterator append(const_iterator end_of_bucket, const CharT* key,
-                        size_type key_size, ValueArgs&&... value) {
+                        size_type key_size, std::size_t hash,
+                        ValueArgs&&... value) {
     const key_size_type key_sz = as_key_size_type(key_size);
 
     if (end_of_bucket == cend()) {
       tsl_ah_assert(m_buffer == nullptr);
 
       const size_type buffer_size = entry_required_bytes(key_sz) +
-                                    sizeof_in_buff<decltype(END_OF_BUCKET)>();
+                                    end_of_bucket_bytes();
 
-      m_buffer = static_cast<CharT*>(std::malloc(buffer_size));
-      if (m_buffer == nullptr) {
-        throw std::bad_alloc();
-      }
+      m_buffer = allocate_buffer(buffer_size);
 
-      append_impl(key, key_sz, m_buffer, std::forward<ValueArgs>(value)...);
+      append_impl(key, key_sz, hash, m_buffer,
+                  std::forward<ValueArgs>(value)...);
 
       return const_iterator(m_buffer);
     } else {
@@ -479,20 +990,19 @@ class array_bucket {
 
       const size_type current_size =
           ((end_of_bucket.m_position +
-            size_as_char_t<decltype(END_OF_BUCKET)>()) -
+            end_of_bucket_size()) -
            m_buffer) *
           sizeof(CharT);
       const size_type new_size = current_size + entry_required_bytes(key_sz);
 
-      CharT* new_buffer = static_cast<CharT*>(std::realloc(m_buffer, new_size));
-      if (new_buffer == nullptr) {
-        throw std::bad_alloc();
+      if (new_size > capacity_bytes(current_size)) {
+        m_buffer = reallocate_buffer(m_buffer, current_size,
+                                     grown_capacity_bytes(new_size));
       }
-      m_buffer = new_buffer;
 
       CharT* buffer_append_pos = m_buffer + current_size / sizeof(CharT) -
-                                 size_as_char_t<decltype(END_OF_BUCKET)>();
-      append_impl(key, key_sz, buffer_append_pos,
+                                 end_of_bucket_size();
+      append_impl(key, key_sz, hash, buffer_append_pos,
                   std::forward<ValueArgs>(value)...);
 
       return const_iterator(buffer_append_pos);
@@ -512,7 +1022,7 @@ class array_bucket {
     while (!is_end_of_bucket(end_buffer_ptr)) {
       end_buffer_ptr += entry_size_bytes(end_buffer_ptr) / sizeof(CharT);
     }
-    end_buffer_ptr += size_as_char_t<decltype(END_OF_BUCKET)>();
+    end_buffer_ptr += end_of_bucket_size();
 
     const size_type size_to_move =
         (end_buffer_ptr - start_next_entry) * sizeof(CharT);
@@ -531,14 +1041,14 @@ class array_bucket {
   /**
    * Return true if an element has been erased
    */
-  bool erase(const CharT* key, size_type key_size) noexcept {
+  bool erase(const CharT* key, size_type key_size, std::size_t hash) noexcept {
     if (m_buffer == nullptr) {
       return false;
     }
 
     const CharT* entry_buffer_ptr_in_out = m_buffer;
-    bool found =
-        find_or_end_of_bucket_impl(key, key_size, entry_buffer_ptr_in_out);
+    bool found = find_or_end_of_bucket_impl(key, key_size, hash,
+                                            entry_buffer_ptr_in_out);
     if (found) {
       erase(const_iterator(entry_buffer_ptr_in_out));
 
@@ -554,13 +1064,14 @@ class array_bucket {
    */
   template <class... ValueArgs>
   void append_in_reserved_bucket_no_check(const CharT* key, size_type key_size,
+                                          std::size_t hash,
                                           ValueArgs&&... value) noexcept {
     CharT* buffer_ptr = m_buffer;
     while (!is_end_of_bucket(buffer_ptr)) {
       buffer_ptr += entry_size_bytes(buffer_ptr) / sizeof(CharT);
     }
 
-    append_impl(key, key_size_type(key_size), buffer_ptr,
+    append_impl(key, key_size_type(key_size), hash, buffer_ptr,
                 std::forward<ValueArgs>(value)...);
   }
 
@@ -568,54 +1079,283 @@ class array_bucket {
     return m_buffer == nullptr || is_end_of_bucket(m_buffer);
   }
 
-  void clear() noexcept {
-    std::free(m_buffer);
-    m_buffer = nullptr;
-  }
+  /**
+   * Prefetch the beginning of the buffer, the bucket itself must be loaded.
+   */
+  void prefetch_buffer() const noexcept { prefetch(m_buffer); }
 
-  iterator mutable_iterator(const_iterator pos) noexcept {
-    return iterator(m_buffer + (pos.m_position - m_buffer));
+  /**
+   * Return the size in bytes of the entries in m_buffer, END_OF_BUCKET
+   * excluded. In O(n), see size().
+   */
+  size_type size_bytes() const noexcept { return size() * sizeof(CharT); }
+
+  void clear() noexcept {
+    if (m_buffer != nullptr) {
+      if (!is_in_slab()) {
+        deallocate_buffer(m_buffer);
+      }
+      m_buffer = nullptr;
+    }
   }
 
-  template <class Serializer>
-  void serialize(Serializer& serializer) const {
-    const slz_size_type bucket_size = size();
-    tsl_ah_assert(m_buffer != nullptr || bucket_size == 0);
+  /**
+   * Reduce the capacity of the buffer to its size if the capacity is stored
+   * and bigger.
+   */
+  void shrink_to_fit() {
+    if (!store_capacity::value || m_buffer == nullptr) {
+      return;
+    }
 
-    serializer(bucket_size);
-    serializer(m_buffer, bucket_size);
+    const size_type in_use_size =
+        size() * sizeof(CharT) + end_of_bucket_bytes();
+    if (in_use_size < capacity_bytes(in_use_size)) {
+      m_buffer = reallocate_buffer(m_buffer, in_use_size, in_use_size);
+    }
   }
 
-  template <class Deserializer>
-  static array_bucket deserialize(Deserializer& deserializer) {
-    array_bucket bucket;
-    const slz_size_type bucket_size_ds =
-        deserialize_value<slz_size_type>(deserializer);
-
-    if (bucket_size_ds == 0) {
-      return bucket;
+  /**
+   * Reorder the entries of the bucket by ascending key, see compare_keys.
+   *
+   * 'entries' and 'sorted_buffer' are scratch buffers which can be reused
+   * between the buckets to avoid an allocation per bucket.
+   */
+  void sort(std::vector<const CharT*>& entries,
+            std::vector<CharT>& sorted_buffer) {
+    if (m_buffer == nullptr) {
+      return;
     }
 
-    const std::size_t bucket_size = numeric_cast<std::size_t>(
-        bucket_size_ds, "Deserialized bucket_size is too big.");
-    bucket.m_buffer = static_cast<CharT*>(
-        std::malloc(bucket_size * sizeof(CharT) +
-                    sizeof_in_buff<decltype(END_OF_BUCKET)>()));
-    if (bucket.m_buffer == nullptr) {
-      throw std::bad_alloc();
+    entries.clear();
+    const CharT* buffer_ptr = m_buffer;
+    while (!is_end_of_bucket(buffer_ptr)) {
+      entries.push_back(buffer_ptr);
+      buffer_ptr += entry_size_bytes(buffer_ptr) / sizeof(CharT);
     }
 
+    auto entry_less = [](const CharT* lhs, const CharT* rhs) {
+      return compare_keys(lhs + read_key_offset(lhs), read_key_size(lhs),
+                          rhs + read_key_offset(rhs), read_key_size(rhs)) < 0;
+    };
+    if (std::is_sorted(entries.begin(), entries.end(), entry_less)) {
+      return;
+    }
+    std::sort(entries.begin(), entries.end(), entry_less);
+
+    sorted_buffer.clear();
+    for (const CharT* entry : entries) {
+      sorted_buffer.insert(sorted_buffer.end(), entry,
+                           entry + entry_size_bytes(entry) / sizeof(CharT));
+    }
+
+    tsl_ah_assert(sorted_buffer.size() == size_type(buffer_ptr - m_buffer));
+    std::memcpy(m_buffer, sorted_buffer.data(),
+                sorted_buffer.size() * sizeof(CharT));
+  }
+
+  /**
+   * Lexicographical comparison of two keys, character by character. A key
+   * comes before all the keys it is a prefix of, so in a sorted bucket the
+   * keys sharing a prefix are contiguous.
+   */
+  static int compare_keys(const CharT* lhs, size_type lhs_size,
+                          const CharT* rhs, size_type rhs_size) noexcept {
+    const int cmp = std::char_traits<CharT>::compare(
+        lhs, rhs, std::min(lhs_size, rhs_size));
+    if (cmp != 0) {
+      return cmp;
+    }
+
+    return (lhs_size < rhs_size) ? -1 : (lhs_size > rhs_size) ? 1 : 0;
+  }
+
+  iterator mutable_iterator(const_iterator pos) noexcept {
+    return iterator(m_buffer + (pos.m_position - m_buffer));
+  }
+
+  template <class Serializer>
+  void serialize(Serializer& serializer) const {
+    const slz_size_type bucket_size = size();
+    tsl_ah_assert(m_buffer != nullptr || bucket_size == 0);
+
+    serializer(bucket_size);
+    serializer(m_buffer, bucket_size);
+  }
+
+  template <class Deserializer>
+  static array_bucket deserialize(Deserializer& deserializer,
+                                  const Allocator& alloc) {
+    array_bucket bucket(alloc);
+    const slz_size_type bucket_size_ds =
+        deserialize_value<slz_size_type>(deserializer);
+
+    if (bucket_size_ds == 0) {
+      return bucket;
+    }
+
+    const std::size_t bucket_size = numeric_cast<std::size_t>(
+        bucket_size_ds, "Deserialized bucket_size is too big.");
+    bucket.m_buffer = bucket.allocate_buffer(
+        bucket_size * sizeof(CharT) +
+        end_of_bucket_bytes());
+
     deserializer(bucket.m_buffer, bucket_size);
 
-    const auto end_of_bucket = END_OF_BUCKET;
-    std::memcpy(bucket.m_buffer + bucket_size, &end_of_bucket,
-                sizeof(end_of_bucket));
+    write_end_of_bucket(bucket.m_buffer + bucket_size);
 
     tsl_ah_assert(bucket.size() == bucket_size);
     return bucket;
   }
 
  private:
+  /*
+   * Sizes are in bytes and always a multiple of sizeof(CharT).
+   *
+   * If store_capacity is true, the capacity of the buffer (in number of CharT,
+   * header included) is stored in a header in front of m_buffer.
+   */
+  CharT* allocate_buffer(size_type size) {
+    tsl_ah_assert(size % sizeof(CharT) == 0);
+    const size_type nb_chars = header_size() + size / sizeof(CharT);
+
+    CharT* allocated_buffer = allocate_chars(nb_chars, use_realloc());
+    write_capacity(allocated_buffer, nb_chars);
+
+    return allocated_buffer + header_size();
+  }
+
+  /**
+   * Reallocate buffer to new_size bytes, current_size bytes of it are in use.
+   * The buffer is left untouched if an exception is thrown.
+   */
+  CharT* reallocate_buffer(CharT* buffer, size_type current_size,
+                           size_type new_size) {
+    tsl_ah_assert(new_size % sizeof(CharT) == 0);
+    const size_type nb_chars = header_size() + new_size / sizeof(CharT);
+
+    const size_type nb_chars_in_use =
+        header_size() + std::min(current_size, new_size) / sizeof(CharT);
+
+    CharT* allocated_buffer;
+    if (is_in_slab(buffer)) {
+      allocated_buffer = allocate_chars(nb_chars, use_realloc());
+      std::memcpy(allocated_buffer, buffer - header_size(),
+                  nb_chars_in_use * sizeof(CharT));
+    } else {
+      allocated_buffer =
+          reallocate_chars(buffer - header_size(), read_capacity(buffer),
+                           nb_chars, nb_chars_in_use, use_realloc());
+    }
+    write_capacity(allocated_buffer, nb_chars);
+
+    return allocated_buffer + header_size();
+  }
+
+  void deallocate_buffer(CharT* buffer) noexcept {
+    deallocate_chars(buffer - header_size(), read_capacity(buffer),
+                     use_realloc());
+  }
+
+  static constexpr size_type header_size() noexcept {
+    return store_capacity::value ? size_as_char_t<size_type>() : 0;
+  }
+
+  /**
+   * Return the number of CharT allocated for buffer (header included), 0 if
+   * the capacity is not stored.
+   */
+  static size_type read_capacity(const CharT* buffer) noexcept {
+    size_type nb_chars = 0;
+    if (store_capacity::value) {
+      std::memcpy(&nb_chars, buffer - header_size(), sizeof(nb_chars));
+    }
+
+    return nb_chars;
+  }
+
+  static void write_capacity(CharT* allocated_buffer,
+                             size_type nb_chars) noexcept {
+    if (store_capacity::value) {
+      std::memcpy(allocated_buffer, &nb_chars, sizeof(nb_chars));
+    }
+  }
+
+  static bool is_in_slab(const CharT* buffer) noexcept {
+    return SlabStorage && read_capacity(buffer) == 0;
+  }
+
+  bool is_in_slab() const noexcept { return is_in_slab(m_buffer); }
+
+  /**
+   * Return the size in bytes available for the entries and the END_OF_BUCKET
+   * marker in m_buffer. Without stored capacity, assume that the buffer is
+   * exactly the size of what it contains, in_use_size.
+   */
+  size_type capacity_bytes(size_type in_use_size) const noexcept {
+    return (store_capacity::value && !is_in_slab())
+               ? (read_capacity(m_buffer) - header_size()) * sizeof(CharT)
+               : in_use_size;
+  }
+
+  /**
+   * Return the new size in bytes of the buffer to be able to store
+   * required_size bytes.
+   */
+  size_type grown_capacity_bytes(size_type required_size) const noexcept {
+    if (!AmortizedGrowth) {
+      return required_size;
+    }
+
+    return std::max(required_size, capacity_bytes(required_size) *
+                                       BUFFER_GROWTH_FACTOR);
+  }
+
+  CharT* allocate_chars(size_type nb_chars, std::true_type /*use_realloc*/) {
+    CharT* buffer = static_cast<CharT*>(std::malloc(nb_chars * sizeof(CharT)));
+    if (buffer == nullptr) {
+      throw std::bad_alloc();
+    }
+
+    return buffer;
+  }
+
+  CharT* allocate_chars(size_type nb_chars, std::false_type /*use_realloc*/) {
+    return allocator_traits::allocate(*this, nb_chars);
+  }
+
+  CharT* reallocate_chars(CharT* buffer, size_type /*nb_chars*/,
+                          size_type new_nb_chars, size_type /*nb_chars_in_use*/,
+                          std::true_type /*use_realloc*/) {
+    CharT* new_buffer =
+        static_cast<CharT*>(std::realloc(buffer, new_nb_chars * sizeof(CharT)));
+    if (new_buffer == nullptr) {
+      throw std::bad_alloc();
+    }
+
+    return new_buffer;
+  }
+
+  CharT* reallocate_chars(CharT* buffer, size_type nb_chars,
+                          size_type new_nb_chars, size_type nb_chars_in_use,
+                          std::false_type /*use_realloc*/) {
+    CharT* new_buffer = allocator_traits::allocate(*this, new_nb_chars);
+    std::memcpy(new_buffer, buffer, nb_chars_in_use * sizeof(CharT));
+    allocator_traits::deallocate(*this, buffer, nb_chars);
+
+    return new_buffer;
+  }
+
+  void deallocate_chars(CharT* buffer, size_type /*nb_chars*/,
+                        std::true_type /*use_realloc*/) noexcept {
+    std::free(buffer);
+  }
+
+  void deallocate_chars(CharT* buffer, size_type nb_chars,
+                        std::false_type /*use_realloc*/) noexcept {
+    allocator_traits::deallocate(*this, buffer, nb_chars);
+  }
+
   key_size_type as_key_size_type(size_type key_size) const {
     if (key_size > MAX_KEY_SIZE) {
       throw std::length_error("Key is too long.");
@@ -632,14 +1372,19 @@ class array_bucket {
    * Start search from buffer_ptr_in_out.
    */
   bool find_or_end_of_bucket_impl(
-      const CharT* key, size_type key_size,
+      const CharT* key, size_type key_size, std::size_t hash,
       const CharT*& buffer_ptr_in_out) const noexcept {
+    const fingerprint_type fingerprint = fingerprint_for_hash(hash);
+
     while (!is_end_of_bucket(buffer_ptr_in_out)) {
-      const key_size_type buffer_key_size = read_key_size(buffer_ptr_in_out);
-      const CharT* buffer_str =
-          buffer_ptr_in_out + size_as_char_t<key_size_type>();
-      if (KeyEqual()(buffer_str, buffer_key_size, key, key_size)) {
-        return true;
+      if (!StoreHashFingerprint ||
+          read_fingerprint(buffer_ptr_in_out) == fingerprint) {
+        const key_size_type buffer_key_size = read_key_size(buffer_ptr_in_out);
+        const CharT* buffer_str =
+            buffer_ptr_in_out + read_key_offset(buffer_ptr_in_out);
+        if (KeyEqual()(buffer_str, buffer_key_size, key, key_size)) {
+          return true;
+        }
       }
 
       buffer_ptr_in_out += entry_size_bytes(buffer_ptr_in_out) / sizeof(CharT);
@@ -648,12 +1393,28 @@ class array_bucket {
     return false;
   }
 
+  /**
+   * Write the size of the key and its potential fingerprint at
+   * buffer_append_pos. Return the position where the key should be written.
+   */
+  static CharT* append_key_header(key_size_type key_size, std::size_t hash,
+                                  CharT* buffer_append_pos) noexcept {
+    write_key_size(key_size, buffer_append_pos);
+
+    if (StoreHashFingerprint) {
+      const fingerprint_type fingerprint = fingerprint_for_hash(hash);
+      std::memcpy(buffer_append_pos + key_size_header_size(key_size),
+                  &fingerprint, sizeof(fingerprint));
+    }
+
+    return buffer_append_pos + key_offset(key_size);
+  }
+
   template <typename U = T, typename std::enable_if<
                                 !has_mapped_type<U>::value>::type* = nullptr>
-  void append_impl(const CharT* key, key_size_type key_size,
+  void append_impl(const CharT* key, key_size_type key_size, std::size_t hash,
                    CharT* buffer_append_pos) noexcept {
-    std::memcpy(buffer_append_pos, &key_size, sizeof(key_size));
-    buffer_append_pos += size_as_char_t<key_size_type>();
+    buffer_append_pos = append_key_header(key_size, hash, buffer_append_pos);
 
     std::memcpy(buffer_append_pos, key, key_size * sizeof(CharT));
     buffer_append_pos += key_size;
@@ -662,18 +1423,20 @@ class array_bucket {
     std::memcpy(buffer_append_pos, &zero, KEY_EXTRA_SIZE * sizeof(CharT));
     buffer_append_pos += KEY_EXTRA_SIZE;
 
-    const auto end_of_bucket = END_OF_BUCKET;
-    std::memcpy(buffer_append_pos, &end_of_bucket, sizeof(end_of_bucket));
+    write_end_of_bucket(buffer_append_pos);
   }
 
   template <typename U = T,
             typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
-  void append_impl(
-      const CharT* key, key_size_type key_size, CharT* buffer_append_pos,
-      typename array_bucket<CharT, U, KeyEqual, KeySizeT,
-                            StoreNullTerminator>::mapped_type value) noexcept {
-    std::memcpy(buffer_append_pos, &key_size, sizeof(key_size));
-    buffer_append_pos += size_as_char_t<key_size_type>();
+  void append_impl(const CharT* key, key_size_type key_size, std::size_t hash,
+                   CharT* buffer_append_pos,
+                   typename array_bucket<
+                       CharT, U, KeyEqual, KeySizeT, StoreNullTerminator,
+                       StoreHashFingerprint, AmortizedGrowth, SlabStorage,
+                       VarintKeySize, InlineValue>::mapped_type
+                       value) noexcept {
+    CharT* const entry = buffer_append_pos;
+    buffer_append_pos = append_key_header(key_size, hash, buffer_append_pos);
 
     std::memcpy(buffer_append_pos, key, key_size * sizeof(CharT));
     buffer_append_pos += key_size;
@@ -682,11 +1445,16 @@ class array_bucket {
     std::memcpy(buffer_append_pos, &zero, KEY_EXTRA_SIZE * sizeof(CharT));
     buffer_append_pos += KEY_EXTRA_SIZE;
 
-    std::memcpy(buffer_append_pos, &value, sizeof(value));
-    buffer_append_pos += size_as_char_t<mapped_type>();
+    CharT* const entry_end =
+        entry + entry_required_bytes(key_size) / sizeof(CharT);
+    if (InlineValue) {
+      // Zero the padding so that the buffer is always fully initialized.
+      std::memset(buffer_append_pos, 0,
+                  (entry_end - buffer_append_pos) * sizeof(CharT));
+    }
+    std::memcpy(entry + value_offset(key_size), &value, sizeof(value));
 
-    const auto end_of_bucket = END_OF_BUCKET;
-    std::memcpy(buffer_append_pos, &end_of_bucket, sizeof(end_of_bucket));
+    write_end_of_bucket(entry_end);
   }
 
   /**
@@ -711,6 +1479,7 @@ class array_bucket {
   static const key_size_type END_OF_BUCKET =
       std::numeric_limits<key_size_type>::max();
   static const key_size_type KEY_EXTRA_SIZE = StoreNullTerminator ? 1 : 0;
+  static const size_type BUFFER_GROWTH_FACTOR = 2;
 
   CharT* m_buffer;
 
@@ -721,34 +1490,277 @@ class array_bucket {
                     1);
 };
 
-template <class T>
+/**
+ * Store the values of an array_hash map. The buckets only store the index of
+ * their value in m_values.
+ *
+ * The slot of an erased value is put in m_erased_values and reused by a later
+ * insertion instead of being kept until a compaction of m_values, when T can
+ * be replaced in place (nothrow move constructible or move assignable).
+ */
+template <class T, class IndexSizeT, class Allocator>
 class value_container {
+ protected:
+  using values_container_type = std::vector<
+      T, typename std::allocator_traits<Allocator>::template rebind_alloc<T>>;
+
+  using erased_values_container_type = std::vector<
+      IndexSizeT,
+      typename std::allocator_traits<Allocator>::template rebind_alloc<
+          IndexSizeT>>;
+
  public:
-  void clear() noexcept { m_values.clear(); }
+  explicit value_container(const Allocator& alloc)
+      : m_values(alloc), m_erased_values(alloc) {}
+
+  value_container(const value_container& other, const Allocator& alloc)
+      : m_values(other.m_values, alloc),
+        m_erased_values(other.m_erased_values, alloc) {}
+
+  void clear() noexcept {
+    m_values.clear();
+    m_erased_values.clear();
+  }
 
   void reserve(std::size_t new_cap) { m_values.reserve(new_cap); }
 
-  void shrink_to_fit() { m_values.shrink_to_fit(); }
+  void shrink_to_fit() {
+    m_values.shrink_to_fit();
+    m_erased_values.shrink_to_fit();
+  }
 
   friend void swap(value_container& lhs, value_container& rhs) {
     lhs.m_values.swap(rhs.m_values);
+    lhs.m_erased_values.swap(rhs.m_erased_values);
+  }
+
+ protected:
+  static constexpr bool REUSE_ERASED_VALUES =
+      std::is_nothrow_move_constructible<T>::value ||
+      std::is_move_assignable<T>::value;
+
+  /**
+   * Mark the value at ivalue as erased. The last value of m_values is
+   * destroyed directly, the other ones are kept until their slot is reused.
+   */
+  void erase_value(std::size_t ivalue) {
+    tsl_ah_assert(ivalue < m_values.size());
+    if (ivalue + 1 == m_values.size()) {
+      m_values.pop_back();
+    } else if (REUSE_ERASED_VALUES) {
+      m_erased_values.push_back(IndexSizeT(ivalue));
+    }
+  }
+
+  bool has_reusable_value() const noexcept { return !m_erased_values.empty(); }
+
+  /**
+   * Replace the value in the last erased slot by a value constructed from
+   * value_args and return its index. The slot is only removed from
+   * m_erased_values by commit_reused_value, so that the caller can rollback
+   * by not calling it.
+   */
+  template <class... ValueArgs>
+  std::size_t reuse_value(ValueArgs&&... value_args) {
+    tsl_ah_assert(has_reusable_value());
+    const std::size_t ivalue = m_erased_values.back();
+
+    T value(std::forward<ValueArgs>(value_args)...);
+    replace_value(ivalue, std::move(value),
+                  std::integral_constant<bool, REUSE_ERASED_VALUES>(),
+                  std::is_nothrow_move_constructible<T>());
+
+    return ivalue;
+  }
+
+  void commit_reused_value() noexcept { m_erased_values.pop_back(); }
+
+ private:
+  template <class Reuse>
+  void replace_value(std::size_t ivalue, T&& value, Reuse /*reuse*/,
+                     std::true_type /*nothrow_move_constructible*/) noexcept {
+    T* slot = std::addressof(m_values[ivalue]);
+    slot->~T();
+    ::new (static_cast<void*>(slot)) T(std::move(value));
+  }
+
+  void replace_value(std::size_t ivalue, T&& value, std::true_type /*reuse*/,
+                     std::false_type /*nothrow_move_constructible*/) {
+    m_values[ivalue] = std::move(value);
+  }
+
+  void replace_value(std::size_t /*ivalue*/, T&& /*value*/,
+                     std::false_type /*reuse*/,
+                     std::false_type /*nothrow_move_constructible*/) {
+    // m_erased_values is always empty in this case.
+    tsl_ah_assert(false);
   }
 
  protected:
   static constexpr float VECTOR_GROWTH_RATE = 1.5f;
 
   // TODO use a sparse array? or a std::deque
-  std::vector<T> m_values;
+  values_container_type m_values;
+  erased_values_container_type m_erased_values;
 };
 
-template <>
-class value_container<void> {
+template <class IndexSizeT, class Allocator>
+class value_container<void, IndexSizeT, Allocator> {
  public:
+  explicit value_container(const Allocator& /*alloc*/) {}
+
+  value_container(const value_container& /*other*/,
+                  const Allocator& /*alloc*/) {}
+
   void clear() noexcept {}
 
   void shrink_to_fit() {}
 
   void reserve(std::size_t /*new_cap*/) {}
+
+ protected:
+  static constexpr bool REUSE_ERASED_VALUES = false;
+};
+
+/**
+ * Contiguous block of memory shared by the buckets of an array_hash (see the
+ * slab constructors of array_bucket). The slab must outlive the buckets
+ * borrowing a part of it.
+ */
+template <class CharT, class Allocator, bool Enabled>
+class bucket_slab : private Allocator {
+ private:
+  using allocator_traits = std::allocator_traits<Allocator>;
+
+ public:
+  explicit bucket_slab(const Allocator& alloc)
+      : Allocator(alloc), m_slab(nullptr), m_slab_size(0) {}
+
+  bucket_slab(std::size_t nb_chars, const Allocator& alloc)
+      : Allocator(alloc), m_slab(nullptr), m_slab_size(0) {
+    if (nb_chars > 0) {
+      m_slab = allocator_traits::allocate(*this, nb_chars);
+      m_slab_size = nb_chars;
+    }
+  }
+
+  bucket_slab(bucket_slab&& other) noexcept
+      : Allocator(std::move(static_cast<Allocator&>(other))),
+        m_slab(other.m_slab),
+        m_slab_size(other.m_slab_size) {
+    other.m_slab = nullptr;
+    other.m_slab_size = 0;
+  }
+
+  bucket_slab(const bucket_slab& other) = delete;
+  bucket_slab& operator=(const bucket_slab& other) = delete;
+  bucket_slab& operator=(bucket_slab&& other) = delete;
+
+  ~bucket_slab() { release(); }
+
+  CharT* slab() noexcept { return m_slab; }
+
+  void release() noexcept {
+    if (m_slab != nullptr) {
+      allocator_traits::deallocate(*this, m_slab, m_slab_size);
+      m_slab = nullptr;
+      m_slab_size = 0;
+    }
+  }
+
+  /**
+   * Only swap the slabs, the allocators of the array_hash are swapped (or
+   * equal) at the same time.
+   */
+  friend void swap(bucket_slab& lhs, bucket_slab& rhs) {
+    std::swap(lhs.m_slab, rhs.m_slab);
+    std::swap(lhs.m_slab_size, rhs.m_slab_size);
+  }
+
+ private:
+  CharT* m_slab;
+  std::size_t m_slab_size;
+};
+
+template <class CharT, class Allocator>
+class bucket_slab<CharT, Allocator, false> {
+ public:
+  explicit bucket_slab(const Allocator& /*alloc*/) {}
+
+  bucket_slab(std::size_t /*nb_chars*/, const Allocator& /*alloc*/) {}
+
+  CharT* slab() noexcept { return nullptr; }
+
+  void release() noexcept {}
+
+  friend void swap(bucket_slab& /*lhs*/, bucket_slab& /*rhs*/) {}
+};
+
+/**
+ * State of an incremental rehash of an array_hash. The buckets not migrated
+ * yet are stored after the new buckets of the array_hash and are indexed with
+ * the growth policy the array_hash had before the rehash.
+ */
+template <class GrowthPolicy, bool Enabled>
+class incremental_rehash_state {
+ public:
+  incremental_rehash_state()
+      : m_old_growth_policy(empty_growth_policy()), m_nb_old_buckets(0) {}
+
+  std::size_t nb_old_buckets() const noexcept { return m_nb_old_buckets; }
+
+  std::size_t old_bucket_for_hash(std::size_t hash) const {
+    return m_old_growth_policy.bucket_for_hash(hash);
+  }
+
+  void start_rehash(const GrowthPolicy& old_growth_policy,
+                    std::size_t nb_old_buckets) {
+    m_old_growth_policy = old_growth_policy;
+    m_nb_old_buckets = nb_old_buckets;
+  }
+
+  void pop_old_bucket() noexcept {
+    tsl_ah_assert(m_nb_old_buckets > 0);
+    m_nb_old_buckets--;
+  }
+
+  void reset() noexcept { m_nb_old_buckets = 0; }
+
+  friend void swap(incremental_rehash_state& lhs,
+                   incremental_rehash_state& rhs) {
+    using std::swap;
+    swap(lhs.m_old_growth_policy, rhs.m_old_growth_policy);
+    swap(lhs.m_nb_old_buckets, rhs.m_nb_old_buckets);
+  }
+
+ private:
+  static GrowthPolicy empty_growth_policy() {
+    std::size_t bucket_count = 0;
+    return GrowthPolicy(bucket_count);
+  }
+
+  GrowthPolicy m_old_growth_policy;
+  std::size_t m_nb_old_buckets;
+};
+
+template <class GrowthPolicy>
+class incremental_rehash_state<GrowthPolicy, false> {
+ public:
+  std::size_t nb_old_buckets() const noexcept { return 0; }
+
+  std::size_t old_bucket_for_hash(std::size_t /*hash*/) const noexcept {
+    return 0;
+  }
+
+  void start_rehash(const GrowthPolicy& /*old_growth_policy*/,
+                    std::size_t /*nb_old_buckets*/) {}
+
+  void pop_old_bucket() noexcept {}
+
+  void reset() noexcept {}
+
+  friend void swap(incremental_rehash_state& /*lhs*/,
+                   incremental_rehash_state& /*rhs*/) {}
 };
 
 /**
@@ -760,28 +1772,119 @@ class value_container<void> {
  *
  * The number of elements in the map is limited to
  * std::numeric_limits<IndexSizeT>::max().
+ *
+ * If StoreHashFingerprint is true, one byte of the hash of each key (extended
+ * to a CharT) is stored next to the key in the buckets (see array_bucket).
+ *
+ * If AmortizedBucketGrowth is true, the buffers of the buckets grow
+ * geometrically instead of being reallocated on each insertion (see
+ * array_bucket).
+ *
+ * If SlabBucketStorage is true, the buffers of all the buckets are packed in
+ * one contiguous slab on rehash, shrink_to_fit, copy and deserialization. A
+ * bucket modified afterwards and which needs more space moves to its own
+ * buffer until the next rebuild of the slab.
+ *
+ * If VarintKeySize is true, the size of each key is stored as a
+ * variable-length integer in the buckets instead of a KeySizeT (see
+ * array_bucket).
+ *
+ * If InlineBucketValues is true, the values of a map are stored directly in
+ * the buckets next to their key instead of in a separate value_container,
+ * which avoids an indirection on each access and the deferred erasure of the
+ * values. T must then be trivially copyable with an alignment not bigger than
+ * the one of std::size_t. Serialized maps have the same format in both modes.
+ *
+ * If IncrementalRehash is true, a growth of the array_hash keeps the old
+ * buckets next to the new ones and each following insertion migrates a few
+ * of them, instead of moving all the elements at once. Lookups check both
+ * the new and the old buckets until the migration ends. It has no effect if
+ * SlabBucketStorage is true, the slab being rebuilt on each rehash anyway.
  */
 template <class CharT, class T, class Hash, class KeyEqual,
           bool StoreNullTerminator, class KeySizeT, class IndexSizeT,
-          class GrowthPolicy>
-class array_hash : private value_container<T>,
-                   private Hash,
-                   private GrowthPolicy {
+          class GrowthPolicy, class Allocator = std::allocator<CharT>,
+          bool StoreHashFingerprint = false, bool AmortizedBucketGrowth = false,
+          bool SlabBucketStorage = false, bool VarintKeySize = false,
+          bool InlineBucketValues = false, bool IncrementalRehash = false>
+class array_hash
+    : private bucket_slab<CharT,
+                          typename std::allocator_traits<
+                              Allocator>::template rebind_alloc<CharT>,
+                          SlabBucketStorage>,
+      private incremental_rehash_state<
+          GrowthPolicy, IncrementalRehash && !SlabBucketStorage>,
+      private value_container<
+          typename std::conditional<InlineBucketValues, void, T>::type,
+          IndexSizeT, Allocator>,
+      private Hash,
+      private GrowthPolicy {
  private:
   template <typename U>
   using has_mapped_type =
       typename std::integral_constant<bool, !std::is_same<U, void>::value>;
 
+  template <typename U>
+  using has_inline_values =
+      typename std::integral_constant<bool, has_mapped_type<U>::value &&
+                                                InlineBucketValues>;
+
+  template <typename U>
+  using has_indexed_values =
+      typename std::integral_constant<bool, has_mapped_type<U>::value &&
+                                                !InlineBucketValues>;
+
+  static_assert(!has_inline_values<T>::value ||
+                    (std::is_trivially_copyable<T>::value &&
+                     alignof(typename std::conditional<
+                             has_mapped_type<T>::value, T, char>::type) <=
+                         alignof(std::size_t)),
+                "T must be trivially copyable with an alignment not bigger "
+                "than alignof(std::size_t) to be stored in the buckets.");
+
+  template <typename U>
+  using rebind_alloc =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<U>;
+
+  using value_container_type = value_container<
+      typename std::conditional<has_indexed_values<T>::value, T, void>::type,
+      IndexSizeT, Allocator>;
+
+  using bucket_slab_type =
+      bucket_slab<CharT, rebind_alloc<CharT>, SlabBucketStorage>;
+
+  using incremental_rehash_type =
+      incremental_rehash_state<GrowthPolicy,
+                               IncrementalRehash && !SlabBucketStorage>;
+
   /**
    * If there is a mapped type in array_hash, we store the values in m_values of
    * value_container class and we store an index to m_values in the bucket. The
-   * index is of type IndexSizeT.
+   * index is of type IndexSizeT. With inline values, the bucket stores T.
    */
-  using array_bucket = tsl::detail_array_hash::array_bucket<
+  template <bool WithHashFingerprint, bool WithVarintKeySize,
+            bool WithInlineValues = InlineBucketValues>
+  using array_bucket_type = tsl::detail_array_hash::array_bucket<
       CharT,
-      typename std::conditional<has_mapped_type<T>::value, IndexSizeT,
-                                void>::type,
-      KeyEqual, KeySizeT, StoreNullTerminator>;
+      typename std::conditional<
+          has_mapped_type<T>::value,
+          typename std::conditional<WithInlineValues, T, IndexSizeT>::type,
+          void>::type,
+      KeyEqual, KeySizeT, StoreNullTerminator, WithHashFingerprint,
+      AmortizedBucketGrowth, SlabBucketStorage, WithVarintKeySize,
+      WithInlineValues && has_mapped_type<T>::value, rebind_alloc<CharT>>;
+
+  using array_bucket = array_bucket_type<StoreHashFingerprint, VarintKeySize>;
+
+  /**
+   * Format of the buckets when serialized, always with indexed values.
+   */
+  template <bool WithHashFingerprint, bool WithVarintKeySize>
+  using serialized_bucket_type =
+      array_bucket_type<WithHashFingerprint, WithVarintKeySize, false>;
+
+  using buckets_container_type =
+      std::vector<array_bucket, rebind_alloc<array_bucket>>;
 
  public:
   template <bool IsConst>
@@ -793,6 +1896,7 @@ class array_hash : private value_container<T>,
   using size_type = std::size_t;
   using hasher = Hash;
   using key_equal = KeyEqual;
+  using allocator_type = Allocator;
   using iterator = array_hash_iterator<false>;
   using const_iterator = array_hash_iterator<true>;
 
@@ -808,8 +1912,8 @@ class array_hash : private value_container<T>,
     using iterator_array_bucket = typename array_bucket::const_iterator;
 
     using iterator_buckets = typename std::conditional<
-        IsConst, typename std::vector<array_bucket>::const_iterator,
-        typename std::vector<array_bucket>::iterator>::type;
+        IsConst, typename buckets_container_type::const_iterator,
+        typename buckets_container_type::iterator>::type;
 
     using array_hash_ptr = typename std::conditional<IsConst, const array_hash*,
                                                      array_hash*>::type;
@@ -867,7 +1971,7 @@ class array_hash : private value_container<T>,
     template <class U = T, typename std::enable_if<
                                has_mapped_type<U>::value>::type* = nullptr>
     reference value() const {
-      return this->m_array_hash->m_values[value_position()];
+      return this->m_array_hash->bucket_value(m_array_bucket_iterator);
     }
 
     template <class U = T, typename std::enable_if<
@@ -888,19 +1992,33 @@ class array_hash : private value_container<T>,
 
       ++m_array_bucket_iterator;
       if (m_array_bucket_iterator == m_buckets_iterator->cend()) {
-        do {
-          ++m_buckets_iterator;
-        } while (m_buckets_iterator != m_array_hash->m_buckets_data.end() &&
-                 m_buckets_iterator->empty());
-
-        if (m_buckets_iterator != m_array_hash->m_buckets_data.end()) {
-          m_array_bucket_iterator = m_buckets_iterator->cbegin();
-        }
+        skip_bucket();
       }
 
       return *this;
     }
 
+    /**
+     * Move the iterator to the first element of the next non-empty bucket,
+     * skipping the remaining elements of the current bucket. Useful when the
+     * buckets are sorted, see sort_buckets.
+     */
+    array_hash_iterator& skip_bucket() {
+      tsl_ah_assert(m_buckets_iterator != m_array_hash->m_buckets_data.end());
+
+      do {
+        ++m_buckets_iterator;
+      } while (m_buckets_iterator != m_array_hash->m_buckets_data.end() &&
+               m_buckets_iterator->empty());
+
+      m_array_bucket_iterator =
+          (m_buckets_iterator != m_array_hash->m_buckets_data.end())
+              ? m_buckets_iterator->cbegin()
+              : array_bucket::cend_it();
+
+      return *this;
+    }
+
     array_hash_iterator operator++(int) {
       array_hash_iterator tmp(*this);
       ++*this;
@@ -920,13 +2038,6 @@ class array_hash : private value_container<T>,
       return !(lhs == rhs);
     }
 
-   private:
-    template <class U = T, typename std::enable_if<
-                               has_mapped_type<U>::value>::type* = nullptr>
-    IndexSizeT value_position() const {
-      return this->m_array_bucket_iterator.value();
-    }
-
    private:
     iterator_buckets m_buckets_iterator;
     iterator_array_bucket m_array_bucket_iterator;
@@ -935,38 +2046,66 @@ class array_hash : private value_container<T>,
   };
 
  public:
-  array_hash(size_type bucket_count, const Hash& hash, float max_load_factor)
-      : value_container<T>(),
+  array_hash(size_type bucket_count, const Hash& hash, float max_load_factor,
+             const Allocator& alloc = Allocator())
+      : bucket_slab_type(rebind_alloc<CharT>(alloc)),
+        value_container_type(alloc),
         Hash(hash),
         GrowthPolicy(bucket_count),
         m_buckets_data(bucket_count > max_bucket_count()
                            ? throw std::length_error(
                                  "The map exceeds its maximum bucket count.")
-                           : bucket_count),
+                           : bucket_count,
+                       array_bucket(rebind_alloc<CharT>(alloc)), alloc),
         m_buckets(m_buckets_data.empty() ? static_empty_bucket_ptr()
                                          : m_buckets_data.data()),
-        m_nb_elements(0) {
+        m_nb_elements(0),
+        m_sorted_buckets(false) {
     this->max_load_factor(max_load_factor);
   }
 
   array_hash(const array_hash& other)
-      : value_container<T>(other),
+      : array_hash(other,
+                   std::allocator_traits<Allocator>::
+                       select_on_container_copy_construction(
+                           other.get_allocator())) {}
+
+  array_hash(const array_hash& other, const Allocator& alloc)
+      : bucket_slab_type(rebind_alloc<CharT>(alloc)),
+        incremental_rehash_type(other),
+        value_container_type(other, alloc),
         Hash(other),
         GrowthPolicy(other),
-        m_buckets_data(other.m_buckets_data),
-        m_buckets(m_buckets_data.empty() ? static_empty_bucket_ptr()
-                                         : m_buckets_data.data()),
+        m_buckets_data(alloc),
+        m_buckets(static_empty_bucket_ptr()),
         m_nb_elements(other.m_nb_elements),
         m_max_load_factor(other.m_max_load_factor),
-        m_load_threshold(other.m_load_threshold) {}
+        m_load_threshold(other.m_load_threshold),
+        m_sorted_buckets(other.m_sorted_buckets) {
+    if (SlabBucketStorage) {
+      rebuild_slab(other.m_buckets_data);
+      return;
+    }
+
+    m_buckets_data.reserve(other.m_buckets_data.size());
+    for (const array_bucket& bucket : other.m_buckets_data) {
+      m_buckets_data.emplace_back(bucket, rebind_alloc<CharT>(alloc));
+    }
+
+    if (!m_buckets_data.empty()) {
+      m_buckets = m_buckets_data.data();
+    }
+  }
 
   array_hash(array_hash&& other) noexcept(
-      std::is_nothrow_move_constructible<value_container<T>>::value&&
+      std::is_nothrow_move_constructible<value_container_type>::value&&
           std::is_nothrow_move_constructible<Hash>::value&&
               std::is_nothrow_move_constructible<GrowthPolicy>::value&&
                   std::is_nothrow_move_constructible<
-                      std::vector<array_bucket>>::value)
-      : value_container<T>(std::move(other)),
+                      buckets_container_type>::value)
+      : bucket_slab_type(std::move(other)),
+        incremental_rehash_type(std::move(other)),
+        value_container_type(std::move(other)),
         Hash(std::move(other)),
         GrowthPolicy(std::move(other)),
         m_buckets_data(std::move(other.m_buckets_data)),
@@ -974,8 +2113,10 @@ class array_hash : private value_container<T>,
                                          : m_buckets_data.data()),
         m_nb_elements(other.m_nb_elements),
         m_max_load_factor(other.m_max_load_factor),
-        m_load_threshold(other.m_load_threshold) {
-    other.value_container<T>::clear();
+        m_load_threshold(other.m_load_threshold),
+        m_sorted_buckets(other.m_sorted_buckets) {
+    other.incremental_rehash_type::reset();
+    other.value_container_type::clear();
     other.GrowthPolicy::clear();
     other.m_buckets_data.clear();
     other.m_buckets = static_empty_bucket_ptr();
@@ -985,16 +2126,22 @@ class array_hash : private value_container<T>,
 
   array_hash& operator=(const array_hash& other) {
     if (&other != this) {
-      value_container<T>::operator=(other);
+      incremental_rehash_type::operator=(other);
+      value_container_type::operator=(other);
       Hash::operator=(other);
       GrowthPolicy::operator=(other);
 
-      m_buckets_data = other.m_buckets_data;
-      m_buckets = m_buckets_data.empty() ? static_empty_bucket_ptr()
-                                         : m_buckets_data.data();
+      if (SlabBucketStorage) {
+        rebuild_slab(other.m_buckets_data);
+      } else {
+        m_buckets_data = other.m_buckets_data;
+        m_buckets = m_buckets_data.empty() ? static_empty_bucket_ptr()
+                                           : m_buckets_data.data();
+      }
       m_nb_elements = other.m_nb_elements;
       m_max_load_factor = other.m_max_load_factor;
       m_load_threshold = other.m_load_threshold;
+      m_sorted_buckets = other.m_sorted_buckets;
     }
 
     return *this;
@@ -1044,6 +2191,10 @@ class array_hash : private value_container<T>,
     return const_iterator(m_buckets_data.end(), array_bucket::cend_it(), this);
   }
 
+  allocator_type get_allocator() const {
+    return allocator_type(m_buckets_data.get_allocator());
+  }
+
   /*
    * Capacity
    */
@@ -1059,44 +2210,157 @@ class array_hash : private value_container<T>,
 
   void shrink_to_fit() {
     clear_old_erased_values();
-    value_container<T>::shrink_to_fit();
+    value_container_type::shrink_to_fit();
+
+    const size_type new_bucket_count =
+        size_type(std::ceil(float(size()) / max_load_factor()));
+    if (SlabBucketStorage && new_bucket_count == bucket_count()) {
+      rebuild_slab(m_buckets_data);
+      return;
+    }
+
+    rehash_impl(new_bucket_count);
 
-    rehash_impl(size_type(std::ceil(float(size()) / max_load_factor())));
+    // rehash_impl doesn't do anything if the bucket count stays the same.
+    for (auto& bucket : m_buckets_data) {
+      bucket.shrink_to_fit();
+    }
   }
 
+  /**
+   * Sort the entries of each bucket by key. The order is kept until the next
+   * insertion or rehash, see sorted_buckets.
+   */
+  void sort_buckets() {
+    std::vector<const CharT*> entries;
+    std::vector<CharT> sorted_buffer;
+    for (auto& bucket : m_buckets_data) {
+      bucket.sort(entries, sorted_buffer);
+    }
+
+    m_sorted_buckets = true;
+  }
+
+  bool sorted_buckets() const noexcept { return m_sorted_buckets; }
+
   /*
    * Modifiers
    */
   void clear() noexcept {
-    value_container<T>::clear();
+    value_container_type::clear();
+
+    m_buckets_data.erase(m_buckets_data.begin() + bucket_count(),
+                         m_buckets_data.end());
+    incremental_rehash_type::reset();
 
     for (auto& bucket : m_buckets_data) {
       bucket.clear();
     }
+    bucket_slab_type::release();
+
+    m_nb_elements = 0;
+  }
+
+  template <class... ValueArgs>
+  std::pair<iterator, bool> emplace(const CharT* key, size_type key_size,
+                                    ValueArgs&&... value_args) {
+    const std::size_t hash = hash_key(key, key_size);
+    std::size_t ibucket;
+
+    auto it_find = find_in_buckets(key, key_size, hash, ibucket);
+    if (it_find.second) {
+      return std::make_pair(
+          iterator(m_buckets_data.begin() + ibucket, it_find.first, this),
+          false);
+    }
+
+    m_sorted_buckets = false;
+    if (grow_on_high_load() || migrate_old_buckets()) {
+      ibucket = bucket_for_hash(hash);
+      it_find =
+          m_buckets[ibucket].find_or_end_of_bucket(key, key_size, hash);
+    }
+
+    return emplace_impl(ibucket, it_find.first, key, key_size, hash,
+                        std::forward<ValueArgs>(value_args)...);
+  }
+
+  /**
+   * Insert the elements pointed by the iterators in [first, last), without
+   * the key_offset first characters of their keys, in the empty array hash.
+   * The iterators point to iterators of other array hashes of the same type,
+   * or to any element providing the same key(), key_size() and value().
+   *
+   * The resulting keys must be unique, there is no duplicate check. The
+   * hashes are computed in a first pass to size each bucket exactly, the
+   * entries are then appended without any reallocation. The values are moved
+   * if MoveValues is true, copied otherwise.
+   *
+   * If an exception is thrown, the array hash stays empty. With MoveValues,
+   * all the memory is allocated before moving the values, no value was moved
+   * if an exception is thrown.
+   */
+  template <bool MoveValues, class ForwardIt>
+  void insert_unique(ForwardIt first, ForwardIt last, size_type key_offset) {
+    tsl_ah_assert(empty());
+    const std::size_t nb_elements =
+        static_cast<std::size_t>(std::distance(first, last));
+    if (nb_elements == 0) {
+      return;
+    }
+
+    if (nb_elements > max_size()) {
+      throw std::length_error(
+          "Can't insert value, too much values in the map.");
+    }
 
-    m_nb_elements = 0;
-  }
+    size_type bucket_count = std::max(
+        this->bucket_count(),
+        size_type(std::ceil(float(nb_elements) / max_load_factor())));
+    GrowthPolicy new_growth_policy(bucket_count);
 
-  template <class... ValueArgs>
-  std::pair<iterator, bool> emplace(const CharT* key, size_type key_size,
-                                    ValueArgs&&... value_args) {
-    const std::size_t hash = hash_key(key, key_size);
-    std::size_t ibucket = bucket_for_hash(hash);
+    std::vector<std::size_t> required_size_for_bucket(bucket_count, 0);
+    std::vector<std::size_t> hash_for_ivalue(nb_elements, 0);
 
-    auto it_find = m_buckets[ibucket].find_or_end_of_bucket(key, key_size);
-    if (it_find.second) {
-      return std::make_pair(
-          iterator(m_buckets_data.begin() + ibucket, it_find.first, this),
-          false);
+    std::size_t ivalue = 0;
+    for (auto it = first; it != last; ++it) {
+      tsl_ah_assert(it->key_size() >= key_offset);
+      const size_type key_size = it->key_size() - key_offset;
+      const std::size_t hash = hash_key(it->key() + key_offset, key_size);
+
+      hash_for_ivalue[ivalue] = hash;
+      required_size_for_bucket[new_growth_policy.bucket_for_hash(hash)] +=
+          array_bucket::entry_required_bytes(key_size);
+      ivalue++;
     }
 
-    if (grow_on_high_load()) {
-      ibucket = bucket_for_hash(hash);
-      it_find = m_buckets[ibucket].find_or_end_of_bucket(key, key_size);
+    const rebind_alloc<CharT> bucket_alloc(get_allocator());
+
+    // Must be declared before new_buckets, see rehash_impl.
+    bucket_slab_type new_slab(
+        slab_required_chars(required_size_for_bucket.begin(),
+                            required_size_for_bucket.end()),
+        bucket_alloc);
+    buckets_container_type new_buckets =
+        create_reserved_buckets(required_size_for_bucket, new_slab);
+    value_container_type::reserve(nb_elements);
+
+    try {
+      ivalue = 0;
+      for (auto it = first; it != last; ++it) {
+        const std::size_t hash = hash_for_ivalue[ivalue];
+        append_unique_in_reserved_bucket<MoveValues>(
+            new_buckets[new_growth_policy.bucket_for_hash(hash)], *it,
+            key_offset, hash);
+        ivalue++;
+      }
+    } catch (...) {
+      value_container_type::clear();
+      throw;
     }
 
-    return emplace_impl(ibucket, it_find.first, key, key_size,
-                        std::forward<ValueArgs>(value_args)...);
+    set_buckets(new_growth_policy, new_slab, new_buckets);
+    m_nb_elements = nb_elements;
   }
 
   template <class M>
@@ -1111,10 +2375,9 @@ class array_hash : private value_container<T>,
   }
 
   iterator erase(const_iterator pos) {
-    if (should_clear_old_erased_values()) {
-      clear_old_erased_values();
-    }
+    clear_old_erased_values_on_erase();
 
+    erase_value(pos.m_array_bucket_iterator);
     return erase_from_bucket(mutable_iterator(pos));
   }
 
@@ -1135,19 +2398,19 @@ class array_hash : private value_container<T>,
      */
     auto to_delete = mutable_iterator(first);
     while (to_delete.m_buckets_iterator != last.m_buckets_iterator) {
+      erase_value(to_delete.m_array_bucket_iterator);
       to_delete = erase_from_bucket(to_delete);
     }
 
     std::size_t nb_elements_until_last = std::distance(
         to_delete.m_array_bucket_iterator, last.m_array_bucket_iterator);
     while (nb_elements_until_last > 0) {
+      erase_value(to_delete.m_array_bucket_iterator);
       to_delete = erase_from_bucket(to_delete);
       nb_elements_until_last--;
     }
 
-    if (should_clear_old_erased_values()) {
-      clear_old_erased_values();
-    }
+    clear_old_erased_values_on_erase();
 
     return to_delete;
   }
@@ -1157,12 +2420,13 @@ class array_hash : private value_container<T>,
   }
 
   size_type erase(const CharT* key, size_type key_size, std::size_t hash) {
-    if (should_clear_old_erased_values()) {
-      clear_old_erased_values();
-    }
+    clear_old_erased_values_on_erase();
 
-    const std::size_t ibucket = bucket_for_hash(hash);
-    if (m_buckets[ibucket].erase(key, key_size)) {
+    std::size_t ibucket;
+    auto it_find = find_in_buckets(key, key_size, hash, ibucket);
+    if (it_find.second) {
+      erase_value(it_find.first);
+      m_buckets[ibucket].erase(it_find.first);
       m_nb_elements--;
       return 1;
     } else {
@@ -1173,8 +2437,12 @@ class array_hash : private value_container<T>,
   void swap(array_hash& other) {
     using std::swap;
 
-    swap(static_cast<value_container<T>&>(*this),
-         static_cast<value_container<T>&>(other));
+    swap(static_cast<bucket_slab_type&>(*this),
+         static_cast<bucket_slab_type&>(other));
+    swap(static_cast<incremental_rehash_type&>(*this),
+         static_cast<incremental_rehash_type&>(other));
+    swap(static_cast<value_container_type&>(*this),
+         static_cast<value_container_type&>(other));
     swap(static_cast<Hash&>(*this), static_cast<Hash&>(other));
     swap(static_cast<GrowthPolicy&>(*this), static_cast<GrowthPolicy&>(other));
     swap(m_buckets_data, other.m_buckets_data);
@@ -1182,6 +2450,7 @@ class array_hash : private value_container<T>,
     swap(m_nb_elements, other.m_nb_elements);
     swap(m_max_load_factor, other.m_max_load_factor);
     swap(m_load_threshold, other.m_load_threshold);
+    swap(m_sorted_buckets, other.m_sorted_buckets);
   }
 
   /*
@@ -1209,11 +2478,11 @@ class array_hash : private value_container<T>,
   template <class U = T,
             typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
   const U& at(const CharT* key, size_type key_size, std::size_t hash) const {
-    const std::size_t ibucket = bucket_for_hash(hash);
+    std::size_t ibucket;
 
-    auto it_find = m_buckets[ibucket].find_or_end_of_bucket(key, key_size);
+    auto it_find = find_in_buckets(key, key_size, hash, ibucket);
     if (it_find.second) {
-      return this->m_values[it_find.first.value()];
+      return bucket_value(it_find.first);
     } else {
       throw std::out_of_range("Couldn't find key.");
     }
@@ -1223,18 +2492,20 @@ class array_hash : private value_container<T>,
             typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
   U& access_operator(const CharT* key, size_type key_size) {
     const std::size_t hash = hash_key(key, key_size);
-    std::size_t ibucket = bucket_for_hash(hash);
+    std::size_t ibucket;
 
-    auto it_find = m_buckets[ibucket].find_or_end_of_bucket(key, key_size);
+    auto it_find = find_in_buckets(key, key_size, hash, ibucket);
     if (it_find.second) {
-      return this->m_values[it_find.first.value()];
+      return bucket_value(it_find.first);
     } else {
-      if (grow_on_high_load()) {
+      m_sorted_buckets = false;
+      if (grow_on_high_load() || migrate_old_buckets()) {
         ibucket = bucket_for_hash(hash);
-        it_find = m_buckets[ibucket].find_or_end_of_bucket(key, key_size);
+        it_find =
+          m_buckets[ibucket].find_or_end_of_bucket(key, key_size, hash);
       }
 
-      return emplace_impl(ibucket, it_find.first, key, key_size, U{})
+      return emplace_impl(ibucket, it_find.first, key, key_size, hash, U{})
           .first.value();
     }
   }
@@ -1245,9 +2516,9 @@ class array_hash : private value_container<T>,
 
   size_type count(const CharT* key, size_type key_size,
                   std::size_t hash) const {
-    const std::size_t ibucket = bucket_for_hash(hash);
+    std::size_t ibucket;
 
-    auto it_find = m_buckets[ibucket].find_or_end_of_bucket(key, key_size);
+    auto it_find = find_in_buckets(key, key_size, hash, ibucket);
     if (it_find.second) {
       return 1;
     } else {
@@ -1264,9 +2535,9 @@ class array_hash : private value_container<T>,
   }
 
   iterator find(const CharT* key, size_type key_size, std::size_t hash) {
-    const std::size_t ibucket = bucket_for_hash(hash);
+    std::size_t ibucket;
 
-    auto it_find = m_buckets[ibucket].find_or_end_of_bucket(key, key_size);
+    auto it_find = find_in_buckets(key, key_size, hash, ibucket);
     if (it_find.second) {
       return iterator(m_buckets_data.begin() + ibucket, it_find.first, this);
     } else {
@@ -1276,9 +2547,9 @@ class array_hash : private value_container<T>,
 
   const_iterator find(const CharT* key, size_type key_size,
                       std::size_t hash) const {
-    const std::size_t ibucket = bucket_for_hash(hash);
+    std::size_t ibucket;
 
-    auto it_find = m_buckets[ibucket].find_or_end_of_bucket(key, key_size);
+    auto it_find = find_in_buckets(key, key_size, hash, ibucket);
     if (it_find.second) {
       return const_iterator(m_buckets_data.cbegin() + ibucket, it_find.first,
                             this);
@@ -1310,10 +2581,25 @@ class array_hash : private value_container<T>,
     return std::make_pair(it, (it == cend()) ? it : std::next(it));
   }
 
+  /**
+   * Prefetch the bucket of the hash. Followed later by a prefetch_bucket_buffer
+   * and a lookup with the same hash, it hides most of the memory latency of
+   * the lookup when other work is done in-between.
+   */
+  void prefetch_bucket(std::size_t hash) const {
+    prefetch(m_buckets + bucket_for_hash(hash));
+  }
+
+  void prefetch_bucket_buffer(std::size_t hash) const {
+    m_buckets[bucket_for_hash(hash)].prefetch_buffer();
+  }
+
   /*
    * Bucket interface
    */
-  size_type bucket_count() const { return m_buckets_data.size(); }
+  size_type bucket_count() const {
+    return m_buckets_data.size() - incremental_rehash_type::nb_old_buckets();
+  }
 
   size_type max_bucket_count() const {
     return std::min(GrowthPolicy::max_bucket_count(),
@@ -1387,10 +2673,40 @@ class array_hash : private value_container<T>,
   }
 
   /**
-   * If there is a mapped_type, the mapped value in m_values is not erased now.
-   * It will be erased when the ratio between the size of the map and
-   * the size of the map + the number of deleted values still stored is low
-   * enough (see clear_old_erased_values).
+   * Look for the key in its bucket and, if an incremental rehash is in
+   * progress, in its old bucket if it wasn't migrated yet. ibucket is set to
+   * the index in m_buckets_data of the bucket containing the key if found, to
+   * the one of its new bucket otherwise (the returned iterator is then the
+   * end of this bucket).
+   */
+  std::pair<typename array_bucket::const_iterator, bool> find_in_buckets(
+      const CharT* key, size_type key_size, std::size_t hash,
+      std::size_t& ibucket) const {
+    ibucket = bucket_for_hash(hash);
+
+    auto it_find =
+        m_buckets[ibucket].find_or_end_of_bucket(key, key_size, hash);
+    if (it_find.second || incremental_rehash_type::nb_old_buckets() == 0) {
+      return it_find;
+    }
+
+    const std::size_t iold_bucket =
+        bucket_count() + incremental_rehash_type::old_bucket_for_hash(hash);
+    if (iold_bucket < m_buckets_data.size()) {
+      auto it_find_old =
+          m_buckets[iold_bucket].find_or_end_of_bucket(key, key_size, hash);
+      if (it_find_old.second) {
+        ibucket = iold_bucket;
+        return it_find_old;
+      }
+    }
+
+    return it_find;
+  }
+
+  /**
+   * If there is a mapped_type, the mapped value in m_values is not erased by
+   * erase_from_bucket, see erase_value.
    */
   iterator erase_from_bucket(iterator pos) noexcept {
     auto array_bucket_next_it =
@@ -1414,15 +2730,70 @@ class array_hash : private value_container<T>,
     }
   }
 
+  template <class U = T,
+            typename std::enable_if<has_indexed_values<U>::value>::type* =
+                nullptr>
+  U& bucket_value(typename array_bucket::const_iterator it) noexcept {
+    return this->m_values[it.value()];
+  }
+
+  template <class U = T,
+            typename std::enable_if<has_indexed_values<U>::value>::type* =
+                nullptr>
+  const U& bucket_value(
+      typename array_bucket::const_iterator it) const noexcept {
+    return this->m_values[it.value()];
+  }
+
+  template <class U = T,
+            typename std::enable_if<has_inline_values<U>::value>::type* =
+                nullptr>
+  U& bucket_value(typename array_bucket::const_iterator it) noexcept {
+    return *const_cast<U*>(it.value_address());
+  }
+
+  template <class U = T,
+            typename std::enable_if<has_inline_values<U>::value>::type* =
+                nullptr>
+  const U& bucket_value(
+      typename array_bucket::const_iterator it) const noexcept {
+    return *it.value_address();
+  }
+
   template <class U = T, typename std::enable_if<
-                             !has_mapped_type<U>::value>::type* = nullptr>
+                             !has_indexed_values<U>::value>::type* = nullptr>
+  void erase_value(typename array_bucket::const_iterator /*it*/) noexcept {}
+
+  /**
+   * The slot in m_values of an erased value is reused by a later insertion
+   * (see value_container). The erased values are thus not compacted on erase,
+   * which would be a pause proportional to the size of the map, unless T
+   * can't be replaced in place.
+   */
+  template <class U = T,
+            typename std::enable_if<has_indexed_values<U>::value>::type* =
+                nullptr>
+  void erase_value(typename array_bucket::const_iterator it) {
+    value_container_type::erase_value(it.value());
+  }
+
+  void clear_old_erased_values_on_erase() {
+    if (!value_container_type::REUSE_ERASED_VALUES &&
+        should_clear_old_erased_values()) {
+      clear_old_erased_values();
+    }
+  }
+
+  template <class U = T, typename std::enable_if<
+                             !has_indexed_values<U>::value>::type* = nullptr>
   bool should_clear_old_erased_values(
       float /*threshold*/ = DEFAULT_CLEAR_OLD_ERASED_VALUE_THRESHOLD) const {
     return false;
   }
 
   template <class U = T,
-            typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
+            typename std::enable_if<has_indexed_values<U>::value>::type* =
+                nullptr>
   bool should_clear_old_erased_values(
       float threshold = DEFAULT_CLEAR_OLD_ERASED_VALUE_THRESHOLD) const {
     if (this->m_values.size() == 0) {
@@ -1433,11 +2804,12 @@ class array_hash : private value_container<T>,
   }
 
   template <class U = T, typename std::enable_if<
-                             !has_mapped_type<U>::value>::type* = nullptr>
+                             !has_indexed_values<U>::value>::type* = nullptr>
   void clear_old_erased_values() {}
 
   template <class U = T,
-            typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
+            typename std::enable_if<has_indexed_values<U>::value>::type* =
+                nullptr>
   void clear_old_erased_values() {
     static_assert(std::is_nothrow_move_constructible<U>::value ||
                       std::is_copy_constructible<U>::value,
@@ -1448,7 +2820,8 @@ class array_hash : private value_container<T>,
       return;
     }
 
-    std::vector<T> new_values;
+    typename value_container_type::values_container_type new_values(
+        this->m_values.get_allocator());
     new_values.reserve(size());
 
     for (auto it = begin(); it != end(); ++it) {
@@ -1464,6 +2837,7 @@ class array_hash : private value_container<T>,
     }
 
     new_values.swap(this->m_values);
+    this->m_erased_values.clear();
     tsl_ah_assert(m_nb_elements == this->m_values.size());
   }
 
@@ -1472,18 +2846,147 @@ class array_hash : private value_container<T>,
    */
   bool grow_on_high_load() {
     if (size() >= m_load_threshold) {
-      rehash_impl(GrowthPolicy::next_bucket_count());
+      if (IncrementalRehash && !SlabBucketStorage && bucket_count() > 0 &&
+          incremental_rehash_type::nb_old_buckets() == 0) {
+        start_incremental_rehash(GrowthPolicy::next_bucket_count());
+      } else {
+        rehash_impl(GrowthPolicy::next_bucket_count());
+      }
+
       return true;
     }
 
     return false;
   }
 
-  template <class... ValueArgs, class U = T,
+  /**
+   * Switch to a new bucket array of bucket_count buckets without moving any
+   * element. The old buckets are moved after the new ones in m_buckets_data
+   * and are migrated a few at a time by migrate_old_buckets.
+   */
+  void start_incremental_rehash(size_type bucket_count) {
+    GrowthPolicy new_growth_policy(bucket_count);
+
+    const rebind_alloc<CharT> bucket_alloc(get_allocator());
+    const std::size_t nb_old_buckets = m_buckets_data.size();
+
+    buckets_container_type new_buckets(m_buckets_data.get_allocator());
+    new_buckets.reserve(bucket_count + nb_old_buckets);
+    new_buckets.resize(bucket_count, array_bucket(bucket_alloc));
+
+    incremental_rehash_type::start_rehash(*this, nb_old_buckets);
+    for (array_bucket& bucket : m_buckets_data) {
+      new_buckets.push_back(std::move(bucket));
+    }
+
+    using std::swap;
+    swap(static_cast<GrowthPolicy&>(*this), new_growth_policy);
+
+    m_buckets_data.swap(new_buckets);
+    m_buckets = m_buckets_data.data();
+
+    // Call max_load_factor to change m_load_threshold
+    max_load_factor(m_max_load_factor);
+  }
+
+  /**
+   * Migrate the elements of the last old buckets of an incremental rehash to
+   * their new bucket. Enough buckets are migrated on each call for the
+   * migration to end before the next growth. Return true if some buckets
+   * were migrated, iterators on the array_hash are then invalidated.
+   */
+  bool migrate_old_buckets() {
+    const std::size_t nb_old_buckets =
+        incremental_rehash_type::nb_old_buckets();
+    if (nb_old_buckets == 0) {
+      return false;
+    }
+
+    // Aim to finish the migration when half of the insertions left before
+    // the next growth are done.
+    const std::size_t nb_insertions_left =
+        (m_load_threshold > size()) ? (m_load_threshold - size()) / 2 : 0;
+    std::size_t nb_buckets_to_migrate = nb_old_buckets;
+    if (nb_insertions_left > 0) {
+      nb_buckets_to_migrate =
+          (nb_old_buckets + nb_insertions_left - 1) / nb_insertions_left;
+    }
+
+    while (nb_buckets_to_migrate > 0 &&
+           incremental_rehash_type::nb_old_buckets() > 0) {
+      migrate_last_old_bucket();
+      nb_buckets_to_migrate--;
+    }
+
+    return true;
+  }
+
+  void migrate_last_old_bucket() {
+    const array_bucket& old_bucket = m_buckets_data.back();
+
+    auto it = old_bucket.cbegin();
+    try {
+      for (; it != old_bucket.cend(); ++it) {
+        const std::size_t hash = hash_key(it.key(), it.key_size());
+        append_bucket_entry(m_buckets[bucket_for_hash(hash)], it, hash);
+      }
+    } catch (...) {
+      // Rollback, remove the copies of the entries already migrated.
+      for (auto it_copied = old_bucket.cbegin(); it_copied != it;
+           ++it_copied) {
+        const std::size_t hash =
+            hash_key(it_copied.key(), it_copied.key_size());
+        array_bucket& bucket = m_buckets[bucket_for_hash(hash)];
+        bucket.erase(bucket.find_or_end_of_bucket(it_copied.key(),
+                                                  it_copied.key_size(), hash)
+                         .first);
+      }
+
+      throw;
+    }
+
+    m_buckets_data.pop_back();
+    incremental_rehash_type::pop_old_bucket();
+  }
+
+  template <class U = T, typename std::enable_if<
+                             !has_mapped_type<U>::value>::type* = nullptr>
+  static void append_bucket_entry(array_bucket& bucket,
+                                  typename array_bucket::const_iterator it,
+                                  std::size_t hash) {
+    bucket.append(bucket.end_of_bucket(), it.key(), it.key_size(), hash);
+  }
+
+  template <class U = T,
             typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
+  static void append_bucket_entry(array_bucket& bucket,
+                                  typename array_bucket::const_iterator it,
+                                  std::size_t hash) {
+    bucket.append(bucket.end_of_bucket(), it.key(), it.key_size(), hash,
+                  it.value());
+  }
+
+  template <class... ValueArgs, class U = T,
+            typename std::enable_if<has_indexed_values<U>::value>::type* =
+                nullptr>
   std::pair<iterator, bool> emplace_impl(
       std::size_t ibucket, typename array_bucket::const_iterator end_of_bucket,
-      const CharT* key, size_type key_size, ValueArgs&&... value_args) {
+      const CharT* key, size_type key_size, std::size_t hash,
+      ValueArgs&&... value_args) {
+    if (value_container_type::has_reusable_value()) {
+      const std::size_t ivalue = value_container_type::reuse_value(
+          std::forward<ValueArgs>(value_args)...);
+
+      // On exception, the slot stays in the erased values of value_container.
+      auto it = m_buckets[ibucket].append(end_of_bucket, key, key_size, hash,
+                                          IndexSizeT(ivalue));
+      value_container_type::commit_reused_value();
+      m_nb_elements++;
+
+      return std::make_pair(
+          iterator(m_buckets_data.begin() + ibucket, it, this), true);
+    }
+
     if (this->m_values.size() >= max_size()) {
       // Try to clear old erased values lingering in m_values. Throw if it
       // doesn't change anything.
@@ -1497,14 +3000,15 @@ class array_hash : private value_container<T>,
     if (this->m_values.size() == this->m_values.capacity()) {
       this->m_values.reserve(
           std::size_t(float(this->m_values.size()) *
-                      value_container<T>::VECTOR_GROWTH_RATE));
+                      value_container_type::VECTOR_GROWTH_RATE));
     }
 
     this->m_values.emplace_back(std::forward<ValueArgs>(value_args)...);
 
     try {
-      auto it = m_buckets[ibucket].append(
-          end_of_bucket, key, key_size, IndexSizeT(this->m_values.size() - 1));
+      auto it =
+          m_buckets[ibucket].append(end_of_bucket, key, key_size, hash,
+                                    IndexSizeT(this->m_values.size() - 1));
       m_nb_elements++;
 
       return std::make_pair(
@@ -1520,13 +3024,34 @@ class array_hash : private value_container<T>,
                              !has_mapped_type<U>::value>::type* = nullptr>
   std::pair<iterator, bool> emplace_impl(
       std::size_t ibucket, typename array_bucket::const_iterator end_of_bucket,
-      const CharT* key, size_type key_size) {
+      const CharT* key, size_type key_size, std::size_t hash) {
+    if (m_nb_elements >= max_size()) {
+      throw std::length_error(
+          "Can't insert value, too much values in the map.");
+    }
+
+    auto it = m_buckets[ibucket].append(end_of_bucket, key, key_size, hash);
+    m_nb_elements++;
+
+    return std::make_pair(iterator(m_buckets_data.begin() + ibucket, it, this),
+                          true);
+  }
+
+  template <class... ValueArgs, class U = T,
+            typename std::enable_if<has_inline_values<U>::value>::type* =
+                nullptr>
+  std::pair<iterator, bool> emplace_impl(
+      std::size_t ibucket, typename array_bucket::const_iterator end_of_bucket,
+      const CharT* key, size_type key_size, std::size_t hash,
+      ValueArgs&&... value_args) {
     if (m_nb_elements >= max_size()) {
       throw std::length_error(
           "Can't insert value, too much values in the map.");
     }
 
-    auto it = m_buckets[ibucket].append(end_of_bucket, key, key_size);
+    auto it =
+        m_buckets[ibucket].append(end_of_bucket, key, key_size, hash,
+                                  U(std::forward<ValueArgs>(value_args)...));
     m_nb_elements++;
 
     return std::make_pair(iterator(m_buckets_data.begin() + ibucket, it, this),
@@ -1545,57 +3070,208 @@ class array_hash : private value_container<T>,
     }
 
     std::vector<std::size_t> required_size_for_bucket(bucket_count, 0);
-    std::vector<std::size_t> bucket_for_ivalue(size(), 0);
+    std::vector<std::size_t> hash_for_ivalue(size(), 0);
 
     std::size_t ivalue = 0;
     for (auto it = begin(); it != end(); ++it) {
       const std::size_t hash = hash_key(it.key(), it.key_size());
       const std::size_t ibucket = new_growth_policy.bucket_for_hash(hash);
 
-      bucket_for_ivalue[ivalue] = ibucket;
+      hash_for_ivalue[ivalue] = hash;
       required_size_for_bucket[ibucket] +=
           array_bucket::entry_required_bytes(it.key_size());
       ivalue++;
     }
 
-    std::vector<array_bucket> new_buckets;
-    new_buckets.reserve(bucket_count);
-    for (std::size_t ibucket = 0; ibucket < bucket_count; ibucket++) {
-      new_buckets.emplace_back(required_size_for_bucket[ibucket]);
-    }
+    const rebind_alloc<CharT> bucket_alloc(get_allocator());
+
+    // Must be declared before new_buckets so that the old buckets are
+    // destroyed before the old slab at the end of the method.
+    bucket_slab_type new_slab(
+        slab_required_chars(required_size_for_bucket.begin(),
+                            required_size_for_bucket.end()),
+        bucket_alloc);
+    buckets_container_type new_buckets =
+        create_reserved_buckets(required_size_for_bucket, new_slab);
 
     ivalue = 0;
     for (auto it = begin(); it != end(); ++it) {
-      const std::size_t ibucket = bucket_for_ivalue[ivalue];
-      append_iterator_in_reserved_bucket_no_check(new_buckets[ibucket], it);
+      const std::size_t hash = hash_for_ivalue[ivalue];
+      const std::size_t ibucket = new_growth_policy.bucket_for_hash(hash);
+      append_iterator_in_reserved_bucket_no_check(new_buckets[ibucket], it,
+                                                  hash);
 
       ivalue++;
     }
 
+    set_buckets(new_growth_policy, new_slab, new_buckets);
+  }
+
+  /**
+   * Create a bucket for each size in required_size_for_bucket with a buffer
+   * reserved for this number of bytes of entries. With SlabBucketStorage, the
+   * buffers are in slab which must have been created with
+   * slab_required_chars.
+   */
+  buckets_container_type create_reserved_buckets(
+      const std::vector<std::size_t>& required_size_for_bucket,
+      bucket_slab_type& slab) {
+    const rebind_alloc<CharT> bucket_alloc(get_allocator());
+    CharT* slab_position = slab.slab();
+
+    buckets_container_type new_buckets(m_buckets_data.get_allocator());
+    new_buckets.reserve(required_size_for_bucket.size());
+    for (const std::size_t required_size : required_size_for_bucket) {
+      if (SlabBucketStorage) {
+        new_buckets.emplace_back(slab_position, required_size, bucket_alloc);
+        slab_position +=
+            array_bucket::slab_required_bytes(required_size) / sizeof(CharT);
+      } else {
+        new_buckets.emplace_back(required_size, bucket_alloc);
+      }
+    }
+
+    return new_buckets;
+  }
+
+  /**
+   * Replace the buckets, their slab and the growth policy by the new ones.
+   * The old ones are left in the parameters.
+   */
+  void set_buckets(GrowthPolicy& new_growth_policy, bucket_slab_type& new_slab,
+                   buckets_container_type& new_buckets) noexcept {
     using std::swap;
     swap(static_cast<GrowthPolicy&>(*this), new_growth_policy);
 
+    swap(static_cast<bucket_slab_type&>(*this), new_slab);
+
     m_buckets_data.swap(new_buckets);
     m_buckets = !m_buckets_data.empty() ? m_buckets_data.data()
                                         : static_empty_bucket_ptr();
+    incremental_rehash_type::reset();
+    m_sorted_buckets = false;
 
     // Call max_load_factor to change m_load_threshold
     max_load_factor(m_max_load_factor);
   }
 
+  /**
+   * Return the number of CharT needed by a slab for buckets storing the number
+   * of bytes of entries in [first, last).
+   */
+  template <class InputIt>
+  static std::size_t slab_required_chars(InputIt first, InputIt last) {
+    std::size_t nb_chars = 0;
+    if (SlabBucketStorage) {
+      for (; first != last; ++first) {
+        nb_chars += array_bucket::slab_required_bytes(*first) / sizeof(CharT);
+      }
+    }
+
+    return nb_chars;
+  }
+
+  /**
+   * Replace the buckets by a copy of source with all the buffers packed in a
+   * new slab. The bucket count stays the same, no rehash is done. source may
+   * be m_buckets_data.
+   */
+  void rebuild_slab(const buckets_container_type& source) {
+    const rebind_alloc<CharT> bucket_alloc(get_allocator());
+
+    std::vector<std::size_t> size_bytes_for_bucket;
+    size_bytes_for_bucket.reserve(source.size());
+    for (const array_bucket& bucket : source) {
+      size_bytes_for_bucket.push_back(bucket.size_bytes());
+    }
+
+    // Must be declared before new_buckets, see rehash_impl.
+    bucket_slab_type new_slab(
+        slab_required_chars(size_bytes_for_bucket.begin(),
+                            size_bytes_for_bucket.end()),
+        bucket_alloc);
+    CharT* slab_position = new_slab.slab();
+
+    buckets_container_type new_buckets(m_buckets_data.get_allocator());
+    new_buckets.reserve(source.size());
+    for (std::size_t ibucket = 0; ibucket < source.size(); ibucket++) {
+      new_buckets.emplace_back(source[ibucket], slab_position, bucket_alloc);
+      slab_position +=
+          array_bucket::slab_required_bytes(size_bytes_for_bucket[ibucket]) /
+          sizeof(CharT);
+    }
+
+    using std::swap;
+    swap(static_cast<bucket_slab_type&>(*this), new_slab);
+
+    m_buckets_data.swap(new_buckets);
+    m_buckets = !m_buckets_data.empty() ? m_buckets_data.data()
+                                        : static_empty_bucket_ptr();
+  }
+
   template <class U = T, typename std::enable_if<
                              !has_mapped_type<U>::value>::type* = nullptr>
   void append_iterator_in_reserved_bucket_no_check(array_bucket& bucket,
-                                                   iterator it) {
-    bucket.append_in_reserved_bucket_no_check(it.key(), it.key_size());
+                                                   iterator it,
+                                                   std::size_t hash) {
+    bucket.append_in_reserved_bucket_no_check(it.key(), it.key_size(), hash);
   }
 
   template <class U = T,
             typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
   void append_iterator_in_reserved_bucket_no_check(array_bucket& bucket,
-                                                   iterator it) {
-    bucket.append_in_reserved_bucket_no_check(it.key(), it.key_size(),
-                                              it.value_position());
+                                                   iterator it,
+                                                   std::size_t hash) {
+    bucket.append_in_reserved_bucket_no_check(
+        it.key(), it.key_size(), hash, it.m_array_bucket_iterator.value());
+  }
+
+  /**
+   * Append the element of it, an iterator of another array hash or an element
+   * with the same interface, without the key_offset first characters of its
+   * key. See insert_unique.
+   */
+  template <bool MoveValues, class Element, class U = T,
+            typename std::enable_if<!has_mapped_type<U>::value>::type* =
+                nullptr>
+  void append_unique_in_reserved_bucket(array_bucket& bucket,
+                                        const Element& it,
+                                        size_type key_offset,
+                                        std::size_t hash) {
+    bucket.append_in_reserved_bucket_no_check(
+        it.key() + key_offset, it.key_size() - key_offset, hash);
+  }
+
+  template <bool MoveValues, class Element, class U = T,
+            typename std::enable_if<has_inline_values<U>::value>::type* =
+                nullptr>
+  void append_unique_in_reserved_bucket(array_bucket& bucket,
+                                        const Element& it,
+                                        size_type key_offset,
+                                        std::size_t hash) {
+    bucket.append_in_reserved_bucket_no_check(it.key() + key_offset,
+                                              it.key_size() - key_offset, hash,
+                                              it.value());
+  }
+
+  template <bool MoveValues, class Element, class U = T,
+            typename std::enable_if<has_indexed_values<U>::value>::type* =
+                nullptr>
+  void append_unique_in_reserved_bucket(array_bucket& bucket,
+                                        const Element& it,
+                                        size_type key_offset,
+                                        std::size_t hash) {
+    static_assert(!MoveValues || std::is_nothrow_move_constructible<U>::value,
+                  "The values can only be moved if their move constructor is "
+                  "noexcept.");
+    using value_reference =
+        typename std::conditional<MoveValues, U&&, const U&>::type;
+
+    // m_values was reserved, only the copy of the value can throw.
+    this->m_values.emplace_back(static_cast<value_reference>(it.value()));
+    bucket.append_in_reserved_bucket_no_check(
+        it.key() + key_offset, it.key_size() - key_offset, hash,
+        IndexSizeT(this->m_values.size() - 1));
   }
 
   /**
@@ -1619,7 +3295,7 @@ class array_hash : private value_container<T>,
     const slz_size_type version = SERIALIZATION_PROTOCOL_VERSION;
     serializer(version);
 
-    const slz_size_type bucket_count = m_buckets_data.size();
+    const slz_size_type bucket_count = this->bucket_count();
     serializer(bucket_count);
 
     const slz_size_type nb_elements = m_nb_elements;
@@ -1628,9 +3304,68 @@ class array_hash : private value_container<T>,
     const float max_load_factor = m_max_load_factor;
     serializer(max_load_factor);
 
-    for (const array_bucket& bucket : m_buckets_data) {
-      bucket.serialize(serializer);
-      serialize_bucket_values(serializer, bucket);
+    if (incremental_rehash_type::nb_old_buckets() == 0) {
+      for (const array_bucket& bucket : m_buckets_data) {
+        serialize_bucket(serializer, bucket);
+      }
+    } else {
+      // Serialize the buckets as they will be once the incremental rehash is
+      // over, the method being const.
+      buckets_container_type buckets(
+          m_buckets_data.begin(), m_buckets_data.begin() + this->bucket_count(),
+          m_buckets_data.get_allocator());
+      for (auto it_bucket = m_buckets_data.begin() + this->bucket_count();
+           it_bucket != m_buckets_data.end(); ++it_bucket) {
+        for (auto it = it_bucket->cbegin(); it != it_bucket->cend(); ++it) {
+          const std::size_t hash = hash_key(it.key(), it.key_size());
+          append_bucket_entry(buckets[bucket_for_hash(hash)], it, hash);
+        }
+      }
+
+      for (const array_bucket& bucket : buckets) {
+        serialize_bucket(serializer, bucket);
+      }
+    }
+  }
+
+  template <class Serializer, class U = T,
+            typename std::enable_if<!has_inline_values<U>::value>::type* =
+                nullptr>
+  void serialize_bucket(Serializer& serializer,
+                        const array_bucket& bucket) const {
+    bucket.serialize(serializer);
+    serialize_bucket_values(serializer, bucket);
+  }
+
+  /**
+   * Serialize the bucket as if its values were indexed, followed by its
+   * values. The indexes are not used on deserialization.
+   */
+  template <class Serializer, class U = T,
+            typename std::enable_if<has_inline_values<U>::value>::type* =
+                nullptr>
+  void serialize_bucket(Serializer& serializer,
+                        const array_bucket& bucket) const {
+    using indexed_bucket =
+        serialized_bucket_type<StoreHashFingerprint, VarintKeySize>;
+
+    std::size_t indexed_bucket_size = 0;
+    for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+      indexed_bucket_size +=
+          indexed_bucket::entry_required_bytes(it.key_size());
+    }
+
+    indexed_bucket bucket_to_serialize(indexed_bucket_size,
+                                       rebind_alloc<CharT>(get_allocator()));
+    for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+      bucket_to_serialize.append_in_reserved_bucket_no_check(
+          it.key(), it.key_size(), hash_key(it.key(), it.key_size()),
+          IndexSizeT(0));
+    }
+
+    bucket_to_serialize.serialize(serializer);
+    for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+      serializer(*it.value_address());
     }
   }
 
@@ -1641,7 +3376,8 @@ class array_hash : private value_container<T>,
                                const array_bucket& /*bucket*/) const {}
 
   template <class Serializer, class U = T,
-            typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
+            typename std::enable_if<has_indexed_values<U>::value>::type* =
+                nullptr>
   void serialize_bucket_values(Serializer& serializer,
                                const array_bucket& bucket) const {
     for (auto it = bucket.begin(); it != bucket.end(); ++it) {
@@ -1655,13 +3391,17 @@ class array_hash : private value_container<T>,
 
     const slz_size_type version =
         deserialize_value<slz_size_type>(deserializer);
-    // For now we only have one version of the serialization protocol.
-    // If it doesn't match there is a problem with the file.
-    if (version != SERIALIZATION_PROTOCOL_VERSION) {
+    // The versions only differ by the format of the entries in the buckets.
+    // If it's none of them there is a problem with the file.
+    if (version < MIN_SERIALIZATION_PROTOCOL_VERSION ||
+        version > MAX_SERIALIZATION_PROTOCOL_VERSION) {
       throw std::runtime_error(
           "Can't deserialize the array_map/set. The protocol version header is "
           "invalid.");
     }
+    // Map the versions before the default hash change to their bucket format.
+    const slz_size_type format =
+        (version < protocol_version(false, false)) ? version + 4 : version;
 
     const slz_size_type bucket_count_ds =
         deserialize_value<slz_size_type>(deserializer);
@@ -1677,46 +3417,34 @@ class array_hash : private value_container<T>,
     GrowthPolicy::operator=(GrowthPolicy(bucket_count));
 
     this->max_load_factor(max_load_factor);
-    value_container<T>::reserve(m_nb_elements);
+    value_container_type::reserve(m_nb_elements);
 
-    if (hash_compatible) {
+    if (hash_compatible && version == SERIALIZATION_PROTOCOL_VERSION) {
       if (bucket_count != bucket_count_ds) {
         throw std::runtime_error(
             "The GrowthPolicy is not the same even though hash_compatible is "
             "true.");
       }
 
-      m_buckets_data.reserve(bucket_count);
-      for (size_type i = 0; i < bucket_count; i++) {
-        m_buckets_data.push_back(array_bucket::deserialize(deserializer));
-        deserialize_bucket_values(deserializer, m_buckets_data.back());
-      }
+      deserialize_hash_compatible_buckets(deserializer, bucket_count);
+    } else if (format == protocol_version(false, false)) {
+      deserialize_and_rehash_buckets<serialized_bucket_type<false, false>>(
+          deserializer, bucket_count);
+    } else if (format == protocol_version(true, false)) {
+      deserialize_and_rehash_buckets<serialized_bucket_type<true, false>>(
+          deserializer, bucket_count);
+    } else if (format == protocol_version(false, true)) {
+      deserialize_and_rehash_buckets<serialized_bucket_type<false, true>>(
+          deserializer, bucket_count);
     } else {
-      m_buckets_data.resize(bucket_count);
-      for (size_type i = 0; i < bucket_count; i++) {
-        // TODO use buffer to avoid reallocation on each deserialization.
-        array_bucket bucket = array_bucket::deserialize(deserializer);
-        deserialize_bucket_values(deserializer, bucket);
-
-        for (auto it_val = bucket.cbegin(); it_val != bucket.cend(); ++it_val) {
-          const std::size_t ibucket =
-              bucket_for_hash(hash_key(it_val.key(), it_val.key_size()));
-
-          auto it_find = m_buckets_data[ibucket].find_or_end_of_bucket(
-              it_val.key(), it_val.key_size());
-          if (it_find.second) {
-            throw std::runtime_error(
-                "Error on deserialization, the same key is presents multiple "
-                "times.");
-          }
-
-          append_array_bucket_iterator_in_bucket(m_buckets_data[ibucket],
-                                                 it_find.first, it_val);
-        }
-      }
+      deserialize_and_rehash_buckets<serialized_bucket_type<true, true>>(
+          deserializer, bucket_count);
     }
 
     m_buckets = m_buckets_data.data();
+    if (SlabBucketStorage) {
+      rebuild_slab(m_buckets_data);
+    }
 
     if (load_factor() > this->max_load_factor()) {
       throw std::runtime_error(
@@ -1726,16 +3454,135 @@ class array_hash : private value_container<T>,
     }
   }
 
+  /**
+   * Deserialize the buckets as they are, the hash and the GrowthPolicy must be
+   * the same as the serialized ones.
+   */
+  template <class Deserializer, class U = T,
+            typename std::enable_if<!has_inline_values<U>::value>::type* =
+                nullptr>
+  void deserialize_hash_compatible_buckets(Deserializer& deserializer,
+                                           size_type bucket_count) {
+    const rebind_alloc<CharT> bucket_alloc(get_allocator());
+
+    m_buckets_data.reserve(bucket_count);
+    for (size_type i = 0; i < bucket_count; i++) {
+      m_buckets_data.push_back(
+          array_bucket::deserialize(deserializer, bucket_alloc));
+      deserialize_bucket_values(deserializer, m_buckets_data.back());
+    }
+  }
+
+  /**
+   * The serialized buckets have indexed values, they can't be used as they
+   * are.
+   */
+  template <class Deserializer, class U = T,
+            typename std::enable_if<has_inline_values<U>::value>::type* =
+                nullptr>
+  void deserialize_hash_compatible_buckets(Deserializer& deserializer,
+                                           size_type bucket_count) {
+    deserialize_and_rehash_buckets<
+        serialized_bucket_type<StoreHashFingerprint, VarintKeySize>>(
+        deserializer, bucket_count);
+  }
+
+  /**
+   * Deserialize each bucket as a SerializedBucket and insert its elements in
+   * the current buckets. SerializedBucket may have a different format than
+   * array_bucket (with or without fingerprints).
+   */
+  template <class SerializedBucket, class Deserializer, class U = T,
+            typename std::enable_if<!has_inline_values<U>::value>::type* =
+                nullptr>
+  void deserialize_and_rehash_buckets(Deserializer& deserializer,
+                                      size_type bucket_count) {
+    const rebind_alloc<CharT> bucket_alloc(get_allocator());
+
+    m_buckets_data.resize(bucket_count, array_bucket(bucket_alloc));
+    for (size_type i = 0; i < bucket_count; i++) {
+      // TODO use buffer to avoid reallocation on each deserialization.
+      SerializedBucket bucket =
+          SerializedBucket::deserialize(deserializer, bucket_alloc);
+      deserialize_bucket_values(deserializer, bucket);
+
+      for (auto it_val = bucket.cbegin(); it_val != bucket.cend(); ++it_val) {
+        const std::size_t hash = hash_key(it_val.key(), it_val.key_size());
+        const std::size_t ibucket = bucket_for_hash(hash);
+
+        append_array_bucket_iterator_in_bucket(
+            m_buckets_data[ibucket],
+            end_of_bucket_for_deserialized_key(ibucket, it_val.key(),
+                                               it_val.key_size(), hash),
+            it_val, hash);
+      }
+    }
+  }
+
+  /**
+   * Same as above but the values following each serialized bucket are stored
+   * in the buckets with their key.
+   */
+  template <class SerializedBucket, class Deserializer, class U = T,
+            typename std::enable_if<has_inline_values<U>::value>::type* =
+                nullptr>
+  void deserialize_and_rehash_buckets(Deserializer& deserializer,
+                                      size_type bucket_count) {
+    const rebind_alloc<CharT> bucket_alloc(get_allocator());
+    std::vector<U, rebind_alloc<U>> values(get_allocator());
+
+    m_buckets_data.resize(bucket_count, array_bucket(bucket_alloc));
+    for (size_type i = 0; i < bucket_count; i++) {
+      SerializedBucket bucket =
+          SerializedBucket::deserialize(deserializer, bucket_alloc);
+
+      values.clear();
+      for (auto it_val = bucket.cbegin(); it_val != bucket.cend(); ++it_val) {
+        values.push_back(deserialize_value<U>(deserializer));
+      }
+
+      auto it_value = values.cbegin();
+      for (auto it_val = bucket.cbegin(); it_val != bucket.cend();
+           ++it_val, ++it_value) {
+        const std::size_t hash = hash_key(it_val.key(), it_val.key_size());
+        const std::size_t ibucket = bucket_for_hash(hash);
+
+        m_buckets_data[ibucket].append(
+            end_of_bucket_for_deserialized_key(ibucket, it_val.key(),
+                                               it_val.key_size(), hash),
+            it_val.key(), it_val.key_size(), hash, *it_value);
+      }
+    }
+  }
+
+  /**
+   * Return the end of the bucket ibucket in m_buckets_data to append the
+   * deserialized key. Throw if the key is already present.
+   */
+  typename array_bucket::const_iterator end_of_bucket_for_deserialized_key(
+      std::size_t ibucket, const CharT* key, size_type key_size,
+      std::size_t hash) const {
+    auto it_find =
+        m_buckets_data[ibucket].find_or_end_of_bucket(key, key_size, hash);
+    if (it_find.second) {
+      throw std::runtime_error(
+          "Error on deserialization, the same key is presents multiple "
+          "times.");
+    }
+
+    return it_find.first;
+  }
+
   template <
-      class Deserializer, class U = T,
+      class Deserializer, class Bucket, class U = T,
       typename std::enable_if<!has_mapped_type<U>::value>::type* = nullptr>
   void deserialize_bucket_values(Deserializer& /*deserializer*/,
-                                 array_bucket& /*bucket*/) {}
+                                 Bucket& /*bucket*/) {}
 
-  template <class Deserializer, class U = T,
-            typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
-  void deserialize_bucket_values(Deserializer& deserializer,
-                                 array_bucket& bucket) {
+  template <class Deserializer, class Bucket, class U = T,
+            typename std::enable_if<has_indexed_values<U>::value>::type* =
+                nullptr>
+  void deserialize_bucket_values(Deserializer& deserializer, Bucket& bucket) {
     for (auto it = bucket.begin(); it != bucket.end(); ++it) {
       this->m_values.emplace_back(deserialize_value<U>(deserializer));
 
@@ -1745,20 +3592,21 @@ class array_hash : private value_container<T>,
     }
   }
 
-  template <class U = T, typename std::enable_if<
-                             !has_mapped_type<U>::value>::type* = nullptr>
+  template <class BucketIterator, class U = T,
+            typename std::enable_if<!has_mapped_type<U>::value>::type* =
+                nullptr>
   void append_array_bucket_iterator_in_bucket(
       array_bucket& bucket, typename array_bucket::const_iterator end_of_bucket,
-      typename array_bucket::const_iterator it_val) {
-    bucket.append(end_of_bucket, it_val.key(), it_val.key_size());
+      BucketIterator it_val, std::size_t hash) {
+    bucket.append(end_of_bucket, it_val.key(), it_val.key_size(), hash);
   }
 
-  template <class U = T,
+  template <class BucketIterator, class U = T,
             typename std::enable_if<has_mapped_type<U>::value>::type* = nullptr>
   void append_array_bucket_iterator_in_bucket(
       array_bucket& bucket, typename array_bucket::const_iterator end_of_bucket,
-      typename array_bucket::const_iterator it_val) {
-    bucket.append(end_of_bucket, it_val.key(), it_val.key_size(),
+      BucketIterator it_val, std::size_t hash) {
+    bucket.append(end_of_bucket, it_val.key(), it_val.key_size(), hash,
                   it_val.value());
   }
 
@@ -1770,23 +3618,42 @@ class array_hash : private value_container<T>,
 
  private:
   /**
-   * Protocol version currenlty used for serialization.
+   * Protocol version of the serialized buckets. Version 1 serializes the
+   * buckets without fingerprints, version 2 with fingerprints. Versions 3 and
+   * 4 are the same with variable-length key sizes. They can all be
+   * deserialized whatever StoreHashFingerprint and VarintKeySize are.
+   *
+   * Versions 5 to 8 use the same bucket formats as versions 1 to 4. They were
+   * introduced with the change of the default str_hash, the older versions
+   * are always rehashed as their hashes may come from the previous one.
    */
-  static const slz_size_type SERIALIZATION_PROTOCOL_VERSION = 1;
+  static constexpr slz_size_type protocol_version(
+      bool with_hash_fingerprint, bool with_varint_key_size) noexcept {
+    return 5 + (with_hash_fingerprint ? 1 : 0) +
+           (with_varint_key_size ? 2 : 0);
+  }
+
+  static const slz_size_type SERIALIZATION_PROTOCOL_VERSION =
+      protocol_version(StoreHashFingerprint, VarintKeySize);
+  static const slz_size_type MIN_SERIALIZATION_PROTOCOL_VERSION = 1;
+  static const slz_size_type MAX_SERIALIZATION_PROTOCOL_VERSION = 8;
 
   static constexpr float DEFAULT_CLEAR_OLD_ERASED_VALUE_THRESHOLD = 0.6f;
   static constexpr float REHASH_CLEAR_OLD_ERASED_VALUE_THRESHOLD = 0.9f;
 
   /**
    * Return an always valid pointer to a static empty array_bucket.
+   *
+   * The empty bucket never allocates anything, it just keeps a copy of the
+   * allocator of the first array_hash which needed it.
    */
   array_bucket* static_empty_bucket_ptr() {
-    static array_bucket empty_bucket;
+    static array_bucket empty_bucket{rebind_alloc<CharT>(get_allocator())};
     return &empty_bucket;
   }
 
  private:
-  std::vector<array_bucket> m_buckets_data;
+  buckets_container_type m_buckets_data;
 
   /**
    * Points to m_buckets_data.data() if !m_buckets_data.empty() otherwise points
@@ -1801,6 +3668,12 @@ class array_hash : private value_container<T>,
   IndexSizeT m_nb_elements;
   float m_max_load_factor;
   size_type m_load_threshold;
+
+  /**
+   * True if the entries of each bucket are sorted by key, see sort_buckets.
+   * Reset by any insertion or rehash.
+   */
+  bool m_sorted_buckets;
 };
 
 }  // end namespace detail_array_hash
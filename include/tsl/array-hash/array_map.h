@@ -45,6 +45,38 @@ namespace tsl {
  * Otherwise the null character is not stored (which allow an economy of 1 byte
  * per string).
  *
+ * If `StoreHashFingerprint` is true, one byte of the hash of each string is
+ * stored next to it (extended to the size of `CharT`). On a search, most of
+ * the strings of a bucket which are not equal to the searched one can then be
+ * skipped without comparing them, at the cost of this extra byte per string.
+ *
+ * By default the buffer of a bucket is reallocated to its exact new size on
+ * each insertion. If `AmortizedBucketGrowth` is true, its capacity is stored
+ * and grows geometrically, which reduces the number of reallocations on
+ * insertion at the cost of some unused memory. `shrink_to_fit` releases it.
+ *
+ * If `SlabBucketStorage` is true, the buffers of all the buckets are packed in
+ * one contiguous slab each time the buckets are rebuilt (rehash,
+ * `shrink_to_fit`, copy and deserialization), which avoids one allocation per
+ * bucket and keeps the buckets close to each other in memory. A bucket which
+ * grows afterwards moves to its own buffer until the next rebuild.
+ *
+ * If `VarintKeySize` is true, the size of each string is stored as a
+ * variable-length integer instead of a `KeySizeT`. A string shorter than 127
+ * characters then only needs one `CharT` for its size (with `CharT` = `char`).
+ *
+ * By default the values are stored in a separate array and each string is
+ * followed by the index of its value. If `InlineBucketValues` is true, the
+ * values are stored directly after their string instead, which avoids one
+ * indirection on each access. `T` must then be trivially copyable and its
+ * alignment can't be bigger than the one of `std::size_t`.
+ *
+ * If `IncrementalRehash` is true, a growth of the map doesn't move all the
+ * elements at once. The old buckets are kept next to the new ones and each
+ * following insertion migrates a few of them, which bounds the latency of an
+ * insertion. The lookups check both buckets until the end of the migration.
+ * It has no effect if `SlabBucketStorage` is true.
+ *
  * The value `T` must be either nothrow move-constructible, copy-constructible
  * or both.
  *
@@ -68,7 +100,11 @@ template <class CharT, class T, class Hash = tsl::ah::str_hash<CharT>,
           class KeyEqual = tsl::ah::str_equal<CharT>,
           bool StoreNullTerminator = true, class KeySizeT = std::uint16_t,
           class IndexSizeT = std::uint32_t,
-          class GrowthPolicy = tsl::ah::power_of_two_growth_policy<2>>
+          class GrowthPolicy = tsl::ah::power_of_two_growth_policy<2>,
+          class Allocator = std::allocator<CharT>,
+          bool StoreHashFingerprint = false, bool AmortizedBucketGrowth = false,
+          bool SlabBucketStorage = false, bool VarintKeySize = false,
+          bool InlineBucketValues = false, bool IncrementalRehash = false>
 class array_map {
  private:
   template <typename U>
@@ -76,7 +112,14 @@ class array_map {
 
   using ht = tsl::detail_array_hash::array_hash<CharT, T, Hash, KeyEqual,
                                                 StoreNullTerminator, KeySizeT,
-                                                IndexSizeT, GrowthPolicy>;
+                                                IndexSizeT, GrowthPolicy,
+                                                Allocator,
+                                                StoreHashFingerprint,
+                                                AmortizedBucketGrowth,
+                                                SlabBucketStorage,
+                                                VarintKeySize,
+                                                InlineBucketValues,
+                                                IncrementalRehash>;
 
  public:
   using char_type = typename ht::char_type;
@@ -86,21 +129,30 @@ class array_map {
   using size_type = typename ht::size_type;
   using hasher = typename ht::hasher;
   using key_equal = typename ht::key_equal;
+  using allocator_type = typename ht::allocator_type;
   using iterator = typename ht::iterator;
   using const_iterator = typename ht::const_iterator;
 
  public:
   array_map() : array_map(ht::DEFAULT_INIT_BUCKET_COUNT) {}
 
-  explicit array_map(size_type bucket_count, const Hash& hash = Hash())
-      : m_ht(bucket_count, hash, ht::DEFAULT_MAX_LOAD_FACTOR) {}
+  explicit array_map(size_type bucket_count, const Hash& hash = Hash(),
+                     const Allocator& alloc = Allocator())
+      : m_ht(bucket_count, hash, ht::DEFAULT_MAX_LOAD_FACTOR, alloc) {}
+
+  explicit array_map(const Allocator& alloc)
+      : array_map(ht::DEFAULT_INIT_BUCKET_COUNT, Hash(), alloc) {}
+
+  array_map(const array_map& other, const Allocator& alloc)
+      : m_ht(other.m_ht, alloc) {}
 
   template <class InputIt, typename std::enable_if<
                                is_iterator<InputIt>::value>::type* = nullptr>
   array_map(InputIt first, InputIt last,
             size_type bucket_count = ht::DEFAULT_INIT_BUCKET_COUNT,
-            const Hash& hash = Hash())
-      : array_map(bucket_count, hash) {
+            const Hash& hash = Hash(),
+            const Allocator& alloc = Allocator())
+      : array_map(bucket_count, hash, alloc) {
     insert(first, last);
   }
 
@@ -108,15 +160,17 @@ class array_map {
   array_map(
       std::initializer_list<std::pair<std::basic_string_view<CharT>, T>> init,
       size_type bucket_count = ht::DEFAULT_INIT_BUCKET_COUNT,
-      const Hash& hash = Hash())
-      : array_map(bucket_count, hash) {
+      const Hash& hash = Hash(),
+      const Allocator& alloc = Allocator())
+      : array_map(bucket_count, hash, alloc) {
     insert(init);
   }
 #else
   array_map(std::initializer_list<std::pair<const CharT*, T>> init,
             size_type bucket_count = ht::DEFAULT_INIT_BUCKET_COUNT,
-            const Hash& hash = Hash())
-      : array_map(bucket_count, hash) {
+            const Hash& hash = Hash(),
+            const Allocator& alloc = Allocator())
+      : array_map(bucket_count, hash, alloc) {
     insert(init);
   }
 #endif
@@ -164,6 +218,16 @@ class array_map {
   size_type max_key_size() const noexcept { return m_ht.max_key_size(); }
   void shrink_to_fit() { m_ht.shrink_to_fit(); }
 
+  /**
+   * Sort the keys inside each bucket. The keys sharing a prefix are then
+   * contiguous in a bucket, which allows prefix searches going through the
+   * buckets to skip the rest of a bucket once they passed the prefix (see
+   * sorted_buckets and iterator::skip_bucket). The order is lost on the next
+   * insertion or rehash, erasures keep it.
+   */
+  void sort_buckets() { m_ht.sort_buckets(); }
+  bool sorted_buckets() const noexcept { return m_ht.sorted_buckets(); }
+
   /*
    * Modifiers
    */
@@ -231,6 +295,22 @@ class array_map {
     }
   }
 
+  /**
+   * Insert the elements pointed by the iterators in [first, last), iterators
+   * of other maps of the same type, without the key_offset first characters
+   * of their keys. The map must be empty and the resulting keys unique: the
+   * buckets are sized exactly in one pass over the keys and there is no
+   * duplicate check.
+   *
+   * The values are moved if MoveValues is true, T must then be nothrow move
+   * constructible. They are copied otherwise.
+   */
+  template <bool MoveValues, class ForwardIt>
+  void insert_unique(ForwardIt first, ForwardIt last,
+                     size_type key_offset = 0) {
+    m_ht.template insert_unique<MoveValues>(first, last, key_offset);
+  }
+
 #ifdef TSL_AH_HAS_STRING_VIEW
   void insert(std::initializer_list<std::pair<std::basic_string_view<CharT>, T>>
                   ilist) {
@@ -787,6 +867,25 @@ class array_map {
     return m_ht.equal_range(key, key_size, precalculated_hash);
   }
 
+  /**
+   * Prefetch the bucket where a key with the hash 'precalculated_hash' is
+   * stored. Calling it, then prefetch_bucket_buffer, before a lookup with the
+   * same hash (e.g. find_ks) hides the memory latency of the lookup if other
+   * work, like the lookups of other keys, is done in-between.
+   */
+  void prefetch_bucket(std::size_t precalculated_hash) const {
+    m_ht.prefetch_bucket(precalculated_hash);
+  }
+
+  /**
+   * Prefetch the entries of the bucket where a key with the hash
+   * 'precalculated_hash' is stored. The bucket itself should already be in
+   * cache, see prefetch_bucket.
+   */
+  void prefetch_bucket_buffer(std::size_t precalculated_hash) const {
+    m_ht.prefetch_bucket_buffer(precalculated_hash);
+  }
+
   /*
    * Bucket interface
    */
@@ -809,6 +908,8 @@ class array_map {
   hasher hash_function() const { return m_ht.hash_function(); }
   key_equal key_eq() const { return m_ht.key_eq(); }
 
+  allocator_type get_allocator() const { return m_ht.get_allocator(); }
+
   /*
    * Other
    */
@@ -855,6 +956,10 @@ class array_map {
    * serialized map. Otherwise the behaviour is undefined with `hash_compatible`
    * sets to true.
    *
+   * A map serialized with a different `StoreHashFingerprint` can also be
+   * deserialized, its elements are then reinserted as if `hash_compatible` was
+   * false.
+   *
    * The behaviour is undefined if the type `CharT` and `T` of the `array_map`
    * are not the same as the types used during serialization.
    *
@@ -864,8 +969,9 @@ class array_map {
    */
   template <class Deserializer>
   static array_map deserialize(Deserializer& deserializer,
-                               bool hash_compatible = false) {
-    array_map map(0);
+                               bool hash_compatible = false,
+                               const Allocator& alloc = Allocator()) {
+    array_map map(0, Hash(), alloc);
     map.m_ht.deserialize(deserializer, hash_compatible);
 
     return map;
@@ -0,0 +1,383 @@
+/**
+ * MIT License
+ *
+ * Copyright (c) 2017 Thibaut Goetghebuer-Planchon <tessil@gmx.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef TSL_HTRIE_ARENA_H
+#define TSL_HTRIE_ARENA_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace tsl {
+
+namespace detail_htrie_arena {
+class arena_attachment;
+}
+
+/**
+ * Memory arena to use with a `tsl::htrie_map` or `tsl::htrie_set` through
+ * `tsl::htrie_arena_allocator`.
+ *
+ * Small allocations (up to `MAX_SMALL_SIZE` bytes) are carved out of big chunks
+ * and recycled through per size-class free lists, so the millions of small
+ * nodes and array buckets of a trie don't each go through the system
+ * allocator. Bigger allocations are forwarded to `::operator new` but are still
+ * tracked by the arena.
+ *
+ * `release()` gives back all the memory of the arena at once. A container
+ * using a `tsl::htrie_arena_allocator` will call it on `clear()` and on
+ * destruction instead of deallocating each node if it's the only container
+ * using the arena and if the destructor of the values, of the hash functor
+ * and of the allocator are trivial. Outside of this case, the arena must not
+ * be released while a container still uses it.
+ *
+ * The arena is not thread-safe.
+ */
+class htrie_arena {
+  friend class detail_htrie_arena::arena_attachment;
+
+ public:
+  static const std::size_t ALIGNMENT = alignof(std::max_align_t);
+  static const std::size_t MAX_SMALL_SIZE = 4096;
+  static const std::size_t DEFAULT_CHUNK_SIZE = 64 * 1024;
+
+  explicit htrie_arena(std::size_t chunk_size = DEFAULT_CHUNK_SIZE)
+      : m_chunk_size(
+            round_up(chunk_size < MAX_SMALL_SIZE ? MAX_SMALL_SIZE : chunk_size) +
+            sizeof(block_header)),
+        m_chunks(nullptr),
+        m_large_blocks(nullptr),
+        m_current(nullptr),
+        m_current_end(nullptr),
+        m_reserved_bytes(0),
+        m_nb_attachments(0) {
+    m_free_lists.fill(nullptr);
+  }
+
+  htrie_arena(const htrie_arena& other) = delete;
+  htrie_arena& operator=(const htrie_arena& other) = delete;
+
+  ~htrie_arena() { release(); }
+
+  /**
+   * Return a block of at least `size` bytes aligned on `ALIGNMENT`.
+   */
+  void* allocate(std::size_t size) {
+    if (size > MAX_SMALL_SIZE) {
+      return allocate_large(size);
+    }
+
+    const std::size_t size_class = size_class_of(size);
+    free_block* block = m_free_lists[size_class];
+    if (block != nullptr) {
+      m_free_lists[size_class] = block->next;
+      return block;
+    }
+
+    return allocate_from_chunk(size_of_class(size_class));
+  }
+
+  /**
+   * `size` must be the size given to `allocate`.
+   */
+  void deallocate(void* ptr, std::size_t size) noexcept {
+    if (size > MAX_SMALL_SIZE) {
+      deallocate_large(ptr, size);
+      return;
+    }
+
+    push_free_block(ptr, size_class_of(size));
+  }
+
+  /**
+   * Give back all the memory of the arena, all the blocks it returned become
+   * invalid. The arena can be used again afterwards.
+   */
+  void release() noexcept {
+    release_list(m_chunks);
+    release_list(m_large_blocks);
+
+    m_free_lists.fill(nullptr);
+    m_current = nullptr;
+    m_current_end = nullptr;
+    m_reserved_bytes = 0;
+  }
+
+  /**
+   * Number of bytes currently reserved by the arena from `::operator new`.
+   */
+  std::size_t reserved_bytes() const noexcept { return m_reserved_bytes; }
+
+ private:
+  struct free_block {
+    free_block* next;
+  };
+
+  /**
+   * Header in front of each chunk and each large block. The large blocks are
+   * in a doubly linked list so that they can be deallocated in O(1).
+   */
+  struct alignas(ALIGNMENT) block_header {
+    block_header* previous;
+    block_header* next;
+  };
+
+  static const std::size_t NB_SIZE_CLASSES = MAX_SMALL_SIZE / ALIGNMENT;
+
+  static std::size_t round_up(std::size_t size) noexcept {
+    return (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+  }
+
+  static std::size_t size_class_of(std::size_t size) noexcept {
+    return (size == 0) ? 0 : round_up(size) / ALIGNMENT - 1;
+  }
+
+  static std::size_t size_of_class(std::size_t size_class) noexcept {
+    return (size_class + 1) * ALIGNMENT;
+  }
+
+  void push_free_block(void* ptr, std::size_t size_class) noexcept {
+    free_block* block = ::new (ptr) free_block;
+    block->next = m_free_lists[size_class];
+    m_free_lists[size_class] = block;
+  }
+
+  void* allocate_from_chunk(std::size_t size) {
+    if (std::size_t(m_current_end - m_current) < size) {
+      // Don't waste the end of the current chunk
+      const std::size_t remaining = std::size_t(m_current_end - m_current);
+      if (remaining >= ALIGNMENT) {
+        push_free_block(m_current, size_class_of(remaining));
+      }
+
+      block_header* chunk = allocate_block(m_chunk_size, m_chunks);
+      m_current = reinterpret_cast<unsigned char*>(chunk + 1);
+      m_current_end = reinterpret_cast<unsigned char*>(chunk) + m_chunk_size;
+    }
+
+    void* ptr = m_current;
+    m_current += size;
+
+    return ptr;
+  }
+
+  void* allocate_large(std::size_t size) {
+    return allocate_block(sizeof(block_header) + size, m_large_blocks) + 1;
+  }
+
+  void deallocate_large(void* ptr, std::size_t size) noexcept {
+    block_header* block = static_cast<block_header*>(ptr) - 1;
+    if (block->previous != nullptr) {
+      block->previous->next = block->next;
+    } else {
+      m_large_blocks = block->next;
+    }
+
+    if (block->next != nullptr) {
+      block->next->previous = block->previous;
+    }
+
+    m_reserved_bytes -= sizeof(block_header) + size;
+    ::operator delete(block);
+  }
+
+  block_header* allocate_block(std::size_t size, block_header*& list) {
+    block_header* block = static_cast<block_header*>(::operator new(size));
+    block->previous = nullptr;
+    block->next = list;
+    if (list != nullptr) {
+      list->previous = block;
+    }
+
+    list = block;
+    m_reserved_bytes += size;
+
+    return block;
+  }
+
+  static void release_list(block_header*& list) noexcept {
+    while (list != nullptr) {
+      block_header* next = list->next;
+      ::operator delete(list);
+      list = next;
+    }
+  }
+
+ private:
+  std::size_t m_chunk_size;
+  block_header* m_chunks;
+  block_header* m_large_blocks;
+
+  unsigned char* m_current;
+  unsigned char* m_current_end;
+
+  std::array<free_block*, NB_SIZE_CLASSES> m_free_lists;
+  std::size_t m_reserved_bytes;
+
+  /**
+   * Number of containers currently using the arena.
+   */
+  std::size_t m_nb_attachments;
+};
+
+/**
+ * Allocator allocating its memory from a `tsl::htrie_arena`. All the copies of
+ * the allocator share the same arena which must outlive them.
+ *
+ * The allocator is propagated on copy assignment, move assignment and swap of
+ * the containers.
+ */
+template <class T>
+class htrie_arena_allocator {
+  static_assert(alignof(T) <= htrie_arena::ALIGNMENT,
+                "The alignment of T is too big for the arena.");
+
+ public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  template <class U>
+  struct rebind {
+    using other = htrie_arena_allocator<U>;
+  };
+
+  explicit htrie_arena_allocator(htrie_arena& arena) noexcept
+      : m_arena(&arena) {}
+
+  template <class U>
+  htrie_arena_allocator(const htrie_arena_allocator<U>& other) noexcept
+      : m_arena(&other.arena()) {}
+
+  T* allocate(std::size_t n) {
+    if (n > std::size_t(-1) / sizeof(T)) {
+      throw std::bad_alloc();
+    }
+
+    return static_cast<T*>(m_arena->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* ptr, std::size_t n) noexcept {
+    m_arena->deallocate(ptr, n * sizeof(T));
+  }
+
+  htrie_arena& arena() const noexcept { return *m_arena; }
+
+  template <class U>
+  friend bool operator==(const htrie_arena_allocator& lhs,
+                         const htrie_arena_allocator<U>& rhs) noexcept {
+    return &lhs.arena() == &rhs.arena();
+  }
+
+  template <class U>
+  friend bool operator!=(const htrie_arena_allocator& lhs,
+                         const htrie_arena_allocator<U>& rhs) noexcept {
+    return !(lhs == rhs);
+  }
+
+ private:
+  htrie_arena* m_arena;
+};
+
+namespace detail_htrie_arena {
+
+/**
+ * Keep track of the number of containers using an arena so that a container
+ * knows when it can release the whole arena instead of deallocating each of
+ * its nodes. Allocators other than htrie_arena_allocator don't have any arena.
+ */
+class arena_attachment {
+ public:
+  template <class Allocator>
+  explicit arena_attachment(const Allocator& alloc) noexcept
+      : m_arena(arena_of(alloc)) {
+    attach();
+  }
+
+  arena_attachment(
+      const arena_attachment& other) noexcept
+      : m_arena(other.m_arena) {
+    attach();
+  }
+
+  arena_attachment& operator=(
+      const arena_attachment& other) noexcept {
+    if (&other != this) {
+      detach();
+      m_arena = other.m_arena;
+      attach();
+    }
+
+    return *this;
+  }
+
+  ~arena_attachment() { detach(); }
+
+  /**
+   * Return the arena if the container is the only one using it, nullptr
+   * otherwise.
+   */
+  htrie_arena* exclusive_arena() const noexcept {
+    return (m_arena != nullptr && m_arena->m_nb_attachments == 1) ? m_arena
+                                                                   : nullptr;
+  }
+
+  void swap(arena_attachment& other) noexcept {
+    std::swap(m_arena, other.m_arena);
+  }
+
+ private:
+  template <class Allocator>
+  static htrie_arena* arena_of(const Allocator& /*alloc*/) noexcept {
+    return nullptr;
+  }
+
+  template <class T>
+  static htrie_arena* arena_of(const htrie_arena_allocator<T>& alloc) noexcept {
+    return &alloc.arena();
+  }
+
+  void attach() noexcept {
+    if (m_arena != nullptr) {
+      m_arena->m_nb_attachments++;
+    }
+  }
+
+  void detach() noexcept {
+    if (m_arena != nullptr) {
+      m_arena->m_nb_attachments--;
+    }
+  }
+
+ private:
+  htrie_arena* m_arena;
+};
+
+}  // end namespace detail_htrie_arena
+}  // end namespace tsl
+
+#endif
@@ -26,21 +26,27 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <exception>
 #include <iterator>
 #include <limits>
 #include <memory>
+#include <new>
+#include <numeric>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
 #include "array-hash/array_map.h"
 #include "array-hash/array_set.h"
+#include "htrie_arena.h"
 
 /*
  * __has_include is a bit useless
@@ -57,6 +63,27 @@
 #include <string_view>
 #endif
 
+#ifdef __has_include
+#if __has_include(<memory_resource>) && \
+    (__cplusplus >= 201703L || _MSVC_LANG >= 201703L)
+#define TSL_HT_HAS_PMR
+#endif
+#endif
+
+#ifdef TSL_HT_HAS_PMR
+#include <memory_resource>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TSL_HT_HAS_SSE2
+#include <emmintrin.h>
+#endif
+
 #ifdef TSL_DEBUG
 #define tsl_ht_assert(expr) assert(expr)
 #else
@@ -103,6 +130,131 @@ static T numeric_cast(U value,
   return ret;
 }
 
+/**
+ * Return the number of trailing zero bits in value, value must not be 0.
+ */
+inline unsigned int count_trailing_zeros(unsigned int value) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+  return static_cast<unsigned int>(__builtin_ctz(value));
+#elif defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, value);
+  return static_cast<unsigned int>(index);
+#else
+  unsigned int count = 0;
+  while ((value & 1u) == 0) {
+    value >>= 1;
+    count++;
+  }
+
+  return count;
+#endif
+}
+
+/**
+ * Return the number of trailing zero bits in value, value must not be 0.
+ */
+inline unsigned int count_trailing_zeros(std::uint64_t value) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+  return static_cast<unsigned int>(__builtin_ctzll(value));
+#else
+  const unsigned int low = static_cast<unsigned int>(value & 0xFFFFFFFFu);
+  return (low != 0) ? count_trailing_zeros(low)
+                    : 32 + count_trailing_zeros(
+                               static_cast<unsigned int>(value >> 32));
+#endif
+}
+
+/**
+ * Return the index of the most significant bit set in value, value must not
+ * be 0.
+ */
+inline unsigned int highest_bit_index(std::uint64_t value) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+  return 63 - static_cast<unsigned int>(__builtin_clzll(value));
+#elif defined(_MSC_VER)
+  unsigned long index;
+  const unsigned long high = static_cast<unsigned long>(value >> 32);
+  if (high != 0) {
+    _BitScanReverse(&index, high);
+    return static_cast<unsigned int>(index) + 32;
+  }
+
+  _BitScanReverse(&index, static_cast<unsigned long>(value));
+  return static_cast<unsigned int>(index);
+#else
+  unsigned int index = 0;
+  while ((value >>= 1) != 0) {
+    index++;
+  }
+
+  return index;
+#endif
+}
+
+/**
+ * Return the number of bits set in value.
+ */
+inline unsigned int popcount(std::uint64_t value) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+  return static_cast<unsigned int>(__builtin_popcountll(value));
+#else
+  value = value - ((value >> 1) & 0x5555555555555555u);
+  value = (value & 0x3333333333333333u) + ((value >> 2) & 0x3333333333333333u);
+  value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0Fu;
+  return static_cast<unsigned int>((value * 0x0101010101010101u) >> 56);
+#endif
+}
+
+/**
+ * Allocate an object of type U with a rebound copy of alloc and construct it
+ * with args. The object is constructed with a placement new, the allocator
+ * must not add its own arguments to the constructor.
+ */
+template <class U, class Allocator, class... Args>
+U* allocate_and_construct(const Allocator& alloc, Args&&... args) {
+  using u_allocator_type =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<U>;
+  using u_allocator_traits = std::allocator_traits<u_allocator_type>;
+
+  u_allocator_type u_alloc(alloc);
+  U* object = u_allocator_traits::allocate(u_alloc, 1);
+  try {
+    ::new (static_cast<void*>(object)) U(std::forward<Args>(args)...);
+  } catch (...) {
+    u_allocator_traits::deallocate(u_alloc, object, 1);
+    throw;
+  }
+
+  return object;
+}
+
+/**
+ * Same as allocate_and_construct but return nullptr instead of throwing.
+ */
+template <class U, class Allocator>
+U* allocate_and_construct_nothrow(const Allocator& alloc) noexcept {
+  try {
+    return allocate_and_construct<U>(alloc);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+/**
+ * Destroy and deallocate an object allocated with allocate_and_construct.
+ * The allocator is taken by copy as it may be part of the object.
+ */
+template <class U, class Allocator>
+void destroy_and_deallocate(Allocator alloc, U* object) noexcept {
+  using u_allocator_type =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<U>;
+
+  u_allocator_type u_alloc(alloc);
+  object->~U();
+  std::allocator_traits<u_allocator_type>::deallocate(u_alloc, object, 1);
+}
+
 template <class T>
 struct value_node {
   /*
@@ -118,8 +270,217 @@ struct value_node {
   T m_value;
 };
 
+/**
+ * Small values that are nothrow move constructible are stored directly inside
+ * the trie_node instead of in a separately allocated value_node.
+ */
+template <class T>
+struct is_inline_value
+    : std::integral_constant<bool, sizeof(T) <= sizeof(void*) &&
+                                       alignof(T) <= alignof(void*) &&
+                                       std::is_nothrow_move_constructible<
+                                           T>::value> {};
+
+/**
+ * Storage for the value of a trie_node. The storage doesn't know if it holds
+ * a value, the trie_node keeps track of it and must call destroy() before
+ * the destruction of the storage if a value was constructed. The value_node,
+ * if any, is allocated with the allocator of the trie_node.
+ */
+template <class T, class Enable = void>
+class value_storage {
+ public:
+  value_storage() noexcept : m_value_node(nullptr) {}
+
+  template <class Allocator, class... Args>
+  void construct(const Allocator& alloc, Args&&... args) {
+    m_value_node = allocate_and_construct<value_node<T>>(
+        alloc, std::forward<Args>(args)...);
+  }
+
+  template <class Allocator>
+  void construct_copy(const Allocator& alloc, const value_storage& other) {
+    construct(alloc, other.get());
+  }
+
+  template <class Allocator>
+  void destroy(const Allocator& alloc) noexcept {
+    destroy_and_deallocate(alloc, m_value_node);
+    m_value_node = nullptr;
+  }
+
+  T& get() noexcept { return m_value_node->m_value; }
+
+  const T& get() const noexcept { return m_value_node->m_value; }
+
+ private:
+  value_node<T>* m_value_node;
+};
+
+template <class T>
+class value_storage<
+    T, typename std::enable_if<is_inline_value<T>::value>::type> {
+ public:
+  template <class Allocator, class... Args>
+  void construct(const Allocator& /*alloc*/, Args&&... args) {
+    ::new (static_cast<void*>(std::addressof(m_value)))
+        T(std::forward<Args>(args)...);
+  }
+
+  template <class Allocator>
+  void construct_copy(const Allocator& alloc, const value_storage& other) {
+    construct(alloc, other.get());
+  }
+
+  template <class Allocator>
+  void destroy(const Allocator& /*alloc*/) noexcept {
+    get().~T();
+  }
+
+  T& get() noexcept { return *reinterpret_cast<T*>(std::addressof(m_value)); }
+
+  const T& get() const noexcept {
+    return *reinterpret_cast<const T*>(std::addressof(m_value));
+  }
+
+ private:
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type m_value;
+};
+
+/**
+ * Sets only need the presence flag kept by the trie_node.
+ */
 template <>
-struct value_node<void> {};
+class value_storage<void> {
+ public:
+  template <class Allocator>
+  void construct(const Allocator& /*alloc*/) noexcept {}
+
+  template <class Allocator>
+  void construct_copy(const Allocator& /*alloc*/,
+                      const value_storage& /*other*/) noexcept {}
+
+  template <class Allocator>
+  void destroy(const Allocator& /*alloc*/) noexcept {}
+};
+
+/**
+ * Check if Hash is an incremental hash function with the init, update and
+ * finalize methods of tsl::ah::str_prefix_hash.
+ */
+template <class Hash, class CharT, class = void>
+struct is_incremental_hash : std::false_type {};
+
+template <class Hash, class CharT>
+struct is_incremental_hash<
+    Hash, CharT,
+    typename std::enable_if<
+        std::is_convertible<decltype(std::declval<const Hash&>().finalize(
+                                std::declval<const Hash&>().init(),
+                                std::size_t())),
+                            std::size_t>::value &&
+        std::is_same<decltype(std::declval<const Hash&>().update(
+                         std::declval<typename Hash::state_type&>(),
+                         std::declval<CharT>())),
+                     void>::value>::type> : std::true_type {};
+
+/**
+ * Hashes of the prefixes [key, key + size) of a key, for size in
+ * [0, key_size]. With an incremental hash function they are all computed in
+ * one pass on construction, otherwise each hash is computed on demand.
+ */
+template <class CharT, class Hash,
+          bool IsIncremental = is_incremental_hash<Hash, CharT>::value>
+class prefix_hashes {
+ public:
+  prefix_hashes(const Hash& hash, const CharT* key, std::size_t /*key_size*/)
+      : m_hash(hash), m_key(key) {}
+
+  std::size_t operator[](std::size_t size) const { return m_hash(m_key, size); }
+
+ private:
+  const Hash& m_hash;
+  const CharT* m_key;
+};
+
+template <class CharT, class Hash>
+class prefix_hashes<CharT, Hash, true> {
+ public:
+  prefix_hashes(const Hash& hash, const CharT* key, std::size_t key_size)
+      : m_hashes(m_small_hashes) {
+    if (key_size >= SMALL_HASHES_SIZE) {
+      m_large_hashes.resize(key_size + 1);
+      m_hashes = m_large_hashes.data();
+    }
+
+    typename Hash::state_type state = hash.init();
+    m_hashes[0] = hash.finalize(state, 0);
+    for (std::size_t i = 0; i < key_size; i++) {
+      hash.update(state, key[i]);
+      m_hashes[i + 1] = hash.finalize(state, i + 1);
+    }
+  }
+
+  prefix_hashes(const prefix_hashes&) = delete;
+  prefix_hashes& operator=(const prefix_hashes&) = delete;
+
+  std::size_t operator[](std::size_t size) const { return m_hashes[size]; }
+
+ private:
+  static const std::size_t SMALL_HASHES_SIZE = 256;
+
+  std::size_t* m_hashes;
+  std::size_t m_small_hashes[SMALL_HASHES_SIZE];
+  std::vector<std::size_t> m_large_hashes;
+};
+
+/**
+ * Call task(i) for each i in [0, nb_tasks) on nb_threads threads (the
+ * calling thread included), each thread taking the next task not yet taken.
+ * If a task throws, the other tasks still run and the first exception is
+ * rethrown once all the threads are joined.
+ */
+template <class Task>
+void run_parallel(std::size_t nb_tasks, std::size_t nb_threads, Task task) {
+  nb_threads = std::max(std::min(nb_threads, nb_tasks), std::size_t(1));
+
+  std::atomic<std::size_t> next_task(0);
+  std::vector<std::exception_ptr> exceptions(nb_threads);
+  const auto worker = [&](std::size_t ithread) {
+    try {
+      std::size_t itask;
+      while ((itask = next_task.fetch_add(1)) < nb_tasks) {
+        task(itask);
+      }
+    } catch (...) {
+      exceptions[ithread] = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(nb_threads - 1);
+  try {
+    for (std::size_t ithread = 1; ithread < nb_threads; ithread++) {
+      threads.emplace_back(worker, ithread);
+    }
+  } catch (...) {
+    // The tasks are taken by the threads already started.
+    exceptions[0] = std::current_exception();
+  }
+
+  if (exceptions[0] == nullptr) {
+    worker(0);
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  for (const std::exception_ptr& exception : exceptions) {
+    if (exception != nullptr) {
+      std::rethrow_exception(exception);
+    }
+  }
+}
 
 template <class CharT, bool HasPrefix>
 struct prefix_filter {};
@@ -136,14 +497,32 @@ struct prefix_filter<CharT, true> {
 /**
  * T should be void if there is no value associated to a key (in a set for
  * example).
+ *
+ * All the nodes, their children arrays, their values and the array hashes are
+ * allocated with a rebound copy of Allocator. Each node keeps a copy of the
+ * allocator which allocated it (without any space overhead for stateless
+ * allocators).
+ *
+ * StoreHashFingerprint, AmortizedBucketGrowth, SlabBucketStorage,
+ * VarintKeySize, InlineBucketValues (only for maps) and IncrementalRehash are
+ * passed to the array hashes of the hash nodes.
  */
-template <class CharT, class T, class Hash, class KeySizeT>
+template <class CharT, class T, class Hash, class KeySizeT,
+          class Allocator = std::allocator<CharT>,
+          bool StoreHashFingerprint = false, bool AmortizedBucketGrowth = false,
+          bool SlabBucketStorage = false, bool VarintKeySize = false,
+          bool InlineBucketValues = false, bool IncrementalRehash = false>
 class htrie_hash {
  private:
   template <typename U>
   using has_value =
       typename std::integral_constant<bool, !std::is_same<U, void>::value>;
 
+  using allocator_traits = std::allocator_traits<Allocator>;
+
+  static_assert(std::is_same<typename Allocator::value_type, CharT>::value,
+                "Allocator::value_type should be CharT.");
+
   static_assert(std::is_same<CharT, char>::value,
                 "char is the only supported CharT type for now.");
 
@@ -158,6 +537,7 @@ class htrie_hash {
   using key_size_type = KeySizeT;
   using size_type = std::size_t;
   using hasher = Hash;
+  using allocator_type = Allocator;
   using iterator = htrie_hash_iterator<false, false>;
   using const_iterator = htrie_hash_iterator<true, false>;
   using prefix_iterator = htrie_hash_iterator<false, true>;
@@ -169,10 +549,16 @@ class htrie_hash {
       has_value<T>::value,
       tsl::array_map<CharT, T, Hash, tsl::ah::str_equal<CharT>, false, KeySizeT,
                      ArrayHashIndexSizeT,
-                     tsl::ah::power_of_two_growth_policy<4>>,
+                     tsl::ah::power_of_two_growth_policy<4>, Allocator,
+                     StoreHashFingerprint, AmortizedBucketGrowth,
+                     SlabBucketStorage, VarintKeySize, InlineBucketValues,
+                     IncrementalRehash>,
       tsl::array_set<CharT, Hash, tsl::ah::str_equal<CharT>, false, KeySizeT,
                      ArrayHashIndexSizeT,
-                     tsl::ah::power_of_two_growth_policy<4>>>::type;
+                     tsl::ah::power_of_two_growth_policy<4>, Allocator,
+                     StoreHashFingerprint, AmortizedBucketGrowth,
+                     SlabBucketStorage, VarintKeySize,
+                     IncrementalRehash>>::type;
 
  private:
   /*
@@ -195,10 +581,20 @@ class htrie_hash {
    *
    * A trie node should at least have one child or a value node. There can't be
    * a trie node without any child and no value node.
+   *
+   * In hybrid mode (see "HAT-trie: A Cache-conscious Trie-based Data Structure
+   * for Strings", Askitis Nikolas and Sinha Ranjan, 2007), a hash_node may be
+   * shared by a range of characters [range_first, range_last] of its parent
+   * trie_node. Such a hybrid hash_node keeps the first character in its keys
+   * and the parent has a child slot pointing to it for each character of the
+   * range used by at least one key (there may be extra slots for characters
+   * without any key, but never slots outside of the range). The ranges of the
+   * children of a trie_node never overlap. When it becomes too big, a hybrid
+   * hash_node is split in two on a range boundary instead of being burst into
+   * a new trie_node. A hash_node with a one-character range is a pure
+   * hash_node.
    */
 
-  using value_node = tsl::detail_htrie_hash::value_node<T>;
-
   class trie_node;
   class hash_node;
 
@@ -207,13 +603,6 @@ class htrie_hash {
     friend class trie_node;
 
    public:
-    /*
-     * TODO Avoid the virtual to economize 8 bytes. We could use a custom
-     * deleter in the std::unique_ptr<anode> we use (as we know if an anode is a
-     * trie_node or hash_node).
-     */
-    virtual ~anode() = default;
-
     bool is_trie_node() const noexcept {
       return m_node_type == node_type::TRIE_NODE;
     }
@@ -268,6 +657,12 @@ class htrie_hash {
           m_child_of_char(child_of_char),
           m_parent_node(nullptr) {}
 
+    /**
+     * The nodes are deleted through tagged_node_ptr which knows their real
+     * type, no need for a virtual destructor.
+     */
+    ~anode() = default;
+
    protected:
     node_type m_node_type;
 
@@ -291,1470 +686,4096 @@ class htrie_hash {
     trie_node* m_parent_node;
   };
 
-  // Give the position in trie_node::m_children corresponding to the character c
-  static std::size_t as_position(CharT c) noexcept {
-    return static_cast<std::size_t>(
-        static_cast<typename std::make_unsigned<CharT>::type>(c));
-  }
-
-  class trie_node : public anode {
+  /**
+   * Non-owning pointer to a trie_node or a hash_node. The type of the node is
+   * stored in the lowest bit of the pointer (the nodes are aligned on at least
+   * 2 bytes) so that it can be known without dereferencing the pointer, saving
+   * a dependent load on each level when descending the tree.
+   */
+  class tagged_node_ptr {
    public:
-    trie_node()
-        : anode(anode::node_type::TRIE_NODE),
-          m_value_node(nullptr),
-          m_children() {}
+    tagged_node_ptr() noexcept : m_ptr(0) {}
 
-    trie_node(const trie_node& other)
-        : anode(anode::node_type::TRIE_NODE, other.m_child_of_char),
-          m_value_node(nullptr),
-          m_children() {
-      if (other.m_value_node != nullptr) {
-        m_value_node = make_unique<value_node>(*other.m_value_node);
-      }
+    tagged_node_ptr(std::nullptr_t) noexcept : m_ptr(0) {}
 
-      // TODO avoid recursion
-      for (std::size_t ichild = 0; ichild < other.m_children.size(); ichild++) {
-        if (other.m_children[ichild] != nullptr) {
-          if (other.m_children[ichild]->is_hash_node()) {
-            m_children[ichild] = make_unique<hash_node>(
-                other.m_children[ichild]->as_hash_node());
-          } else {
-            m_children[ichild] = make_unique<trie_node>(
-                other.m_children[ichild]->as_trie_node());
-          }
+    explicit tagged_node_ptr(trie_node* tnode) noexcept
+        : m_ptr(reinterpret_cast<std::uintptr_t>(tnode) | TRIE_NODE_TAG) {
+      tsl_ht_assert(tnode != nullptr);
+    }
 
-          m_children[ichild]->m_parent_node = this;
-        }
-      }
+    explicit tagged_node_ptr(hash_node* hnode) noexcept
+        : m_ptr(reinterpret_cast<std::uintptr_t>(hnode)) {
+      tsl_ht_assert(hnode != nullptr);
     }
 
-    trie_node(trie_node&& other) = delete;
-    trie_node& operator=(const trie_node& other) = delete;
-    trie_node& operator=(trie_node&& other) = delete;
+    bool is_trie_node() const noexcept {
+      return (m_ptr & TRIE_NODE_TAG) != 0;
+    }
 
-    /**
-     * Return nullptr if none.
-     */
-    anode* first_child() noexcept {
-      return const_cast<anode*>(
-          static_cast<const trie_node*>(this)->first_child());
+    bool is_hash_node() const noexcept {
+      return m_ptr != 0 && (m_ptr & TRIE_NODE_TAG) == 0;
     }
 
-    const anode* first_child() const noexcept {
-      for (std::size_t ichild = 0; ichild < m_children.size(); ichild++) {
-        if (m_children[ichild] != nullptr) {
-          return m_children[ichild].get();
-        }
-      }
+    trie_node& as_trie_node() const noexcept {
+      tsl_ht_assert(is_trie_node());
+      return *reinterpret_cast<trie_node*>(m_ptr & ~TRIE_NODE_TAG);
+    }
 
-      return nullptr;
+    hash_node& as_hash_node() const noexcept {
+      tsl_ht_assert(is_hash_node());
+      return *reinterpret_cast<hash_node*>(m_ptr);
     }
 
     /**
-     * Get the next_child that come after current_child. Return nullptr if no
-     * next child.
+     * Return nullptr if none.
      */
-    anode* next_child(const anode& current_child) noexcept {
-      return const_cast<anode*>(
-          static_cast<const trie_node*>(this)->next_child(current_child));
+    anode* get() const noexcept {
+      if (is_trie_node()) {
+        return &as_trie_node();
+      } else if (is_hash_node()) {
+        return &as_hash_node();
+      } else {
+        return nullptr;
+      }
     }
 
-    const anode* next_child(const anode& current_child) const noexcept {
-      tsl_ht_assert(current_child.parent() == this);
-
-      for (std::size_t ichild = as_position(current_child.child_of_char()) + 1;
-           ichild < m_children.size(); ichild++) {
-        if (m_children[ichild] != nullptr) {
-          return m_children[ichild].get();
-        }
-      }
+    anode& operator*() const noexcept { return *get(); }
 
-      return nullptr;
-    }
+    anode* operator->() const noexcept { return get(); }
 
     /**
-     * Return the first left-descendant trie node with an m_value_node. If none
-     * return the most left trie node.
+     * Delete the pointed node, if any, with the destructor of its real type
+     * and the allocator stored in the node.
      */
-    trie_node& most_left_descendant_value_trie_node() noexcept {
-      return const_cast<trie_node&>(
-          static_cast<const trie_node*>(this)
-              ->most_left_descendant_value_trie_node());
-    }
+    void destroy() noexcept {
+      static_assert(alignof(trie_node) > TRIE_NODE_TAG &&
+                        alignof(hash_node) > TRIE_NODE_TAG,
+                    "The lowest bit of the nodes addresses must be free.");
+
+      if (is_trie_node()) {
+        trie_node& tnode = as_trie_node();
+        destroy_and_deallocate(tnode.get_allocator(), &tnode);
+      } else if (is_hash_node()) {
+        hash_node& hnode = as_hash_node();
+        destroy_and_deallocate(hnode.get_allocator(), &hnode);
+      }
 
-    const trie_node& most_left_descendant_value_trie_node() const noexcept {
-      const trie_node* current_node = this;
-      while (true) {
-        if (current_node->m_value_node != nullptr) {
-          return *current_node;
-        }
+      m_ptr = 0;
+    }
 
-        const anode* first_child = current_node->first_child();
-        tsl_ht_assert(first_child !=
-                      nullptr);  // a trie_node must either have a value_node or
-                                 // at least one child.
-        if (first_child->is_hash_node()) {
-          return *current_node;
-        }
+    friend bool operator==(tagged_node_ptr lhs, std::nullptr_t) noexcept {
+      return lhs.m_ptr == 0;
+    }
 
-        current_node = &first_child->as_trie_node();
-      }
+    friend bool operator!=(tagged_node_ptr lhs, std::nullptr_t) noexcept {
+      return lhs.m_ptr != 0;
     }
 
-    size_type nb_children() const noexcept {
-      return std::count_if(
-          m_children.cbegin(), m_children.cend(),
-          [](const std::unique_ptr<anode>& n) { return n != nullptr; });
+    friend bool operator==(tagged_node_ptr lhs, const anode* rhs) noexcept {
+      return lhs.get() == rhs;
     }
 
-    bool empty() const noexcept {
-      return std::all_of(m_children.cbegin(), m_children.cend(),
-                         [](const std::unique_ptr<anode>& n) {
-                           return n == nullptr;
-                         }) &&
-             m_value_node == nullptr;
+    friend bool operator!=(tagged_node_ptr lhs, const anode* rhs) noexcept {
+      return lhs.get() != rhs;
     }
 
-    std::unique_ptr<anode>& child(CharT for_char) noexcept {
-      return m_children[as_position(for_char)];
+    friend bool operator==(tagged_node_ptr lhs, tagged_node_ptr rhs) noexcept {
+      return lhs.m_ptr == rhs.m_ptr;
     }
 
-    const std::unique_ptr<anode>& child(CharT for_char) const noexcept {
-      return m_children[as_position(for_char)];
+    friend bool operator!=(tagged_node_ptr lhs, tagged_node_ptr rhs) noexcept {
+      return lhs.m_ptr != rhs.m_ptr;
     }
 
-    typename std::array<std::unique_ptr<anode>, ALPHABET_SIZE>::iterator
-    begin() noexcept {
-      return m_children.begin();
+   private:
+    static const std::uintptr_t TRIE_NODE_TAG = 1;
+
+    std::uintptr_t m_ptr;
+  };
+
+  struct node_deleter {
+    void operator()(trie_node* tnode) const noexcept {
+      tagged_node_ptr(tnode).destroy();
     }
 
-    typename std::array<std::unique_ptr<anode>, ALPHABET_SIZE>::iterator
-    end() noexcept {
-      return m_children.end();
+    void operator()(hash_node* hnode) const noexcept {
+      tagged_node_ptr(hnode).destroy();
     }
+  };
+
+  using trie_node_ptr = std::unique_ptr<trie_node, node_deleter>;
+  using hash_node_ptr = std::unique_ptr<hash_node, node_deleter>;
+
+  /**
+   * Owning tagged_node_ptr. Use the tag to call the destructor of the right
+   * node type so that anode doesn't need a virtual destructor.
+   */
+  class unique_node_ptr {
+   public:
+    unique_node_ptr() noexcept : m_node() {}
+
+    unique_node_ptr(std::nullptr_t) noexcept : m_node() {}
 
-    void set_child(CharT for_char, std::unique_ptr<anode> child) noexcept {
-      if (child != nullptr) {
-        child->m_child_of_char = for_char;
-        child->m_parent_node = this;
+    explicit unique_node_ptr(tagged_node_ptr node) noexcept : m_node(node) {}
+
+    unique_node_ptr(trie_node_ptr tnode) noexcept : m_node() {
+      if (tnode != nullptr) {
+        m_node = tagged_node_ptr(tnode.release());
       }
+    }
 
-      m_children[as_position(for_char)] = std::move(child);
+    unique_node_ptr(hash_node_ptr hnode) noexcept : m_node() {
+      if (hnode != nullptr) {
+        m_node = tagged_node_ptr(hnode.release());
+      }
     }
 
-    std::unique_ptr<value_node>& val_node() noexcept { return m_value_node; }
+    unique_node_ptr(const unique_node_ptr& other) = delete;
+
+    unique_node_ptr(unique_node_ptr&& other) noexcept
+        : m_node(other.release()) {}
 
-    const std::unique_ptr<value_node>& val_node() const noexcept {
-      return m_value_node;
+    unique_node_ptr& operator=(const unique_node_ptr& other) = delete;
+
+    unique_node_ptr& operator=(unique_node_ptr&& other) noexcept {
+      reset(other.release());
+      return *this;
     }
 
-   private:
-    // TODO Avoid storing a value_node when has_value<T>::value is false
-    std::unique_ptr<value_node> m_value_node;
+    ~unique_node_ptr() { reset(); }
 
-    /**
-     * Each character CharT corresponds to one position in the array. To convert
-     * a character to a position use the as_position method.
-     *
-     * TODO Try to reduce the size of m_children with a hash map, linear/binary
-     * search on array, ...
-     * TODO Store number of non-null values in m_children. Check if we can store
-     * this value in the alignment space as we don't want the node to get bigger
-     * (empty() and nb_children() are rarely used so it is not an important
-     * variable).
-     */
-    std::array<std::unique_ptr<anode>, ALPHABET_SIZE> m_children;
-  };
+    tagged_node_ptr get() const noexcept { return m_node; }
 
-  class hash_node : public anode {
-   public:
-    hash_node(const Hash& hash, float max_load_factor)
-        : hash_node(HASH_NODE_DEFAULT_INIT_BUCKETS_COUNT, hash,
-                    max_load_factor) {}
+    tagged_node_ptr release() noexcept {
+      const tagged_node_ptr node = m_node;
+      m_node = nullptr;
 
-    hash_node(size_type bucket_count, const Hash& hash, float max_load_factor)
-        : anode(anode::node_type::HASH_NODE), m_array_hash(bucket_count, hash) {
-      m_array_hash.max_load_factor(max_load_factor);
+      return node;
     }
 
-    hash_node(array_hash_type&& array_hash) noexcept(
-        std::is_nothrow_move_constructible<array_hash_type>::value)
-        : anode(anode::node_type::HASH_NODE),
-          m_array_hash(std::move(array_hash)) {}
+    void reset(tagged_node_ptr node = nullptr) noexcept {
+      tagged_node_ptr old_node = m_node;
+      m_node = node;
+      old_node.destroy();
+    }
 
-    hash_node(const hash_node& other) = default;
+    bool is_trie_node() const noexcept { return m_node.is_trie_node(); }
 
-    hash_node(hash_node&& other) = delete;
-    hash_node& operator=(const hash_node& other) = delete;
-    hash_node& operator=(hash_node&& other) = delete;
+    bool is_hash_node() const noexcept { return m_node.is_hash_node(); }
 
-    array_hash_type& array_hash() noexcept { return m_array_hash; }
+    trie_node& as_trie_node() const noexcept { return m_node.as_trie_node(); }
 
-    const array_hash_type& array_hash() const noexcept { return m_array_hash; }
+    hash_node& as_hash_node() const noexcept { return m_node.as_hash_node(); }
 
-   private:
-    array_hash_type m_array_hash;
-  };
+    anode& operator*() const noexcept { return *m_node; }
 
- public:
-  template <bool IsConst, bool IsPrefixIterator>
-  class htrie_hash_iterator : private prefix_filter<CharT, IsPrefixIterator> {
-    friend class htrie_hash;
+    anode* operator->() const noexcept { return m_node.get(); }
 
-   private:
-    using anode_type =
-        typename std::conditional<IsConst, const anode, anode>::type;
-    using trie_node_type =
-        typename std::conditional<IsConst, const trie_node, trie_node>::type;
-    using hash_node_type =
-        typename std::conditional<IsConst, const hash_node, hash_node>::type;
+    friend bool operator==(const unique_node_ptr& lhs,
+                           std::nullptr_t) noexcept {
+      return lhs.m_node == nullptr;
+    }
 
-    using array_hash_iterator_type =
-        typename std::conditional<IsConst,
-                                  typename array_hash_type::const_iterator,
-                                  typename array_hash_type::iterator>::type;
+    friend bool operator!=(const unique_node_ptr& lhs,
+                           std::nullptr_t) noexcept {
+      return lhs.m_node != nullptr;
+    }
 
-   public:
-    using iterator_category = std::forward_iterator_tag;
-    using value_type =
-        typename std::conditional<has_value<T>::value, T, void>::type;
-    using difference_type = std::ptrdiff_t;
-    using reference = typename std::conditional<
-        has_value<T>::value,
-        typename std::conditional<
-            IsConst, typename std::add_lvalue_reference<const T>::type,
-            typename std::add_lvalue_reference<T>::type>::type,
-        void>::type;
-    using pointer = typename std::conditional<
-        has_value<T>::value,
-        typename std::conditional<IsConst, const T*, T*>::type, void>::type;
+    friend void swap(unique_node_ptr& lhs, unique_node_ptr& rhs) noexcept {
+      std::swap(lhs.m_node, rhs.m_node);
+    }
 
    private:
-    /**
-     * Start reading from start_hash_node->array_hash().begin().
-     */
-    htrie_hash_iterator(hash_node_type& start_hash_node) noexcept
-        : htrie_hash_iterator(start_hash_node,
-                              start_hash_node.array_hash().begin()) {}
+    tagged_node_ptr m_node;
+  };
 
-    /**
-     * Start reading from iterator begin in start_hash_node->array_hash().
-     */
-    htrie_hash_iterator(hash_node_type& start_hash_node,
-                        array_hash_iterator_type begin) noexcept
-        : m_current_trie_node(start_hash_node.parent()),
-          m_current_hash_node(&start_hash_node),
-          m_array_hash_iterator(begin),
-          m_array_hash_end_iterator(start_hash_node.array_hash().end()),
-          m_read_trie_node_value(false) {
-      tsl_ht_assert(!m_current_hash_node->array_hash().empty());
-    }
+  // Give the position in trie_node children corresponding to the character c
+  static std::size_t as_position(CharT c) noexcept {
+    return static_cast<std::size_t>(
+        static_cast<typename std::make_unsigned<CharT>::type>(c));
+  }
 
-    /**
-     * Start reading from the value in start_trie_node.
-     * start_trie_node->val_node() should be non-null.
-     */
-    htrie_hash_iterator(trie_node_type& start_trie_node) noexcept
-        : m_current_trie_node(&start_trie_node),
-          m_current_hash_node(nullptr),
-          m_read_trie_node_value(true) {
-      tsl_ht_assert(m_current_trie_node->val_node() != nullptr);
+  // Inverse of as_position
+  static CharT as_char(std::size_t pos) noexcept {
+    tsl_ht_assert(pos < ALPHABET_SIZE);
+    return static_cast<CharT>(
+        static_cast<typename std::make_unsigned<CharT>::type>(pos));
+  }
+
+  /**
+   * Return 0 if the key starts with prefix, a negative value if the key comes
+   * before all the keys starting with prefix in the order of a sorted array
+   * hash bucket (see array_map::sort_buckets), a positive value if it comes
+   * after them.
+   */
+  static int compare_to_prefix(const CharT* key, size_type key_size,
+                               const CharT* prefix,
+                               size_type prefix_size) noexcept {
+    const int cmp = std::char_traits<CharT>::compare(
+        key, prefix, std::min(key_size, prefix_size));
+    if (cmp != 0) {
+      return cmp;
     }
 
-    template <bool TIsPrefixIterator = IsPrefixIterator,
-              typename std::enable_if<!TIsPrefixIterator>::type* = nullptr>
-    htrie_hash_iterator(trie_node_type* tnode, hash_node_type* hnode,
-                        array_hash_iterator_type begin,
-                        array_hash_iterator_type end,
-                        bool read_trie_node_value) noexcept
-        : m_current_trie_node(tnode),
-          m_current_hash_node(hnode),
-          m_array_hash_iterator(begin),
-          m_array_hash_end_iterator(end),
-          m_read_trie_node_value(read_trie_node_value) {}
+    return (key_size < prefix_size) ? -1 : 0;
+  }
 
-    template <bool TIsPrefixIterator = IsPrefixIterator,
-              typename std::enable_if<TIsPrefixIterator>::type* = nullptr>
-    htrie_hash_iterator(trie_node_type* tnode, hash_node_type* hnode,
-                        array_hash_iterator_type begin,
-                        array_hash_iterator_type end, bool read_trie_node_value,
-                        std::basic_string<CharT> prefix_filter_) noexcept
-        : prefix_filter<CharT, TIsPrefixIterator>(std::move(prefix_filter_)),
-          m_current_trie_node(tnode),
-          m_current_hash_node(hnode),
-          m_array_hash_iterator(begin),
-          m_array_hash_end_iterator(end),
-          m_read_trie_node_value(read_trie_node_value) {}
+  /**
+   * A trie_node stores its children in one of four representations depending
+   * on how many children it has (see "The Adaptive Radix Tree: ARTful Indexing
+   * for Main-Memory Databases", Leis Viktor, Kemper Alfons and Neumann Thomas,
+   * 2013):
+   *
+   * - NODE_4: up to 4 children. The characters and the children are stored in
+   *   two sorted arrays directly inside the trie_node.
+   * - NODE_16: up to 16 children. Same as NODE_4 but the arrays are stored in a
+   *   separately allocated node16_children. The search of a character can be
+   *   done with one SIMD comparison.
+   * - NODE_48: up to 48 children. A 256-entries array maps each character to a
+   *   position + 1 in an array of 48 children (0 if no child).
+   * - NODE_256: a direct 256-entries array of children.
+   *
+   * NODE_48 and NODE_256 also keep a bitmap of the positions having a child so
+   * that the ordered traversal of the children (first_child, next_child, ...)
+   * doesn't have to scan the 256 entries.
+   *
+   * The node grows to the next representation when it's full and shrinks to
+   * the previous one when it becomes sparse enough (with some hysteresis to
+   * avoid oscillations on alternating inserts and erases).
+   */
+  enum class children_kind : unsigned char { NODE_4, NODE_16, NODE_48, NODE_256 };
 
-   public:
-    htrie_hash_iterator() noexcept {}
+  struct node16_children {
+    unsigned char keys[16];
+    tagged_node_ptr children[16];
+  };
 
-    // Copy constructor from iterator to const_iterator.
-    template <bool TIsConst = IsConst,
-              bool TIsPrefixIterator = IsPrefixIterator,
-              typename std::enable_if<TIsConst && !TIsPrefixIterator>::type* =
-                  nullptr>
-    htrie_hash_iterator(
-        const htrie_hash_iterator<!TIsConst, TIsPrefixIterator>& other) noexcept
-        : m_current_trie_node(other.m_current_trie_node),
-          m_current_hash_node(other.m_current_hash_node),
-          m_array_hash_iterator(other.m_array_hash_iterator),
-          m_array_hash_end_iterator(other.m_array_hash_end_iterator),
-          m_read_trie_node_value(other.m_read_trie_node_value) {}
+  /**
+   * Bitmap of the positions having a child. Zero-initialized when
+   * value-initialized.
+   */
+  struct children_bitmap {
+    static const std::size_t NB_WORDS = ALPHABET_SIZE / 64;
+    static_assert(ALPHABET_SIZE % 64 == 0,
+                  "ALPHABET_SIZE should be a multiple of 64.");
 
-    // Copy constructor from iterator to const_iterator.
-    template <
-        bool TIsConst = IsConst, bool TIsPrefixIterator = IsPrefixIterator,
-        typename std::enable_if<TIsConst && TIsPrefixIterator>::type* = nullptr>
-    htrie_hash_iterator(
-        const htrie_hash_iterator<!TIsConst, TIsPrefixIterator>& other) noexcept
-        : prefix_filter<CharT, TIsPrefixIterator>(other.m_prefix_filter),
-          m_current_trie_node(other.m_current_trie_node),
-          m_current_hash_node(other.m_current_hash_node),
-          m_array_hash_iterator(other.m_array_hash_iterator),
-          m_array_hash_end_iterator(other.m_array_hash_end_iterator),
-          m_read_trie_node_value(other.m_read_trie_node_value) {}
+    bool test(std::size_t pos) const noexcept {
+      return (words[pos / 64] & (std::uint64_t(1) << (pos % 64))) != 0;
+    }
 
-    htrie_hash_iterator(const htrie_hash_iterator& other) = default;
-    htrie_hash_iterator(htrie_hash_iterator&& other) = default;
-    htrie_hash_iterator& operator=(const htrie_hash_iterator& other) = default;
-    htrie_hash_iterator& operator=(htrie_hash_iterator&& other) = default;
+    void set(std::size_t pos) noexcept {
+      words[pos / 64] |= std::uint64_t(1) << (pos % 64);
+    }
 
-    void key(std::basic_string<CharT>& key_buffer_out) const {
-      key_buffer_out.clear();
+    void reset(std::size_t pos) noexcept {
+      words[pos / 64] &= ~(std::uint64_t(1) << (pos % 64));
+    }
 
-      trie_node_type* tnode = m_current_trie_node;
-      while (tnode != nullptr && tnode->parent() != nullptr) {
-        key_buffer_out.push_back(tnode->child_of_char());
-        tnode = tnode->parent();
+    std::size_t count() const noexcept {
+      std::size_t nb_bits = 0;
+      for (std::size_t iword = 0; iword < NB_WORDS; iword++) {
+        nb_bits += popcount(words[iword]);
       }
 
-      std::reverse(key_buffer_out.begin(), key_buffer_out.end());
+      return nb_bits;
+    }
 
-      if (!m_read_trie_node_value) {
-        tsl_ht_assert(m_current_hash_node != nullptr);
-        if (m_current_hash_node->parent() != nullptr) {
-          key_buffer_out.push_back(m_current_hash_node->child_of_char());
+    /**
+     * Return the smallest position >= pos with a child, or ALPHABET_SIZE if
+     * none.
+     */
+    std::size_t find_next(std::size_t pos) const noexcept {
+      std::size_t iword = pos / 64;
+      if (iword >= NB_WORDS) {
+        return ALPHABET_SIZE;
+      }
+
+      std::uint64_t word = words[iword] & (~std::uint64_t(0) << (pos % 64));
+      while (word == 0) {
+        iword++;
+        if (iword == NB_WORDS) {
+          return ALPHABET_SIZE;
         }
 
-        key_buffer_out.append(m_array_hash_iterator.key(),
-                              m_array_hash_iterator.key_size());
+        word = words[iword];
       }
-    }
 
-    std::basic_string<CharT> key() const {
-      std::basic_string<CharT> key_buffer;
-      key(key_buffer);
-
-      return key_buffer;
+      return iword * 64 + count_trailing_zeros(word);
     }
 
-    template <class U = T,
-              typename std::enable_if<has_value<U>::value>::type* = nullptr>
-    reference value() const {
-      if (this->m_read_trie_node_value) {
-        tsl_ht_assert(this->m_current_trie_node != nullptr);
-        tsl_ht_assert(this->m_current_trie_node->val_node() != nullptr);
+    /**
+     * Return the greatest position < pos with a child, or ALPHABET_SIZE if
+     * none.
+     */
+    std::size_t find_previous(std::size_t pos) const noexcept {
+      if (pos == 0) {
+        return ALPHABET_SIZE;
+      }
 
-        return this->m_current_trie_node->val_node()->m_value;
-      } else {
-        return this->m_array_hash_iterator.value();
+      pos--;
+      std::size_t iword = pos / 64;
+      std::uint64_t word =
+          words[iword] & (~std::uint64_t(0) >> (63 - pos % 64));
+      while (word == 0) {
+        if (iword == 0) {
+          return ALPHABET_SIZE;
+        }
+
+        iword--;
+        word = words[iword];
       }
-    }
 
-    template <class U = T,
-              typename std::enable_if<has_value<U>::value>::type* = nullptr>
-    reference operator*() const {
-      return value();
+      return iword * 64 + highest_bit_index(word);
     }
 
-    template <class U = T,
-              typename std::enable_if<has_value<U>::value>::type* = nullptr>
-    pointer operator->() const {
-      return std::addressof(value());
-    }
+    std::uint64_t words[NB_WORDS];
+  };
 
-    htrie_hash_iterator& operator++() {
-      if (m_read_trie_node_value) {
-        tsl_ht_assert(m_current_trie_node != nullptr);
+  struct node48_children {
+    children_bitmap bitmap;
+    unsigned char child_index[ALPHABET_SIZE];
+    tagged_node_ptr children[48];
+  };
 
-        m_read_trie_node_value = false;
+  struct node256_children {
+    children_bitmap bitmap;
+    tagged_node_ptr children[ALPHABET_SIZE];
+  };
 
-        anode_type* child = m_current_trie_node->first_child();
-        if (child != nullptr) {
-          set_most_left_descendant_as_next_node(*child);
-        } else if (m_current_trie_node->parent() != nullptr) {
-          trie_node_type* current_node_child = m_current_trie_node;
-          m_current_trie_node = m_current_trie_node->parent();
+  class trie_node : public anode, private Allocator {
+   public:
+    explicit trie_node(const Allocator& alloc)
+        : anode(anode::node_type::TRIE_NODE),
+          Allocator(alloc),
+          m_value(),
+          m_children_kind(children_kind::NODE_4),
+          m_has_value(false),
+          m_nb_children(0),
+          m_node4_keys(),
+          m_node4_children() {}
 
-          set_next_node_ascending(*current_node_child);
-        } else {
-          set_as_end_iterator();
-        }
-      } else {
-        ++m_array_hash_iterator;
-        if (m_array_hash_iterator != m_array_hash_end_iterator) {
-          filter_prefix();
-        }
-        // End of the road, set the iterator as an end node.
-        else if (m_current_trie_node == nullptr) {
-          set_as_end_iterator();
+    /**
+     * Copy other and all its descendants with alloc. As the constructor
+     * delegates to trie_node(alloc), the destructor takes care of the already
+     * copied children if an exception is thrown.
+     */
+    trie_node(const trie_node& other, const Allocator& alloc)
+        : trie_node(alloc) {
+      this->m_child_of_char = other.m_child_of_char;
+
+      if (other.m_has_value) {
+        m_value.construct_copy(get_allocator(), other.m_value);
+        m_has_value = true;
+      }
+
+      // TODO avoid recursion
+      for (const anode* child = other.first_child(); child != nullptr;
+           child = other.next_child(*child)) {
+        if (child->is_trie_node()) {
+          set_child(child->child_of_char(),
+                    make_node<trie_node>(alloc, child->as_trie_node(), alloc));
+        } else if (!child->as_hash_node().is_hybrid()) {
+          set_child(child->child_of_char(),
+                    make_node<hash_node>(alloc, child->as_hash_node(), alloc));
         } else {
-          tsl_ht_assert(m_current_hash_node != nullptr);
-          set_next_node_ascending(*m_current_hash_node);
+          const hash_node& hnode = child->as_hash_node();
+          set_child(hnode.child_of_char(),
+                    make_node<hash_node>(alloc, hnode, alloc));
+
+          const tagged_node_ptr hnode_copy = this->child(hnode.child_of_char());
+          for (std::size_t pos = hnode.range_first(); pos <= hnode.range_last();
+               pos++) {
+            if (other.child(as_char(pos)) == &hnode &&
+                this->child(as_char(pos)) == nullptr) {
+              add_child_slot(as_char(pos), hnode_copy);
+            }
+          }
         }
       }
+    }
 
-      return *this;
+    ~trie_node() {
+      clear_children();
+      erase_value();
     }
 
-    htrie_hash_iterator operator++(int) {
-      htrie_hash_iterator tmp(*this);
-      ++*this;
+    trie_node(const trie_node& other) = delete;
+    trie_node(trie_node&& other) = delete;
+    trie_node& operator=(const trie_node& other) = delete;
+    trie_node& operator=(trie_node&& other) = delete;
 
-      return tmp;
+    const Allocator& get_allocator() const noexcept { return *this; }
+
+    /**
+     * Return nullptr if none.
+     */
+    anode* first_child() noexcept {
+      return const_cast<anode*>(
+          static_cast<const trie_node*>(this)->first_child());
     }
 
-    friend bool operator==(const htrie_hash_iterator& lhs,
-                           const htrie_hash_iterator& rhs) {
-      if (lhs.m_current_trie_node != rhs.m_current_trie_node ||
-          lhs.m_read_trie_node_value != rhs.m_read_trie_node_value) {
-        return false;
-      } else if (lhs.m_read_trie_node_value) {
-        return true;
-      } else {
-        if (lhs.m_current_hash_node != rhs.m_current_hash_node) {
-          return false;
-        } else if (lhs.m_current_hash_node == nullptr) {
-          return true;
-        } else {
-          return lhs.m_array_hash_iterator == rhs.m_array_hash_iterator &&
-                 lhs.m_array_hash_end_iterator == rhs.m_array_hash_end_iterator;
-        }
+    const anode* first_child() const noexcept {
+      switch (m_children_kind) {
+        case children_kind::NODE_4:
+        case children_kind::NODE_16:
+          return (m_nb_children > 0) ? sorted_children()[0].get() : nullptr;
+        case children_kind::NODE_48:
+        case children_kind::NODE_256:
+          return next_child_from(0).get();
       }
-    }
 
-    friend bool operator!=(const htrie_hash_iterator& lhs,
-                           const htrie_hash_iterator& rhs) {
-      return !(lhs == rhs);
+      tsl_ht_assert(false);
+      return nullptr;
     }
 
-   private:
-    void hash_node_prefix(std::basic_string<CharT>& key_buffer_out) const {
-      tsl_ht_assert(!m_read_trie_node_value);
-      key_buffer_out.clear();
+    /**
+     * Get the next_child that come after current_child. Return nullptr if no
+     * next child.
+     */
+    anode* next_child(const anode& current_child) noexcept {
+      return const_cast<anode*>(
+          static_cast<const trie_node*>(this)->next_child(current_child));
+    }
 
-      trie_node_type* tnode = m_current_trie_node;
-      while (tnode != nullptr && tnode->parent() != nullptr) {
-        key_buffer_out.push_back(tnode->child_of_char());
-        tnode = tnode->parent();
+    const anode* next_child(const anode& current_child) const noexcept {
+      tsl_ht_assert(current_child.parent() == this);
+
+      if (current_child.is_hash_node() &&
+          current_child.as_hash_node().is_hybrid()) {
+        return child_after(current_child.as_hash_node().range_last()).get();
       }
 
-      std::reverse(key_buffer_out.begin(), key_buffer_out.end());
+      const std::size_t pos = as_position(current_child.child_of_char());
+      switch (m_children_kind) {
+        case children_kind::NODE_4:
+        case children_kind::NODE_16: {
+          const std::size_t ichild = find_sorted_index(pos);
+          tsl_ht_assert(ichild < m_nb_children);
 
-      tsl_ht_assert(m_current_hash_node != nullptr);
-      if (m_current_hash_node->parent() != nullptr) {
-        key_buffer_out.push_back(m_current_hash_node->child_of_char());
+          return (ichild + 1 < m_nb_children)
+                     ? sorted_children()[ichild + 1].get()
+                     : nullptr;
+        }
+        case children_kind::NODE_48:
+        case children_kind::NODE_256:
+          return next_child_from(pos + 1).get();
       }
+
+      tsl_ht_assert(false);
+      return nullptr;
     }
 
-    template <bool TIsPrefixIterator = IsPrefixIterator,
-              typename std::enable_if<!TIsPrefixIterator>::type* = nullptr>
-    void filter_prefix() {}
+    /**
+     * Return the first left-descendant trie node with a value. If none
+     * return the most left trie node.
+     */
+    trie_node& most_left_descendant_value_trie_node() noexcept {
+      return const_cast<trie_node&>(
+          static_cast<const trie_node*>(this)
+              ->most_left_descendant_value_trie_node());
+    }
 
-    template <bool TIsPrefixIterator = IsPrefixIterator,
-              typename std::enable_if<TIsPrefixIterator>::type* = nullptr>
-    void filter_prefix() {
-      tsl_ht_assert(m_array_hash_iterator != m_array_hash_end_iterator);
-      tsl_ht_assert(!m_read_trie_node_value && m_current_hash_node != nullptr);
+    const trie_node& most_left_descendant_value_trie_node() const noexcept {
+      const trie_node* current_node = this;
+      while (true) {
+        if (current_node->m_has_value) {
+          return *current_node;
+        }
 
-      if (this->m_prefix_filter.empty()) {
+        const anode* first_child = current_node->first_child();
+        tsl_ht_assert(first_child !=
+                      nullptr);  // a trie_node must either have a value_node or
+                                 // at least one child.
+        if (first_child->is_hash_node()) {
+          return *current_node;
+        }
+
+        current_node = &first_child->as_trie_node();
+      }
+    }
+
+    size_type nb_children() const noexcept { return m_nb_children; }
+
+    /**
+     * Return true if the node has another child than child.
+     */
+    bool has_other_child(const anode& child) const noexcept {
+      tsl_ht_assert(child.parent() == this);
+
+      if (child.is_trie_node() || !child.as_hash_node().is_hybrid()) {
+        return m_nb_children > 1;
+      }
+
+      return first_child() != &child || next_child(child) != nullptr;
+    }
+
+    bool empty() const noexcept {
+      return m_nb_children == 0 && !m_has_value;
+    }
+
+    /**
+     * Return nullptr if there is no child for for_char.
+     */
+    tagged_node_ptr child(CharT for_char) const noexcept {
+      const std::size_t pos = as_position(for_char);
+      switch (m_children_kind) {
+        case children_kind::NODE_4:
+        case children_kind::NODE_16: {
+          const std::size_t ichild = find_sorted_index(pos);
+          return (ichild < m_nb_children) ? sorted_children()[ichild]
+                                          : tagged_node_ptr();
+        }
+        case children_kind::NODE_48: {
+          const unsigned char index = m_node48->child_index[pos];
+          return (index != 0) ? m_node48->children[index - 1]
+                              : tagged_node_ptr();
+        }
+        case children_kind::NODE_256:
+          return m_node256->children[pos];
+      }
+
+      tsl_ht_assert(false);
+      return nullptr;
+    }
+
+    /**
+     * Set child as the child of for_char, the previous child of for_char (if
+     * any) is deleted. If child is nullptr, the child of for_char is removed.
+     *
+     * Removing or replacing a child never throws, adding a new child may throw
+     * if the node needs to grow to a bigger representation.
+     */
+    void set_child(CharT for_char, unique_node_ptr child) {
+      if (child == nullptr) {
+        unique_node_ptr old_child = release_child(for_char);
         return;
       }
 
-      while ((this->m_prefix_filter.size() > m_array_hash_iterator.key_size() ||
-              this->m_prefix_filter.compare(
-                  0, this->m_prefix_filter.size(), m_array_hash_iterator.key(),
-                  this->m_prefix_filter.size()) != 0)) {
-        ++m_array_hash_iterator;
-        if (m_array_hash_iterator == m_array_hash_end_iterator) {
-          if (m_current_trie_node == nullptr) {
-            set_as_end_iterator();
-          } else {
-            tsl_ht_assert(m_current_hash_node != nullptr);
-            set_next_node_ascending(*m_current_hash_node);
+      child->m_child_of_char = for_char;
+      child->m_parent_node = this;
+
+      tagged_node_ptr* slot = child_slot(as_position(for_char));
+      if (slot != nullptr) {
+        unique_node_ptr old_child(*slot);
+        *slot = child.release();
+      } else {
+        insert_child(as_position(for_char), child.get());
+        child.release();
+      }
+    }
+
+    /**
+     * Remove the child of for_char from the node without deleting it and
+     * return it. Return nullptr if there is no child for for_char.
+     *
+     * The child must not be a hybrid hash_node, use remove_child instead.
+     */
+    unique_node_ptr release_child(CharT for_char) noexcept {
+      tsl_ht_assert(!child(for_char).is_hash_node() ||
+                    !child(for_char).as_hash_node().is_hybrid());
+      return unique_node_ptr(release_slot(as_position(for_char)));
+    }
+
+    /**
+     * Add a slot for for_char to child, which must already be a hybrid child
+     * of the node with a range containing for_char.
+     *
+     * May throw if the node needs to grow to a bigger representation.
+     */
+    void add_child_slot(CharT for_char, tagged_node_ptr child) {
+      tsl_ht_assert(child.is_hash_node() && child->parent() == this);
+      tsl_ht_assert(as_position(for_char) >=
+                        child.as_hash_node().range_first() &&
+                    as_position(for_char) <= child.as_hash_node().range_last());
+
+      if (child_slot(as_position(for_char)) == nullptr) {
+        insert_child(as_position(for_char), child);
+      }
+    }
+
+    /**
+     * Remove all the slots of child and delete it.
+     */
+    void remove_child(const anode& child) noexcept {
+      tsl_ht_assert(child.parent() == this);
+
+      if (child.is_trie_node() || !child.as_hash_node().is_hybrid()) {
+        unique_node_ptr old_child = release_child(child.child_of_char());
+        return;
+      }
+
+      const hash_node& hnode = child.as_hash_node();
+      tagged_node_ptr old_child;
+      for (std::size_t pos = hnode.range_first(); pos <= hnode.range_last();
+           pos++) {
+        tagged_node_ptr* slot = child_slot(pos);
+        if (slot != nullptr && *slot == &hnode) {
+          old_child = release_slot(pos);
+        }
+      }
+
+      old_child.destroy();
+    }
+
+    /**
+     * Replace the hybrid child old_child by first and second (which can be
+     * nullptr), their ranges must be inside the range of old_child. Each slot
+     * of old_child is given to the new child with a range containing its
+     * character, the slot is removed if there is none. old_child is deleted.
+     *
+     * Each key of first and second must start with a character which has a
+     * slot pointing to old_child.
+     */
+    void split_child(const hash_node& old_child,
+                     hash_node_ptr first,
+                     hash_node_ptr second) noexcept {
+      tsl_ht_assert(old_child.parent() == this && old_child.is_hybrid());
+
+      const tagged_node_ptr new_children[] = {
+          attach_split_child(std::move(first)),
+          attach_split_child(std::move(second))};
+
+      tagged_node_ptr released_child;
+      for (std::size_t pos = old_child.range_first();
+           pos <= old_child.range_last(); pos++) {
+        tagged_node_ptr* slot = child_slot(pos);
+        if (slot == nullptr || *slot != &old_child) {
+          continue;
+        }
+
+        tagged_node_ptr new_child;
+        for (const tagged_node_ptr candidate : new_children) {
+          if (candidate != nullptr &&
+              pos >= candidate.as_hash_node().range_first() &&
+              pos <= candidate.as_hash_node().range_last()) {
+            new_child = candidate;
           }
+        }
 
-          return;
+        if (new_child != nullptr) {
+          released_child = *slot;
+          *slot = new_child;
+        } else {
+          released_child = release_slot(pos);
         }
       }
+
+      released_child.destroy();
     }
 
     /**
-     * Go back up in the tree to get the current_trie_node_child sibling.
-     * If none, try to go back up more in the tree to check the siblings of the
-     * ancestors.
+     * Return the child with the greatest position lower than pos or nullptr if
+     * none.
      */
-    void set_next_node_ascending(anode_type& current_trie_node_child) {
-      tsl_ht_assert(m_current_trie_node != nullptr);
-      tsl_ht_assert(current_trie_node_child.parent() == m_current_trie_node);
+    tagged_node_ptr child_before(std::size_t pos) const noexcept {
+      switch (m_children_kind) {
+        case children_kind::NODE_4:
+        case children_kind::NODE_16: {
+          const unsigned char* keys = sorted_keys();
+          std::size_t ichild = m_nb_children;
+          while (ichild > 0 && keys[ichild - 1] >= pos) {
+            ichild--;
+          }
 
-      anode_type* next_node =
-          m_current_trie_node->next_child(current_trie_node_child);
-      while (next_node == nullptr && m_current_trie_node->parent() != nullptr) {
-        anode_type* current_child = m_current_trie_node;
-        m_current_trie_node = m_current_trie_node->parent();
-        next_node = m_current_trie_node->next_child(*current_child);
+          return (ichild > 0) ? sorted_children()[ichild - 1]
+                              : tagged_node_ptr();
+        }
+        case children_kind::NODE_48:
+        case children_kind::NODE_256: {
+          const std::size_t previous = bitmap().find_previous(pos);
+          return (previous < ALPHABET_SIZE) ? child(as_char(previous))
+                                            : tagged_node_ptr();
+        }
       }
 
-      // End of the road, set the iterator as an end node.
-      if (next_node == nullptr) {
-        set_as_end_iterator();
-      } else {
-        set_most_left_descendant_as_next_node(*next_node);
+      tsl_ht_assert(false);
+      return nullptr;
+    }
+
+    /**
+     * Return the child with the smallest position greater than pos or nullptr
+     * if none.
+     */
+    tagged_node_ptr child_after(std::size_t pos) const noexcept {
+      switch (m_children_kind) {
+        case children_kind::NODE_4:
+        case children_kind::NODE_16: {
+          const unsigned char* keys = sorted_keys();
+          std::size_t ichild = 0;
+          while (ichild < m_nb_children && keys[ichild] <= pos) {
+            ichild++;
+          }
+
+          return (ichild < m_nb_children) ? sorted_children()[ichild]
+                                          : tagged_node_ptr();
+        }
+        case children_kind::NODE_48:
+        case children_kind::NODE_256:
+          return next_child_from(pos + 1);
       }
+
+      tsl_ht_assert(false);
+      return nullptr;
     }
 
-    void set_most_left_descendant_as_next_node(anode_type& search_start) {
-      if (search_start.is_hash_node()) {
-        set_current_hash_node(search_start.as_hash_node());
-      } else {
-        m_current_trie_node =
-            &search_start.as_trie_node().most_left_descendant_value_trie_node();
-        if (m_current_trie_node->val_node() != nullptr) {
-          m_read_trie_node_value = true;
-        } else {
-          anode_type* first_child = m_current_trie_node->first_child();
-          // a trie_node must either have a value_node or at least one child.
-          tsl_ht_assert(first_child != nullptr);
+    bool holds_value() const noexcept { return m_has_value; }
 
-          set_current_hash_node(first_child->as_hash_node());
+    template <class U = T,
+              typename std::enable_if<has_value<U>::value>::type* = nullptr>
+    U& value() noexcept {
+      tsl_ht_assert(m_has_value);
+      return m_value.get();
+    }
+
+    template <class U = T,
+              typename std::enable_if<has_value<U>::value>::type* = nullptr>
+    const U& value() const noexcept {
+      tsl_ht_assert(m_has_value);
+      return m_value.get();
+    }
+
+    /**
+     * Construct the value of the node, which must not already have one.
+     */
+    template <class... Args>
+    void emplace_value(Args&&... args) {
+      tsl_ht_assert(!m_has_value);
+
+      m_value.construct(get_allocator(), std::forward<Args>(args)...);
+      m_has_value = true;
+    }
+
+    void erase_value() noexcept {
+      if (m_has_value) {
+        m_value.destroy(get_allocator());
+        m_has_value = false;
+      }
+    }
+
+   private:
+    /**
+     * Remove the slot at pos (if any) and return the child it pointed to.
+     */
+    tagged_node_ptr release_slot(std::size_t pos) noexcept {
+      tagged_node_ptr released;
+
+      switch (m_children_kind) {
+        case children_kind::NODE_4:
+        case children_kind::NODE_16: {
+          const std::size_t ichild = find_sorted_index(pos);
+          if (ichild >= m_nb_children) {
+            return released;
+          }
+
+          unsigned char* keys = sorted_keys();
+          tagged_node_ptr* children = sorted_children();
+          released = children[ichild];
+
+          std::copy(keys + ichild + 1, keys + m_nb_children, keys + ichild);
+          std::copy(children + ichild + 1, children + m_nb_children,
+                    children + ichild);
+          break;
+        }
+        case children_kind::NODE_48: {
+          const unsigned char index = m_node48->child_index[pos];
+          if (index == 0) {
+            return released;
+          }
+
+          released = m_node48->children[index - 1];
+          m_node48->children[index - 1] = nullptr;
+          m_node48->child_index[pos] = 0;
+          m_node48->bitmap.reset(pos);
+          break;
+        }
+        case children_kind::NODE_256:
+          if (m_node256->children[pos] == nullptr) {
+            return released;
+          }
+
+          released = m_node256->children[pos];
+          m_node256->children[pos] = nullptr;
+          m_node256->bitmap.reset(pos);
+          break;
+      }
+
+      m_nb_children--;
+      shrink_if_sparse();
+
+      return released;
+    }
+
+    tagged_node_ptr attach_split_child(
+        hash_node_ptr child) noexcept {
+      if (child == nullptr) {
+        return nullptr;
+      }
+
+      child->m_child_of_char = as_char(child->range_first());
+      child->m_parent_node = this;
+
+      return tagged_node_ptr(child.release());
+    }
+
+    unsigned char* sorted_keys() noexcept {
+      tsl_ht_assert(m_children_kind == children_kind::NODE_4 ||
+                    m_children_kind == children_kind::NODE_16);
+      return (m_children_kind == children_kind::NODE_4) ? m_node4_keys
+                                                        : m_node16->keys;
+    }
+
+    const unsigned char* sorted_keys() const noexcept {
+      return const_cast<trie_node*>(this)->sorted_keys();
+    }
+
+    tagged_node_ptr* sorted_children() noexcept {
+      tsl_ht_assert(m_children_kind == children_kind::NODE_4 ||
+                    m_children_kind == children_kind::NODE_16);
+      return (m_children_kind == children_kind::NODE_4) ? m_node4_children
+                                                        : m_node16->children;
+    }
+
+    const tagged_node_ptr* sorted_children() const noexcept {
+      return const_cast<trie_node*>(this)->sorted_children();
+    }
+
+    /**
+     * For NODE_4 and NODE_16, return the index of pos in the sorted keys or
+     * m_nb_children if absent.
+     */
+    std::size_t find_sorted_index(std::size_t pos) const noexcept {
+#ifdef TSL_HT_HAS_SSE2
+      if (m_children_kind == children_kind::NODE_16) {
+        const __m128i keys = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(m_node16->keys));
+        const __m128i cmp =
+            _mm_cmpeq_epi8(keys, _mm_set1_epi8(static_cast<char>(pos)));
+        const unsigned int mask =
+            static_cast<unsigned int>(_mm_movemask_epi8(cmp)) &
+            ((1u << m_nb_children) - 1);
+
+        return (mask != 0) ? count_trailing_zeros(mask) : m_nb_children;
+      }
+#endif
+
+      const unsigned char* keys = sorted_keys();
+      for (std::size_t ichild = 0; ichild < m_nb_children; ichild++) {
+        if (keys[ichild] == pos) {
+          return ichild;
         }
       }
+
+      return m_nb_children;
     }
 
-    void set_current_hash_node(hash_node_type& hnode) {
-      tsl_ht_assert(!hnode.array_hash().empty());
+    /**
+     * For NODE_48 and NODE_256, return the first child with a position >= pos.
+     */
+    tagged_node_ptr next_child_from(std::size_t pos) const noexcept {
+      const std::size_t next = bitmap().find_next(pos);
+      return (next < ALPHABET_SIZE) ? child(as_char(next)) : tagged_node_ptr();
+    }
 
-      m_current_hash_node = &hnode;
-      m_array_hash_iterator = m_current_hash_node->array_hash().begin();
-      m_array_hash_end_iterator = m_current_hash_node->array_hash().end();
+    const children_bitmap& bitmap() const noexcept {
+      tsl_ht_assert(m_children_kind == children_kind::NODE_48 ||
+                    m_children_kind == children_kind::NODE_256);
+      return (m_children_kind == children_kind::NODE_48) ? m_node48->bitmap
+                                                         : m_node256->bitmap;
     }
 
-    void set_as_end_iterator() {
-      m_current_trie_node = nullptr;
-      m_current_hash_node = nullptr;
-      m_read_trie_node_value = false;
+    tagged_node_ptr* child_slot(std::size_t pos) noexcept {
+      switch (m_children_kind) {
+        case children_kind::NODE_4:
+        case children_kind::NODE_16: {
+          const std::size_t ichild = find_sorted_index(pos);
+          return (ichild < m_nb_children) ? sorted_children() + ichild
+                                          : nullptr;
+        }
+        case children_kind::NODE_48: {
+          const unsigned char index = m_node48->child_index[pos];
+          return (index != 0) ? m_node48->children + (index - 1) : nullptr;
+        }
+        case children_kind::NODE_256:
+          return (m_node256->children[pos] != nullptr)
+                     ? m_node256->children + pos
+                     : nullptr;
+      }
+
+      tsl_ht_assert(false);
+      return nullptr;
     }
 
-    void skip_hash_node() {
-      tsl_ht_assert(!m_read_trie_node_value && m_current_hash_node != nullptr);
-      if (m_current_trie_node == nullptr) {
-        set_as_end_iterator();
-      } else {
-        tsl_ht_assert(m_current_hash_node != nullptr);
-        set_next_node_ascending(*m_current_hash_node);
+    /**
+     * Insert a child for pos which must not already have one. Grow the node
+     * if needed, the node is left unchanged if the growth throws.
+     */
+    void insert_child(std::size_t pos, tagged_node_ptr child) {
+      tsl_ht_assert(child_slot(pos) == nullptr);
+
+      if ((m_children_kind == children_kind::NODE_4 && m_nb_children == 4) ||
+          (m_children_kind == children_kind::NODE_16 && m_nb_children == 16) ||
+          (m_children_kind == children_kind::NODE_48 && m_nb_children == 48)) {
+        grow();
+      }
+
+      switch (m_children_kind) {
+        case children_kind::NODE_4:
+        case children_kind::NODE_16: {
+          unsigned char* keys = sorted_keys();
+          tagged_node_ptr* children = sorted_children();
+
+          std::size_t ichild = 0;
+          while (ichild < m_nb_children && keys[ichild] < pos) {
+            ichild++;
+          }
+
+          std::copy_backward(keys + ichild, keys + m_nb_children,
+                             keys + m_nb_children + 1);
+          std::copy_backward(children + ichild, children + m_nb_children,
+                             children + m_nb_children + 1);
+
+          keys[ichild] = static_cast<unsigned char>(pos);
+          children[ichild] = child;
+          break;
+        }
+        case children_kind::NODE_48: {
+          std::size_t ichild = 0;
+          while (m_node48->children[ichild] != nullptr) {
+            ichild++;
+          }
+          tsl_ht_assert(ichild < 48);
+
+          m_node48->children[ichild] = child;
+          m_node48->child_index[pos] = static_cast<unsigned char>(ichild + 1);
+          m_node48->bitmap.set(pos);
+          break;
+        }
+        case children_kind::NODE_256:
+          m_node256->children[pos] = child;
+          m_node256->bitmap.set(pos);
+          break;
       }
+
+      m_nb_children++;
+      tsl_ht_assert(m_children_kind == children_kind::NODE_4 ||
+                    m_children_kind == children_kind::NODE_16 ||
+                    bitmap().count() == m_nb_children);
+    }
+
+    void grow() {
+      switch (m_children_kind) {
+        case children_kind::NODE_4: {
+          node16_children* node16 =
+              allocate_and_construct<node16_children>(get_allocator());
+          std::copy(m_node4_keys, m_node4_keys + 4, node16->keys);
+          std::copy(m_node4_children, m_node4_children + 4, node16->children);
+
+          m_node16 = node16;
+          m_children_kind = children_kind::NODE_16;
+          break;
+        }
+        case children_kind::NODE_16: {
+          node48_children* node48 =
+              allocate_and_construct<node48_children>(get_allocator());
+          for (std::size_t ichild = 0; ichild < m_nb_children; ichild++) {
+            node48->children[ichild] = m_node16->children[ichild];
+            node48->child_index[m_node16->keys[ichild]] =
+                static_cast<unsigned char>(ichild + 1);
+            node48->bitmap.set(m_node16->keys[ichild]);
+          }
+
+          destroy_and_deallocate(get_allocator(), m_node16);
+          m_node48 = node48;
+          m_children_kind = children_kind::NODE_48;
+          break;
+        }
+        case children_kind::NODE_48: {
+          node256_children* node256 =
+              allocate_and_construct<node256_children>(get_allocator());
+          node256->bitmap = m_node48->bitmap;
+          for (std::size_t pos = m_node48->bitmap.find_next(0);
+               pos < ALPHABET_SIZE; pos = m_node48->bitmap.find_next(pos + 1)) {
+            node256->children[pos] =
+                m_node48->children[m_node48->child_index[pos] - 1];
+          }
+
+          destroy_and_deallocate(get_allocator(), m_node48);
+          m_node256 = node256;
+          m_children_kind = children_kind::NODE_256;
+          break;
+        }
+        case children_kind::NODE_256:
+          tsl_ht_assert(false);
+          break;
+      }
+    }
+
+    /**
+     * Shrink the node to the previous representation if it's sparse enough.
+     * If the allocation of the smaller representation fails, the node just
+     * stays in its current representation.
+     */
+    void shrink_if_sparse() noexcept {
+      switch (m_children_kind) {
+        case children_kind::NODE_4:
+          break;
+        case children_kind::NODE_16: {
+          if (m_nb_children > NODE_16_SHRINK_THRESHOLD) {
+            break;
+          }
+
+          node16_children* node16 = m_node16;
+          std::copy(node16->keys, node16->keys + m_nb_children, m_node4_keys);
+          std::copy(node16->children, node16->children + m_nb_children,
+                    m_node4_children);
+
+          destroy_and_deallocate(get_allocator(), node16);
+          m_children_kind = children_kind::NODE_4;
+          break;
+        }
+        case children_kind::NODE_48: {
+          if (m_nb_children > NODE_48_SHRINK_THRESHOLD) {
+            break;
+          }
+
+          node16_children* node16 =
+              allocate_and_construct_nothrow<node16_children>(get_allocator());
+          if (node16 == nullptr) {
+            break;
+          }
+
+          std::size_t ichild = 0;
+          for (std::size_t pos = m_node48->bitmap.find_next(0);
+               pos < ALPHABET_SIZE; pos = m_node48->bitmap.find_next(pos + 1)) {
+            node16->keys[ichild] = static_cast<unsigned char>(pos);
+            node16->children[ichild] =
+                m_node48->children[m_node48->child_index[pos] - 1];
+            ichild++;
+          }
+
+          destroy_and_deallocate(get_allocator(), m_node48);
+          m_node16 = node16;
+          m_children_kind = children_kind::NODE_16;
+          break;
+        }
+        case children_kind::NODE_256: {
+          if (m_nb_children > NODE_256_SHRINK_THRESHOLD) {
+            break;
+          }
+
+          node48_children* node48 =
+              allocate_and_construct_nothrow<node48_children>(get_allocator());
+          if (node48 == nullptr) {
+            break;
+          }
+
+          node48->bitmap = m_node256->bitmap;
+          std::size_t ichild = 0;
+          const children_bitmap& node256_bitmap = m_node256->bitmap;
+          for (std::size_t pos = node256_bitmap.find_next(0);
+               pos < ALPHABET_SIZE; pos = node256_bitmap.find_next(pos + 1)) {
+            node48->children[ichild] = m_node256->children[pos];
+            node48->child_index[pos] = static_cast<unsigned char>(ichild + 1);
+            ichild++;
+          }
+
+          destroy_and_deallocate(get_allocator(), m_node256);
+          m_node48 = node48;
+          m_children_kind = children_kind::NODE_48;
+          break;
+        }
+      }
+    }
+
+    /**
+     * Delete all the children and go back to an empty NODE_4.
+     *
+     * No other child can have a slot between two slots of a hybrid child, only
+     * delete a child when its pointer differs from the previous non-empty
+     * slot.
+     */
+    void clear_children() noexcept {
+      tagged_node_ptr previous_child;
+      auto destroy_slot = [&](tagged_node_ptr& slot) {
+        if (slot != nullptr && slot != previous_child) {
+          previous_child = slot;
+          slot.destroy();
+        }
+      };
+
+      switch (m_children_kind) {
+        case children_kind::NODE_4:
+        case children_kind::NODE_16: {
+          tagged_node_ptr* children = sorted_children();
+          for (std::size_t ichild = 0; ichild < m_nb_children; ichild++) {
+            destroy_slot(children[ichild]);
+          }
+
+          if (m_children_kind == children_kind::NODE_16) {
+            destroy_and_deallocate(get_allocator(), m_node16);
+          }
+          break;
+        }
+        case children_kind::NODE_48:
+          for (std::size_t pos = m_node48->bitmap.find_next(0);
+               pos < ALPHABET_SIZE; pos = m_node48->bitmap.find_next(pos + 1)) {
+            destroy_slot(m_node48->children[m_node48->child_index[pos] - 1]);
+          }
+
+          destroy_and_deallocate(get_allocator(), m_node48);
+          break;
+        case children_kind::NODE_256:
+          const children_bitmap& node256_bitmap = m_node256->bitmap;
+          for (std::size_t pos = node256_bitmap.find_next(0);
+               pos < ALPHABET_SIZE; pos = node256_bitmap.find_next(pos + 1)) {
+            destroy_slot(m_node256->children[pos]);
+          }
+
+          destroy_and_deallocate(get_allocator(), m_node256);
+          break;
+      }
+
+      m_children_kind = children_kind::NODE_4;
+      m_nb_children = 0;
+    }
+
+   private:
+    static const std::size_t NODE_16_SHRINK_THRESHOLD = 3;
+    static const std::size_t NODE_48_SHRINK_THRESHOLD = 12;
+    static const std::size_t NODE_256_SHRINK_THRESHOLD = 36;
+
+    value_storage<T> m_value;
+
+    children_kind m_children_kind;
+    bool m_has_value;
+    std::uint16_t m_nb_children;
+
+    /**
+     * Sorted characters of the children when m_children_kind is NODE_4. Each
+     * character is stored as the position returned by as_position.
+     */
+    unsigned char m_node4_keys[4];
+
+    union {
+      tagged_node_ptr m_node4_children[4];
+      node16_children* m_node16;
+      node48_children* m_node48;
+      node256_children* m_node256;
+    };
+  };
+
+  class hash_node : public anode {
+   public:
+    hash_node(const Hash& hash, float max_load_factor,
+              const Allocator& alloc)
+        : hash_node(HASH_NODE_DEFAULT_INIT_BUCKETS_COUNT, hash,
+                    max_load_factor, alloc) {}
+
+    hash_node(size_type bucket_count, const Hash& hash, float max_load_factor,
+              const Allocator& alloc)
+        : anode(anode::node_type::HASH_NODE),
+          m_array_hash(bucket_count, hash, alloc),
+          m_range_first(0),
+          m_range_last(0),
+          m_nb_prefix_searches(0),
+          m_nb_exact_searches(0) {
+      m_array_hash.max_load_factor(max_load_factor);
+      clear_key_sizes();
+    }
+
+    hash_node(array_hash_type&& array_hash) noexcept(
+        std::is_nothrow_move_constructible<array_hash_type>::value)
+        : anode(anode::node_type::HASH_NODE),
+          m_array_hash(std::move(array_hash)),
+          m_range_first(0),
+          m_range_last(0),
+          m_nb_prefix_searches(0),
+          m_nb_exact_searches(0) {
+      update_key_sizes();
+    }
+
+    hash_node(const hash_node& other, const Allocator& alloc)
+        : anode(other),
+          m_array_hash(other.m_array_hash, alloc),
+          m_range_first(other.m_range_first),
+          m_range_last(other.m_range_last),
+          m_min_key_size(other.m_min_key_size),
+          m_max_key_size(other.m_max_key_size),
+          m_key_sizes_mod_64(other.m_key_sizes_mod_64),
+          m_nb_prefix_searches(other.nb_prefix_searches()),
+          m_nb_exact_searches(other.nb_exact_searches()) {}
+
+    hash_node(const hash_node& other) = delete;
+    hash_node(hash_node&& other) = delete;
+    hash_node& operator=(const hash_node& other) = delete;
+    hash_node& operator=(hash_node&& other) = delete;
+
+    array_hash_type& array_hash() noexcept { return m_array_hash; }
+
+    const array_hash_type& array_hash() const noexcept { return m_array_hash; }
+
+    Allocator get_allocator() const { return m_array_hash.get_allocator(); }
+
+    /**
+     * Insert in the array hash and add the key size to the summary of the key
+     * sizes. The keys must be inserted through these methods.
+     */
+    template <class... Args>
+    std::pair<typename array_hash_type::iterator, bool> insert_ks(
+        const CharT* key, size_type key_size, Args&&... args) {
+      auto it_insert =
+          m_array_hash.insert_ks(key, key_size, std::forward<Args>(args)...);
+      add_key_size(key_size);
+
+      return it_insert;
+    }
+
+    template <class... Args>
+    std::pair<typename array_hash_type::iterator, bool> emplace_ks(
+        const CharT* key, size_type key_size, Args&&... args) {
+      auto it_insert =
+          m_array_hash.emplace_ks(key, key_size, std::forward<Args>(args)...);
+      add_key_size(key_size);
+
+      return it_insert;
+    }
+
+    /**
+     * Number of prefix searches (longest_prefix, for_each_prefix_of,
+     * equal_prefix_range) and exact searches which ended in the node, used by
+     * the adaptive burst. Both are halved once their sum reaches
+     * ADAPTIVE_BURST_SEARCHES_WINDOW so that they follow the recent searches.
+     *
+     * The searches are const, the counters are updated with relaxed loads and
+     * stores instead of atomic increments: concurrent searches may lose some
+     * counts but there is no data race.
+     */
+    std::uint32_t nb_prefix_searches() const noexcept {
+      return m_nb_prefix_searches.load(std::memory_order_relaxed);
+    }
+
+    std::uint32_t nb_exact_searches() const noexcept {
+      return m_nb_exact_searches.load(std::memory_order_relaxed);
+    }
+
+    void record_search(bool prefix_search) const noexcept {
+      std::uint32_t nb_prefix = nb_prefix_searches();
+      std::uint32_t nb_exact = nb_exact_searches();
+      if (nb_prefix + nb_exact >= ADAPTIVE_BURST_SEARCHES_WINDOW) {
+        nb_prefix /= 2;
+        nb_exact /= 2;
+      }
+
+      if (prefix_search) {
+        nb_prefix++;
+      } else {
+        nb_exact++;
+      }
+
+      m_nb_prefix_searches.store(nb_prefix, std::memory_order_relaxed);
+      m_nb_exact_searches.store(nb_exact, std::memory_order_relaxed);
+    }
+
+    /**
+     * Insert the elements of the iterators in [first, last) in the empty
+     * array hash with insert_unique, see array_map::insert_unique.
+     */
+    template <bool MoveValues, class ForwardIt, class U = T,
+              typename std::enable_if<has_value<U>::value>::type* = nullptr>
+    void insert_unique(ForwardIt first, ForwardIt last, size_type key_offset) {
+      m_array_hash.template insert_unique<MoveValues>(first, last, key_offset);
+      add_key_sizes(first, last, key_offset);
+    }
+
+    template <bool MoveValues, class ForwardIt, class U = T,
+              typename std::enable_if<!has_value<U>::value>::type* = nullptr>
+    void insert_unique(ForwardIt first, ForwardIt last, size_type key_offset) {
+      m_array_hash.insert_unique(first, last, key_offset);
+      add_key_sizes(first, last, key_offset);
+    }
+
+    /**
+     * False if no key of the node has a size of key_size. The summary of the
+     * key sizes keeps the sizes of the erased keys, a true result may be a
+     * false positive.
+     *
+     * It is the range [m_min_key_size, m_max_key_size] of the key sizes with
+     * a bitmap of the key sizes modulo 64. Used to skip the impossible sizes
+     * in longest_prefix and for_each_prefix_of.
+     */
+    bool may_contain_key_size(size_type key_size) const noexcept {
+      return key_size >= m_min_key_size && key_size <= m_max_key_size &&
+             ((m_key_sizes_mod_64 >> (key_size % 64)) & 1) != 0;
+    }
+
+    /**
+     * Upper bound of the sizes of the keys in the node.
+     */
+    size_type max_contained_key_size() const noexcept {
+      return m_max_key_size;
+    }
+
+    void clear_key_sizes() noexcept {
+      m_min_key_size = std::numeric_limits<KeySizeT>::max();
+      m_max_key_size = 0;
+      m_key_sizes_mod_64 = 0;
+    }
+
+    /**
+     * Recompute the exact summary of the key sizes from the keys of the node.
+     */
+    void update_key_sizes() noexcept {
+      clear_key_sizes();
+      for (auto it = m_array_hash.cbegin(); it != m_array_hash.cend(); ++it) {
+        add_key_size(it.key_size());
+      }
+    }
+
+    /**
+     * True if the node is shared by more than one character of its parent. The
+     * keys of a hybrid node start with the character of the parent's slot.
+     */
+    bool is_hybrid() const noexcept { return m_range_first != m_range_last; }
+
+    /**
+     * Positions (see as_position) of the first and last characters of the
+     * range covered by a hybrid node.
+     */
+    std::size_t range_first() const noexcept { return m_range_first; }
+
+    std::size_t range_last() const noexcept { return m_range_last; }
+
+    void set_range(std::size_t first, std::size_t last) noexcept {
+      tsl_ht_assert(first <= last && last < ALPHABET_SIZE);
+      m_range_first = static_cast<unsigned char>(first);
+      m_range_last = static_cast<unsigned char>(last);
+    }
+
+   private:
+    template <class ForwardIt>
+    void add_key_sizes(ForwardIt first, ForwardIt last,
+                       size_type key_offset) noexcept {
+      for (auto it = first; it != last; ++it) {
+        add_key_size(it->key_size() - key_offset);
+      }
+    }
+
+    void add_key_size(size_type key_size) noexcept {
+      tsl_ht_assert(key_size <= std::numeric_limits<KeySizeT>::max());
+      m_min_key_size = std::min(m_min_key_size, KeySizeT(key_size));
+      m_max_key_size = std::max(m_max_key_size, KeySizeT(key_size));
+      m_key_sizes_mod_64 |= std::uint64_t(1) << (key_size % 64);
+    }
+
+   private:
+    array_hash_type m_array_hash;
+
+    unsigned char m_range_first;
+    unsigned char m_range_last;
+
+    KeySizeT m_min_key_size;
+    KeySizeT m_max_key_size;
+    std::uint64_t m_key_sizes_mod_64;
+
+    mutable std::atomic<std::uint32_t> m_nb_prefix_searches;
+    mutable std::atomic<std::uint32_t> m_nb_exact_searches;
+  };
+
+ public:
+  template <bool IsConst, bool IsPrefixIterator>
+  class htrie_hash_iterator : private prefix_filter<CharT, IsPrefixIterator> {
+    friend class htrie_hash;
+
+   private:
+    using anode_type =
+        typename std::conditional<IsConst, const anode, anode>::type;
+    using trie_node_type =
+        typename std::conditional<IsConst, const trie_node, trie_node>::type;
+    using hash_node_type =
+        typename std::conditional<IsConst, const hash_node, hash_node>::type;
+
+    using array_hash_iterator_type =
+        typename std::conditional<IsConst,
+                                  typename array_hash_type::const_iterator,
+                                  typename array_hash_type::iterator>::type;
+
+   public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type =
+        typename std::conditional<has_value<T>::value, T, void>::type;
+    using difference_type = std::ptrdiff_t;
+    using reference = typename std::conditional<
+        has_value<T>::value,
+        typename std::conditional<
+            IsConst, typename std::add_lvalue_reference<const T>::type,
+            typename std::add_lvalue_reference<T>::type>::type,
+        void>::type;
+    using pointer = typename std::conditional<
+        has_value<T>::value,
+        typename std::conditional<IsConst, const T*, T*>::type, void>::type;
+
+   private:
+    /**
+     * Start reading from start_hash_node->array_hash().begin().
+     */
+    htrie_hash_iterator(hash_node_type& start_hash_node) noexcept
+        : htrie_hash_iterator(start_hash_node,
+                              start_hash_node.array_hash().begin()) {}
+
+    /**
+     * Start reading from iterator begin in start_hash_node->array_hash().
+     */
+    htrie_hash_iterator(hash_node_type& start_hash_node,
+                        array_hash_iterator_type begin) noexcept
+        : m_current_trie_node(start_hash_node.parent()),
+          m_current_hash_node(&start_hash_node),
+          m_array_hash_iterator(begin),
+          m_array_hash_end_iterator(start_hash_node.array_hash().end()),
+          m_read_trie_node_value(false) {
+      tsl_ht_assert(!m_current_hash_node->array_hash().empty());
+    }
+
+    /**
+     * Start reading from the value in start_trie_node.
+     * start_trie_node should have a value.
+     */
+    htrie_hash_iterator(trie_node_type& start_trie_node) noexcept
+        : m_current_trie_node(&start_trie_node),
+          m_current_hash_node(nullptr),
+          m_read_trie_node_value(true) {
+      tsl_ht_assert(m_current_trie_node->holds_value());
+    }
+
+    template <bool TIsPrefixIterator = IsPrefixIterator,
+              typename std::enable_if<!TIsPrefixIterator>::type* = nullptr>
+    htrie_hash_iterator(trie_node_type* tnode, hash_node_type* hnode,
+                        array_hash_iterator_type begin,
+                        array_hash_iterator_type end,
+                        bool read_trie_node_value) noexcept
+        : m_current_trie_node(tnode),
+          m_current_hash_node(hnode),
+          m_array_hash_iterator(begin),
+          m_array_hash_end_iterator(end),
+          m_read_trie_node_value(read_trie_node_value) {}
+
+    template <bool TIsPrefixIterator = IsPrefixIterator,
+              typename std::enable_if<TIsPrefixIterator>::type* = nullptr>
+    htrie_hash_iterator(trie_node_type* tnode, hash_node_type* hnode,
+                        array_hash_iterator_type begin,
+                        array_hash_iterator_type end, bool read_trie_node_value,
+                        std::basic_string<CharT> prefix_filter_) noexcept
+        : prefix_filter<CharT, TIsPrefixIterator>(std::move(prefix_filter_)),
+          m_current_trie_node(tnode),
+          m_current_hash_node(hnode),
+          m_array_hash_iterator(begin),
+          m_array_hash_end_iterator(end),
+          m_read_trie_node_value(read_trie_node_value) {}
+
+   public:
+    htrie_hash_iterator() noexcept {}
+
+    // Copy constructor from iterator to const_iterator.
+    template <bool TIsConst = IsConst,
+              bool TIsPrefixIterator = IsPrefixIterator,
+              typename std::enable_if<TIsConst && !TIsPrefixIterator>::type* =
+                  nullptr>
+    htrie_hash_iterator(
+        const htrie_hash_iterator<!TIsConst, TIsPrefixIterator>& other) noexcept
+        : m_current_trie_node(other.m_current_trie_node),
+          m_current_hash_node(other.m_current_hash_node),
+          m_array_hash_iterator(other.m_array_hash_iterator),
+          m_array_hash_end_iterator(other.m_array_hash_end_iterator),
+          m_read_trie_node_value(other.m_read_trie_node_value) {}
+
+    // Copy constructor from iterator to const_iterator.
+    template <
+        bool TIsConst = IsConst, bool TIsPrefixIterator = IsPrefixIterator,
+        typename std::enable_if<TIsConst && TIsPrefixIterator>::type* = nullptr>
+    htrie_hash_iterator(
+        const htrie_hash_iterator<!TIsConst, TIsPrefixIterator>& other) noexcept
+        : prefix_filter<CharT, TIsPrefixIterator>(other.m_prefix_filter),
+          m_current_trie_node(other.m_current_trie_node),
+          m_current_hash_node(other.m_current_hash_node),
+          m_array_hash_iterator(other.m_array_hash_iterator),
+          m_array_hash_end_iterator(other.m_array_hash_end_iterator),
+          m_read_trie_node_value(other.m_read_trie_node_value) {}
+
+    htrie_hash_iterator(const htrie_hash_iterator& other) = default;
+    htrie_hash_iterator(htrie_hash_iterator&& other) = default;
+    htrie_hash_iterator& operator=(const htrie_hash_iterator& other) = default;
+    htrie_hash_iterator& operator=(htrie_hash_iterator&& other) = default;
+
+    void key(std::basic_string<CharT>& key_buffer_out) const {
+      key_buffer_out.clear();
+
+      trie_node_type* tnode = m_current_trie_node;
+      while (tnode != nullptr && tnode->parent() != nullptr) {
+        key_buffer_out.push_back(tnode->child_of_char());
+        tnode = tnode->parent();
+      }
+
+      std::reverse(key_buffer_out.begin(), key_buffer_out.end());
+
+      if (!m_read_trie_node_value) {
+        tsl_ht_assert(m_current_hash_node != nullptr);
+        if (m_current_hash_node->parent() != nullptr &&
+            !m_current_hash_node->is_hybrid()) {
+          key_buffer_out.push_back(m_current_hash_node->child_of_char());
+        }
+
+        key_buffer_out.append(m_array_hash_iterator.key(),
+                              m_array_hash_iterator.key_size());
+      }
+    }
+
+    std::basic_string<CharT> key() const {
+      std::basic_string<CharT> key_buffer;
+      key(key_buffer);
+
+      return key_buffer;
+    }
+
+    template <class U = T,
+              typename std::enable_if<has_value<U>::value>::type* = nullptr>
+    reference value() const {
+      if (this->m_read_trie_node_value) {
+        tsl_ht_assert(this->m_current_trie_node != nullptr);
+        tsl_ht_assert(this->m_current_trie_node->holds_value());
+
+        return this->m_current_trie_node->value();
+      } else {
+        return this->m_array_hash_iterator.value();
+      }
+    }
+
+    template <class U = T,
+              typename std::enable_if<has_value<U>::value>::type* = nullptr>
+    reference operator*() const {
+      return value();
+    }
+
+    template <class U = T,
+              typename std::enable_if<has_value<U>::value>::type* = nullptr>
+    pointer operator->() const {
+      return std::addressof(value());
+    }
+
+    htrie_hash_iterator& operator++() {
+      if (m_read_trie_node_value) {
+        tsl_ht_assert(m_current_trie_node != nullptr);
+
+        m_read_trie_node_value = false;
+
+        anode_type* child = m_current_trie_node->first_child();
+        if (child != nullptr) {
+          set_most_left_descendant_as_next_node(*child);
+        } else if (m_current_trie_node->parent() != nullptr) {
+          trie_node_type* current_node_child = m_current_trie_node;
+          m_current_trie_node = m_current_trie_node->parent();
+
+          set_next_node_ascending(*current_node_child);
+        } else {
+          set_as_end_iterator();
+        }
+      } else {
+        ++m_array_hash_iterator;
+        if (m_array_hash_iterator != m_array_hash_end_iterator) {
+          filter_prefix();
+        }
+        // End of the road, set the iterator as an end node.
+        else if (m_current_trie_node == nullptr) {
+          set_as_end_iterator();
+        } else {
+          tsl_ht_assert(m_current_hash_node != nullptr);
+          set_next_node_ascending(*m_current_hash_node);
+        }
+      }
+
+      return *this;
+    }
+
+    htrie_hash_iterator operator++(int) {
+      htrie_hash_iterator tmp(*this);
+      ++*this;
+
+      return tmp;
+    }
+
+    friend bool operator==(const htrie_hash_iterator& lhs,
+                           const htrie_hash_iterator& rhs) {
+      if (lhs.m_current_trie_node != rhs.m_current_trie_node ||
+          lhs.m_read_trie_node_value != rhs.m_read_trie_node_value) {
+        return false;
+      } else if (lhs.m_read_trie_node_value) {
+        return true;
+      } else {
+        if (lhs.m_current_hash_node != rhs.m_current_hash_node) {
+          return false;
+        } else if (lhs.m_current_hash_node == nullptr) {
+          return true;
+        } else {
+          return lhs.m_array_hash_iterator == rhs.m_array_hash_iterator &&
+                 lhs.m_array_hash_end_iterator == rhs.m_array_hash_end_iterator;
+        }
+      }
+    }
+
+    friend bool operator!=(const htrie_hash_iterator& lhs,
+                           const htrie_hash_iterator& rhs) {
+      return !(lhs == rhs);
+    }
+
+   private:
+    void hash_node_prefix(std::basic_string<CharT>& key_buffer_out) const {
+      tsl_ht_assert(!m_read_trie_node_value);
+      key_buffer_out.clear();
+
+      trie_node_type* tnode = m_current_trie_node;
+      while (tnode != nullptr && tnode->parent() != nullptr) {
+        key_buffer_out.push_back(tnode->child_of_char());
+        tnode = tnode->parent();
+      }
+
+      std::reverse(key_buffer_out.begin(), key_buffer_out.end());
+
+      tsl_ht_assert(m_current_hash_node != nullptr);
+      if (m_current_hash_node->parent() != nullptr &&
+          !m_current_hash_node->is_hybrid()) {
+        key_buffer_out.push_back(m_current_hash_node->child_of_char());
+      }
+    }
+
+    template <bool TIsPrefixIterator = IsPrefixIterator,
+              typename std::enable_if<!TIsPrefixIterator>::type* = nullptr>
+    void filter_prefix() {}
+
+    template <bool TIsPrefixIterator = IsPrefixIterator,
+              typename std::enable_if<TIsPrefixIterator>::type* = nullptr>
+    void filter_prefix() {
+      tsl_ht_assert(m_array_hash_iterator != m_array_hash_end_iterator);
+      tsl_ht_assert(!m_read_trie_node_value && m_current_hash_node != nullptr);
+
+      if (this->m_prefix_filter.empty()) {
+        return;
+      }
+
+      const bool sorted_buckets =
+          m_current_hash_node->array_hash().sorted_buckets();
+      while (true) {
+        if (sorted_buckets) {
+          // Once past the prefix, the rest of the bucket can't match.
+          const int cmp = compare_to_prefix(m_array_hash_iterator.key(),
+                                            m_array_hash_iterator.key_size(),
+                                            this->m_prefix_filter.data(),
+                                            this->m_prefix_filter.size());
+          if (cmp == 0) {
+            return;
+          } else if (cmp > 0) {
+            m_array_hash_iterator.skip_bucket();
+          } else {
+            ++m_array_hash_iterator;
+          }
+        } else {
+          if (this->m_prefix_filter.size() <=
+                  m_array_hash_iterator.key_size() &&
+              this->m_prefix_filter.compare(0, this->m_prefix_filter.size(),
+                                            m_array_hash_iterator.key(),
+                                            this->m_prefix_filter.size()) ==
+                  0) {
+            return;
+          }
+          ++m_array_hash_iterator;
+        }
+
+        if (m_array_hash_iterator == m_array_hash_end_iterator) {
+          if (m_current_trie_node == nullptr) {
+            set_as_end_iterator();
+          } else {
+            tsl_ht_assert(m_current_hash_node != nullptr);
+            set_next_node_ascending(*m_current_hash_node);
+          }
+
+          return;
+        }
+      }
+    }
+
+    /**
+     * Go back up in the tree to get the current_trie_node_child sibling.
+     * If none, try to go back up more in the tree to check the siblings of the
+     * ancestors.
+     */
+    void set_next_node_ascending(anode_type& current_trie_node_child) {
+      tsl_ht_assert(m_current_trie_node != nullptr);
+      tsl_ht_assert(current_trie_node_child.parent() == m_current_trie_node);
+
+      anode_type* next_node =
+          m_current_trie_node->next_child(current_trie_node_child);
+      while (next_node == nullptr && m_current_trie_node->parent() != nullptr) {
+        anode_type* current_child = m_current_trie_node;
+        m_current_trie_node = m_current_trie_node->parent();
+        next_node = m_current_trie_node->next_child(*current_child);
+      }
+
+      // End of the road, set the iterator as an end node.
+      if (next_node == nullptr) {
+        set_as_end_iterator();
+      } else {
+        set_most_left_descendant_as_next_node(*next_node);
+      }
+    }
+
+    void set_most_left_descendant_as_next_node(anode_type& search_start) {
+      if (search_start.is_hash_node()) {
+        set_current_hash_node(search_start.as_hash_node());
+      } else {
+        m_current_trie_node =
+            &search_start.as_trie_node().most_left_descendant_value_trie_node();
+        if (m_current_trie_node->holds_value()) {
+          m_read_trie_node_value = true;
+        } else {
+          anode_type* first_child = m_current_trie_node->first_child();
+          // a trie_node must either have a value or at least one child.
+          tsl_ht_assert(first_child != nullptr);
+
+          set_current_hash_node(first_child->as_hash_node());
+        }
+      }
+    }
+
+    void set_current_hash_node(hash_node_type& hnode) {
+      tsl_ht_assert(!hnode.array_hash().empty());
+
+      m_current_hash_node = &hnode;
+      m_array_hash_iterator = m_current_hash_node->array_hash().begin();
+      m_array_hash_end_iterator = m_current_hash_node->array_hash().end();
+    }
+
+    void set_as_end_iterator() {
+      m_current_trie_node = nullptr;
+      m_current_hash_node = nullptr;
+      m_read_trie_node_value = false;
+    }
+
+    void skip_hash_node() {
+      tsl_ht_assert(!m_read_trie_node_value && m_current_hash_node != nullptr);
+      if (m_current_trie_node == nullptr) {
+        set_as_end_iterator();
+      } else {
+        tsl_ht_assert(m_current_hash_node != nullptr);
+        set_next_node_ascending(*m_current_hash_node);
+      }
+    }
+
+   private:
+    trie_node_type* m_current_trie_node;
+    hash_node_type* m_current_hash_node;
+
+    array_hash_iterator_type m_array_hash_iterator;
+    array_hash_iterator_type m_array_hash_end_iterator;
+
+    bool m_read_trie_node_value;
+  };
+
+ public:
+  htrie_hash(const Hash& hash, float max_load_factor, size_type burst_threshold,
+             const Allocator& alloc = Allocator())
+      : m_alloc(alloc),
+        m_arena_attachment(m_alloc),
+        m_root(nullptr),
+        m_nb_elements(0),
+        m_hash(hash),
+        m_max_load_factor(max_load_factor),
+        m_hybrid_mode(false),
+        m_adaptive_burst(false) {
+    this->burst_threshold(burst_threshold);
+  }
+
+  htrie_hash(const htrie_hash& other)
+      : htrie_hash(other, allocator_traits::select_on_container_copy_construction(
+                              other.m_alloc)) {}
+
+  htrie_hash(const htrie_hash& other, const Allocator& alloc)
+      : m_alloc(alloc),
+        m_arena_attachment(m_alloc),
+        m_root(copy_root(other, m_alloc)),
+        m_nb_elements(other.m_nb_elements),
+        m_hash(other.m_hash),
+        m_max_load_factor(other.m_max_load_factor),
+        m_burst_threshold(other.m_burst_threshold),
+        m_hybrid_mode(other.m_hybrid_mode),
+        m_adaptive_burst(other.m_adaptive_burst) {}
+
+  htrie_hash(htrie_hash&& other) noexcept(
+      std::is_nothrow_move_constructible<Hash>::value)
+      : m_alloc(std::move(other.m_alloc)),
+        m_arena_attachment(m_alloc),
+        m_root(std::move(other.m_root)),
+        m_nb_elements(other.m_nb_elements),
+        m_hash(std::move(other.m_hash)),
+        m_max_load_factor(other.m_max_load_factor),
+        m_burst_threshold(other.m_burst_threshold),
+        m_hybrid_mode(other.m_hybrid_mode),
+        m_adaptive_burst(other.m_adaptive_burst) {
+    other.clear();
+  }
+
+  /**
+   * If the container is the only user of an htrie_arena, release the whole
+   * arena instead of deallocating each node.
+   */
+  ~htrie_hash() {
+    if (can_release_arena()) {
+      m_root.release();
+      m_arena_attachment.exclusive_arena()->release();
+    }
+  }
+
+  htrie_hash& operator=(const htrie_hash& other) {
+    if (&other != this) {
+      const Allocator& new_alloc =
+          allocator_traits::propagate_on_container_copy_assignment::value
+              ? other.m_alloc
+              : m_alloc;
+      unique_node_ptr new_root = copy_root(other, new_alloc);
+
+      m_root = std::move(new_root);
+      propagate_allocator(
+          other.m_alloc,
+          typename allocator_traits::propagate_on_container_copy_assignment());
+
+      m_hash = other.m_hash;
+      m_nb_elements = other.m_nb_elements;
+      m_max_load_factor = other.m_max_load_factor;
+      m_burst_threshold = other.m_burst_threshold;
+      m_hybrid_mode = other.m_hybrid_mode;
+      m_adaptive_burst = other.m_adaptive_burst;
+    }
+
+    return *this;
+  }
+
+  htrie_hash& operator=(htrie_hash&& other) {
+    other.swap(*this);
+    other.clear();
+
+    return *this;
+  }
+
+  allocator_type get_allocator() const { return m_alloc; }
+
+  /*
+   * Iterators
+   */
+  iterator begin() noexcept { return mutable_iterator(cbegin()); }
+
+  const_iterator begin() const noexcept { return cbegin(); }
+
+  const_iterator cbegin() const noexcept {
+    if (empty()) {
+      return cend();
+    }
+
+    return cbegin<const_iterator>(*m_root);
+  }
+
+  iterator end() noexcept {
+    iterator it;
+    it.set_as_end_iterator();
+
+    return it;
+  }
+
+  const_iterator end() const noexcept { return cend(); }
+
+  const_iterator cend() const noexcept {
+    const_iterator it;
+    it.set_as_end_iterator();
+
+    return it;
+  }
+
+  /*
+   * Capacity
+   */
+  bool empty() const noexcept { return m_nb_elements == 0; }
+
+  size_type size() const noexcept { return m_nb_elements; }
+
+  size_type max_size() const noexcept {
+    return std::numeric_limits<size_type>::max();
+  }
+
+  size_type max_key_size() const noexcept {
+    return array_hash_type::MAX_KEY_SIZE;
+  }
+
+  void shrink_to_fit() {
+    auto first = begin();
+    auto last = end();
+
+    while (first != last) {
+      if (first.m_read_trie_node_value) {
+        ++first;
+      } else {
+        /*
+         * shrink_to_fit on array_hash will invalidate the iterators of
+         * array_hash. Save pointer to array_hash, skip the array_hash_node and
+         * then call shrink_to_fit on the saved pointer.
+         */
+        hash_node* hnode = first.m_current_hash_node;
+        first.skip_hash_node();
+
+        tsl_ht_assert(hnode != nullptr);
+        hash_node& compacted_node = factor_common_prefix(*hnode);
+        compacted_node.array_hash().shrink_to_fit();
+        compacted_node.array_hash().sort_buckets();
+        compacted_node.update_key_sizes();
+      }
+    }
+  }
+
+  /*
+   * Modifiers
+   */
+  /**
+   * In O(1) if the container is the only user of an htrie_arena (see
+   * can_release_arena).
+   */
+  void clear() noexcept {
+    if (can_release_arena()) {
+      m_root.release();
+      m_arena_attachment.exclusive_arena()->release();
+    } else {
+      m_root.reset(nullptr);
+    }
+
+    m_nb_elements = 0;
+  }
+
+  template <class... ValueArgs>
+  std::pair<iterator, bool> insert(const CharT* key, size_type key_size,
+                                   ValueArgs&&... value_args) {
+    if (key_size > max_key_size()) {
+      throw std::length_error("Key is too long.");
+    }
+
+    if (m_root == nullptr) {
+      m_root = make_node<hash_node>(m_alloc, m_hash, m_max_load_factor, m_alloc);
+    }
+
+    return insert_impl(m_root.get(), key, key_size,
+                       std::forward<ValueArgs>(value_args)...);
+  }
+
+  /**
+   * Element of a bulk insertion (see insert_sorted) with the interface of an
+   * array hash iterator used by hash_node::insert_unique. The value (if any)
+   * is copied, the element doesn't own its key and value.
+   */
+  struct bulk_element {
+    bulk_element(const CharT* key, size_type key_size, T* value) noexcept
+        : m_key(key), m_key_size(key_size), m_value(value) {}
+
+    bulk_element(const CharT* key, T* value) noexcept
+        : bulk_element(key, std::char_traits<CharT>::length(key), value) {}
+
+    bulk_element(const std::basic_string<CharT>& key, T* value) noexcept
+        : bulk_element(key.data(), key.size(), value) {}
+
+#ifdef TSL_HT_HAS_STRING_VIEW
+    bulk_element(const std::basic_string_view<CharT>& key, T* value) noexcept
+        : bulk_element(key.data(), key.size(), value) {}
+#endif
+
+    const CharT* key() const noexcept { return m_key; }
+
+    size_type key_size() const noexcept { return m_key_size; }
+
+    template <class U = T,
+              typename std::enable_if<has_value<U>::value>::type* = nullptr>
+    U& value() const noexcept {
+      return *m_value;
+    }
+
+    const CharT* m_key;
+    size_type m_key_size;
+    T* m_value;
+  };
+
+  /**
+   * Insert the elements, sorted by key, in the empty trie without any burst
+   * or rehash. The elements under each character of a trie node are
+   * contiguous once sorted, they are counted before creating their node: a
+   * trie node if they reach the burst threshold, an exactly sized hash node
+   * filled at once through insert_unique otherwise (in hybrid mode the
+   * consecutive small groups share a hash node).
+   *
+   * If the elements aren't sorted, they are sorted first. As with insert, only
+   * the first element of a key is inserted. If the trie isn't empty, the
+   * elements are inserted one by one.
+   *
+   * With nb_threads > 1, the sort and the build of the subtries are spread on
+   * nb_threads threads, see build_sorted_ranges_parallel. The allocator must
+   * then be std::allocator, otherwise a single thread is used.
+   *
+   * If an exception is thrown, the trie is left empty.
+   */
+  void insert_sorted(std::vector<bulk_element>& elements,
+                     std::size_t nb_threads = 1) {
+    for (const bulk_element& element : elements) {
+      if (element.key_size() > max_key_size()) {
+        throw std::length_error("Key is too long.");
+      }
+    }
+
+    if (!empty()) {
+      for (const bulk_element& element : elements) {
+        insert_bulk_element(element);
+      }
+      return;
+    }
+
+    // Each thread allocates the nodes of its subtries concurrently.
+    if (!std::is_same<Allocator, std::allocator<CharT>>::value) {
+      nb_threads = 1;
+    }
+
+    if (!std::is_sorted(elements.begin(), elements.end(), bulk_key_less)) {
+      sort_bulk_elements(elements, nb_threads);
+    }
+    elements.erase(std::unique(elements.begin(), elements.end(), bulk_key_equal),
+                   elements.end());
+
+    if (elements.empty()) {
+      return;
+    }
+
+    try {
+      if (elements.size() < m_burst_threshold) {
+        auto hnode = create_hash_node(elements.size(), 0, 0);
+        hnode->template insert_unique<false>(elements.begin(), elements.end(),
+                                             0);
+        m_root = std::move(hnode);
+      } else {
+        auto tnode = make_node<trie_node>(m_alloc, m_alloc);
+        trie_node& root = *tnode;
+        m_root = std::move(tnode);
+
+        std::vector<sorted_range> ranges = {
+            {&root, elements.begin(), elements.end(), 0}};
+        if (nb_threads > 1) {
+          build_sorted_ranges_parallel(std::move(ranges), nb_threads);
+        } else {
+          build_sorted_ranges(std::move(ranges));
+        }
+      }
+    } catch (...) {
+      clear();
+      throw;
+    }
+
+    m_nb_elements = elements.size();
+  }
+
+  /**
+   * Insert the elements in the trie, which may already hold keys, and return
+   * the number of inserted elements. The elements are partitioned by the
+   * characters of their keys while descending the trie (stable counting
+   * sort at each trie node): the path to each node is descended once for all
+   * its elements and each hash node receives all its elements after a single
+   * reserve. A hash node which would go over its burst threshold is burst (or
+   * split) once before its elements are inserted in the resulting nodes. The
+   * elements under a character without child are built as a new subtrie,
+   * see insert_sorted.
+   *
+   * As with insert, only the first element of a key is inserted and an
+   * existing key keeps its value. If an exception is thrown, the elements
+   * inserted before it stay in the trie.
+   */
+  size_type insert_batch(std::vector<bulk_element>& elements) {
+    if (empty()) {
+      insert_sorted(elements);
+      return size();
+    }
+
+    for (const bulk_element& element : elements) {
+      if (element.key_size() > max_key_size()) {
+        throw std::length_error("Key is too long.");
+      }
+    }
+
+    const size_type nb_elements_before = m_nb_elements;
+    if (m_root.is_hash_node()) {
+      hash_node& root = m_root.as_hash_node();
+      if (insert_batch_in_hash_node(root, elements.begin(), elements.end(),
+                                    0)) {
+        return m_nb_elements - nb_elements_before;
+      }
+
+      burst_or_split(root);
+    }
+
+    std::vector<bulk_element> partition_buffer(elements);
+    std::vector<sorted_range> ranges = {
+        {&m_root.as_trie_node(), elements.begin(), elements.end(), 0}};
+    while (!ranges.empty()) {
+      const sorted_range range = ranges.back();
+      ranges.pop_back();
+
+      insert_batch_range(range, partition_buffer, ranges);
+    }
+
+    return m_nb_elements - nb_elements_before;
+  }
+
+  iterator erase(const_iterator pos) { return erase(mutable_iterator(pos)); }
+
+  iterator erase(const_iterator first, const_iterator last) {
+    // TODO Optimize, could avoid the call to std::distance
+    const std::size_t nb_to_erase = std::size_t(std::distance(first, last));
+    auto to_delete = mutable_iterator(first);
+    for (std::size_t i = 0; i < nb_to_erase; i++) {
+      to_delete = erase(to_delete);
+    }
+
+    return to_delete;
+  }
+
+  size_type erase(const CharT* key, size_type key_size) {
+    auto it = find(key, key_size);
+    if (it != end()) {
+      erase(it);
+      return 1;
+    } else {
+      return 0;
+    }
+  }
+
+  size_type erase_prefix(const CharT* prefix, size_type prefix_size) {
+    if (m_root == nullptr) {
+      return 0;
+    }
+
+    tagged_node_ptr current_node = m_root.get();
+    for (size_type iprefix = 0; iprefix < prefix_size; iprefix++) {
+      if (current_node.is_trie_node()) {
+        trie_node* tnode = &current_node.as_trie_node();
+
+        current_node = tnode->child(prefix[iprefix]);
+        if (current_node == nullptr) {
+          return 0;
+        } else if (is_hybrid_hash_node(current_node)) {
+          return erase_prefix_hash_node(current_node.as_hash_node(),
+                                        prefix + iprefix,
+                                        prefix_size - iprefix);
+        }
+      } else {
+        hash_node& hnode = current_node.as_hash_node();
+        return erase_prefix_hash_node(hnode, prefix + iprefix,
+                                      prefix_size - iprefix);
+      }
+    }
+
+    if (current_node.is_trie_node()) {
+      trie_node* parent = current_node->parent();
+
+      if (parent != nullptr) {
+        const size_type nb_erased =
+            size_descendants(current_node.as_trie_node());
+
+        parent->set_child(current_node->child_of_char(), nullptr);
+        m_nb_elements -= nb_erased;
+
+        if (parent->empty()) {
+          clear_empty_nodes(*parent);
+        }
+
+        return nb_erased;
+      } else {
+        const size_type nb_erased = m_nb_elements;
+        m_root.reset(nullptr);
+        m_nb_elements = 0;
+
+        return nb_erased;
+      }
+    } else {
+      const size_type nb_erased =
+          current_node.as_hash_node().array_hash().size();
+
+      current_node.as_hash_node().array_hash().clear();
+      current_node.as_hash_node().clear_key_sizes();
+      m_nb_elements -= nb_erased;
+
+      clear_empty_nodes(current_node.as_hash_node());
+
+      return nb_erased;
+    }
+  }
+
+  void swap(htrie_hash& other) {
+    using std::swap;
+
+    swap_allocator(
+        other, typename allocator_traits::propagate_on_container_swap());
+    swap(m_hash, other.m_hash);
+    swap(m_root, other.m_root);
+    swap(m_nb_elements, other.m_nb_elements);
+    swap(m_max_load_factor, other.m_max_load_factor);
+    swap(m_burst_threshold, other.m_burst_threshold);
+    swap(m_hybrid_mode, other.m_hybrid_mode);
+    swap(m_adaptive_burst, other.m_adaptive_burst);
+  }
+
+  /*
+   * Lookup
+   */
+  template <class U = T,
+            typename std::enable_if<has_value<U>::value>::type* = nullptr>
+  U& at(const CharT* key, size_type key_size) {
+    return const_cast<U&>(
+        static_cast<const htrie_hash*>(this)->at(key, key_size));
+  }
+
+  template <class U = T,
+            typename std::enable_if<has_value<U>::value>::type* = nullptr>
+  const U& at(const CharT* key, size_type key_size) const {
+    auto it_find = find(key, key_size);
+    if (it_find != cend()) {
+      return it_find.value();
+    } else {
+      throw std::out_of_range("Couldn't find key.");
+    }
+  }
+
+  // TODO optimize
+  template <class U = T,
+            typename std::enable_if<has_value<U>::value>::type* = nullptr>
+  U& access_operator(const CharT* key, size_type key_size) {
+    auto it_find = find(key, key_size);
+    if (it_find != cend()) {
+      return it_find.value();
+    } else {
+      return insert(key, key_size, U{}).first.value();
+    }
+  }
+
+  size_type count(const CharT* key, size_type key_size) const {
+    if (find(key, key_size) != cend()) {
+      return 1;
+    } else {
+      return 0;
+    }
+  }
+
+  iterator find(const CharT* key, size_type key_size) {
+    if (m_root == nullptr) {
+      return end();
+    }
+
+    return find_impl(m_root.get(), key, key_size);
+  }
+
+  const_iterator find(const CharT* key, size_type key_size) const {
+    if (m_root == nullptr) {
+      return cend();
+    }
+
+    return find_impl(m_root.get(), key, key_size);
+  }
+
+  std::pair<iterator, iterator> equal_range(const CharT* key,
+                                            size_type key_size) {
+    iterator it = find(key, key_size);
+    return std::make_pair(it, (it == end()) ? it : std::next(it));
+  }
+
+  std::pair<const_iterator, const_iterator> equal_range(
+      const CharT* key, size_type key_size) const {
+    const_iterator it = find(key, key_size);
+    return std::make_pair(it, (it == cend()) ? it : std::next(it));
+  }
+
+  template <class ForwardIt, class OutputIt>
+  OutputIt find_batch(ForwardIt first, ForwardIt last, OutputIt results) {
+    return lookup_batch(first, last, results, [this](const_iterator it) {
+      return mutable_iterator(it);
+    });
+  }
+
+  template <class ForwardIt, class OutputIt>
+  OutputIt find_batch(ForwardIt first, ForwardIt last,
+                      OutputIt results) const {
+    return lookup_batch(first, last, results,
+                        [](const_iterator it) { return it; });
+  }
+
+  template <class ForwardIt, class OutputIt>
+  OutputIt count_batch(ForwardIt first, ForwardIt last,
+                       OutputIt counts) const {
+    const const_iterator it_end = cend();
+    return lookup_batch(first, last, counts, [&](const_iterator it) {
+      return size_type(it != it_end);
+    });
+  }
+
+  std::pair<prefix_iterator, prefix_iterator> equal_prefix_range(
+      const CharT* prefix, size_type prefix_size) {
+    if (m_root == nullptr) {
+      return std::make_pair(prefix_end(), prefix_end());
+    }
+
+    return equal_prefix_range_impl(m_root.get(), prefix, prefix_size);
+  }
+
+  std::pair<const_prefix_iterator, const_prefix_iterator> equal_prefix_range(
+      const CharT* prefix, size_type prefix_size) const {
+    if (m_root == nullptr) {
+      return std::make_pair(prefix_cend(), prefix_cend());
+    }
+
+    return equal_prefix_range_impl(m_root.get(), prefix, prefix_size);
+  }
+
+  iterator longest_prefix(const CharT* key, size_type key_size) {
+    if (m_root == nullptr) {
+      return end();
+    }
+
+    return longest_prefix_impl(m_root.get(), key, key_size);
+  }
+
+  const_iterator longest_prefix(const CharT* key, size_type key_size) const {
+    if (m_root == nullptr) {
+      return cend();
+    }
+
+    return longest_prefix_impl(m_root.get(), key, key_size);
+  }
+
+  template <class F>
+  void for_each_prefix_of(const CharT* key, size_type key_size, F&& visitor) {
+    if (m_root != nullptr) {
+      for_each_prefix_of_impl<iterator>(m_root.get(), key, key_size,
+                                        std::forward<F>(visitor));
+    }
+  }
+
+  template <class F>
+  void for_each_prefix_of(const CharT* key, size_type key_size,
+                          F&& visitor) const {
+    if (m_root != nullptr) {
+      for_each_prefix_of_impl<const_iterator>(m_root.get(), key, key_size,
+                                              std::forward<F>(visitor));
+    }
+  }
+
+  /*
+   * Hash policy
+   */
+  float max_load_factor() const { return m_max_load_factor; }
+
+  void max_load_factor(float ml) {
+    const float min_max_load_factor = array_hash_type::MIN_MAX_LOAD_FACTOR;
+    m_max_load_factor = std::max(min_max_load_factor, ml);
+  }
+
+  /*
+   * Burst policy
+   */
+  size_type burst_threshold() const { return m_burst_threshold; }
+
+  void burst_threshold(size_type threshold) {
+    const size_type min_burst_threshold = MIN_BURST_THRESHOLD;
+    const size_type max_burst_threshold = MAX_BURST_THRESHOLD;
+
+    m_burst_threshold = threshold;
+    m_burst_threshold = std::max(m_burst_threshold, min_burst_threshold);
+    m_burst_threshold = std::min(m_burst_threshold, max_burst_threshold);
+  }
+
+  bool hybrid_mode() const { return m_hybrid_mode; }
+
+  void hybrid_mode(bool enable) { m_hybrid_mode = enable; }
+
+  bool adaptive_burst() const { return m_adaptive_burst; }
+
+  void adaptive_burst(bool enable) { m_adaptive_burst = enable; }
+
+  /**
+   * Burst, or split if hybrid, all the hash nodes which reached their burst
+   * threshold (see burst_threshold_of) without waiting for their next
+   * insertion.
+   */
+  void burst_full_nodes() {
+    std::vector<hash_node*> full_nodes;
+    for (auto it = begin(); it != end();) {
+      if (it.m_read_trie_node_value) {
+        ++it;
+      } else {
+        hash_node* hnode = it.m_current_hash_node;
+        it.skip_hash_node();
+
+        tsl_ht_assert(hnode != nullptr);
+        if (need_burst(*hnode)) {
+          full_nodes.push_back(hnode);
+        }
+      }
+    }
+
+    // Each burst only deletes its own node, the other pointers stay valid.
+    for (hash_node* hnode : full_nodes) {
+      burst_or_split(*hnode);
+    }
+  }
+
+  /**
+   * Collapse each trie node whose subtree holds less than
+   * burst_threshold() * burst_threshold_ratio elements back into a single
+   * pure hash node, giving back the memory of the trie nodes and of the small
+   * hash nodes left by the erasures. Only the highest such trie nodes are
+   * collapsed, burst_threshold_ratio is clamped to [0, 1].
+   *
+   * If an exception is thrown, the trie node being collapsed is unchanged.
+   */
+  void merge_small_nodes(float burst_threshold_ratio) {
+    if (m_root == nullptr || m_root.is_hash_node()) {
+      return;
+    }
+
+    burst_threshold_ratio = std::max(burst_threshold_ratio, 0.0f);
+    burst_threshold_ratio = std::min(burst_threshold_ratio, 1.0f);
+    const size_type merge_threshold =
+        size_type(float(m_burst_threshold) * burst_threshold_ratio);
+
+    std::vector<trie_node*> trie_nodes = {&m_root.as_trie_node()};
+    while (!trie_nodes.empty()) {
+      trie_node& tnode = *trie_nodes.back();
+      trie_nodes.pop_back();
+
+      const size_type nb_elements =
+          size_descendants(tnode, merge_threshold);
+      if (nb_elements < merge_threshold) {
+        merge_trie_node(tnode, nb_elements);
+        continue;
+      }
+
+      for (anode* child = tnode.first_child(); child != nullptr;
+           child = tnode.next_child(*child)) {
+        if (child->is_trie_node()) {
+          trie_nodes.push_back(&child->as_trie_node());
+        }
+      }
+    }
+  }
+
+  /*
+   * Observers
+   */
+  hasher hash_function() const { return m_hash; }
+
+  /*
+   * Other
+   */
+  template <class Serializer>
+  void serialize(Serializer& serializer) const {
+    serialize_impl(serializer);
+  }
+
+  template <class Deserializer>
+  void deserialize(Deserializer& deserializer, bool hash_compatible) {
+    deserialize_impl(deserializer, hash_compatible);
+  }
+
+ private:
+  /**
+   * Get the begin iterator by searching for the most left descendant node
+   * starting at search_start_node.
+   */
+  template <typename Iterator>
+  Iterator cbegin(const anode& search_start_node) const noexcept {
+    if (search_start_node.is_hash_node()) {
+      return Iterator(search_start_node.as_hash_node());
+    }
+
+    const trie_node& tnode =
+        search_start_node.as_trie_node().most_left_descendant_value_trie_node();
+    if (tnode.holds_value()) {
+      return Iterator(tnode);
+    } else {
+      const anode* first_child = tnode.first_child();
+      tsl_ht_assert(first_child != nullptr);
+
+      return Iterator(first_child->as_hash_node());
+    }
+  }
+
+  /**
+   * Get an iterator to the node that come just after the last descendant of
+   * search_start_node.
+   */
+  template <typename Iterator>
+  Iterator cend(const anode& search_start_node) const noexcept {
+    if (search_start_node.parent() == nullptr) {
+      Iterator it;
+      it.set_as_end_iterator();
+
+      return it;
+    }
+
+    const trie_node* current_trie_node = search_start_node.parent();
+    const anode* next_node = current_trie_node->next_child(search_start_node);
+
+    while (next_node == nullptr && current_trie_node->parent() != nullptr) {
+      const anode* current_child = current_trie_node;
+      current_trie_node = current_trie_node->parent();
+      next_node = current_trie_node->next_child(*current_child);
+    }
+
+    if (next_node == nullptr) {
+      Iterator it;
+      it.set_as_end_iterator();
+
+      return it;
+    } else {
+      return cbegin<Iterator>(*next_node);
     }
+  }
 
-   private:
-    trie_node_type* m_current_trie_node;
-    hash_node_type* m_current_hash_node;
+  prefix_iterator prefix_end() noexcept {
+    prefix_iterator it;
+    it.set_as_end_iterator();
 
-    array_hash_iterator_type m_array_hash_iterator;
-    array_hash_iterator_type m_array_hash_end_iterator;
+    return it;
+  }
 
-    bool m_read_trie_node_value;
-  };
+  const_prefix_iterator prefix_cend() const noexcept {
+    const_prefix_iterator it;
+    it.set_as_end_iterator();
 
- public:
-  htrie_hash(const Hash& hash, float max_load_factor, size_type burst_threshold)
-      : m_root(nullptr),
-        m_nb_elements(0),
-        m_hash(hash),
-        m_max_load_factor(max_load_factor) {
-    this->burst_threshold(burst_threshold);
+    return it;
   }
 
-  htrie_hash(const htrie_hash& other)
-      : m_root(nullptr),
-        m_nb_elements(other.m_nb_elements),
-        m_hash(other.m_hash),
-        m_max_load_factor(other.m_max_load_factor),
-        m_burst_threshold(other.m_burst_threshold) {
-    if (other.m_root != nullptr) {
-      if (other.m_root->is_hash_node()) {
-        m_root = make_unique<hash_node>(other.m_root->as_hash_node());
+  /**
+   * Number of elements in start_node and its descendants. Stop counting once
+   * max_count is reached, the result is then at least max_count.
+   */
+  size_type size_descendants(
+      const anode& start_node,
+      size_type max_count = std::numeric_limits<size_type>::max()) const {
+    auto first = cbegin<const_iterator>(start_node);
+    auto last = cend<const_iterator>(start_node);
+
+    size_type nb_elements = 0;
+    while (first != last && nb_elements < max_count) {
+      if (first.m_read_trie_node_value) {
+        nb_elements++;
+        ++first;
       } else {
-        m_root = make_unique<trie_node>(other.m_root->as_trie_node());
+        nb_elements += first.m_current_hash_node->array_hash().size();
+        first.skip_hash_node();
       }
     }
-  }
 
-  htrie_hash(htrie_hash&& other) noexcept(
-      std::is_nothrow_move_constructible<Hash>::value)
-      : m_root(std::move(other.m_root)),
-        m_nb_elements(other.m_nb_elements),
-        m_hash(std::move(other.m_hash)),
-        m_max_load_factor(other.m_max_load_factor),
-        m_burst_threshold(other.m_burst_threshold) {
-    other.clear();
+    return nb_elements;
   }
 
-  htrie_hash& operator=(const htrie_hash& other) {
-    if (&other != this) {
-      std::unique_ptr<anode> new_root = nullptr;
-      if (other.m_root != nullptr) {
-        if (other.m_root->is_hash_node()) {
-          new_root = make_unique<hash_node>(other.m_root->as_hash_node());
-        } else {
-          new_root = make_unique<trie_node>(other.m_root->as_trie_node());
+  template <class... ValueArgs>
+  std::pair<iterator, bool> insert_impl(tagged_node_ptr search_start_node,
+                                        const CharT* key, size_type key_size,
+                                        ValueArgs&&... value_args) {
+    tagged_node_ptr current_node = search_start_node;
+
+    for (size_type ikey = 0; ikey < key_size; ikey++) {
+      if (current_node.is_trie_node()) {
+        trie_node& tnode = current_node.as_trie_node();
+
+        current_node = tnode.child(key[ikey]);
+        if (current_node == nullptr) {
+          return insert_in_new_child(tnode, key + ikey, key_size - ikey,
+                                     std::forward<ValueArgs>(value_args)...);
+        } else if (is_hybrid_hash_node(current_node)) {
+          return insert_in_hash_node(current_node.as_hash_node(), key + ikey,
+                                     key_size - ikey,
+                                     std::forward<ValueArgs>(value_args)...);
         }
+      } else {
+        return insert_in_hash_node(current_node.as_hash_node(), key + ikey,
+                                   key_size - ikey,
+                                   std::forward<ValueArgs>(value_args)...);
       }
-
-      m_hash = other.m_hash;
-      m_root = std::move(new_root);
-      m_nb_elements = other.m_nb_elements;
-      m_max_load_factor = other.m_max_load_factor;
-      m_burst_threshold = other.m_burst_threshold;
     }
 
-    return *this;
-  }
-
-  htrie_hash& operator=(htrie_hash&& other) {
-    other.swap(*this);
-    other.clear();
+    if (current_node.is_trie_node()) {
+      trie_node& tnode = current_node.as_trie_node();
+      if (tnode.holds_value()) {
+        return std::make_pair(iterator(tnode), false);
+      } else {
+        tnode.emplace_value(std::forward<ValueArgs>(value_args)...);
+        m_nb_elements++;
 
-    return *this;
+        return std::make_pair(iterator(tnode), true);
+      }
+    } else {
+      return insert_in_hash_node(current_node.as_hash_node(), "", 0,
+                                 std::forward<ValueArgs>(value_args)...);
+    }
   }
 
-  /*
-   * Iterators
+  /**
+   * Insert the key in a new hash_node child of tnode for the character key[0],
+   * or in the hybrid child with a range containing key[0] if there is one.
+   *
+   * In hybrid mode the new hash_node covers all the characters between the
+   * neighbours of key[0] in tnode.
    */
-  iterator begin() noexcept { return mutable_iterator(cbegin()); }
+  template <class... ValueArgs>
+  std::pair<iterator, bool> insert_in_new_child(trie_node& tnode,
+                                                const CharT* key,
+                                                size_type key_size,
+                                                ValueArgs&&... value_args) {
+    tsl_ht_assert(key_size > 0 && tnode.child(key[0]) == nullptr);
+
+    const std::size_t pos = as_position(key[0]);
+    std::size_t range_first = pos;
+    std::size_t range_last = pos;
+
+    if (m_hybrid_mode) {
+      const tagged_node_ptr before = tnode.child_before(pos);
+      const tagged_node_ptr after = tnode.child_after(pos);
+
+      tagged_node_ptr hybrid_child;
+      if (is_hybrid_hash_node(before) &&
+          before.as_hash_node().range_last() >= pos) {
+        hybrid_child = before;
+      } else if (is_hybrid_hash_node(after) &&
+                 after.as_hash_node().range_first() <= pos) {
+        hybrid_child = after;
+      }
 
-  const_iterator begin() const noexcept { return cbegin(); }
+      if (hybrid_child != nullptr) {
+        tnode.add_child_slot(key[0], hybrid_child);
+        return insert_in_hash_node(hybrid_child.as_hash_node(), key, key_size,
+                                   std::forward<ValueArgs>(value_args)...);
+      }
 
-  const_iterator cbegin() const noexcept {
-    if (empty()) {
-      return cend();
+      range_first = (before != nullptr) ? last_position(*before) + 1 : 0;
+      range_last =
+          (after != nullptr) ? first_position(*after) - 1 : ALPHABET_SIZE - 1;
     }
 
-    return cbegin<const_iterator>(*m_root);
-  }
+    /*
+     * Add the hash node to tnode before inserting the value in it as set_child
+     * may throw if tnode needs to grow. Remove it if the insertion throws.
+     */
+    auto new_hnode =
+        make_node<hash_node>(m_alloc, m_hash, m_max_load_factor, m_alloc);
+    new_hnode->set_range(range_first, range_last);
+    tnode.set_child(key[0], std::move(new_hnode));
 
-  iterator end() noexcept {
-    iterator it;
-    it.set_as_end_iterator();
+    hash_node& hnode = tnode.child(key[0]).as_hash_node();
+    const size_type key_offset = hnode.is_hybrid() ? 0 : 1;
 
-    return it;
-  }
+    try {
+      auto insert_it =
+          hnode.emplace_ks(key + key_offset, key_size - key_offset,
+                           std::forward<ValueArgs>(value_args)...);
+      m_nb_elements++;
 
-  const_iterator end() const noexcept { return cend(); }
+      return std::make_pair(iterator(hnode, insert_it.first), true);
+    } catch (...) {
+      tnode.remove_child(hnode);
+      throw;
+    }
+  }
 
-  const_iterator cend() const noexcept {
-    const_iterator it;
-    it.set_as_end_iterator();
+  template <class... ValueArgs>
+  std::pair<iterator, bool> insert_in_hash_node(hash_node& hnode,
+                                                const CharT* key,
+                                                size_type key_size,
+                                                ValueArgs&&... value_args) {
+    if (need_burst(hnode)) {
+      return insert_impl(burst_or_split(hnode), key, key_size,
+                         std::forward<ValueArgs>(value_args)...);
+    } else {
+      auto it_insert = hnode.emplace_ks(key, key_size,
+                                        std::forward<ValueArgs>(value_args)...);
+      if (it_insert.second) {
+        m_nb_elements++;
+      }
 
-    return it;
+      return std::make_pair(iterator(hnode, it_insert.first), it_insert.second);
+    }
   }
 
-  /*
-   * Capacity
-   */
-  bool empty() const noexcept { return m_nb_elements == 0; }
+  iterator erase(iterator pos) {
+    iterator next_pos = std::next(pos);
 
-  size_type size() const noexcept { return m_nb_elements; }
+    if (pos.m_read_trie_node_value) {
+      tsl_ht_assert(pos.m_current_trie_node != nullptr &&
+                    pos.m_current_trie_node->holds_value());
 
-  size_type max_size() const noexcept {
-    return std::numeric_limits<size_type>::max();
-  }
+      pos.m_current_trie_node->erase_value();
+      m_nb_elements--;
 
-  size_type max_key_size() const noexcept {
-    return array_hash_type::MAX_KEY_SIZE;
-  }
+      if (pos.m_current_trie_node->empty()) {
+        clear_empty_nodes(*pos.m_current_trie_node);
+      }
 
-  void shrink_to_fit() {
-    auto first = begin();
-    auto last = end();
+      return next_pos;
+    } else {
+      tsl_ht_assert(pos.m_current_hash_node != nullptr);
+      auto next_array_hash_it = pos.m_current_hash_node->array_hash().erase(
+          pos.m_array_hash_iterator);
+      m_nb_elements--;
 
-    while (first != last) {
-      if (first.m_read_trie_node_value) {
-        ++first;
+      if (next_array_hash_it != pos.m_current_hash_node->array_hash().end()) {
+        // The erase on array_hash invalidated the next_pos iterator, return the
+        // right one.
+        return iterator(*pos.m_current_hash_node, next_array_hash_it);
       } else {
-        /*
-         * shrink_to_fit on array_hash will invalidate the iterators of
-         * array_hash. Save pointer to array_hash, skip the array_hash_node and
-         * then call shrink_to_fit on the saved pointer.
-         */
-        hash_node* hnode = first.m_current_hash_node;
-        first.skip_hash_node();
+        if (pos.m_current_hash_node->array_hash().empty()) {
+          clear_empty_nodes(*pos.m_current_hash_node);
+        }
 
-        tsl_ht_assert(hnode != nullptr);
-        hnode->array_hash().shrink_to_fit();
+        return next_pos;
       }
     }
   }
 
-  /*
-   * Modifiers
+  /**
+   * Clear all the empty nodes from the tree starting from empty_node (empty for
+   * a hash_node means that the array hash is empty, for a trie_node it means
+   * the node doesn't have any child or value associated to it).
    */
-  void clear() noexcept {
-    m_root.reset(nullptr);
-    m_nb_elements = 0;
-  }
+  void clear_empty_nodes(anode& empty_node) noexcept {
+    tsl_ht_assert(!empty_node.is_trie_node() ||
+                  empty_node.as_trie_node().empty());
+    tsl_ht_assert(!empty_node.is_hash_node() ||
+                  empty_node.as_hash_node().array_hash().empty());
 
-  template <class... ValueArgs>
-  std::pair<iterator, bool> insert(const CharT* key, size_type key_size,
-                                   ValueArgs&&... value_args) {
-    if (key_size > max_key_size()) {
-      throw std::length_error("Key is too long.");
-    }
+    trie_node* parent = empty_node.parent();
+    if (parent == nullptr) {
+      tsl_ht_assert(m_root.get() == &empty_node);
+      tsl_ht_assert(m_nb_elements == 0);
+      m_root.reset(nullptr);
+    } else if (parent->holds_value() ||
+               parent->has_other_child(empty_node)) {
+      parent->remove_child(empty_node);
+    } else if (parent->parent() == nullptr) {
+      tsl_ht_assert(m_root.get() == empty_node.parent());
+      tsl_ht_assert(m_nb_elements == 0);
+      m_root.reset(nullptr);
+    } else if (empty_node.is_hash_node() &&
+               empty_node.as_hash_node().is_hybrid()) {
+      /**
+       * A hybrid hash node can't be moved up as it only makes sense for its
+       * parent. Remove it and clear the now empty parent instead.
+       */
+      parent->remove_child(empty_node);
+      clear_empty_nodes(*parent);
+    } else {
+      /**
+       * Parent is empty if we remove its empty_node child.
+       * Put empty_node as new child of the grand parent instead of parent (move
+       * hnode up, and delete the parent). And recurse.
+       *
+       * We can't just set grand_parent->child(parent->child_of_char()) to
+       * nullptr as the grand_parent may also become empty. We don't want empty
+       * trie_node with no value in the tree.
+       */
+      trie_node* grand_parent = parent->parent();
+      grand_parent->set_child(
+          parent->child_of_char(),
+          parent->release_child(empty_node.child_of_char()));
 
-    if (m_root == nullptr) {
-      m_root = make_unique<hash_node>(m_hash, m_max_load_factor);
+      clear_empty_nodes(empty_node);
     }
+  }
 
-    return insert_impl(*m_root, key, key_size,
-                       std::forward<ValueArgs>(value_args)...);
+  iterator find_impl(tagged_node_ptr search_start_node, const CharT* key,
+                     size_type key_size) {
+    return mutable_iterator(static_cast<const htrie_hash*>(this)->find_impl(
+        search_start_node, key, key_size));
   }
 
-  iterator erase(const_iterator pos) { return erase(mutable_iterator(pos)); }
+  const_iterator find_impl(tagged_node_ptr search_start_node, const CharT* key,
+                           size_type key_size) const {
+    tagged_node_ptr current_node = search_start_node;
 
-  iterator erase(const_iterator first, const_iterator last) {
-    // TODO Optimize, could avoid the call to std::distance
-    const std::size_t nb_to_erase = std::size_t(std::distance(first, last));
-    auto to_delete = mutable_iterator(first);
-    for (std::size_t i = 0; i < nb_to_erase; i++) {
-      to_delete = erase(to_delete);
+    for (size_type ikey = 0; ikey < key_size; ikey++) {
+      if (current_node.is_trie_node()) {
+        const trie_node* tnode = &current_node.as_trie_node();
+
+        current_node = tnode->child(key[ikey]);
+        if (current_node == nullptr) {
+          return cend();
+        } else if (is_hybrid_hash_node(current_node)) {
+          return find_in_hash_node(current_node.as_hash_node(), key + ikey,
+                                   key_size - ikey);
+        }
+      } else {
+        return find_in_hash_node(current_node.as_hash_node(), key + ikey,
+                                 key_size - ikey);
+      }
     }
 
-    return to_delete;
+    if (current_node.is_trie_node()) {
+      const trie_node& tnode = current_node.as_trie_node();
+      return tnode.holds_value() ? const_iterator(tnode) : cend();
+    } else {
+      return find_in_hash_node(current_node.as_hash_node(), "", 0);
+    }
   }
 
-  size_type erase(const CharT* key, size_type key_size) {
-    auto it = find(key, key_size);
-    if (it != end()) {
-      erase(it);
-      return 1;
+  const_iterator find_in_hash_node(const hash_node& hnode, const CharT* key,
+                                   size_type key_size) const {
+    record_search(hnode, false);
+    auto it = hnode.array_hash().find_ks(key, key_size);
+    if (it != hnode.array_hash().end()) {
+      return const_iterator(hnode, it);
     } else {
-      return 0;
+      return cend();
     }
   }
 
-  size_type erase_prefix(const CharT* prefix, size_type prefix_size) {
-    if (m_root == nullptr) {
-      return 0;
-    }
+  /**
+   * State of one lookup in lookup_batch.
+   */
+  struct batch_lookup {
+    enum class step { descend, prefetch_bucket_buffer, search, done };
+
+    const CharT* key;
+    size_type key_size;
+    size_type ikey;
+    tagged_node_ptr node;
+    std::size_t hash;
+    step next_step;
+    const_iterator result;
+  };
+
+  static void set_lookup_key(batch_lookup& lookup,
+                             const std::basic_string<CharT>& key) noexcept {
+    lookup.key = key.data();
+    lookup.key_size = key.size();
+  }
+
+  static void set_lookup_key(batch_lookup& lookup, const CharT* key) noexcept {
+    lookup.key = key;
+    lookup.key_size = std::char_traits<CharT>::length(key);
+  }
 
-    anode* current_node = m_root.get();
-    for (size_type iprefix = 0; iprefix < prefix_size; iprefix++) {
-      if (current_node->is_trie_node()) {
-        trie_node* tnode = &current_node->as_trie_node();
+#ifdef TSL_HT_HAS_STRING_VIEW
+  static void set_lookup_key(
+      batch_lookup& lookup, const std::basic_string_view<CharT>& key) noexcept {
+    lookup.key = key.data();
+    lookup.key_size = key.size();
+  }
+#endif
 
-        if (tnode->child(prefix[iprefix]) == nullptr) {
-          return 0;
+  /**
+   * Look up the keys in [first, last) by groups of LOOKUP_BATCH_GROUP_SIZE
+   * and write convert(result) of each key to results, in order.
+   *
+   * A lookup is split in steps, each of them prefetching the memory read by
+   * the next one: the next node while descending the trie, then the bucket
+   * and the bucket buffer of the hash node. The lookups of a group advance
+   * one step at a time in turn so that their cache misses overlap instead of
+   * being waited for one after the other.
+   */
+  template <class ForwardIt, class OutputIt, class ResultConverter>
+  OutputIt lookup_batch(ForwardIt first, ForwardIt last, OutputIt results,
+                        ResultConverter convert) const {
+    batch_lookup lookups[LOOKUP_BATCH_GROUP_SIZE];
+
+    while (first != last) {
+      std::size_t nb_lookups = 0;
+      for (; first != last && nb_lookups < LOOKUP_BATCH_GROUP_SIZE;
+           ++first, ++nb_lookups) {
+        batch_lookup& lookup = lookups[nb_lookups];
+        set_lookup_key(lookup, *first);
+        lookup.ikey = 0;
+        lookup.result = cend();
+        if (m_root == nullptr) {
+          lookup.next_step = batch_lookup::step::done;
         } else {
-          current_node = tnode->child(prefix[iprefix]).get();
+          lookup.node = m_root.get();
+          lookup.next_step = batch_lookup::step::descend;
         }
-      } else {
-        hash_node& hnode = current_node->as_hash_node();
-        return erase_prefix_hash_node(hnode, prefix + iprefix,
-                                      prefix_size - iprefix);
+      }
+
+      bool has_pending_lookups = true;
+      while (has_pending_lookups) {
+        has_pending_lookups = false;
+        for (std::size_t i = 0; i < nb_lookups; i++) {
+          if (lookups[i].next_step != batch_lookup::step::done) {
+            advance_lookup(lookups[i]);
+            has_pending_lookups = true;
+          }
+        }
+      }
+
+      for (std::size_t i = 0; i < nb_lookups; i++) {
+        *results = convert(lookups[i].result);
+        ++results;
       }
     }
 
-    if (current_node->is_trie_node()) {
-      trie_node* parent = current_node->parent();
+    return results;
+  }
 
-      if (parent != nullptr) {
-        const size_type nb_erased =
-            size_descendants(current_node->as_trie_node());
+  /**
+   * Execute the next step of the lookup, same logic as find_impl.
+   */
+  void advance_lookup(batch_lookup& lookup) const {
+    switch (lookup.next_step) {
+      case batch_lookup::step::descend:
+        if (lookup.node.is_trie_node()) {
+          const trie_node& tnode = lookup.node.as_trie_node();
+          if (lookup.ikey == lookup.key_size) {
+            if (tnode.holds_value()) {
+              lookup.result = const_iterator(tnode);
+            }
+            lookup.next_step = batch_lookup::step::done;
+            return;
+          }
 
-        parent->set_child(current_node->child_of_char(), nullptr);
-        m_nb_elements -= nb_erased;
+          lookup.node = tnode.child(lookup.key[lookup.ikey]);
+          lookup.ikey++;
+          if (lookup.node == nullptr) {
+            lookup.next_step = batch_lookup::step::done;
+          } else {
+            tsl::detail_array_hash::prefetch(lookup.node.get());
+          }
+        } else {
+          const hash_node& hnode = lookup.node.as_hash_node();
+          // A hybrid hash node also stores the character of its parent.
+          if (hnode.is_hybrid()) {
+            tsl_ht_assert(lookup.ikey > 0);
+            lookup.ikey--;
+          }
 
-        if (parent->empty()) {
-          clear_empty_nodes(*parent);
+          lookup.hash = hnode.array_hash().hash_function()(
+              lookup.key + lookup.ikey, lookup.key_size - lookup.ikey);
+          hnode.array_hash().prefetch_bucket(lookup.hash);
+          lookup.next_step = batch_lookup::step::prefetch_bucket_buffer;
+        }
+        break;
+      case batch_lookup::step::prefetch_bucket_buffer:
+        lookup.node.as_hash_node().array_hash().prefetch_bucket_buffer(
+            lookup.hash);
+        lookup.next_step = batch_lookup::step::search;
+        break;
+      case batch_lookup::step::search: {
+        const hash_node& hnode = lookup.node.as_hash_node();
+        auto it = hnode.array_hash().find_ks(
+            lookup.key + lookup.ikey, lookup.key_size - lookup.ikey,
+            lookup.hash);
+        if (it != hnode.array_hash().end()) {
+          lookup.result = const_iterator(hnode, it);
         }
+        lookup.next_step = batch_lookup::step::done;
+        break;
+      }
+      case batch_lookup::step::done:
+        break;
+    }
+  }
 
-        return nb_erased;
-      } else {
-        const size_type nb_erased = m_nb_elements;
-        m_root.reset(nullptr);
-        m_nb_elements = 0;
+  iterator longest_prefix_impl(tagged_node_ptr search_start_node,
+                               const CharT* value, size_type value_size) {
+    return mutable_iterator(
+        static_cast<const htrie_hash*>(this)->longest_prefix_impl(
+            search_start_node, value, value_size));
+  }
 
-        return nb_erased;
-      }
-    } else {
-      const size_type nb_erased =
-          current_node->as_hash_node().array_hash().size();
+  const_iterator longest_prefix_impl(tagged_node_ptr search_start_node,
+                                     const CharT* value,
+                                     size_type value_size) const {
+    tagged_node_ptr current_node = search_start_node;
+    const_iterator longest_found_prefix = cend();
 
-      current_node->as_hash_node().array_hash().clear();
-      m_nb_elements -= nb_erased;
+    for (size_type ivalue = 0; ivalue < value_size; ivalue++) {
+      if (current_node.is_trie_node()) {
+        const trie_node& tnode = current_node.as_trie_node();
 
-      clear_empty_nodes(current_node->as_hash_node());
+        if (tnode.holds_value()) {
+          longest_found_prefix = const_iterator(tnode);
+        }
 
-      return nb_erased;
-    }
-  }
+        current_node = tnode.child(value[ivalue]);
+        if (current_node == nullptr) {
+          return longest_found_prefix;
+        } else if (is_hybrid_hash_node(current_node)) {
+          const hash_node& hnode = current_node.as_hash_node();
+
+          /**
+           * The keys of a hybrid hash node keep their first character, test
+           * the substrings of [ivalue, value_size) starting from the longest
+           * down to the one-character substring (the empty one is the value of
+           * tnode).
+           */
+          record_search(hnode, true);
+          const auto hash = hnode.array_hash().hash_function();
+          const detail_htrie_hash::prefix_hashes<CharT, Hash> hashes(
+              hash, value + ivalue,
+              std::min(value_size - ivalue, hnode.max_contained_key_size()));
+          for (std::size_t i = value_size; i > ivalue; i--) {
+            if (!hnode.may_contain_key_size(i - ivalue)) {
+              continue;
+            }
+
+            auto it = hnode.array_hash().find_ks(value + ivalue, i - ivalue,
+                                                 hashes[i - ivalue]);
+            if (it != hnode.array_hash().end()) {
+              return const_iterator(hnode, it);
+            }
+          }
 
-  void swap(htrie_hash& other) {
-    using std::swap;
+          return longest_found_prefix;
+        }
+      } else {
+        const hash_node& hnode = current_node.as_hash_node();
 
-    swap(m_hash, other.m_hash);
-    swap(m_root, other.m_root);
-    swap(m_nb_elements, other.m_nb_elements);
-    swap(m_max_load_factor, other.m_max_load_factor);
-    swap(m_burst_threshold, other.m_burst_threshold);
-  }
+        /**
+         * Test the presence in the hash node of each substring from the
+         * remaining [ivalue, value_size) string starting from the longest.
+         * Also test the empty string. The hashes of all the substrings are
+         * computed in one pass if the hash function is incremental.
+         */
+        record_search(hnode, true);
+        const auto hash = hnode.array_hash().hash_function();
+        const detail_htrie_hash::prefix_hashes<CharT, Hash> hashes(
+            hash, value + ivalue,
+            std::min(value_size - ivalue, hnode.max_contained_key_size()));
+        for (std::size_t i = ivalue; i <= value_size; i++) {
+          if (!hnode.may_contain_key_size(value_size - i)) {
+            continue;
+          }
 
-  /*
-   * Lookup
-   */
-  template <class U = T,
-            typename std::enable_if<has_value<U>::value>::type* = nullptr>
-  U& at(const CharT* key, size_type key_size) {
-    return const_cast<U&>(
-        static_cast<const htrie_hash*>(this)->at(key, key_size));
-  }
+          auto it = hnode.array_hash().find_ks(
+              value + ivalue, (value_size - i), hashes[value_size - i]);
+          if (it != hnode.array_hash().end()) {
+            return const_iterator(hnode, it);
+          }
+        }
 
-  template <class U = T,
-            typename std::enable_if<has_value<U>::value>::type* = nullptr>
-  const U& at(const CharT* key, size_type key_size) const {
-    auto it_find = find(key, key_size);
-    if (it_find != cend()) {
-      return it_find.value();
-    } else {
-      throw std::out_of_range("Couldn't find key.");
+        return longest_found_prefix;
+      }
     }
-  }
 
-  // TODO optimize
-  template <class U = T,
-            typename std::enable_if<has_value<U>::value>::type* = nullptr>
-  U& access_operator(const CharT* key, size_type key_size) {
-    auto it_find = find(key, key_size);
-    if (it_find != cend()) {
-      return it_find.value();
-    } else {
-      return insert(key, key_size, U{}).first.value();
-    }
-  }
+    if (current_node.is_trie_node()) {
+      const trie_node& tnode = current_node.as_trie_node();
 
-  size_type count(const CharT* key, size_type key_size) const {
-    if (find(key, key_size) != cend()) {
-      return 1;
+      if (tnode.holds_value()) {
+        longest_found_prefix = const_iterator(tnode);
+      }
     } else {
-      return 0;
-    }
-  }
+      const hash_node& hnode = current_node.as_hash_node();
 
-  iterator find(const CharT* key, size_type key_size) {
-    if (m_root == nullptr) {
-      return end();
+      auto it = hnode.array_hash().find_ks("", 0);
+      if (it != hnode.array_hash().end()) {
+        longest_found_prefix = const_iterator(hnode, it);
+      }
     }
 
-    return find_impl(*m_root, key, key_size);
+    return longest_found_prefix;
   }
 
-  const_iterator find(const CharT* key, size_type key_size) const {
-    if (m_root == nullptr) {
-      return cend();
-    }
+  template <class Iterator, class F>
+  void for_each_prefix_of_impl(tagged_node_ptr search_start_node,
+                               const CharT* value, size_type value_size,
+                               F&& visitor) const {
+    tagged_node_ptr current_node = search_start_node;
 
-    return find_impl(*m_root, key, key_size);
-  }
+    for (size_type ivalue = 0; ivalue < value_size; ivalue++) {
+      if (current_node.is_trie_node()) {
+        auto& tnode = current_node.as_trie_node();
 
-  std::pair<iterator, iterator> equal_range(const CharT* key,
-                                            size_type key_size) {
-    iterator it = find(key, key_size);
-    return std::make_pair(it, (it == end()) ? it : std::next(it));
-  }
+        if (tnode.holds_value()) {
+          visitor(Iterator(tnode));
+        }
 
-  std::pair<const_iterator, const_iterator> equal_range(
-      const CharT* key, size_type key_size) const {
-    const_iterator it = find(key, key_size);
-    return std::make_pair(it, (it == cend()) ? it : std::next(it));
-  }
+        current_node = tnode.child(value[ivalue]);
+        if (current_node == nullptr) {
+          return;
+        } else if (is_hybrid_hash_node(current_node)) {
+          auto& hnode = current_node.as_hash_node();
+
+          // Same as below but the keys keep their first character and the
+          // empty substring is the value of tnode.
+          record_search(hnode, true);
+          const auto hash = hnode.array_hash().hash_function();
+          const detail_htrie_hash::prefix_hashes<CharT, Hash> hashes(
+              hash, value + ivalue,
+              std::min(value_size - ivalue, hnode.max_contained_key_size()));
+          for (std::size_t i = ivalue + 1; i <= value_size; i++) {
+            if (!hnode.may_contain_key_size(i - ivalue)) {
+              continue;
+            }
+
+            auto it = hnode.array_hash().find_ks(value + ivalue, i - ivalue,
+                                                 hashes[i - ivalue]);
+            if (it != hnode.array_hash().end()) {
+              visitor(Iterator(hnode, it));
+            }
+          }
 
-  std::pair<prefix_iterator, prefix_iterator> equal_prefix_range(
-      const CharT* prefix, size_type prefix_size) {
-    if (m_root == nullptr) {
-      return std::make_pair(prefix_end(), prefix_end());
-    }
+          return;
+        }
+      } else {
+        auto& hnode = current_node.as_hash_node();
 
-    return equal_prefix_range_impl(*m_root, prefix, prefix_size);
-  }
+        /**
+         * Test the presence in the hash node of each substring from the
+         * remaining [ivalue, value_size) string starting from the shortest.
+         * Also test the empty string. The hashes of all the substrings are
+         * computed in one pass if the hash function is incremental.
+         */
+        record_search(hnode, true);
+        const auto hash = hnode.array_hash().hash_function();
+        const detail_htrie_hash::prefix_hashes<CharT, Hash> hashes(
+            hash, value + ivalue,
+            std::min(value_size - ivalue, hnode.max_contained_key_size()));
+        for (std::size_t i = value_size + 1; i > ivalue; i--) {
+          if (!hnode.may_contain_key_size(value_size - i + 1)) {
+            continue;
+          }
 
-  std::pair<const_prefix_iterator, const_prefix_iterator> equal_prefix_range(
-      const CharT* prefix, size_type prefix_size) const {
-    if (m_root == nullptr) {
-      return std::make_pair(prefix_cend(), prefix_cend());
+          auto it = hnode.array_hash().find_ks(value + ivalue,
+                                               (value_size - i + 1),
+                                               hashes[value_size - i + 1]);
+          if (it != hnode.array_hash().end()) {
+            visitor(Iterator(hnode, it));
+          }
+        }
+
+        return;
+      }
     }
 
-    return equal_prefix_range_impl(*m_root, prefix, prefix_size);
-  }
+    if (current_node.is_trie_node()) {
+      auto& tnode = current_node.as_trie_node();
 
-  iterator longest_prefix(const CharT* key, size_type key_size) {
-    if (m_root == nullptr) {
-      return end();
+      if (tnode.holds_value()) {
+        visitor(Iterator(tnode));
+      }
+    } else {
+      auto& hnode = current_node.as_hash_node();
+
+      auto it = hnode.array_hash().find_ks("", 0);
+      if (it != hnode.array_hash().end()) {
+        visitor(Iterator(hnode, it));
+      }
     }
+  }
 
-    return longest_prefix_impl(*m_root, key, key_size);
+  std::pair<prefix_iterator, prefix_iterator> equal_prefix_range_impl(
+      tagged_node_ptr search_start_node, const CharT* prefix,
+      size_type prefix_size) {
+    auto range = static_cast<const htrie_hash*>(this)->equal_prefix_range_impl(
+        search_start_node, prefix, prefix_size);
+    return std::make_pair(mutable_iterator(range.first),
+                          mutable_iterator(range.second));
   }
 
-  const_iterator longest_prefix(const CharT* key, size_type key_size) const {
-    if (m_root == nullptr) {
-      return cend();
-    }
+  std::pair<const_prefix_iterator, const_prefix_iterator>
+  equal_prefix_range_impl(tagged_node_ptr search_start_node,
+                          const CharT* prefix, size_type prefix_size) const {
+    tagged_node_ptr current_node = search_start_node;
 
-    return longest_prefix_impl(*m_root, key, key_size);
-  }
+    for (size_type iprefix = 0; iprefix < prefix_size; iprefix++) {
+      if (current_node.is_trie_node()) {
+        const trie_node* tnode = &current_node.as_trie_node();
 
-  template <class F>
-  void for_each_prefix_of(const CharT* key, size_type key_size, F&& visitor) {
-    if (m_root != nullptr) {
-      for_each_prefix_of_impl<iterator>(*m_root, key, key_size,
-                                        std::forward<F>(visitor));
+        current_node = tnode->child(prefix[iprefix]);
+        if (current_node == nullptr) {
+          return std::make_pair(prefix_cend(), prefix_cend());
+        } else if (is_hybrid_hash_node(current_node)) {
+          return equal_prefix_range_hash_node(current_node.as_hash_node(),
+                                              prefix + iprefix,
+                                              prefix_size - iprefix);
+        }
+      } else {
+        return equal_prefix_range_hash_node(current_node.as_hash_node(),
+                                            prefix + iprefix,
+                                            prefix_size - iprefix);
+      }
     }
-  }
 
-  template <class F>
-  void for_each_prefix_of(const CharT* key, size_type key_size,
-                          F&& visitor) const {
-    if (m_root != nullptr) {
-      for_each_prefix_of_impl<const_iterator>(*m_root, key, key_size,
-                                              std::forward<F>(visitor));
-    }
+    const_prefix_iterator begin = cbegin<const_prefix_iterator>(*current_node);
+    const_prefix_iterator end = cend<const_prefix_iterator>(*current_node);
+
+    return std::make_pair(begin, end);
   }
 
-  /*
-   * Hash policy
-   */
-  float max_load_factor() const { return m_max_load_factor; }
+  std::pair<const_prefix_iterator, const_prefix_iterator>
+  equal_prefix_range_hash_node(const hash_node& hnode, const CharT* prefix,
+                               size_type prefix_size) const {
+    record_search(hnode, true);
+    const_prefix_iterator begin(hnode.parent(), &hnode,
+                                hnode.array_hash().begin(),
+                                hnode.array_hash().end(), false,
+                                std::basic_string<CharT>(prefix, prefix_size));
+    begin.filter_prefix();
 
-  void max_load_factor(float ml) {
-    const float min_max_load_factor = array_hash_type::MIN_MAX_LOAD_FACTOR;
-    m_max_load_factor = std::max(min_max_load_factor, ml);
+    const_prefix_iterator end = cend<const_prefix_iterator>(hnode);
+
+    return std::make_pair(begin, end);
   }
 
-  /*
-   * Burst policy
-   */
-  size_type burst_threshold() const { return m_burst_threshold; }
+  size_type erase_prefix_hash_node(hash_node& hnode, const CharT* prefix,
+                                   size_type prefix_size) {
+    size_type nb_erased = 0;
 
-  void burst_threshold(size_type threshold) {
-    const size_type min_burst_threshold = MIN_BURST_THRESHOLD;
-    const size_type max_burst_threshold = MAX_BURST_THRESHOLD;
+    const bool sorted_buckets = hnode.array_hash().sorted_buckets();
+    auto it = hnode.array_hash().begin();
+    while (it != hnode.array_hash().end()) {
+      const int cmp =
+          compare_to_prefix(it.key(), it.key_size(), prefix, prefix_size);
+      if (cmp == 0) {
+        it = hnode.array_hash().erase(it);
+        ++nb_erased;
+        --m_nb_elements;
+      } else if (sorted_buckets && cmp > 0) {
+        it.skip_bucket();
+      } else {
+        ++it;
+      }
+    }
 
-    m_burst_threshold = threshold;
-    m_burst_threshold = std::max(m_burst_threshold, min_burst_threshold);
-    m_burst_threshold = std::min(m_burst_threshold, max_burst_threshold);
-  }
+    if (hnode.array_hash().empty()) {
+      clear_empty_nodes(hnode);
+    }
 
-  /*
-   * Observers
-   */
-  hasher hash_function() const { return m_hash; }
+    return nb_erased;
+  }
 
   /*
-   * Other
+   * Burst
    */
-  template <class Serializer>
-  void serialize(Serializer& serializer) const {
-    serialize_impl(serializer);
-  }
-
-  template <class Deserializer>
-  void deserialize(Deserializer& deserializer, bool hash_compatible) {
-    deserialize_impl(deserializer, hash_compatible);
+  bool need_burst(const hash_node& node) const {
+    return node.array_hash().size() >= burst_threshold_of(node);
   }
 
- private:
   /**
-   * Get the begin iterator by searching for the most left descendant node
-   * starting at search_start_node.
+   * Burst threshold of the node. Without the adaptive burst, it's always
+   * m_burst_threshold.
+   *
+   * With the adaptive burst, once the node saw ADAPTIVE_BURST_MIN_SEARCHES
+   * searches, the threshold is divided by ADAPTIVE_BURST_FACTOR if at least a
+   * quarter of them are prefix searches, which then filter smaller nodes. It
+   * is multiplied by ADAPTIVE_BURST_FACTOR if almost all of them are exact
+   * searches, the node then stays a compact array hash longer.
    */
-  template <typename Iterator>
-  Iterator cbegin(const anode& search_start_node) const noexcept {
-    if (search_start_node.is_hash_node()) {
-      return Iterator(search_start_node.as_hash_node());
+  size_type burst_threshold_of(const hash_node& node) const noexcept {
+    if (!m_adaptive_burst) {
+      return m_burst_threshold;
     }
 
-    const trie_node& tnode =
-        search_start_node.as_trie_node().most_left_descendant_value_trie_node();
-    if (tnode.val_node() != nullptr) {
-      return Iterator(tnode);
+    const size_type min_burst_threshold = MIN_BURST_THRESHOLD;
+    const size_type max_burst_threshold = MAX_BURST_THRESHOLD;
+
+    const size_type nb_prefix = node.nb_prefix_searches();
+    const size_type nb_searches = nb_prefix + node.nb_exact_searches();
+    if (nb_searches < ADAPTIVE_BURST_MIN_SEARCHES) {
+      return m_burst_threshold;
+    } else if (nb_prefix * 4 >= nb_searches) {
+      return std::max(m_burst_threshold / ADAPTIVE_BURST_FACTOR,
+                      min_burst_threshold);
+    } else if (nb_prefix * 64 < nb_searches) {
+      return std::min(m_burst_threshold * ADAPTIVE_BURST_FACTOR,
+                      max_burst_threshold);
     } else {
-      const anode* first_child = tnode.first_child();
-      tsl_ht_assert(first_child != nullptr);
+      return m_burst_threshold;
+    }
+  }
 
-      return Iterator(first_child->as_hash_node());
+  void record_search(const hash_node& node, bool prefix_search) const noexcept {
+    if (m_adaptive_burst) {
+      node.record_search(prefix_search);
     }
   }
 
   /**
-   * Get an iterator to the node that come just after the last descendant of
-   * search_start_node.
+   * Burst the pure hash node into a new trie node or split the hybrid one,
+   * hnode is deleted. Return the node from which the keys of hnode, relative
+   * to hnode, can be searched: the new trie node or the parent of the hybrid
+   * node (the keys of a hybrid node keep the character of the parent).
    */
-  template <typename Iterator>
-  Iterator cend(const anode& search_start_node) const noexcept {
-    if (search_start_node.parent() == nullptr) {
-      Iterator it;
-      it.set_as_end_iterator();
+  tagged_node_ptr burst_or_split(hash_node& hnode) {
+    if (hnode.is_hybrid()) {
+      trie_node* parent = hnode.parent();
+      split(hnode);
 
-      return it;
+      return tagged_node_ptr(parent);
     }
 
-    const trie_node* current_trie_node = search_start_node.parent();
-    const anode* next_node = current_trie_node->next_child(search_start_node);
+    trie_node_ptr new_node = burst(hnode);
+    if (hnode.parent() == nullptr) {
+      tsl_ht_assert(m_root.get() == &hnode);
 
-    while (next_node == nullptr && current_trie_node->parent() != nullptr) {
-      const anode* current_child = current_trie_node;
-      current_trie_node = current_trie_node->parent();
-      next_node = current_trie_node->next_child(*current_child);
-    }
+      m_root = std::move(new_node);
+      return m_root.get();
+    } else {
+      trie_node* parent = hnode.parent();
+      const CharT child_of_char = hnode.child_of_char();
 
-    if (next_node == nullptr) {
-      Iterator it;
-      it.set_as_end_iterator();
+      parent->set_child(child_of_char, std::move(new_node));
 
-      return it;
-    } else {
-      return cbegin<Iterator>(*next_node);
+      return parent->child(child_of_char);
     }
   }
 
-  prefix_iterator prefix_end() noexcept {
-    prefix_iterator it;
-    it.set_as_end_iterator();
-
-    return it;
+  static bool is_hybrid_hash_node(tagged_node_ptr node) noexcept {
+    return node.is_hash_node() && node.as_hash_node().is_hybrid();
   }
 
-  const_prefix_iterator prefix_cend() const noexcept {
-    const_prefix_iterator it;
-    it.set_as_end_iterator();
+  /**
+   * First and last positions of the characters taken by child in its parent.
+   */
+  static std::size_t first_position(const anode& child) noexcept {
+    return (child.is_hash_node() && child.as_hash_node().is_hybrid())
+               ? child.as_hash_node().range_first()
+               : as_position(child.child_of_char());
+  }
 
-    return it;
+  static std::size_t last_position(const anode& child) noexcept {
+    return (child.is_hash_node() && child.as_hash_node().is_hybrid())
+               ? child.as_hash_node().range_last()
+               : as_position(child.child_of_char());
   }
 
-  size_type size_descendants(const anode& start_node) const {
-    auto first = cbegin<const_iterator>(start_node);
-    auto last = cend<const_iterator>(start_node);
+  /**
+   * Burst the node into a new trie_node. In pure mode each character gets its
+   * own hash_node, in hybrid mode the characters are split between at most two
+   * hash nodes.
+   */
+  trie_node_ptr burst(hash_node& node) {
+    tsl_ht_assert(!node.is_hybrid());
 
-    size_type nb_elements = 0;
-    while (first != last) {
-      if (first.m_read_trie_node_value) {
-        nb_elements++;
-        ++first;
-      } else {
-        nb_elements += first.m_current_hash_node->array_hash().size();
-        first.skip_hash_node();
+    const std::array<size_type, ALPHABET_SIZE> first_char_count =
+        get_first_char_count(node.array_hash().cbegin(),
+                             node.array_hash().cend());
+    std::array<hash_node*, ALPHABET_SIZE> destinations{{}};
+
+    auto new_node = make_node<trie_node>(m_alloc, m_alloc);
+    if (m_hybrid_mode) {
+      auto new_hnodes = create_split_hash_nodes(first_char_count, 0,
+                                                ALPHABET_SIZE - 1, destinations);
+      for (auto& new_hnode : new_hnodes) {
+        if (new_hnode != nullptr) {
+          add_hash_node_child(*new_node, std::move(new_hnode),
+                              first_char_count);
+        }
+      }
+    } else {
+      for (std::size_t pos = 0; pos < ALPHABET_SIZE; pos++) {
+        if (first_char_count[pos] > 0) {
+          auto new_hnode = create_hash_node(first_char_count[pos], pos, pos);
+          destinations[pos] = new_hnode.get();
+          new_node->set_child(as_char(pos), std::move(new_hnode));
+        }
       }
     }
 
-    return nb_elements;
+    move_elements(node, destinations, new_node.get());
+
+    tsl_ht_assert(!new_node->empty());
+    return new_node;
   }
 
-  template <class... ValueArgs>
-  std::pair<iterator, bool> insert_impl(anode& search_start_node,
-                                        const CharT* key, size_type key_size,
-                                        ValueArgs&&... value_args) {
-    anode* current_node = &search_start_node;
+  /**
+   * Split the hybrid node in at most two hash nodes on a range boundary.
+   * node is deleted.
+   */
+  void split(hash_node& node) {
+    tsl_ht_assert(node.is_hybrid() && node.parent() != nullptr);
 
-    for (size_type ikey = 0; ikey < key_size; ikey++) {
-      if (current_node->is_trie_node()) {
-        trie_node& tnode = current_node->as_trie_node();
+    const std::array<size_type, ALPHABET_SIZE> first_char_count =
+        get_first_char_count(node.array_hash().cbegin(),
+                             node.array_hash().cend());
+    std::array<hash_node*, ALPHABET_SIZE> destinations{{}};
 
-        if (tnode.child(key[ikey]) != nullptr) {
-          current_node = tnode.child(key[ikey]).get();
-        } else {
-          auto hnode = make_unique<hash_node>(m_hash, m_max_load_factor);
-          auto insert_it = hnode->array_hash().emplace_ks(
-              key + ikey + 1, key_size - ikey - 1,
-              std::forward<ValueArgs>(value_args)...);
+    auto new_hnodes = create_split_hash_nodes(
+        first_char_count, node.range_first(), node.range_last(), destinations);
+    move_elements(node, destinations, nullptr);
 
-          tnode.set_child(key[ikey], std::move(hnode));
-          m_nb_elements++;
+    node.parent()->split_child(node, std::move(new_hnodes[0]),
+                               std::move(new_hnodes[1]));
+  }
 
-          return std::make_pair(
-              iterator(tnode.child(key[ikey])->as_hash_node(), insert_it.first),
-              true);
-        }
-      } else {
-        return insert_in_hash_node(current_node->as_hash_node(), key + ikey,
-                                   key_size - ikey,
-                                   std::forward<ValueArgs>(value_args)...);
-      }
+  /**
+   * If all the keys of the pure hash node start with a common prefix, move the
+   * node under a chain of trie nodes, one for each character of the prefix,
+   * and remove the prefix from its keys. The prefix is then stored once in the
+   * trie instead of once per key. Nothing is done if the node doesn't have
+   * enough keys for the saved characters to outweigh the new trie nodes.
+   *
+   * Return the hash node holding the keys afterwards. If it's a new one, node
+   * is deleted.
+   */
+  hash_node& factor_common_prefix(hash_node& node) {
+    if (node.is_hybrid() ||
+        node.array_hash().size() * sizeof(CharT) < sizeof(trie_node)) {
+      return node;
     }
 
-    if (current_node->is_trie_node()) {
-      trie_node& tnode = current_node->as_trie_node();
-      if (tnode.val_node() != nullptr) {
-        return std::make_pair(iterator(tnode), false);
-      } else {
-        tnode.val_node() =
-            make_unique<value_node>(std::forward<ValueArgs>(value_args)...);
-        m_nb_elements++;
+    auto it = node.array_hash().cbegin();
+    const CharT* prefix = it.key();
+    size_type prefix_size = it.key_size();
+    for (++it; it != node.array_hash().cend() && prefix_size > 0; ++it) {
+      prefix_size = std::min(prefix_size, it.key_size());
+      prefix_size = size_type(
+          std::mismatch(prefix, prefix + prefix_size, it.key()).first - prefix);
+    }
 
-        return std::make_pair(iterator(tnode), true);
-      }
+    if (prefix_size == 0) {
+      return node;
+    }
+
+    const std::size_t last_char_pos = as_position(prefix[prefix_size - 1]);
+    std::array<hash_node*, ALPHABET_SIZE> destinations{{}};
+
+    auto new_hnode = create_hash_node(node.array_hash().size(), last_char_pos,
+                                      last_char_pos);
+    hash_node& compacted_node = *new_hnode;
+    destinations[last_char_pos] = new_hnode.get();
+
+    // Create all the nodes first, nothing can throw once the elements moved.
+    trie_node_ptr chain = make_node<trie_node>(m_alloc, m_alloc);
+    chain->set_child(prefix[prefix_size - 1], std::move(new_hnode));
+    for (size_type i = prefix_size - 1; i > 0; i--) {
+      auto tnode = make_node<trie_node>(m_alloc, m_alloc);
+      tnode->set_child(prefix[i - 1], std::move(chain));
+      chain = std::move(tnode);
+    }
+
+    move_elements(node, destinations, nullptr, prefix_size - 1);
+
+    if (node.parent() == nullptr) {
+      tsl_ht_assert(m_root.get() == &node);
+      m_root = std::move(chain);
     } else {
-      return insert_in_hash_node(current_node->as_hash_node(), "", 0,
-                                 std::forward<ValueArgs>(value_args)...);
+      node.parent()->set_child(node.child_of_char(), std::move(chain));
     }
+
+    return compacted_node;
   }
 
-  template <class... ValueArgs>
-  std::pair<iterator, bool> insert_in_hash_node(hash_node& hnode,
-                                                const CharT* key,
-                                                size_type key_size,
-                                                ValueArgs&&... value_args) {
-    if (need_burst(hnode)) {
-      std::unique_ptr<trie_node> new_node = burst(hnode);
-      if (hnode.parent() == nullptr) {
-        tsl_ht_assert(m_root.get() == &hnode);
+  /**
+   * Create the hash nodes that will receive the keys of a node covering the
+   * range [range_first, range_last], and set destinations accordingly.
+   *
+   * If all the keys start with the same character, only one pure hash node is
+   * created. Otherwise the range is split in two hybrid or pure hash nodes on
+   * the boundary which best balances the number of keys between them.
+   */
+  std::array<hash_node_ptr, 2> create_split_hash_nodes(
+      const std::array<size_type, ALPHABET_SIZE>& first_char_count,
+      std::size_t range_first, std::size_t range_last,
+      std::array<hash_node*, ALPHABET_SIZE>& destinations) {
+    std::size_t first_used = range_last;
+    std::size_t last_used = range_first;
+    size_type nb_keys = 0;
+    for (std::size_t pos = range_first; pos <= range_last; pos++) {
+      if (first_char_count[pos] > 0) {
+        first_used = std::min(first_used, pos);
+        last_used = pos;
+        nb_keys += first_char_count[pos];
+      }
+    }
+    tsl_ht_assert(nb_keys > 0);
 
-        m_root = std::move(new_node);
-        return insert_impl(*m_root, key, key_size,
-                           std::forward<ValueArgs>(value_args)...);
-      } else {
-        trie_node* parent = hnode.parent();
-        const CharT child_of_char = hnode.child_of_char();
+    std::array<hash_node_ptr, 2> new_hnodes;
+    if (first_used == last_used) {
+      new_hnodes[0] = create_hash_node(nb_keys, first_used, first_used);
+      destinations[first_used] = new_hnodes[0].get();
 
-        parent->set_child(child_of_char, std::move(new_node));
+      return new_hnodes;
+    }
 
-        return insert_impl(*parent->child(child_of_char), key, key_size,
-                           std::forward<ValueArgs>(value_args)...);
-      }
-    } else {
-      auto it_insert = hnode.array_hash().emplace_ks(
-          key, key_size, std::forward<ValueArgs>(value_args)...);
-      if (it_insert.second) {
-        m_nb_elements++;
+    std::size_t split_pos = first_used;
+    size_type nb_keys_first = 0;
+    size_type best_nb_keys_first = 0;
+    size_type best_imbalance = std::numeric_limits<size_type>::max();
+    for (std::size_t pos = first_used; pos < last_used; pos++) {
+      nb_keys_first += first_char_count[pos];
+
+      const size_type nb_keys_second = nb_keys - nb_keys_first;
+      const size_type imbalance = (nb_keys_first > nb_keys_second)
+                                      ? nb_keys_first - nb_keys_second
+                                      : nb_keys_second - nb_keys_first;
+      if (imbalance < best_imbalance) {
+        best_imbalance = imbalance;
+        best_nb_keys_first = nb_keys_first;
+        split_pos = pos;
       }
+    }
 
-      return std::make_pair(iterator(hnode, it_insert.first), it_insert.second);
+    new_hnodes[0] =
+        create_hash_node(best_nb_keys_first, range_first, split_pos);
+    new_hnodes[1] = create_hash_node(nb_keys - best_nb_keys_first,
+                                     split_pos + 1, range_last);
+    for (std::size_t pos = range_first; pos <= range_last; pos++) {
+      destinations[pos] = new_hnodes[(pos <= split_pos) ? 0 : 1].get();
     }
-  }
 
-  iterator erase(iterator pos) {
-    iterator next_pos = std::next(pos);
+    return new_hnodes;
+  }
 
-    if (pos.m_read_trie_node_value) {
-      tsl_ht_assert(pos.m_current_trie_node != nullptr &&
-                    pos.m_current_trie_node->val_node() != nullptr);
+  hash_node_ptr create_hash_node(size_type nb_elements,
+                                              std::size_t range_first,
+                                              std::size_t range_last) {
+    const size_type nb_buckets = size_type(
+        std::ceil(float(nb_elements + HASH_NODE_DEFAULT_INIT_BUCKETS_COUNT / 2) /
+                  m_max_load_factor));
 
-      pos.m_current_trie_node->val_node().reset(nullptr);
-      m_nb_elements--;
+    auto hnode = make_node<hash_node>(m_alloc, nb_buckets, m_hash,
+                                      m_max_load_factor, m_alloc);
+    hnode->set_range(range_first, range_last);
 
-      if (pos.m_current_trie_node->empty()) {
-        clear_empty_nodes(*pos.m_current_trie_node);
-      }
+    return hnode;
+  }
 
-      return next_pos;
-    } else {
-      tsl_ht_assert(pos.m_current_hash_node != nullptr);
-      auto next_array_hash_it = pos.m_current_hash_node->array_hash().erase(
-          pos.m_array_hash_iterator);
-      m_nb_elements--;
+  /**
+   * Add hnode as child of tnode with a slot for each character of its range
+   * used by a key.
+   */
+  void add_hash_node_child(
+      trie_node& tnode, hash_node_ptr hnode,
+      const std::array<size_type, ALPHABET_SIZE>& first_char_count) {
+    const std::size_t range_first = hnode->range_first();
+    const std::size_t range_last = hnode->range_last();
+
+    std::size_t pos = range_first;
+    while (first_char_count[pos] == 0) {
+      pos++;
+      tsl_ht_assert(pos <= range_last);
+    }
 
-      if (next_array_hash_it != pos.m_current_hash_node->array_hash().end()) {
-        // The erase on array_hash invalidated the next_pos iterator, return the
-        // right one.
-        return iterator(*pos.m_current_hash_node, next_array_hash_it);
-      } else {
-        if (pos.m_current_hash_node->array_hash().empty()) {
-          clear_empty_nodes(*pos.m_current_hash_node);
-        }
+    tnode.set_child(as_char(pos), std::move(hnode));
+    const tagged_node_ptr child = tnode.child(as_char(pos));
 
-        return next_pos;
+    for (pos++; pos <= range_last; pos++) {
+      if (first_char_count[pos] > 0) {
+        tnode.add_child_slot(as_char(pos), child);
       }
     }
   }
 
   /**
-   * Clear all the empty nodes from the tree starting from empty_node (empty for
-   * a hash_node means that the array hash is empty, for a trie_node it means
-   * the node doesn't have any child or value_node associated to it).
+   * Replace tnode, which holds nb_elements elements with its descendants, by
+   * a single pure hash node. The keys of the new node are relative to tnode,
+   * the value of tnode itself has an empty key.
+   *
+   * The new node is filled at once through insert_unique before tnode is
+   * deleted, tnode is unchanged if an exception is thrown. The values are
+   * moved if their move constructor doesn't throw, copied otherwise.
    */
-  void clear_empty_nodes(anode& empty_node) noexcept {
-    tsl_ht_assert(!empty_node.is_trie_node() ||
-                  empty_node.as_trie_node().empty());
-    tsl_ht_assert(!empty_node.is_hash_node() ||
-                  empty_node.as_hash_node().array_hash().empty());
+  void merge_trie_node(trie_node& tnode, size_type nb_elements) {
+    std::size_t prefix_size = 0;
+    for (const trie_node* parent = tnode.parent(); parent != nullptr;
+         parent = parent->parent()) {
+      prefix_size++;
+    }
 
-    trie_node* parent = empty_node.parent();
+    // The keys relative to tnode are appended to keys, which may reallocate.
+    // The elements only point to them once all the keys are appended.
+    std::basic_string<CharT> keys;
+    std::basic_string<CharT> key_buffer;
+    std::vector<std::size_t> key_positions;
+    std::vector<bulk_element> elements;
+    key_positions.reserve(nb_elements);
+    elements.reserve(nb_elements);
+
+    auto last = cend<const_iterator>(tnode);
+    for (auto it = cbegin<const_iterator>(tnode); it != last; ++it) {
+      it.key(key_buffer);
+      tsl_ht_assert(key_buffer.size() >= prefix_size);
+
+      key_positions.push_back(keys.size());
+      elements.emplace_back(nullptr,
+                            size_type(key_buffer.size() - prefix_size),
+                            element_value_ptr(it));
+      keys.append(key_buffer, prefix_size, key_buffer.npos);
+    }
+    tsl_ht_assert(elements.size() == nb_elements);
+
+    for (std::size_t i = 0; i < elements.size(); i++) {
+      elements[i].m_key = keys.data() + key_positions[i];
+    }
+
+    const std::size_t pos =
+        (tnode.parent() != nullptr) ? as_position(tnode.child_of_char()) : 0;
+    auto new_hnode = create_hash_node(nb_elements, pos, pos);
+    new_hnode->template insert_unique<
+        std::is_nothrow_move_constructible<T>::value>(elements.begin(),
+                                                      elements.end(), 0);
+
+    // Replacing an existing child doesn't throw.
+    trie_node* parent = tnode.parent();
     if (parent == nullptr) {
-      tsl_ht_assert(m_root.get() == &empty_node);
-      tsl_ht_assert(m_nb_elements == 0);
-      m_root.reset(nullptr);
-    } else if (parent->val_node() != nullptr || parent->nb_children() > 1) {
-      parent->child(empty_node.child_of_char()).reset(nullptr);
-    } else if (parent->parent() == nullptr) {
-      tsl_ht_assert(m_root.get() == empty_node.parent());
-      tsl_ht_assert(m_nb_elements == 0);
-      m_root.reset(nullptr);
+      m_root = std::move(new_hnode);
     } else {
-      /**
-       * Parent is empty if we remove its empty_node child.
-       * Put empty_node as new child of the grand parent instead of parent (move
-       * hnode up, and delete the parent). And recurse.
-       *
-       * We can't just set grand_parent->child(parent->child_of_char()) to
-       * nullptr as the grand_parent may also become empty. We don't want empty
-       * trie_node with no value_node in the tree.
-       */
-      trie_node* grand_parent = parent->parent();
-      grand_parent->set_child(
-          parent->child_of_char(),
-          std::move(parent->child(empty_node.child_of_char())));
-
-      clear_empty_nodes(empty_node);
+      parent->set_child(tnode.child_of_char(), std::move(new_hnode));
     }
   }
 
-  iterator find_impl(const anode& search_start_node, const CharT* key,
-                     size_type key_size) {
-    return mutable_iterator(static_cast<const htrie_hash*>(this)->find_impl(
-        search_start_node, key, key_size));
+  template <class U = T,
+            typename std::enable_if<has_value<U>::value>::type* = nullptr>
+  U* element_value_ptr(const_iterator it) noexcept {
+    return std::addressof(mutable_iterator(it).value());
   }
 
-  const_iterator find_impl(const anode& search_start_node, const CharT* key,
-                           size_type key_size) const {
-    const anode* current_node = &search_start_node;
+  template <class U = T,
+            typename std::enable_if<!has_value<U>::value>::type* = nullptr>
+  U* element_value_ptr(const_iterator /*it*/) noexcept {
+    return nullptr;
+  }
 
-    for (size_type ikey = 0; ikey < key_size; ikey++) {
-      if (current_node->is_trie_node()) {
-        const trie_node* tnode = &current_node->as_trie_node();
+  using bulk_element_iterator = typename std::vector<bulk_element>::iterator;
 
-        if (tnode->child(key[ikey]) == nullptr) {
-          return cend();
-        } else {
-          current_node = tnode->child(key[ikey]).get();
-        }
-      } else {
-        return find_in_hash_node(current_node->as_hash_node(), key + ikey,
-                                 key_size - ikey);
-      }
+  /**
+   * Sorted and unique elements in [first, last) sharing the key_index first
+   * characters of their keys, to insert under the trie node tnode. See
+   * insert_sorted.
+   */
+  struct sorted_range {
+    trie_node* tnode;
+    bulk_element_iterator first;
+    bulk_element_iterator last;
+    size_type key_index;
+  };
+
+  /**
+   * std::char_traits<char> compares the characters as unsigned char, in the
+   * order of their position in the trie nodes.
+   */
+  static bool bulk_key_less(const bulk_element& lhs,
+                            const bulk_element& rhs) noexcept {
+    const int cmp = std::char_traits<CharT>::compare(
+        lhs.key(), rhs.key(), std::min(lhs.key_size(), rhs.key_size()));
+    return cmp < 0 || (cmp == 0 && lhs.key_size() < rhs.key_size());
+  }
+
+  static bool bulk_key_equal(const bulk_element& lhs,
+                             const bulk_element& rhs) noexcept {
+    return lhs.key_size() == rhs.key_size() &&
+           std::char_traits<CharT>::compare(lhs.key(), rhs.key(),
+                                            lhs.key_size()) == 0;
+  }
+
+  /**
+   * Stable sort of the elements by key. With nb_threads > 1, nb_threads
+   * chunks are sorted in parallel and then merged two by two, the merges of
+   * a round running in parallel too.
+   */
+  static void sort_bulk_elements(std::vector<bulk_element>& elements,
+                                 std::size_t nb_threads) {
+    const std::size_t nb_chunks = std::min(nb_threads, elements.size());
+    if (nb_chunks <= 1) {
+      std::stable_sort(elements.begin(), elements.end(), bulk_key_less);
+      return;
     }
 
-    if (current_node->is_trie_node()) {
-      const trie_node& tnode = current_node->as_trie_node();
-      return (tnode.val_node() != nullptr) ? const_iterator(tnode) : cend();
-    } else {
-      return find_in_hash_node(current_node->as_hash_node(), "", 0);
+    std::vector<bulk_element_iterator> bounds(nb_chunks + 1);
+    for (std::size_t i = 0; i <= nb_chunks; i++) {
+      bounds[i] = elements.begin() + std::ptrdiff_t(elements.size() * i /
+                                                    nb_chunks);
     }
-  }
 
-  const_iterator find_in_hash_node(const hash_node& hnode, const CharT* key,
-                                   size_type key_size) const {
-    auto it = hnode.array_hash().find_ks(key, key_size);
-    if (it != hnode.array_hash().end()) {
-      return const_iterator(hnode, it);
-    } else {
-      return cend();
+    run_parallel(nb_chunks, nb_threads, [&](std::size_t ichunk) {
+      std::stable_sort(bounds[ichunk], bounds[ichunk + 1], bulk_key_less);
+    });
+
+    for (std::size_t width = 1; width < nb_chunks; width *= 2) {
+      const std::size_t nb_merges = (nb_chunks - width + 2 * width - 1) /
+                                    (2 * width);
+      run_parallel(nb_merges, nb_threads, [&](std::size_t imerge) {
+        const std::size_t ifirst = imerge * 2 * width;
+        const std::size_t imiddle = ifirst + width;
+        const std::size_t ilast = std::min(imiddle + width, nb_chunks);
+        std::inplace_merge(bounds[ifirst], bounds[imiddle], bounds[ilast],
+                           bulk_key_less);
+      });
     }
   }
 
-  iterator longest_prefix_impl(const anode& search_start_node,
-                               const CharT* value, size_type value_size) {
-    return mutable_iterator(
-        static_cast<const htrie_hash*>(this)->longest_prefix_impl(
-            search_start_node, value, value_size));
+  /**
+   * Build all the sorted ranges and the ranges of their descendants, see
+   * insert_sorted.
+   */
+  void build_sorted_ranges(std::vector<sorted_range> ranges) {
+    while (!ranges.empty()) {
+      const sorted_range range = ranges.back();
+      ranges.pop_back();
+
+      build_sorted_range(range, ranges);
+    }
   }
 
-  const_iterator longest_prefix_impl(const anode& search_start_node,
-                                     const CharT* value,
-                                     size_type value_size) const {
-    const anode* current_node = &search_start_node;
-    const_iterator longest_found_prefix = cend();
+  /**
+   * Build the sorted ranges on nb_threads threads. The subtries of the
+   * different ranges are independent: the biggest ranges are first split,
+   * on the calling thread, by their leading characters until there are enough
+   * ranges to keep the threads busy, the threads then build them from the
+   * biggest to the smallest.
+   */
+  void build_sorted_ranges_parallel(std::vector<sorted_range> ranges,
+                                    std::size_t nb_threads) {
+    const std::size_t min_nb_ranges =
+        nb_threads * PARALLEL_BUILD_RANGES_PER_THREAD;
+    const auto smaller_range = [](const sorted_range& lhs,
+                                  const sorted_range& rhs) {
+      return std::distance(lhs.first, lhs.last) <
+             std::distance(rhs.first, rhs.last);
+    };
+
+    std::make_heap(ranges.begin(), ranges.end(), smaller_range);
+    std::vector<sorted_range> child_ranges;
+    while (!ranges.empty() && ranges.size() < min_nb_ranges) {
+      std::pop_heap(ranges.begin(), ranges.end(), smaller_range);
+      const sorted_range range = ranges.back();
+      ranges.pop_back();
+
+      child_ranges.clear();
+      build_sorted_range(range, child_ranges);
+      for (const sorted_range& child_range : child_ranges) {
+        ranges.push_back(child_range);
+        std::push_heap(ranges.begin(), ranges.end(), smaller_range);
+      }
+    }
 
-    for (size_type ivalue = 0; ivalue < value_size; ivalue++) {
-      if (current_node->is_trie_node()) {
-        const trie_node& tnode = current_node->as_trie_node();
+    std::sort_heap(ranges.begin(), ranges.end(), smaller_range);
+    run_parallel(ranges.size(), nb_threads, [&](std::size_t irange) {
+      build_sorted_ranges({ranges[ranges.size() - irange - 1]});
+    });
+  }
 
-        if (tnode.val_node() != nullptr) {
-          longest_found_prefix = const_iterator(tnode);
-        }
+  /**
+   * Build the value and the hash node children of range.tnode from the
+   * elements of range. The ranges of its trie node children, which are
+   * created empty, are appended to child_ranges.
+   */
+  void build_sorted_range(const sorted_range& range,
+                          std::vector<sorted_range>& child_ranges) {
+    trie_node& tnode = *range.tnode;
+    const size_type key_index = range.key_index;
+    bulk_element_iterator it = range.first;
+    if (it->key_size() == key_index) {
+      emplace_bulk_value(tnode, *it);
+      ++it;
+    }
 
-        if (tnode.child(value[ivalue]) == nullptr) {
-          return longest_found_prefix;
-        } else {
-          current_node = tnode.child(value[ivalue]).get();
-        }
+    // Elements of the small groups waiting for their hash node, shared by
+    // the consecutive small groups in hybrid mode.
+    bulk_element_iterator pending_first = it;
+    std::size_t nb_pending_chars = 0;
+
+    while (it != range.last) {
+      // The characters at key_index are sorted, binary search the end of
+      // the group instead of reading the keys of all its elements.
+      const CharT c = it->key()[key_index];
+      const bulk_element_iterator group_last = std::upper_bound(
+          it, range.last, as_position(c),
+          [key_index](std::size_t pos, const bulk_element& element) {
+            return pos < as_position(element.key()[key_index]);
+          });
+
+      const size_type nb_group_elements =
+          size_type(std::distance(it, group_last));
+      const size_type nb_pending_elements =
+          size_type(std::distance(pending_first, it));
+
+      if (nb_group_elements >= m_burst_threshold) {
+        add_sorted_hash_node(tnode, pending_first, it, key_index,
+                             nb_pending_chars);
+
+        auto child = make_node<trie_node>(m_alloc, m_alloc);
+        trie_node* child_ptr = child.get();
+        tnode.set_child(c, std::move(child));
+        child_ranges.push_back({child_ptr, it, group_last, key_index + 1});
+
+        pending_first = group_last;
+        nb_pending_chars = 0;
+      } else if (m_hybrid_mode && nb_pending_elements + nb_group_elements <
+                                      m_burst_threshold) {
+        nb_pending_chars++;
       } else {
-        const hash_node& hnode = current_node->as_hash_node();
-
-        /**
-         * Test the presence in the hash node of each substring from the
-         * remaining [ivalue, value_size) string starting from the longest.
-         * Also test the empty string.
-         */
-        for (std::size_t i = ivalue; i <= value_size; i++) {
-          auto it =
-              hnode.array_hash().find_ks(value + ivalue, (value_size - i));
-          if (it != hnode.array_hash().end()) {
-            return const_iterator(hnode, it);
-          }
-        }
+        add_sorted_hash_node(tnode, pending_first, it, key_index,
+                             nb_pending_chars);
 
-        return longest_found_prefix;
+        pending_first = it;
+        nb_pending_chars = 1;
       }
+
+      it = group_last;
     }
 
-    if (current_node->is_trie_node()) {
-      const trie_node& tnode = current_node->as_trie_node();
+    add_sorted_hash_node(tnode, pending_first, range.last, key_index,
+                         nb_pending_chars);
+  }
 
-      if (tnode.val_node() != nullptr) {
-        longest_found_prefix = const_iterator(tnode);
-      }
-    } else {
-      const hash_node& hnode = current_node->as_hash_node();
+  /**
+   * Add a hash node child to tnode with the elements in [first, last), which
+   * share the key_index first characters of their keys and use
+   * nb_chars different characters at key_index. The node is a pure hash node
+   * if nb_chars is 1, a hybrid one with a slot for each character otherwise.
+   */
+  void add_sorted_hash_node(trie_node& tnode, bulk_element_iterator first,
+                            bulk_element_iterator last, size_type key_index,
+                            std::size_t nb_chars) {
+    if (nb_chars == 0) {
+      tsl_ht_assert(first == last);
+      return;
+    }
 
-      auto it = hnode.array_hash().find_ks("", 0);
-      if (it != hnode.array_hash().end()) {
-        longest_found_prefix = const_iterator(hnode, it);
+    const std::size_t range_first = as_position(first->key()[key_index]);
+    const std::size_t range_last =
+        as_position(std::prev(last)->key()[key_index]);
+    tsl_ht_assert((nb_chars == 1) == (range_first == range_last));
+
+    auto hnode = create_hash_node(size_type(std::distance(first, last)),
+                                  range_first, range_last);
+    hnode->template insert_unique<false>(
+        first, last, key_index + (nb_chars == 1 ? 1 : 0));
+
+    tnode.set_child(as_char(range_first), std::move(hnode));
+    const tagged_node_ptr child = tnode.child(as_char(range_first));
+    for (auto it = first; it != last; ++it) {
+      // No-op for the characters which already have a slot.
+      tnode.add_child_slot(it->key()[key_index], child);
+    }
+  }
+
+  /**
+   * Insert the elements of range under the existing trie node range.tnode.
+   * The elements aren't sorted, they are first partitioned by their
+   * character at range.key_index with a stable counting sort through
+   * partition_buffer, which has the size of the batch. The ranges of the
+   * elements going in its trie node children, and in the nodes replacing its
+   * burst or split hash node children, are appended to ranges. See
+   * insert_batch.
+   */
+  void insert_batch_range(const sorted_range& range,
+                          std::vector<bulk_element>& partition_buffer,
+                          std::vector<sorted_range>& ranges) {
+    trie_node& tnode = *range.tnode;
+    const size_type key_index = range.key_index;
+
+    // Group 0 holds the elements whose key ends at key_index, the group
+    // pos + 1 the ones with the character of position pos at key_index.
+    const auto group_of = [key_index](const bulk_element& element) {
+      return (element.key_size() == key_index)
+                 ? std::size_t(0)
+                 : as_position(element.key()[key_index]) + 1;
+    };
+
+    std::array<size_type, ALPHABET_SIZE + 2> offsets{{}};
+    for (auto it = range.first; it != range.last; ++it) {
+      offsets[group_of(*it) + 1]++;
+    }
+    std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+
+    // Nothing to move if all the elements are in the same group, as along a
+    // path of trie nodes with a single child. Otherwise the range is copied
+    // back right away, the buffer can be reused from its beginning by each
+    // range.
+    const size_type nb_elements =
+        size_type(std::distance(range.first, range.last));
+    const std::size_t first_group = group_of(*range.first);
+    if (offsets[first_group + 1] - offsets[first_group] != nb_elements) {
+      std::array<size_type, ALPHABET_SIZE + 2> positions = offsets;
+      for (auto it = range.first; it != range.last; ++it) {
+        partition_buffer[positions[group_of(*it)]++] = *it;
       }
+      std::copy(partition_buffer.begin(),
+                partition_buffer.begin() + std::ptrdiff_t(nb_elements),
+                range.first);
     }
 
-    return longest_found_prefix;
-  }
+    const auto group_first = [&](std::size_t group) {
+      return range.first + std::ptrdiff_t(offsets[group]);
+    };
 
-  template <class Iterator, class N, class F>
-  void for_each_prefix_of_impl(N& search_start_node, const CharT* value,
-                               size_type value_size, F&& visitor) const {
-    auto* current_node = &search_start_node;
+    if (offsets[1] > 0 && !tnode.holds_value()) {
+      emplace_bulk_value(tnode, *range.first);
+      m_nb_elements++;
+    }
 
-    for (size_type ivalue = 0; ivalue < value_size; ivalue++) {
-      if (current_node->is_trie_node()) {
-        auto& tnode = current_node->as_trie_node();
+    std::size_t pos = 0;
+    while (pos < ALPHABET_SIZE) {
+      if (offsets[pos + 2] == offsets[pos + 1]) {
+        pos++;
+        continue;
+      }
 
-        if (tnode.val_node() != nullptr) {
-          visitor(Iterator(tnode));
+      const CharT c = as_char(pos);
+      tagged_node_ptr child = tnode.child(c);
+      if (child == nullptr && m_hybrid_mode) {
+        const tagged_node_ptr before = tnode.child_before(pos);
+        const tagged_node_ptr after = tnode.child_after(pos);
+        if (is_hybrid_hash_node(before) &&
+            before.as_hash_node().range_last() >= pos) {
+          child = before;
+        } else if (is_hybrid_hash_node(after) &&
+                   after.as_hash_node().range_first() <= pos) {
+          child = after;
         }
+      }
 
-        if (tnode.child(value[ivalue]) == nullptr) {
-          return;
-        } else {
-          current_node = tnode.child(value[ivalue]).get();
-        }
-      } else {
-        auto& hnode = current_node->as_hash_node();
+      // A hybrid child takes the elements of all the characters of its range.
+      const std::size_t last_pos =
+          is_hybrid_hash_node(child) ? child.as_hash_node().range_last() : pos;
+      const bulk_element_iterator first = group_first(pos + 1);
+      const bulk_element_iterator last = group_first(last_pos + 2);
 
-        /**
-         * Test the presence in the hash node of each substring from the
-         * remaining [ivalue, value_size) string starting from the shortest.
-         * Also test the empty string.
-         */
-        for (std::size_t i = value_size + 1; i > ivalue; i--) {
-          auto it =
-              hnode.array_hash().find_ks(value + ivalue, (value_size - i + 1));
-          if (it != hnode.array_hash().end()) {
-            visitor(Iterator(hnode, it));
+      if (child == nullptr) {
+        add_batch_child(tnode, first, last, key_index);
+      } else if (child.is_trie_node()) {
+        ranges.push_back({&child.as_trie_node(), first, last, key_index + 1});
+      } else {
+        hash_node& hnode = child.as_hash_node();
+        const bool hybrid = hnode.is_hybrid();
+        if (hybrid) {
+          for (auto it = first; it != last; ++it) {
+            // No-op for the characters which already have a slot.
+            tnode.add_child_slot(it->key()[key_index], child);
           }
         }
 
-        return;
+        const size_type key_offset = key_index + (hybrid ? 0 : 1);
+        if (!insert_batch_in_hash_node(hnode, first, last, key_offset)) {
+          const tagged_node_ptr new_node = burst_or_split(hnode);
+          ranges.push_back({&new_node.as_trie_node(), first, last, key_offset});
+        }
       }
+
+      pos = last_pos + 1;
     }
+  }
 
-    if (current_node->is_trie_node()) {
-      auto& tnode = current_node->as_trie_node();
+  /**
+   * Insert the elements of [first, last), without their key_offset first
+   * characters, in hnode after a single reserve. Return false, without
+   * inserting anything, if hnode would go over its burst threshold: it must
+   * then be burst or split first.
+   */
+  bool insert_batch_in_hash_node(hash_node& hnode, bulk_element_iterator first,
+                                 bulk_element_iterator last,
+                                 size_type key_offset) {
+    const size_type new_size =
+        hnode.array_hash().size() + size_type(std::distance(first, last));
+    if (new_size > burst_threshold_of(hnode)) {
+      return false;
+    }
 
-      if (tnode.val_node() != nullptr) {
-        visitor(Iterator(tnode));
-      }
-    } else {
-      auto& hnode = current_node->as_hash_node();
+    // reserve may also shrink the buckets, only call it to grow them.
+    array_hash_type& array_hash = hnode.array_hash();
+    if (float(new_size) > float(array_hash.bucket_count()) *
+                              array_hash.max_load_factor()) {
+      array_hash.reserve(new_size);
+    }
 
-      auto it = hnode.array_hash().find_ks("", 0);
-      if (it != hnode.array_hash().end()) {
-        visitor(Iterator(hnode, it));
+    for (auto it = first; it != last; ++it) {
+      if (insert_bulk_element_in_hash_node(hnode, *it, key_offset)) {
+        m_nb_elements++;
       }
     }
-  }
 
-  std::pair<prefix_iterator, prefix_iterator> equal_prefix_range_impl(
-      anode& search_start_node, const CharT* prefix, size_type prefix_size) {
-    auto range = static_cast<const htrie_hash*>(this)->equal_prefix_range_impl(
-        search_start_node, prefix, prefix_size);
-    return std::make_pair(mutable_iterator(range.first),
-                          mutable_iterator(range.second));
+    return true;
   }
 
-  std::pair<const_prefix_iterator, const_prefix_iterator>
-  equal_prefix_range_impl(const anode& search_start_node, const CharT* prefix,
-                          size_type prefix_size) const {
-    const anode* current_node = &search_start_node;
-
-    for (size_type iprefix = 0; iprefix < prefix_size; iprefix++) {
-      if (current_node->is_trie_node()) {
-        const trie_node* tnode = &current_node->as_trie_node();
-
-        if (tnode->child(prefix[iprefix]) == nullptr) {
-          return std::make_pair(prefix_cend(), prefix_cend());
-        } else {
-          current_node = tnode->child(prefix[iprefix]).get();
-        }
-      } else {
-        const hash_node& hnode = current_node->as_hash_node();
-        const_prefix_iterator begin(
-            hnode.parent(), &hnode, hnode.array_hash().begin(),
-            hnode.array_hash().end(), false,
-            std::basic_string<CharT>(prefix + iprefix, prefix_size - iprefix));
-        begin.filter_prefix();
-
-        const_prefix_iterator end = cend<const_prefix_iterator>(*current_node);
-
-        return std::make_pair(begin, end);
-      }
+  /**
+   * Add a new child to tnode for the elements of [first, last), which share
+   * the key_index + 1 first characters of their keys. The elements are
+   * sorted and the child is built from them (see insert_sorted) before being
+   * attached to tnode, which is unchanged if an exception is thrown.
+   */
+  void add_batch_child(trie_node& tnode, bulk_element_iterator first,
+                       bulk_element_iterator last, size_type key_index) {
+    std::stable_sort(first, last, bulk_key_less);
+    last = std::unique(first, last, bulk_key_equal);
+
+    const CharT c = first->key()[key_index];
+    const size_type nb_elements = size_type(std::distance(first, last));
+
+    if (nb_elements >= m_burst_threshold) {
+      auto child = make_node<trie_node>(m_alloc, m_alloc);
+      build_sorted_ranges({{child.get(), first, last, key_index + 1}});
+      tnode.set_child(c, std::move(child));
+    } else {
+      const std::size_t pos = as_position(c);
+      auto child = create_hash_node(nb_elements, pos, pos);
+      child->template insert_unique<false>(first, last, key_index + 1);
+      tnode.set_child(c, std::move(child));
     }
 
-    const_prefix_iterator begin = cbegin<const_prefix_iterator>(*current_node);
-    const_prefix_iterator end = cend<const_prefix_iterator>(*current_node);
+    m_nb_elements += nb_elements;
+  }
 
-    return std::make_pair(begin, end);
+  template <class U = T,
+            typename std::enable_if<has_value<U>::value>::type* = nullptr>
+  bool insert_bulk_element_in_hash_node(hash_node& hnode,
+                                        const bulk_element& element,
+                                        size_type key_offset) {
+    return hnode
+        .insert_ks(element.key() + key_offset, element.key_size() - key_offset,
+                   element.value())
+        .second;
   }
 
-  size_type erase_prefix_hash_node(hash_node& hnode, const CharT* prefix,
-                                   size_type prefix_size) {
-    size_type nb_erased = 0;
+  template <class U = T,
+            typename std::enable_if<!has_value<U>::value>::type* = nullptr>
+  bool insert_bulk_element_in_hash_node(hash_node& hnode,
+                                        const bulk_element& element,
+                                        size_type key_offset) {
+    return hnode
+        .insert_ks(element.key() + key_offset, element.key_size() - key_offset)
+        .second;
+  }
 
-    auto it = hnode.array_hash().begin();
-    while (it != hnode.array_hash().end()) {
-      if (it.key_size() >= prefix_size &&
-          std::memcmp(prefix, it.key(), prefix_size * sizeof(CharT)) == 0) {
-        it = hnode.array_hash().erase(it);
-        ++nb_erased;
-        --m_nb_elements;
-      } else {
-        ++it;
-      }
-    }
+  template <class U = T,
+            typename std::enable_if<has_value<U>::value>::type* = nullptr>
+  void emplace_bulk_value(trie_node& tnode, const bulk_element& element) {
+    tnode.emplace_value(element.value());
+  }
 
-    if (hnode.array_hash().empty()) {
-      clear_empty_nodes(hnode);
-    }
+  template <class U = T,
+            typename std::enable_if<!has_value<U>::value>::type* = nullptr>
+  void emplace_bulk_value(trie_node& tnode, const bulk_element& /*element*/) {
+    tnode.emplace_value();
+  }
 
-    return nb_erased;
+  template <class U = T,
+            typename std::enable_if<has_value<U>::value>::type* = nullptr>
+  void insert_bulk_element(const bulk_element& element) {
+    insert(element.key(), element.key_size(), element.value());
   }
 
-  /*
-   * Burst
-   */
-  bool need_burst(hash_node& node) const {
-    return node.array_hash().size() >= m_burst_threshold;
+  template <class U = T,
+            typename std::enable_if<!has_value<U>::value>::type* = nullptr>
+  void insert_bulk_element(const bulk_element& element) {
+    insert(element.key(), element.key_size());
   }
 
   /**
-   * Burst the node and use the copy constructor instead of move constructor for
-   * the values. Also use this method for trivial value types like int, int*,
-   * ... as it requires less book-keeping (thus faster) than the burst using
-   * move constructors.
+   * Move the elements of node to the hash nodes in destinations, indexed by
+   * the position of the first character of the key. The first character is
+   * removed from the key if the destination is a pure hash node. The element
+   * with an empty key, if any, becomes the value of value_destination.
+   *
+   * If first_char_index is not 0, the first character is the one at this
+   * index and the characters before it, which must be shared by all the keys,
+   * are removed too.
+   *
+   * The destinations must be empty. Each one receives all its elements at
+   * once through insert_unique, see insert_grouped_elements.
+   *
+   * Use the copy constructor instead of move constructor for the values. Also
+   * use this method for trivial value types like int, int*, ... as it requires
+   * less book-keeping (thus faster) than the move using move constructors.
    */
   template <class U = T,
             typename std::enable_if<
@@ -1763,31 +4784,28 @@ class htrie_hash {
                  !std::is_nothrow_move_assignable<U>::value ||
                  std::is_arithmetic<U>::value ||
                  std::is_pointer<U>::value)>::type* = nullptr>
-  std::unique_ptr<trie_node> burst(hash_node& node) {
-    const std::array<size_type, ALPHABET_SIZE> first_char_count =
-        get_first_char_count(node.array_hash().cbegin(),
-                             node.array_hash().cend());
-
-    auto new_node = make_unique<trie_node>();
-    for (auto it = node.array_hash().cbegin(); it != node.array_hash().cend();
-         ++it) {
-      if (it.key_size() == 0) {
-        new_node->val_node() = make_unique<value_node>(it.value());
-      } else {
-        hash_node& hnode =
-            get_hash_node_for_char(first_char_count, *new_node, it.key()[0]);
-        hnode.array_hash().insert_ks(it.key() + 1, it.key_size() - 1,
-                                     it.value());
-      }
+  void move_elements(hash_node& node,
+                     const std::array<hash_node*, ALPHABET_SIZE>& destinations,
+                     trie_node* value_destination,
+                     size_type first_char_index = 0) {
+    std::vector<typename array_hash_type::iterator> grouped;
+    std::array<size_type, ALPHABET_SIZE + 1> offsets;
+    auto it_value =
+        group_elements_by_char(node, first_char_index, grouped, offsets);
+
+    if (it_value != node.array_hash().end()) {
+      tsl_ht_assert(value_destination != nullptr);
+      value_destination->emplace_value(it_value.value());
     }
 
-    tsl_ht_assert(!new_node->empty());
-    return new_node;
+    size_type nb_inserted = 0;
+    insert_grouped_elements<false>(destinations, grouped, offsets,
+                                   first_char_index, nb_inserted);
   }
 
   /**
-   * Burst the node and use the move constructor and move assign operator if
-   * they don't throw.
+   * Move the elements of node and use the move constructor and move assign
+   * operator if they don't throw.
    */
   template <class U = T, typename std::enable_if<
                              has_value<U>::value &&
@@ -1795,49 +4813,47 @@ class htrie_hash {
                              std::is_nothrow_move_assignable<U>::value &&
                              !std::is_arithmetic<U>::value &&
                              !std::is_pointer<U>::value>::type* = nullptr>
-  std::unique_ptr<trie_node> burst(hash_node& node) {
-    /**
-     * We burst the node->array_hash() into multiple arrays hash. While doing
-     * so, we move each value in the node->array_hash() into the new arrays
-     * hash. After each move, we save a pointer to where the value has been
-     * moved. In case of exception, we rollback these values into the original
-     * node->array_hash().
-     */
-    std::vector<T*> moved_values_rollback;
-    moved_values_rollback.reserve(node.array_hash().size());
-
+  void move_elements(hash_node& node,
+                     const std::array<hash_node*, ALPHABET_SIZE>& destinations,
+                     trie_node* value_destination,
+                     size_type first_char_index = 0) {
+    std::vector<typename array_hash_type::iterator> grouped;
+    std::array<size_type, ALPHABET_SIZE + 1> offsets;
+    auto it_value =
+        group_elements_by_char(node, first_char_index, grouped, offsets);
+
+    bool value_moved = false;
+    size_type nb_inserted = 0;
     try {
-      const std::array<size_type, ALPHABET_SIZE> first_char_count =
-          get_first_char_count(node.array_hash().cbegin(),
-                               node.array_hash().cend());
-
-      auto new_node = make_unique<trie_node>();
-      for (auto it = node.array_hash().begin(); it != node.array_hash().end();
-           ++it) {
-        if (it.key_size() == 0) {
-          new_node->val_node() = make_unique<value_node>(std::move(it.value()));
-          moved_values_rollback.push_back(
-              std::addressof(new_node->val_node()->m_value));
-        } else {
-          hash_node& hnode =
-              get_hash_node_for_char(first_char_count, *new_node, it.key()[0]);
-          auto it_insert = hnode.array_hash().insert_ks(
-              it.key() + 1, it.key_size() - 1, std::move(it.value()));
-          moved_values_rollback.push_back(
-              std::addressof(it_insert.first.value()));
-        }
+      if (it_value != node.array_hash().end()) {
+        tsl_ht_assert(value_destination != nullptr);
+        value_destination->emplace_value(std::move(it_value.value()));
+        value_moved = true;
       }
 
-      tsl_ht_assert(!new_node->empty());
-      return new_node;
+      insert_grouped_elements<true>(destinations, grouped, offsets,
+                                    first_char_index, nb_inserted);
     } catch (...) {
-      // Rollback the values
-      auto it = node.array_hash().begin();
-      for (std::size_t ivalue = 0; ivalue < moved_values_rollback.size();
-           ivalue++) {
-        it.value() = std::move(*moved_values_rollback[ivalue]);
+      /**
+       * Rollback the values into node->array_hash(). insert_unique doesn't
+       * move any value if it throws, only the values of the first
+       * nb_inserted grouped elements were moved.
+       */
+      if (value_moved) {
+        it_value.value() = std::move(value_destination->value());
+      }
 
-        ++it;
+      for (size_type i = 0; i < nb_inserted; i++) {
+        auto& it = grouped[i];
+        hash_node& hnode =
+            *destinations[as_position(it.key()[first_char_index])];
+        const size_type key_offset =
+            first_char_index + (hnode.is_hybrid() ? 0 : 1);
+
+        auto it_moved = hnode.array_hash().find_ks(it.key() + key_offset,
+                                                   it.key_size() - key_offset);
+        tsl_ht_assert(it_moved != hnode.array_hash().end());
+        it.value() = std::move(it_moved.value());
       }
 
       throw;
@@ -1846,25 +4862,104 @@ class htrie_hash {
 
   template <class U = T,
             typename std::enable_if<!has_value<U>::value>::type* = nullptr>
-  std::unique_ptr<trie_node> burst(hash_node& node) {
-    const std::array<size_type, ALPHABET_SIZE> first_char_count =
-        get_first_char_count(node.array_hash().begin(),
-                             node.array_hash().end());
+  void move_elements(hash_node& node,
+                     const std::array<hash_node*, ALPHABET_SIZE>& destinations,
+                     trie_node* value_destination,
+                     size_type first_char_index = 0) {
+    std::vector<typename array_hash_type::iterator> grouped;
+    std::array<size_type, ALPHABET_SIZE + 1> offsets;
+    auto it_value =
+        group_elements_by_char(node, first_char_index, grouped, offsets);
+
+    if (it_value != node.array_hash().end()) {
+      tsl_ht_assert(value_destination != nullptr);
+      value_destination->emplace_value();
+    }
+
+    size_type nb_inserted = 0;
+    insert_grouped_elements<false>(destinations, grouped, offsets,
+                                   first_char_index, nb_inserted);
+  }
 
-    auto new_node = make_unique<trie_node>();
-    for (auto it = node.array_hash().cbegin(); it != node.array_hash().cend();
+  /**
+   * Group the iterators on the elements of node in grouped by the position of
+   * the character at first_char_index in their keys (counting sort, the keys
+   * aren't hashed). The elements of the position pos are in
+   * [offsets[pos], offsets[pos + 1]).
+   *
+   * The element whose key has first_char_index characters, if any, isn't
+   * grouped and is returned. Otherwise return node.array_hash().end().
+   */
+  typename array_hash_type::iterator group_elements_by_char(
+      hash_node& node, size_type first_char_index,
+      std::vector<typename array_hash_type::iterator>& grouped,
+      std::array<size_type, ALPHABET_SIZE + 1>& offsets) const {
+    auto it_value = node.array_hash().end();
+
+    std::array<size_type, ALPHABET_SIZE + 1> count{{}};
+    for (auto it = node.array_hash().begin(); it != node.array_hash().end();
          ++it) {
-      if (it.key_size() == 0) {
-        new_node->val_node() = make_unique<value_node>();
+      if (it.key_size() == first_char_index) {
+        it_value = it;
       } else {
-        hash_node& hnode =
-            get_hash_node_for_char(first_char_count, *new_node, it.key()[0]);
-        hnode.array_hash().insert_ks(it.key() + 1, it.key_size() - 1);
+        count[as_position(it.key()[first_char_index]) + 1]++;
       }
     }
 
-    tsl_ht_assert(!new_node->empty());
-    return new_node;
+    std::partial_sum(count.begin(), count.end(), offsets.begin());
+
+    grouped.resize(offsets[ALPHABET_SIZE]);
+    std::array<size_type, ALPHABET_SIZE + 1> positions = offsets;
+    for (auto it = node.array_hash().begin(); it != node.array_hash().end();
+         ++it) {
+      if (it.key_size() != first_char_index) {
+        grouped[positions[as_position(it.key()[first_char_index])]++] = it;
+      }
+    }
+
+    return it_value;
+  }
+
+  /**
+   * Insert the elements grouped by group_elements_by_char in the hash nodes
+   * of destinations. Each hash node receives the contiguous groups of the
+   * positions it covers at once through insert_unique: the buckets are sized
+   * exactly and there is no duplicate check, the keys being unique. The
+   * values are moved if MoveValues is true, copied otherwise.
+   *
+   * nb_inserted is the number of grouped elements inserted, the ones before
+   * a potential exception.
+   */
+  template <bool MoveValues>
+  void insert_grouped_elements(
+      const std::array<hash_node*, ALPHABET_SIZE>& destinations,
+      const std::vector<typename array_hash_type::iterator>& grouped,
+      const std::array<size_type, ALPHABET_SIZE + 1>& offsets,
+      size_type first_char_index, size_type& nb_inserted) {
+    nb_inserted = 0;
+
+    std::size_t pos = 0;
+    while (pos < ALPHABET_SIZE) {
+      hash_node* hnode = destinations[pos];
+
+      std::size_t end_pos = pos + 1;
+      while (end_pos < ALPHABET_SIZE && destinations[end_pos] == hnode) {
+        end_pos++;
+      }
+
+      if (offsets[end_pos] > offsets[pos]) {
+        tsl_ht_assert(hnode != nullptr && hnode->array_hash().empty());
+        const size_type key_offset =
+            first_char_index + (hnode->is_hybrid() ? 0 : 1);
+
+        hnode->template insert_unique<MoveValues>(
+            grouped.begin() + offsets[pos], grouped.begin() + offsets[end_pos],
+            key_offset);
+        nb_inserted = offsets[end_pos];
+      }
+
+      pos = end_pos;
+    }
   }
 
   std::array<size_type, ALPHABET_SIZE> get_first_char_count(
@@ -1882,22 +4977,6 @@ class htrie_hash {
     return count;
   }
 
-  hash_node& get_hash_node_for_char(
-      const std::array<size_type, ALPHABET_SIZE>& first_char_count,
-      trie_node& tnode, CharT for_char) {
-    if (tnode.child(for_char) == nullptr) {
-      const size_type nb_buckets =
-          size_type(std::ceil(float(first_char_count[as_position(for_char)] +
-                                    HASH_NODE_DEFAULT_INIT_BUCKETS_COUNT / 2) /
-                              m_max_load_factor));
-
-      tnode.set_child(for_char, make_unique<hash_node>(nb_buckets, m_hash,
-                                                       m_max_load_factor));
-    }
-
-    return tnode.child(for_char)->as_hash_node();
-  }
-
   iterator mutable_iterator(const_iterator it) noexcept {
     // end iterator or reading from a trie node value
     if (it.m_current_hash_node == nullptr || it.m_read_trie_node_value) {
@@ -1947,6 +5026,12 @@ class htrie_hash {
     const slz_size_type burst_threshold = m_burst_threshold;
     serializer(burst_threshold);
 
+    const slz_size_type hybrid_mode = m_hybrid_mode ? 1 : 0;
+    serializer(hybrid_mode);
+
+    const slz_size_type adaptive_burst = m_adaptive_burst ? 1 : 0;
+    serializer(adaptive_burst);
+
     std::basic_string<CharT> str_buffer;
 
     auto it = begin();
@@ -1971,9 +5056,13 @@ class htrie_hash {
       }
       // Serialize hash node values
       else {
+        const hash_node* hnode = it.m_current_hash_node;
+        tsl_ht_assert(hnode != nullptr);
+
         const CharT node_type =
             static_cast<typename std::underlying_type<slz_node_type>::type>(
-                slz_node_type::HASH_NODE);
+                hnode->is_hybrid() ? slz_node_type::HYBRID_HASH_NODE
+                                   : slz_node_type::HASH_NODE);
         serializer(&node_type, 1);
 
         it.hash_node_prefix(str_buffer);
@@ -1982,8 +5071,12 @@ class htrie_hash {
         serializer(str_size);
         serializer(str_buffer.data(), str_buffer.size());
 
-        const hash_node* hnode = it.m_current_hash_node;
-        tsl_ht_assert(hnode != nullptr);
+        if (hnode->is_hybrid()) {
+          const CharT range[] = {as_char(hnode->range_first()),
+                                 as_char(hnode->range_last())};
+          serializer(range, 2);
+        }
+
         hnode->array_hash().serialize(serializer);
 
         it.skip_hash_node();
@@ -2009,9 +5102,10 @@ class htrie_hash {
 
     const slz_size_type version =
         deserialize_value<slz_size_type>(deserializer);
-    // For now we only have one version of the serialization protocol.
-    // If it doesn't match there is a problem with the file.
-    if (version != SERIALIZATION_PROTOCOL_VERSION) {
+    // Version 2 only adds the hybrid mode to version 1 and version 3 the
+    // adaptive burst, we can read all of them. If it doesn't match there is a
+    // problem with the file.
+    if (version < 1 || version > SERIALIZATION_PROTOCOL_VERSION) {
       throw std::runtime_error(
           "Can't deserialize the htrie_map/set. The protocol version header is "
           "invalid.");
@@ -2027,6 +5121,15 @@ class htrie_hash {
         burst_threshold, "Deserialized burst_threshold is too big."));
     this->max_load_factor(max_load_factor);
 
+    if (version >= 2) {
+      this->hybrid_mode(deserialize_value<slz_size_type>(deserializer) != 0);
+    }
+
+    if (version >= 3) {
+      this->adaptive_burst(deserialize_value<slz_size_type>(deserializer) !=
+                           0);
+    }
+
     std::vector<CharT> str_buffer;
     while (m_nb_elements < nb_elements) {
       CharT node_type_marker;
@@ -2056,10 +5159,11 @@ class htrie_hash {
             "Deserialized str_size is too big.");
 
         if (str_size == 0) {
-          tsl_ht_assert(m_nb_elements == 0 && !m_root);
+          tsl_ht_assert(m_nb_elements == 0 && m_root == nullptr);
 
-          m_root = make_unique<hash_node>(
-              array_hash_type::deserialize(deserializer, hash_compatible));
+          m_root = make_node<hash_node>(
+              m_alloc, array_hash_type::deserialize(deserializer,
+                                                    hash_compatible, m_alloc));
           m_nb_elements += m_root->as_hash_node().array_hash().size();
 
           tsl_ht_assert(m_nb_elements == nb_elements);
@@ -2067,14 +5171,50 @@ class htrie_hash {
           str_buffer.resize(str_size);
           deserializer(str_buffer.data(), str_size);
 
-          auto hnode = make_unique<hash_node>(
-              array_hash_type::deserialize(deserializer, hash_compatible));
+          auto hnode = make_node<hash_node>(
+              m_alloc, array_hash_type::deserialize(deserializer,
+                                                    hash_compatible, m_alloc));
           m_nb_elements += hnode->array_hash().size();
 
           trie_node* current_node =
               insert_prefix_trie_nodes(str_buffer.data(), str_size - 1);
           current_node->set_child(str_buffer[str_size - 1], std::move(hnode));
         }
+      } else if (node_type == slz_node_type::HYBRID_HASH_NODE) {
+        const std::size_t str_size = numeric_cast<std::size_t>(
+            deserialize_value<slz_size_type>(deserializer),
+            "Deserialized str_size is too big.");
+
+        str_buffer.resize(str_size);
+        deserializer(str_buffer.data(), str_size);
+
+        CharT range[2];
+        deserializer(range, 2);
+        if (as_position(range[0]) >= as_position(range[1])) {
+          throw std::runtime_error("Invalid deserialized hybrid node range.");
+        }
+
+        auto hnode = make_node<hash_node>(
+            m_alloc, array_hash_type::deserialize(deserializer, hash_compatible,
+                                                  m_alloc));
+        hnode->set_range(as_position(range[0]), as_position(range[1]));
+        m_nb_elements += hnode->array_hash().size();
+
+        const std::array<size_type, ALPHABET_SIZE> first_char_count =
+            get_first_char_count(hnode->array_hash().cbegin(),
+                                 hnode->array_hash().cend());
+        const size_type nb_in_range = std::accumulate(
+            first_char_count.begin() + hnode->range_first(),
+            first_char_count.begin() + hnode->range_last() + 1, size_type(0));
+        if (hnode->array_hash().empty() ||
+            nb_in_range != hnode->array_hash().size()) {
+          throw std::runtime_error(
+              "Invalid deserialized hybrid node, keys out of its range.");
+        }
+
+        trie_node* current_node =
+            insert_prefix_trie_nodes(str_buffer.data(), str_size);
+        add_hash_node_child(*current_node, std::move(hnode), first_char_count);
       } else {
         throw std::runtime_error("Unknown deserialized node type.");
       }
@@ -2086,13 +5226,14 @@ class htrie_hash {
   trie_node* insert_prefix_trie_nodes(const CharT* prefix,
                                       std::size_t prefix_size) {
     if (m_root == nullptr) {
-      m_root = make_unique<trie_node>();
+      m_root = make_node<trie_node>(m_alloc, m_alloc);
     }
 
     trie_node* current_node = &m_root->as_trie_node();
     for (std::size_t iprefix = 0; iprefix < prefix_size; iprefix++) {
       if (current_node->child(prefix[iprefix]) == nullptr) {
-        current_node->set_child(prefix[iprefix], make_unique<trie_node>());
+        current_node->set_child(prefix[iprefix],
+                                make_node<trie_node>(m_alloc, m_alloc));
       }
 
       current_node = &current_node->child(prefix[iprefix])->as_trie_node();
@@ -2105,17 +5246,14 @@ class htrie_hash {
             typename std::enable_if<!has_value<U>::value>::type* = nullptr>
   void deserialize_value_node(Deserializer& /*deserializer*/,
                               trie_node* current_node) {
-    tsl_ht_assert(!current_node->val_node());
-    current_node->val_node() = make_unique<value_node>();
+    current_node->emplace_value();
   }
 
   template <class Deserializer, class U = T,
             typename std::enable_if<has_value<U>::value>::type* = nullptr>
   void deserialize_value_node(Deserializer& deserializer,
                               trie_node* current_node) {
-    tsl_ht_assert(!current_node->val_node());
-    current_node->val_node() =
-        make_unique<value_node>(deserialize_value<T>(deserializer));
+    current_node->emplace_value(deserialize_value<T>(deserializer));
   }
 
   template <class U, class Deserializer>
@@ -2129,11 +5267,60 @@ class htrie_hash {
 #endif
   }
 
-  // Same as std::make_unique for non-array types which is only available in
-  // C++14 (we need to support C++11).
+  /**
+   * Allocate a trie_node or a hash_node with alloc. The node also needs the
+   * allocator as constructor argument to store it.
+   */
   template <typename U, typename... Args>
-  static std::unique_ptr<U> make_unique(Args&&... args) {
-    return std::unique_ptr<U>(new U(std::forward<Args>(args)...));
+  static std::unique_ptr<U, node_deleter> make_node(const Allocator& alloc,
+                                                    Args&&... args) {
+    return std::unique_ptr<U, node_deleter>(
+        allocate_and_construct<U>(alloc, std::forward<Args>(args)...));
+  }
+
+  static unique_node_ptr copy_root(const htrie_hash& other,
+                                   const Allocator& alloc) {
+    if (other.m_root == nullptr) {
+      return nullptr;
+    } else if (other.m_root.is_hash_node()) {
+      return make_node<hash_node>(alloc, other.m_root.as_hash_node(), alloc);
+    } else {
+      return make_node<trie_node>(alloc, other.m_root.as_trie_node(), alloc);
+    }
+  }
+
+  void propagate_allocator(const Allocator& alloc,
+                           std::true_type /*propagate*/) {
+    m_alloc = alloc;
+    m_arena_attachment = tsl::detail_htrie_arena::arena_attachment(m_alloc);
+  }
+
+  void propagate_allocator(const Allocator& /*alloc*/,
+                           std::false_type /*propagate*/) noexcept {}
+
+  void swap_allocator(htrie_hash& other, std::true_type /*propagate*/) {
+    using std::swap;
+    swap(m_alloc, other.m_alloc);
+    m_arena_attachment.swap(other.m_arena_attachment);
+  }
+
+  void swap_allocator(htrie_hash& /*other*/,
+                      std::false_type /*propagate*/) noexcept {}
+
+  /**
+   * The memory of the nodes can be given back by releasing the whole arena
+   * without calling the destructors of the nodes only if the container is the
+   * only user of the arena and if these destructors have nothing else to do.
+   */
+  bool can_release_arena() const noexcept {
+    return (std::is_void<T>::value ||
+            std::is_trivially_destructible<
+                typename std::conditional<std::is_void<T>::value, CharT,
+                                          T>::type>::value) &&
+           std::is_trivially_destructible<Hash>::value &&
+           std::is_trivially_destructible<Allocator>::value &&
+           m_root != nullptr &&
+           m_arena_attachment.exclusive_arena() != nullptr;
   }
 
  public:
@@ -2147,23 +5334,53 @@ class htrie_hash {
    * and must be the same size on both platforms.
    */
   using slz_size_type = std::uint64_t;
-  enum class slz_node_type : CharT { TRIE_NODE = 0, HASH_NODE = 1 };
+  enum class slz_node_type : CharT {
+    TRIE_NODE = 0,
+    HASH_NODE = 1,
+    HYBRID_HASH_NODE = 2
+  };
 
   /**
    * Protocol version currenlty used for serialization.
    */
-  static const slz_size_type SERIALIZATION_PROTOCOL_VERSION = 1;
+  static const slz_size_type SERIALIZATION_PROTOCOL_VERSION = 3;
 
   static const size_type HASH_NODE_DEFAULT_INIT_BUCKETS_COUNT = 32;
   static const size_type MIN_BURST_THRESHOLD = 4;
   static const size_type MAX_BURST_THRESHOLD =
       std::numeric_limits<ArrayHashIndexSizeT>::max();
 
-  std::unique_ptr<anode> m_root;
+  /**
+   * See burst_threshold_of and hash_node::record_search.
+   */
+  static const size_type ADAPTIVE_BURST_FACTOR = 8;
+  static const size_type ADAPTIVE_BURST_MIN_SEARCHES = 64;
+  static const std::uint32_t ADAPTIVE_BURST_SEARCHES_WINDOW = 1 << 16;
+
+  /**
+   * Number of lookups interleaved by find_batch and count_batch. It must be
+   * large enough to cover the memory latency but not so large that the
+   * prefetched lines are evicted before being used.
+   */
+  static const std::size_t LOOKUP_BATCH_GROUP_SIZE = 16;
+
+  /**
+   * Minimum number of independent ranges per thread built in parallel by
+   * build_sorted_ranges_parallel, to balance the threads when the subtries
+   * have very different sizes.
+   */
+  static const std::size_t PARALLEL_BUILD_RANGES_PER_THREAD = 8;
+
+  Allocator m_alloc;
+  tsl::detail_htrie_arena::arena_attachment m_arena_attachment;
+
+  unique_node_ptr m_root;
   size_type m_nb_elements;
   Hash m_hash;
   float m_max_load_factor;
   size_type m_burst_threshold;
+  bool m_hybrid_mode;
+  bool m_adaptive_burst;
 };
 
 }  // end namespace detail_htrie_hash
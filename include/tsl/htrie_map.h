@@ -26,9 +26,14 @@
 
 #include <cstddef>
 #include <cstring>
+#include <algorithm>
 #include <initializer_list>
+#include <iterator>
+#include <memory>
 #include <string>
+#include <thread>
 #include <utility>
+#include <vector>
 
 #include "htrie_hash.h"
 
@@ -45,19 +50,66 @@ namespace tsl {
  * KeySizeT template parameter. See max_key_size() for an easy access to this
  * limit.
  *
+ * All the memory of the hat-trie (nodes, array hashes and their buckets) is
+ * allocated through a rebound copy of Allocator, which must have CharT as
+ * value_type. `tsl::htrie_arena_allocator` can be used to allocate the nodes
+ * from a `tsl::htrie_arena` (see htrie_arena.h).
+ *
+ * If StoreHashFingerprint is true, one byte of the hash of each key suffix is
+ * stored in the array hashes of the hash nodes to speed up the searches by
+ * skipping most of the non-matching suffixes without comparing them (see
+ * tsl::array_map), at the cost of one byte per key.
+ *
+ * If AmortizedBucketGrowth is true, the buckets of the array hashes grow
+ * geometrically instead of being reallocated on each insertion, which speeds
+ * up the insertions at the cost of some unused memory until shrink_to_fit()
+ * is called.
+ *
+ * If SlabBucketStorage is true, the buckets of each array hash are packed in
+ * one contiguous slab when the array hash is rehashed, copied or shrunk with
+ * shrink_to_fit(), which reduces the number of allocations and improves the
+ * locality of the searches in the hash nodes.
+ *
+ * If VarintKeySize is true, the size of each key suffix stored in the array
+ * hashes is encoded as a variable-length integer instead of a KeySizeT. Most
+ * suffixes are short and then only need one byte for their size.
+ *
+ * If InlineBucketValues is true, the values of the keys in the hash nodes are
+ * stored in the array hashes next to their key suffix instead of in a
+ * separate array, which saves a cache miss on each access. T must then be
+ * trivially copyable (integers, pointers, small structs) with an alignment
+ * not bigger than alignof(std::size_t).
+ *
+ * If IncrementalRehash is true, the growth of an array hash doesn't move all
+ * its elements at once, a few of its old buckets are migrated on each
+ * following insertion instead. It bounds the latency of the insertions in big
+ * hash nodes (see burst_threshold()) at the cost of slightly slower lookups
+ * during the migration. It has no effect if SlabBucketStorage is true.
+ *
  * Iterators invalidation:
  *  - clear, operator=: always invalidate the iterators.
  *  - insert, emplace, operator[]: always invalidate the iterators.
  *  - erase: always invalidate the iterators.
  */
 template <class CharT, class T, class Hash = tsl::ah::str_hash<CharT>,
-          class KeySizeT = std::uint16_t>
+          class KeySizeT = std::uint16_t,
+          class Allocator = std::allocator<CharT>,
+          bool StoreHashFingerprint = false, bool AmortizedBucketGrowth = false,
+          bool SlabBucketStorage = false, bool VarintKeySize = false,
+          bool InlineBucketValues = false, bool IncrementalRehash = false>
 class htrie_map {
  private:
   template <typename U>
   using is_iterator = tsl::detail_array_hash::is_iterator<U>;
 
-  using ht = tsl::detail_htrie_hash::htrie_hash<CharT, T, Hash, KeySizeT>;
+  using ht = tsl::detail_htrie_hash::htrie_hash<CharT, T, Hash, KeySizeT,
+                                                Allocator,
+                                                StoreHashFingerprint,
+                                                AmortizedBucketGrowth,
+                                                SlabBucketStorage,
+                                                VarintKeySize,
+                                                InlineBucketValues,
+                                                IncrementalRehash>;
 
  public:
   using char_type = typename ht::char_type;
@@ -65,37 +117,65 @@ class htrie_map {
   using key_size_type = typename ht::key_size_type;
   using size_type = typename ht::size_type;
   using hasher = typename ht::hasher;
+  using allocator_type = typename ht::allocator_type;
   using iterator = typename ht::iterator;
   using const_iterator = typename ht::const_iterator;
   using prefix_iterator = typename ht::prefix_iterator;
   using const_prefix_iterator = typename ht::const_prefix_iterator;
 
  public:
-  explicit htrie_map(const Hash& hash = Hash())
+  explicit htrie_map(const Hash& hash = Hash(),
+                     const Allocator& alloc = Allocator())
       : m_ht(hash, ht::HASH_NODE_DEFAULT_MAX_LOAD_FACTOR,
-             ht::DEFAULT_BURST_THRESHOLD) {}
+             ht::DEFAULT_BURST_THRESHOLD, alloc) {}
 
-  explicit htrie_map(size_type burst_threshold, const Hash& hash = Hash())
-      : m_ht(hash, ht::HASH_NODE_DEFAULT_MAX_LOAD_FACTOR, burst_threshold) {}
+  explicit htrie_map(size_type burst_threshold, const Hash& hash = Hash(),
+                     const Allocator& alloc = Allocator())
+      : m_ht(hash, ht::HASH_NODE_DEFAULT_MAX_LOAD_FACTOR, burst_threshold,
+             alloc) {}
+
+  explicit htrie_map(const Allocator& alloc) : htrie_map(Hash(), alloc) {}
+
+  /**
+   * Build a map from the key-value pairs of [first, last) sorted by key, see
+   * insert_sorted.
+   */
+  template <class ForwardIt, typename std::enable_if<
+                                 is_iterator<ForwardIt>::value>::type* = nullptr>
+  static htrie_map from_sorted(
+      ForwardIt first, ForwardIt last,
+      size_type burst_threshold = ht::DEFAULT_BURST_THRESHOLD,
+      const Hash& hash = Hash(), const Allocator& alloc = Allocator()) {
+    htrie_map map(burst_threshold, hash, alloc);
+    map.insert_sorted(first, last);
+
+    return map;
+  }
+
+  htrie_map(const htrie_map& other, const Allocator& alloc)
+      : m_ht(other.m_ht, alloc) {}
 
   template <class InputIt, typename std::enable_if<
                                is_iterator<InputIt>::value>::type* = nullptr>
-  htrie_map(InputIt first, InputIt last, const Hash& hash = Hash())
-      : htrie_map(hash) {
+  htrie_map(InputIt first, InputIt last, const Hash& hash = Hash(),
+            const Allocator& alloc = Allocator())
+      : htrie_map(hash, alloc) {
     insert(first, last);
   }
 
 #ifdef TSL_HT_HAS_STRING_VIEW
   htrie_map(
       std::initializer_list<std::pair<std::basic_string_view<CharT>, T>> init,
-      const Hash& hash = Hash())
-      : htrie_map(hash) {
+      const Hash& hash = Hash(),
+            const Allocator& alloc = Allocator())
+      : htrie_map(hash, alloc) {
     insert(init);
   }
 #else
   htrie_map(std::initializer_list<std::pair<const CharT*, T>> init,
-            const Hash& hash = Hash())
-      : htrie_map(hash) {
+            const Hash& hash = Hash(),
+            const Allocator& alloc = Allocator())
+      : htrie_map(hash, alloc) {
     insert(init);
   }
 #endif
@@ -140,6 +220,15 @@ class htrie_map {
 
   /**
    * Call shrink_to_fit() on each hash node of the hat-trie to reduce its size.
+   *
+   * The keys inside each bucket of the hash nodes are also sorted, so that
+   * equal_prefix_range and erase_prefix can skip the rest of a bucket once
+   * past the prefix when the prefix ends inside a hash node. A hash node loses
+   * this order on its next insertion.
+   *
+   * If all the keys of a large enough hash node share a common prefix, the
+   * prefix is moved to a chain of trie nodes above the node and removed from
+   * the keys, so it's stored only once.
    */
   void shrink_to_fit() { m_ht.shrink_to_fit(); }
 
@@ -196,6 +285,61 @@ class htrie_map {
     }
   }
 
+  /**
+   * Insert the key-value pairs of [first, last), sorted by key, in the empty
+   * map. The trie is built in one pass from the sorted keys: each node is
+   * created with its final size, without any burst or rehash of the hash
+   * nodes. The keys are sorted first if they aren't, and the first pair of
+   * a key is inserted as with insert. If the map isn't empty, same as
+   * insert(first, last).
+   *
+   * The keys can be `std::basic_string<CharT>`, `const CharT*` (or
+   * `std::basic_string_view<CharT>` with C++17), the values are copied.
+   */
+  template <class ForwardIt, typename std::enable_if<
+                                 is_iterator<ForwardIt>::value>::type* = nullptr>
+  void insert_sorted(ForwardIt first, ForwardIt last) {
+    auto elements = bulk_elements(first, last);
+    m_ht.insert_sorted(elements);
+  }
+
+  /**
+   * Insert the key-value pairs of [first, last), in any order, and return the number
+   * of inserted elements. The batch is sorted so that the path to each node
+   * is descended once for all its keys, each hash node receives its keys
+   * after a single reserve and is burst at most once per batch. As with
+   * insert, an existing key isn't modified. Faster than an insert per key
+   * for batches of a few thousand keys or more.
+   *
+   * The keys can be `std::basic_string<CharT>`, `const CharT*` (or
+   * `std::basic_string_view<CharT>` with C++17), the values are copied.
+   */
+  template <class ForwardIt, typename std::enable_if<
+                                 is_iterator<ForwardIt>::value>::type* = nullptr>
+  size_type insert_batch(ForwardIt first, ForwardIt last) {
+    auto elements = bulk_elements(first, last);
+    return m_ht.insert_batch(elements);
+  }
+
+  /**
+   * Same as insert_sorted but the key-value pairs of [first, last) don't need to be
+   * sorted: they are sorted and their subtries, independent from each other
+   * under their leading characters, are built in parallel on nb_threads
+   * threads (std::thread::hardware_concurrency() if 0). The parallel build
+   * requires std::allocator, other allocators use a single thread.
+   */
+  template <class ForwardIt, typename std::enable_if<
+                                 is_iterator<ForwardIt>::value>::type* = nullptr>
+  void insert_parallel(ForwardIt first, ForwardIt last,
+                       std::size_t nb_threads = 0) {
+    if (nb_threads == 0) {
+      nb_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    auto elements = bulk_elements(first, last);
+    m_ht.insert_sorted(elements, nb_threads);
+  }
+
 #ifdef TSL_HT_HAS_STRING_VIEW
   void insert(std::initializer_list<std::pair<std::basic_string_view<CharT>, T>>
                   ilist) {
@@ -414,6 +558,39 @@ class htrie_map {
   }
 #endif
 
+  /**
+   * Look up each key of the range [first, last) and write the result, an
+   * iterator to the element or end(), to 'results' in the same order. Return
+   * the output iterator past the last written result.
+   *
+   * The keys can be std::basic_string<CharT>, null-terminated const CharT* or,
+   * in C++17, std::basic_string_view<CharT>. The lookups of several keys are
+   * interleaved so that their cache misses overlap, which is faster than
+   * calling find for each key when the map doesn't fit in the CPU caches.
+   */
+  template <class ForwardIt, class OutputIt>
+  OutputIt find_batch(ForwardIt first, ForwardIt last, OutputIt results) {
+    return m_ht.find_batch(first, last, results);
+  }
+
+  /**
+   * @copydoc find_batch(ForwardIt first, ForwardIt last, OutputIt results)
+   */
+  template <class ForwardIt, class OutputIt>
+  OutputIt find_batch(ForwardIt first, ForwardIt last,
+                      OutputIt results) const {
+    return m_ht.find_batch(first, last, results);
+  }
+
+  /**
+   * Same as find_batch but write the count of each key, 0 or 1, to 'counts'.
+   */
+  template <class ForwardIt, class OutputIt>
+  OutputIt count_batch(ForwardIt first, ForwardIt last,
+                       OutputIt counts) const {
+    return m_ht.count_batch(first, last, counts);
+  }
+
   /**
    * Return a range containing all the elements which have 'prefix' as prefix.
    * The range is defined by a pair of iterator, the first being the begin
@@ -657,11 +834,56 @@ class htrie_map {
   size_type burst_threshold() const { return m_ht.burst_threshold(); }
   void burst_threshold(size_type threshold) { m_ht.burst_threshold(threshold); }
 
+  /**
+   * In hybrid mode, a hash node may be shared by a range of characters of its
+   * parent trie node. When full, such a node is split in two on a range
+   * boundary instead of being burst into a new trie node, reducing the number
+   * of nodes. Only affects the future bursts. Disabled by default.
+   */
+  bool hybrid_mode() const { return m_ht.hybrid_mode(); }
+  void hybrid_mode(bool enable) { m_ht.hybrid_mode(enable); }
+
+  /**
+   * With the adaptive burst, each hash node counts the prefix searches
+   * (equal_prefix_range, longest_prefix, for_each_prefix_of) and the exact
+   * searches ending in it. A node mostly used by prefix searches bursts at an
+   * eighth of burst_threshold() so that the prefix searches filter smaller
+   * nodes. A node only used by exact searches bursts at eight times
+   * burst_threshold() (at most 65 535) and stays a compact array hash longer.
+   * Disabled by default.
+   *
+   * The counters are updated by the const search methods. Concurrent searches
+   * stay safe but may lose some counts.
+   */
+  bool adaptive_burst() const { return m_ht.adaptive_burst(); }
+  void adaptive_burst(bool enable) { m_ht.adaptive_burst(enable); }
+
+  /**
+   * Burst (or split in hybrid mode) all the hash nodes which reached their
+   * burst threshold without waiting for their next insertion. Mainly useful
+   * with the adaptive burst, to burst the nodes whose threshold was lowered
+   * by prefix searches. Invalidates the iterators.
+   */
+  void burst_full_nodes() { m_ht.burst_full_nodes(); }
+
+  /**
+   * Collapse each subtree of the trie which holds less than
+   * burst_threshold() * burst_threshold_ratio elements back into a single
+   * hash node. The trie nodes and small hash nodes left behind by erasures
+   * are only removed when they become empty, call this method after a large
+   * number of erasures to give their memory back. Invalidates the iterators.
+   */
+  void merge_small_nodes(float burst_threshold_ratio = 0.25f) {
+    m_ht.merge_small_nodes(burst_threshold_ratio);
+  }
+
   /*
    * Observers
    */
   hasher hash_function() const { return m_ht.hash_function(); }
 
+  allocator_type get_allocator() const { return m_ht.get_allocator(); }
+
   /*
    * Other
    */
@@ -710,8 +932,9 @@ class htrie_map {
    */
   template <class Deserializer>
   static htrie_map deserialize(Deserializer& deserializer,
-                               bool hash_compatible = false) {
-    htrie_map map;
+                               bool hash_compatible = false,
+                               const Allocator& alloc = Allocator()) {
+    htrie_map map(Hash(), alloc);
     map.m_ht.deserialize(deserializer, hash_compatible);
 
     return map;
@@ -754,9 +977,38 @@ class htrie_map {
   }
 
  private:
+  template <class ForwardIt>
+  static std::vector<typename ht::bulk_element> bulk_elements(ForwardIt first,
+                                                              ForwardIt last) {
+    std::vector<typename ht::bulk_element> elements;
+    elements.reserve(std::size_t(std::distance(first, last)));
+    for (auto it = first; it != last; ++it) {
+      // The values are only read, see ht::bulk_element.
+      elements.emplace_back(it->first,
+                            const_cast<T*>(std::addressof(it->second)));
+    }
+
+    return elements;
+  }
+
   ht m_ht;
 };
 
+#ifdef TSL_HT_HAS_PMR
+namespace pmr {
+
+/**
+ * Same as `tsl::htrie_map<CharT, T, Hash, KeySizeT,
+ * std::pmr::polymorphic_allocator<CharT>>`.
+ */
+template <class CharT, class T, class Hash = tsl::ah::str_hash<CharT>,
+          class KeySizeT = std::uint16_t>
+using htrie_map = tsl::htrie_map<CharT, T, Hash, KeySizeT,
+                               std::pmr::polymorphic_allocator<CharT>>;
+
+}  // end namespace pmr
+#endif
+
 }  // end namespace tsl
 
 #endif
@@ -23,23 +23,38 @@
  */
 #include <boost/mpl/list.hpp>
 #include <boost/test/unit_test.hpp>
+#include <algorithm>
 #include <cstddef>
 #include <iterator>
+#include <map>
 #include <set>
 #include <stdexcept>
 #include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include "tsl/htrie_map.h"
 #include "utils.h"
 
 BOOST_AUTO_TEST_SUITE(test_htrie_map)
 
-using test_types = boost::mpl::list<tsl::htrie_map<char, std::int64_t>,
-                                    tsl::htrie_map<char, std::string>,
-                                    tsl::htrie_map<char, throw_move_test>,
-                                    tsl::htrie_map<char, move_only_test>>;
+using test_types = boost::mpl::list<
+    tsl::htrie_map<char, std::int64_t>, tsl::htrie_map<char, std::string>,
+    tsl::htrie_map<char, throw_move_test>, tsl::htrie_map<char, move_only_test>,
+    tsl::htrie_map<char, std::string, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, true>,
+    tsl::htrie_map<char, move_only_test, tsl::ah::str_hash<char>,
+                   std::uint16_t, std::allocator<char>, false, true>,
+    tsl::htrie_map<char, std::string, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, false, false, true>,
+    tsl::htrie_map<char, std::string, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, true, false, false, true>,
+    tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, false, false, false, false, true>,
+    tsl::htrie_map<char, std::string, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, false, false, false, false, false,
+                   true>>;
 
 /**
  * insert
@@ -90,6 +105,208 @@ BOOST_AUTO_TEST_CASE_TEMPLATE(test_insert, TMap, test_types) {
   }
 }
 
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_insert_burst, TMap, test_types) {
+  // Burst, in pure and hybrid mode, hash nodes holding the empty key, keys
+  // which only differ by their size and a lot of keys under a few
+  // characters. Check all the elements after each insertion.
+  using value_tt = typename TMap::mapped_type;
+
+  auto get_key = [](std::size_t i) {
+    return (i % 3 == 0) ? std::string(i % 40, 'a')
+                        : std::string(1, static_cast<char>('a' + i % 5)) +
+                              std::to_string(i);
+  };
+
+  for (const bool hybrid : {false, true}) {
+    TMap map(32);
+    map.hybrid_mode(hybrid);
+
+    std::set<std::string> keys;
+    for (std::size_t i = 0; i < 600; i++) {
+      const std::string key = get_key(i);
+      BOOST_CHECK_EQUAL(map.insert(key, utils::get_value<value_tt>(i)).second,
+                        keys.insert(key).second);
+
+      if (i % 50 == 0 || i < 100) {
+        BOOST_REQUIRE_EQUAL(map.size(), keys.size());
+        for (std::size_t j = 0; j <= i; j++) {
+          auto it = map.find(get_key(j));
+          BOOST_REQUIRE(it != map.end());
+          BOOST_CHECK_EQUAL(it.key(), get_key(j));
+        }
+      }
+    }
+
+    for (std::size_t i = 0; i < 600; i++) {
+      if (i % 3 != 0 || i < 40) {
+        BOOST_CHECK_EQUAL(map.at(get_key(i)), utils::get_value<value_tt>(i));
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_insert_sorted) {
+  // Build maps from sorted keys, with a lot of keys under a few characters,
+  // the empty key and duplicates, in pure and hybrid mode. Compare them to
+  // maps built with insert and check that they keep working after new
+  // insertions and erasures.
+  using map_type = tsl::htrie_map<char, std::string>;
+
+  std::vector<std::pair<std::string, std::string>> pairs = {{"", "empty"}};
+  for (std::size_t i = 0; i < 5000; i++) {
+    const std::string key = (i % 4 == 0) ? std::string(i % 30, 'a')
+                                         : std::string(1, char('a' + i % 3)) +
+                                               std::to_string(i * 7 % 997);
+    pairs.emplace_back(key, std::to_string(i));
+  }
+  pairs.emplace_back("\xff\xff", "max");
+
+  for (const bool hybrid : {false, true}) {
+    map_type expected_map(32);
+    expected_map.insert(pairs.begin(), pairs.end());
+
+    std::vector<std::pair<std::string, std::string>> sorted_pairs = pairs;
+    std::stable_sort(sorted_pairs.begin(), sorted_pairs.end(),
+                     [](const std::pair<std::string, std::string>& lhs,
+                        const std::pair<std::string, std::string>& rhs) {
+                       return lhs.first < rhs.first;
+                     });
+
+    for (const auto* input : {&sorted_pairs, &pairs}) {
+      map_type map(32);
+      map.hybrid_mode(hybrid);
+      map.insert_sorted(input->begin(), input->end());
+
+      BOOST_CHECK_EQUAL(map.size(), expected_map.size());
+      BOOST_CHECK(map == expected_map);
+      BOOST_CHECK_EQUAL(std::distance(map.begin(), map.end()), map.size());
+
+      auto range = map.equal_prefix_range("aaaa");
+      auto expected_range = expected_map.equal_prefix_range("aaaa");
+      BOOST_CHECK_EQUAL(
+          std::distance(range.first, range.second),
+          std::distance(expected_range.first, expected_range.second));
+      BOOST_CHECK_EQUAL(map.longest_prefix("b42xyz").key(),
+                        expected_map.longest_prefix("b42xyz").key());
+
+      map.insert("b42xyz", std::string("new"));
+      map.insert(std::string(50, 'a'), std::string("new"));
+      BOOST_CHECK_EQUAL(map.erase("c3"), expected_map.count("c3"));
+      BOOST_CHECK_EQUAL(map.at("b42xyz"), "new");
+      BOOST_CHECK_EQUAL(map.at(""), "empty");
+    }
+  }
+
+  const map_type map = map_type::from_sorted(pairs.begin(), pairs.begin() + 10);
+  BOOST_CHECK_EQUAL(map.burst_threshold(), map_type().burst_threshold());
+  BOOST_CHECK(map == map_type(pairs.begin(), pairs.begin() + 10));
+
+  // Not empty, same as insert.
+  map_type map2;
+  map2.insert("zz", std::string("1"));
+  map2.insert_sorted(pairs.begin(), pairs.end());
+  BOOST_CHECK_EQUAL(map2.size(), map_type(pairs.begin(), pairs.end()).size() + 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_insert_parallel) {
+  // Unsorted keys with a long common prefix and a skewed first character,
+  // built on several threads in pure and hybrid mode. Also check the
+  // rollback when a copy throws in one of the threads.
+  std::vector<std::pair<std::string, std::int64_t>> pairs;
+  for (std::size_t i = 0; i < 50000; i++) {
+    const std::size_t n = i * 7919 % 50000;
+    const std::string key = (n % 5 == 0) ? "b" + std::to_string(n)
+                                          : "https://a" + std::to_string(n);
+    pairs.emplace_back(key, std::int64_t(n));
+  }
+  pairs.emplace_back("b0", -1);
+
+  const tsl::htrie_map<char, std::int64_t> expected_map(pairs.begin(),
+                                                        pairs.end());
+  for (const bool hybrid : {false, true}) {
+    for (const std::size_t nb_threads : {1, 2, 7}) {
+      tsl::htrie_map<char, std::int64_t> map(64);
+      map.hybrid_mode(hybrid);
+      map.insert_parallel(pairs.begin(), pairs.end(), nb_threads);
+
+      BOOST_CHECK_EQUAL(map.size(), 50000);
+      BOOST_CHECK(map == expected_map);
+      BOOST_CHECK_EQUAL(map.at("b0"), 0);
+
+      map.insert("https://a", 1);
+      BOOST_CHECK_EQUAL(map.erase("https://a1"), 1);
+      BOOST_CHECK_EQUAL(map.size(), 50000);
+    }
+  }
+
+  std::vector<std::pair<std::string, throw_copy_test>> throw_pairs;
+  for (std::size_t i = 0; i < 10000; i++) {
+    throw_pairs.emplace_back(utils::get_key<char>(i),
+                             throw_copy_test(std::int64_t(i), i == 5000));
+  }
+
+  tsl::htrie_map<char, throw_copy_test> map(64);
+  BOOST_CHECK_THROW(
+      map.insert_parallel(throw_pairs.begin(), throw_pairs.end(), 4),
+      std::runtime_error);
+  BOOST_CHECK(map.empty());
+  BOOST_CHECK(map.begin() == map.end());
+}
+
+// insert_batch copies the values.
+using copyable_test_types = boost::mpl::list<
+    tsl::htrie_map<char, std::int64_t>, tsl::htrie_map<char, std::string>,
+    tsl::htrie_map<char, throw_move_test>,
+    tsl::htrie_map<char, std::string, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, true>,
+    tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, false, false, false, false, true>,
+    tsl::htrie_map<char, std::string, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, false, false, false, false, false,
+                   true>>;
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_insert_batch, TMap, copyable_test_types) {
+  // Insert batches of unsorted keys, with duplicates and keys already in the
+  // map, which burst or split the hash nodes, in pure and hybrid mode. Check
+  // all the elements after each batch.
+  using value_tt = typename TMap::mapped_type;
+
+  auto get_key = [](std::size_t i) {
+    return (i % 11 == 0) ? std::string(i % 30, 'a')
+                         : std::string(1, static_cast<char>('a' + i % 4)) +
+                               std::to_string(i % 1500);
+  };
+
+  for (const bool hybrid : {false, true}) {
+    TMap map(32);
+    map.hybrid_mode(hybrid);
+
+    std::map<std::string, std::size_t> expected;
+    for (std::size_t batch = 0; batch < 6; batch++) {
+      std::vector<std::pair<std::string, value_tt>> pairs;
+      for (std::size_t i = batch * 500; i < (batch + 1) * 500; i++) {
+        const std::size_t n = i * 7919 % 3000;
+        pairs.emplace_back(get_key(n), utils::get_value<value_tt>(n));
+      }
+
+      std::size_t nb_new_keys = 0;
+      for (std::size_t i = batch * 500; i < (batch + 1) * 500; i++) {
+        const std::size_t n = i * 7919 % 3000;
+        nb_new_keys += expected.insert({get_key(n), n}).second ? 1 : 0;
+      }
+
+      BOOST_CHECK_EQUAL(map.insert_batch(pairs.begin(), pairs.end()),
+                        nb_new_keys);
+      BOOST_REQUIRE_EQUAL(map.size(), expected.size());
+      for (const auto& key_value : expected) {
+        BOOST_CHECK_EQUAL(map.at(key_value.first),
+                          utils::get_value<value_tt>(key_value.second));
+      }
+      BOOST_CHECK_EQUAL(std::distance(map.begin(), map.end()), map.size());
+    }
+  }
+}
+
 BOOST_AUTO_TEST_CASE(test_insert_with_too_long_string) {
   tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>, std::uint8_t> map;
   map.burst_threshold(8);
@@ -224,6 +441,35 @@ BOOST_AUTO_TEST_CASE_TEMPLATE(test_insert_erase_insert, TMap, test_types) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_erase_insert_alternating) {
+  // The slots of the erased values are reused by the following insertions.
+  const std::size_t nb_values = 1000;
+  tsl::htrie_map<char, std::string> map;
+
+  for (std::size_t i = 0; i < nb_values; i++) {
+    map.insert(utils::get_key<char>(i), utils::get_value<std::string>(i));
+  }
+
+  for (std::size_t i = 0; i < nb_values; i++) {
+    BOOST_CHECK_EQUAL(map.erase(utils::get_key<char>(i)), 1);
+    map.insert(utils::get_key<char>(i + nb_values),
+               utils::get_value<std::string>(i + nb_values));
+    BOOST_CHECK_EQUAL(map.size(), nb_values);
+  }
+
+  const tsl::htrie_map<char, std::string> map_copy = map;
+  for (std::size_t i = 0; i < 2 * nb_values; i++) {
+    auto it = map_copy.find(utils::get_key<char>(i));
+    if (i < nb_values) {
+      BOOST_CHECK(it == map_copy.end());
+    } else {
+      BOOST_REQUIRE(it != map_copy.end());
+      BOOST_CHECK_EQUAL(*it, utils::get_value<std::string>(i));
+      BOOST_CHECK_EQUAL(*map.find(utils::get_key<char>(i)), *it);
+    }
+  }
+}
+
 BOOST_AUTO_TEST_CASE(test_erase_with_empty_trie_node) {
   // Construct a hat-trie so that the multiple erases occur on trie_node without
   // any child.
@@ -250,6 +496,177 @@ BOOST_AUTO_TEST_CASE(test_erase_with_empty_trie_node) {
   BOOST_CHECK_EQUAL(std::distance(map.begin(), map.end()), 0);
 }
 
+BOOST_AUTO_TEST_CASE(test_insert_erase_wide_trie_node) {
+  // Give the root trie node one child for each possible character so that it
+  // goes through all its children representations while growing and while
+  // shrinking back.
+  const std::size_t nb_chars = 256;
+  const std::size_t nb_suffixes = 8;
+
+  auto get_key = [](std::size_t ichar, std::size_t isuffix) {
+    return std::string(1, static_cast<char>(ichar)) + std::to_string(isuffix);
+  };
+
+  tsl::htrie_map<char, std::int64_t> map(4);
+  for (std::size_t ichar = 0; ichar < nb_chars; ichar++) {
+    for (std::size_t isuffix = 0; isuffix < nb_suffixes; isuffix++) {
+      map.insert(get_key(ichar, isuffix),
+                 static_cast<std::int64_t>(ichar * nb_suffixes + isuffix));
+    }
+
+    const tsl::htrie_map<char, std::int64_t> map_copy = map;
+    BOOST_CHECK(map_copy == map);
+    BOOST_CHECK_EQUAL(std::distance(map.begin(), map.end()),
+                      (ichar + 1) * nb_suffixes);
+  }
+
+  for (std::size_t ichar = 0; ichar < nb_chars; ichar++) {
+    for (std::size_t isuffix = 0; isuffix < nb_suffixes; isuffix++) {
+      BOOST_CHECK_EQUAL(map.at(get_key(ichar, isuffix)),
+                        static_cast<std::int64_t>(ichar * nb_suffixes + isuffix));
+    }
+  }
+
+  // Erase from both ends to keep some children on each side of the node.
+  std::size_t nb_erased_chars = 0;
+  for (std::size_t i = 0; i < nb_chars / 2; i++) {
+    for (const std::size_t ichar : {i, nb_chars - 1 - i}) {
+      const std::string prefix(1, static_cast<char>(ichar));
+      BOOST_CHECK_EQUAL(map.erase_prefix(prefix), nb_suffixes);
+      nb_erased_chars++;
+
+      BOOST_CHECK_EQUAL(map.size(), (nb_chars - nb_erased_chars) * nb_suffixes);
+      BOOST_CHECK_EQUAL(std::distance(map.begin(), map.end()),
+                        (nb_chars - nb_erased_chars) * nb_suffixes);
+      BOOST_CHECK(map.find(get_key(ichar, 0)) == map.end());
+    }
+
+    if (i + 1 < nb_chars / 2) {
+      BOOST_CHECK_EQUAL(map.at(get_key(nb_chars / 2, 0)),
+                        static_cast<std::int64_t>(nb_chars / 2 * nb_suffixes));
+    }
+  }
+
+  BOOST_CHECK(map.empty());
+}
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_hybrid_mode, TMap, test_types) {
+  // Check that a map in hybrid mode behaves like a map in pure mode with
+  // skewed keys (a lot of keys under a few prefixes).
+  using char_tt = typename TMap::char_type;
+  using value_tt = typename TMap::mapped_type;
+
+  const std::size_t nb_values = 4000;
+  auto get_key = [](std::size_t i) {
+    const std::string key = std::to_string(i * 7919 % 100003);
+    return (i % 4 == 0) ? std::string(1, static_cast<char>(i % 256)) + key
+                        : "k" + key;
+  };
+
+  TMap pure_map(8);
+  TMap hybrid_map(8);
+  hybrid_map.hybrid_mode(true);
+  BOOST_CHECK(!pure_map.hybrid_mode());
+  BOOST_CHECK(hybrid_map.hybrid_mode());
+
+  for (std::size_t i = 0; i < nb_values; i++) {
+    pure_map.insert(get_key(i), utils::get_value<value_tt>(i));
+    BOOST_CHECK(
+        hybrid_map.insert(get_key(i), utils::get_value<value_tt>(i)).second);
+  }
+  hybrid_map.insert("", utils::get_value<value_tt>(nb_values));
+  pure_map.insert("", utils::get_value<value_tt>(nb_values));
+
+  BOOST_CHECK(hybrid_map == pure_map);
+  BOOST_CHECK_EQUAL(std::distance(hybrid_map.begin(), hybrid_map.end()),
+                    nb_values + 1);
+  for (auto it = hybrid_map.begin(); it != hybrid_map.end(); ++it) {
+    BOOST_CHECK(pure_map.find(it.key()) != pure_map.end());
+  }
+
+  for (const std::string prefix : {"k", "k1", "k12", "k123", "1", "a", "zz"}) {
+    auto hybrid_range = hybrid_map.equal_prefix_range(prefix);
+    auto pure_range = pure_map.equal_prefix_range(prefix);
+    BOOST_CHECK_EQUAL(std::distance(hybrid_range.first, hybrid_range.second),
+                      std::distance(pure_range.first, pure_range.second));
+  }
+
+  for (std::size_t i = 0; i < nb_values; i += 3) {
+    const std::string key = get_key(i) + "xyz";
+    BOOST_CHECK_EQUAL(hybrid_map.longest_prefix(key).key(),
+                      pure_map.longest_prefix(key).key());
+
+    std::vector<std::basic_string<char_tt>> hybrid_prefixes;
+    std::vector<std::basic_string<char_tt>> pure_prefixes;
+    hybrid_map.for_each_prefix_of(key, [&](typename TMap::iterator it) {
+      hybrid_prefixes.push_back(it.key());
+    });
+    pure_map.for_each_prefix_of(key, [&](typename TMap::iterator it) {
+      pure_prefixes.push_back(it.key());
+    });
+    BOOST_CHECK(hybrid_prefixes == pure_prefixes);
+  }
+
+  for (std::size_t i = 0; i < nb_values; i += 2) {
+    BOOST_CHECK_EQUAL(hybrid_map.erase(get_key(i)), 1);
+    pure_map.erase(get_key(i));
+  }
+  BOOST_CHECK(hybrid_map == pure_map);
+
+  BOOST_CHECK_EQUAL(hybrid_map.erase_prefix("k1"), pure_map.erase_prefix("k1"));
+  BOOST_CHECK(hybrid_map == pure_map);
+
+  auto it = hybrid_map.erase(hybrid_map.begin(), hybrid_map.end());
+  BOOST_CHECK(it == hybrid_map.end());
+  BOOST_CHECK(hybrid_map.empty());
+}
+
+BOOST_AUTO_TEST_CASE(test_adaptive_burst) {
+  // Keys under "p" are searched by prefix, keys under "e" exactly. Check that
+  // a map with the adaptive burst, whose hash nodes burst at different sizes,
+  // stays the same as a map without, in pure and hybrid mode.
+  for (const bool hybrid : {false, true}) {
+    tsl::htrie_map<char, std::int64_t> adaptive_map(256);
+    tsl::htrie_map<char, std::int64_t> map(256);
+    adaptive_map.adaptive_burst(true);
+    adaptive_map.hybrid_mode(hybrid);
+    map.hybrid_mode(hybrid);
+    BOOST_CHECK(adaptive_map.adaptive_burst());
+    BOOST_CHECK(!map.adaptive_burst());
+
+    for (std::size_t round = 0; round < 8; round++) {
+      for (std::size_t i = round * 200; i < (round + 1) * 200; i++) {
+        const std::string suffix = std::to_string(i * 7919 % 100003);
+        adaptive_map.insert("p" + suffix, i);
+        adaptive_map.insert("e" + suffix, i);
+        map.insert("p" + suffix, i);
+        map.insert("e" + suffix, i);
+      }
+
+      for (std::size_t i = 0; i < 100; i++) {
+        const std::string prefix = "p" + std::to_string(i % 10);
+        auto range = adaptive_map.equal_prefix_range(prefix);
+        auto expected_range = map.equal_prefix_range(prefix);
+        BOOST_CHECK_EQUAL(std::distance(range.first, range.second),
+                          std::distance(expected_range.first,
+                                        expected_range.second));
+
+        const std::string key = "e" + std::to_string(i * 7919 % 100003);
+        BOOST_CHECK_EQUAL(adaptive_map.at(key), map.at(key));
+      }
+
+      BOOST_CHECK(adaptive_map == map);
+    }
+
+    adaptive_map.burst_full_nodes();
+    BOOST_CHECK(adaptive_map == map);
+
+    const std::string key = "p" + std::to_string(7919) + "abc";
+    BOOST_CHECK_EQUAL(adaptive_map.longest_prefix(key).key(),
+                      map.longest_prefix(key).key());
+  }
+}
+
 /**
  * emplace
  */
@@ -402,6 +819,113 @@ BOOST_AUTO_TEST_CASE(test_for_each_prefix_of) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_prefix_search_incremental_hash) {
+  // longest_prefix and for_each_prefix_of compute the hashes of the prefixes
+  // in one pass with an incremental hash. Compare with the default hash, in
+  // pure and hybrid mode, with keys longer and shorter than the prefix hashes
+  // kept on the stack.
+  using prefix_map_type =
+      tsl::htrie_map<char, std::int64_t, tsl::ah::str_prefix_hash<char>>;
+  using map_type = tsl::htrie_map<char, std::int64_t>;
+
+  const tsl::ah::str_prefix_hash<char> prefix_hash;
+  const std::string long_key(300, 'l');
+  BOOST_CHECK_EQUAL(prefix_hash(long_key.data(), long_key.size()),
+                    prefix_hash(long_key.data(), long_key.size()));
+  BOOST_CHECK_NE(prefix_hash(long_key.data(), 299),
+                 prefix_hash(long_key.data(), 300));
+
+  auto get_key = [&](std::size_t i) {
+    const std::string key = std::to_string(i * 7919 % 100003);
+    return (i % 5 == 0) ? long_key.substr(0, i % 301) + key : "k" + key;
+  };
+
+  for (const bool hybrid : {false, true}) {
+    prefix_map_type prefix_map(8);
+    map_type map(8);
+    prefix_map.hybrid_mode(hybrid);
+    map.hybrid_mode(hybrid);
+
+    for (std::size_t i = 0; i < 2000; i++) {
+      prefix_map.insert(get_key(i), i);
+      map.insert(get_key(i), i);
+    }
+
+    for (std::size_t i = 0; i < 2000; i += 3) {
+      for (const std::string& key :
+           {get_key(i) + "xyz", long_key + get_key(i), get_key(i)}) {
+        auto it_prefix = prefix_map.longest_prefix(key);
+        auto it = map.longest_prefix(key);
+        BOOST_REQUIRE_EQUAL(it_prefix == prefix_map.end(), it == map.end());
+        if (it != map.end()) {
+          BOOST_CHECK_EQUAL(it_prefix.key(), it.key());
+        }
+
+        std::vector<std::string> prefixes_prefix_map;
+        std::vector<std::string> prefixes_map;
+        prefix_map.for_each_prefix_of(
+            key, [&](prefix_map_type::const_iterator it) {
+              prefixes_prefix_map.push_back(it.key());
+            });
+        map.for_each_prefix_of(key, [&](map_type::const_iterator it) {
+          prefixes_map.push_back(it.key());
+        });
+        BOOST_CHECK(prefixes_prefix_map == prefixes_map);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_prefix_search_key_sizes) {
+  // The hash nodes skip the key sizes they don't contain in longest_prefix and
+  // for_each_prefix_of. Check the results when the sizes of the keys in the
+  // node change through inserts, erases, shrink_to_fit and erase_prefix.
+  tsl::htrie_map<char, int> map;
+  const std::string query =
+      "abcdefghijklmnopqrstuvwxyz" + std::string(100, '_');
+
+  auto check_prefixes = [&](const std::vector<std::string>& expected) {
+    std::vector<std::string> prefixes;
+    map.for_each_prefix_of(query, [&](tsl::htrie_map<char, int>::iterator it) {
+      prefixes.push_back(it.key());
+    });
+    BOOST_CHECK(prefixes == expected);
+
+    if (expected.empty()) {
+      BOOST_CHECK(map.longest_prefix(query) == map.end());
+    } else {
+      BOOST_CHECK_EQUAL(map.longest_prefix(query).key(), expected.back());
+    }
+  };
+
+  map.insert("abc", 1);
+  map.insert("abcdefghijkl", 1);
+  map.insert("zzzzzzzz", 1);
+  check_prefixes({"abc", "abcdefghijkl"});
+
+  // 3 + 64: same size modulo 64 as "abc".
+  map.insert(query.substr(0, 67), 1);
+  map.insert("abcdef", 1);
+  check_prefixes({"abc", "abcdef", "abcdefghijkl", query.substr(0, 67)});
+
+  map.erase("abc");
+  map.erase(query.substr(0, 67));
+  check_prefixes({"abcdef", "abcdefghijkl"});
+
+  map.shrink_to_fit();
+  check_prefixes({"abcdef", "abcdefghijkl"});
+
+  map.insert("", 1);
+  map.insert("a", 1);
+  check_prefixes({"", "a", "abcdef", "abcdefghijkl"});
+
+  map.erase_prefix("");
+  check_prefixes({});
+
+  map.insert(query, 1);
+  check_prefixes({query});
+}
+
 /**
  * erase_prefix
  */
@@ -518,6 +1042,90 @@ BOOST_AUTO_TEST_CASE(test_erase_prefix_empty_map) {
   BOOST_CHECK_EQUAL(map.erase_prefix(""), 0);
 }
 
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_merge_small_nodes, TMap, test_types) {
+  // Erase most of the keys, merge the small subtrees and check the elements
+  // before and after new insertions and erasures, in pure and hybrid mode.
+  using value_tt = typename TMap::mapped_type;
+
+  auto get_key = [](std::size_t i) {
+    return (i % 7 == 0) ? std::string(i % 20, 'k')
+                        : "k" + std::to_string(i / 10 % 10) + std::to_string(i);
+  };
+
+  for (const bool hybrid : {false, true}) {
+    TMap map(16);
+    map.hybrid_mode(hybrid);
+
+    std::map<std::string, std::size_t> expected;
+    for (std::size_t i = 0; i < 2000; i++) {
+      map.insert(get_key(i), utils::get_value<value_tt>(i));
+      expected.insert({get_key(i), i});
+    }
+
+    for (std::size_t i = 0; i < 2000; i++) {
+      if (i % 10 != 0 || i % 20 == 0) {
+        map.erase(get_key(i));
+        expected.erase(get_key(i));
+      }
+    }
+    BOOST_CHECK(map.erase_prefix("k3") > 0);
+    expected.erase(expected.lower_bound("k3"), expected.lower_bound("k4"));
+
+    map.merge_small_nodes(1.0f);
+    BOOST_REQUIRE_EQUAL(map.size(), expected.size());
+    for (const auto& key_value : expected) {
+      BOOST_CHECK_EQUAL(map.at(key_value.first),
+                        utils::get_value<value_tt>(key_value.second));
+    }
+    BOOST_CHECK_EQUAL(std::distance(map.begin(), map.end()), expected.size());
+
+    auto range = map.equal_prefix_range("k1");
+    BOOST_CHECK_EQUAL(std::distance(range.first, range.second),
+                      std::distance(expected.lower_bound("k1"),
+                                    expected.lower_bound("k2")));
+    BOOST_CHECK_EQUAL(map.longest_prefix("kkkkkkkkkkkkkkkkkkkkkkk").key(),
+                      std::string(10, 'k'));
+
+    for (std::size_t i = 2000; i < 2200; i++) {
+      map.insert(get_key(i), utils::get_value<value_tt>(i));
+      expected.insert({get_key(i), i});
+    }
+    map.erase(get_key(10));
+    expected.erase(get_key(10));
+
+    BOOST_REQUIRE_EQUAL(map.size(), expected.size());
+    for (const auto& key_value : expected) {
+      BOOST_CHECK_EQUAL(map.at(key_value.first),
+                        utils::get_value<value_tt>(key_value.second));
+    }
+
+    map.erase(map.begin(), map.end());
+    map.merge_small_nodes(1.0f);
+    BOOST_CHECK(map.empty());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_merge_small_nodes_move_only) {
+  tsl::htrie_map<char, move_only_test> map(8);
+  for (std::size_t i = 0; i < 500; i++) {
+    map.emplace("k" + std::to_string(i), i);
+  }
+  for (std::size_t i = 0; i < 500; i++) {
+    if (i % 50 != 0) {
+      map.erase("k" + std::to_string(i));
+    }
+  }
+
+  map.merge_small_nodes(0.0f);
+  BOOST_CHECK_EQUAL(map.size(), 10);
+
+  map.merge_small_nodes(1.0f);
+  BOOST_CHECK_EQUAL(map.size(), 10);
+  for (std::size_t i = 0; i < 500; i += 50) {
+    BOOST_CHECK(map.at("k" + std::to_string(i)) == move_only_test(i));
+  }
+}
+
 /**
  * operator== and operator!=
  */
@@ -606,6 +1214,65 @@ BOOST_AUTO_TEST_CASE(test_move_operator) {
   BOOST_CHECK(map2 == (tsl::htrie_map<char, std::int64_t>{{"test1", 10}}));
 }
 
+/**
+ * Allocator
+ */
+BOOST_AUTO_TEST_CASE(test_arena_allocator) {
+  using arena_map =
+      tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>,
+                     std::uint16_t, tsl::htrie_arena_allocator<char>>;
+  const std::size_t nb_elements = 1000;
+
+  tsl::htrie_arena arena;
+  const tsl::htrie_arena_allocator<char> alloc(arena);
+
+  tsl::htrie_map<char, std::int64_t> std_alloc_map(8);
+  arena_map map_moved(alloc);
+  {
+    arena_map map(8, tsl::ah::str_hash<char>(), alloc);
+    for (std::size_t i = 0; i < nb_elements; i++) {
+      map.insert(utils::get_key<char>(i), utils::get_value<std::int64_t>(i));
+      std_alloc_map.insert(utils::get_key<char>(i),
+                           utils::get_value<std::int64_t>(i));
+    }
+
+    for (std::size_t i = 0; i < nb_elements; i += 2) {
+      BOOST_CHECK_EQUAL(map.erase(utils::get_key<char>(i)), 1);
+      BOOST_CHECK_EQUAL(std_alloc_map.erase(utils::get_key<char>(i)), 1);
+    }
+
+    BOOST_CHECK(map.get_allocator() == alloc);
+    BOOST_CHECK_EQUAL(map.size(), std_alloc_map.size());
+    for (auto it = std_alloc_map.begin(); it != std_alloc_map.end(); ++it) {
+      BOOST_CHECK_EQUAL(map.at(it.key()), it.value());
+    }
+
+    {
+      // The copy uses the same arena, clear() can't release it.
+      arena_map map_copy = map;
+      BOOST_CHECK(map_copy == map);
+
+      map_copy.clear();
+      BOOST_CHECK(map_copy.empty());
+      BOOST_CHECK_EQUAL(map.size(), std_alloc_map.size());
+      BOOST_CHECK(map.find(utils::get_key<char>(1)) != map.end());
+    }
+
+    map_moved = std::move(map);
+  }
+  BOOST_CHECK_EQUAL(map_moved.size(), std_alloc_map.size());
+  BOOST_CHECK(arena.reserved_bytes() > 0);
+
+  // map_moved is now the only user of the arena, clear() releases it.
+  map_moved.clear();
+  BOOST_CHECK(map_moved.empty());
+  BOOST_CHECK_EQUAL(arena.reserved_bytes(), 0);
+
+  map_moved.insert("test", 1);
+  BOOST_CHECK_EQUAL(map_moved.at("test"), 1);
+  BOOST_CHECK(arena.reserved_bytes() > 0);
+}
+
 /**
  * at
  */
@@ -643,6 +1310,57 @@ BOOST_AUTO_TEST_CASE(test_equal_range) {
   BOOST_CHECK(it_pair.first == map.end());
 }
 
+/**
+ * find_batch, count_batch
+ */
+BOOST_AUTO_TEST_CASE(test_find_count_batch) {
+  // Look up present and absent keys, ending in trie nodes, pure and hybrid
+  // hash nodes, and compare with find and count.
+  const std::size_t nb_values = 1000;
+
+  tsl::htrie_map<char, std::int64_t> map;
+  map.burst_threshold(8);
+
+  std::vector<std::string> keys = {"", "K", "Key 1x"};
+  for (std::size_t i = 0; i < nb_values; i++) {
+    keys.push_back(utils::get_key<char>(i));
+    if (i % 2 == 0) {
+      map.insert(keys.back(), utils::get_value<std::int64_t>(i));
+    }
+  }
+  map.insert("", 1);
+
+  std::vector<tsl::htrie_map<char, std::int64_t>::iterator> its;
+  map.find_batch(keys.begin(), keys.end(), std::back_inserter(its));
+
+  std::vector<tsl::htrie_map<char, std::int64_t>::size_type> counts;
+  map.count_batch(keys.begin(), keys.end(), std::back_inserter(counts));
+
+  BOOST_REQUIRE_EQUAL(its.size(), keys.size());
+  BOOST_REQUIRE_EQUAL(counts.size(), keys.size());
+  for (std::size_t i = 0; i < keys.size(); i++) {
+    BOOST_CHECK(its[i] == map.find(keys[i]));
+    BOOST_CHECK_EQUAL(counts[i], map.count(keys[i]));
+  }
+
+  std::vector<const char*> c_keys = {"", "Key 2", "Key 3", "Key 20"};
+  std::vector<tsl::htrie_map<char, std::int64_t>::const_iterator> c_its(
+      c_keys.size());
+
+  const auto& const_map = map;
+  auto it_end =
+      const_map.find_batch(c_keys.begin(), c_keys.end(), c_its.begin());
+  BOOST_CHECK(it_end == c_its.end());
+  BOOST_CHECK_EQUAL(c_its[0].value(), 1);
+  BOOST_CHECK_EQUAL(c_its[1].value(), utils::get_value<std::int64_t>(2));
+  BOOST_CHECK(c_its[2] == const_map.cend());
+  BOOST_CHECK_EQUAL(c_its[3].value(), utils::get_value<std::int64_t>(20));
+
+  const tsl::htrie_map<char, std::int64_t> empty_map;
+  empty_map.count_batch(c_keys.begin(), c_keys.end(), counts.begin());
+  BOOST_CHECK_EQUAL(std::count(counts.begin(), counts.begin() + 4, 0), 4);
+}
+
 /**
  * operator[]
  */
@@ -663,8 +1381,17 @@ BOOST_AUTO_TEST_CASE(test_access_operator) {
 /**
  * shrink_to_fit
  */
-BOOST_AUTO_TEST_CASE(test_shrink_to_fit) {
-  using TMap = tsl::htrie_map<char, std::int64_t>;
+using shrink_to_fit_test_types = boost::mpl::list<
+    tsl::htrie_map<char, std::int64_t>,
+    tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, false, true>,
+    tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, false, true, true>,
+    tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, true, true, true, true, true>>;
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_shrink_to_fit, TMap,
+                              shrink_to_fit_test_types) {
   using char_tt = typename TMap::char_type;
   using value_tt = typename TMap::mapped_type;
 
@@ -696,6 +1423,189 @@ BOOST_AUTO_TEST_CASE(test_shrink_to_fit) {
   BOOST_CHECK(map == map2);
 }
 
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_shrink_to_fit_sorted_buckets, TMap,
+                              shrink_to_fit_test_types) {
+  // equal_prefix_range and erase_prefix inside a hash node with sorted
+  // buckets, then after an insertion which breaks the order.
+  const std::size_t nb_elements = 4000;
+  const std::vector<std::string> prefixes = {
+      "", "K", "Key", "Key 1", "Key 12", "Key 399", "Key 3999", "Key 40", "Kex",
+      "Kez"};
+
+  const TMap map = utils::get_filled_map<TMap>(nb_elements, 16384);
+  TMap sorted_map = map;
+  sorted_map.shrink_to_fit();
+
+  auto check_prefix_ranges = [&](const TMap& expected, const TMap& sorted) {
+    for (const std::string& prefix : prefixes) {
+      auto expected_range = expected.equal_prefix_range(prefix);
+      auto range = sorted.equal_prefix_range(prefix);
+
+      std::set<std::string> expected_keys;
+      for (auto it = expected_range.first; it != expected_range.second; ++it) {
+        expected_keys.insert(it.key());
+      }
+
+      std::set<std::string> keys;
+      for (auto it = range.first; it != range.second; ++it) {
+        keys.insert(it.key());
+      }
+
+      BOOST_CHECK(keys == expected_keys);
+    }
+  };
+  check_prefix_ranges(map, sorted_map);
+
+  TMap expected_map = map;
+  BOOST_CHECK_EQUAL(sorted_map.erase_prefix("Key 12"),
+                    expected_map.erase_prefix("Key 12"));
+  BOOST_CHECK(sorted_map == expected_map);
+  check_prefix_ranges(expected_map, sorted_map);
+
+  sorted_map.insert("Key 1200", 1);
+  expected_map.insert("Key 1200", 1);
+  check_prefix_ranges(expected_map, sorted_map);
+}
+
+BOOST_AUTO_TEST_CASE(test_shrink_to_fit_common_prefix) {
+  // shrink_to_fit moves the common prefix of the keys of a hash node to the
+  // trie, check the lookups and modifications around this prefix.
+  const std::size_t nb_elements = 1000;
+  const std::string prefix = "http://www.example.com/";
+
+  tsl::htrie_map<char, std::int64_t> map;
+  for (std::size_t i = 0; i < nb_elements; i++) {
+    map.insert(prefix + utils::get_key<char>(i),
+               utils::get_value<std::int64_t>(i));
+  }
+
+  const tsl::htrie_map<char, std::int64_t> map_before = map;
+  map.shrink_to_fit();
+  BOOST_CHECK(map == map_before);
+
+  for (std::size_t i = 0; i < nb_elements; i++) {
+    BOOST_CHECK_EQUAL(map.at(prefix + utils::get_key<char>(i)),
+                      utils::get_value<std::int64_t>(i));
+  }
+  BOOST_CHECK(map.find("http://www.example.com") == map.end());
+  BOOST_CHECK_EQUAL(map.longest_prefix(prefix + "Key 12x").key(),
+                    prefix + "Key 12");
+
+  auto range = map.equal_prefix_range("http://www.ex");
+  BOOST_CHECK_EQUAL(std::distance(range.first, range.second), nb_elements);
+  range = map.equal_prefix_range(prefix + "Key 99");
+  BOOST_CHECK_EQUAL(std::distance(range.first, range.second), 11);
+
+  BOOST_CHECK(map.insert("http", 1).second);
+  BOOST_CHECK(map.insert("https://www.example.com/", 2).second);
+  BOOST_CHECK_EQUAL(map.erase_prefix("http://"), nb_elements);
+  BOOST_CHECK_EQUAL(map.size(), 2);
+  BOOST_CHECK_EQUAL(map.at("http"), 1);
+  BOOST_CHECK_EQUAL(map.at("https://www.example.com/"), 2);
+
+  serializer serial;
+  map.serialize(serial);
+  deserializer dserial(serial.str());
+  const auto map_deserialized =
+      tsl::htrie_map<char, std::int64_t>::deserialize(dserial);
+  BOOST_CHECK(map_deserialized == map);
+
+  map.erase("http");
+  map.erase("https://www.example.com/");
+  BOOST_CHECK(map.empty());
+  BOOST_CHECK(map.begin() == map.end());
+}
+
+BOOST_AUTO_TEST_CASE(test_slab_bucket_storage) {
+  // modify the buckets packed in a slab after a copy, a move, a swap and a
+  // deserialization.
+  using slab_map = tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>,
+                                  std::uint16_t, std::allocator<char>, false,
+                                  false, true>;
+  const std::size_t nb_values = 1000;
+
+  slab_map map(100);
+  for (std::size_t i = 0; i < nb_values; i++) {
+    map.insert(utils::get_key<char>(i), utils::get_value<std::int64_t>(i));
+  }
+
+  slab_map map_copy = map;
+  for (std::size_t i = 0; i < nb_values; i += 2) {
+    BOOST_CHECK_EQUAL(map_copy.erase(utils::get_key<char>(i)), 1);
+  }
+  for (std::size_t i = nb_values; i < nb_values * 2; i++) {
+    map_copy.insert(utils::get_key<char>(i),
+                    utils::get_value<std::int64_t>(i));
+  }
+  BOOST_CHECK_EQUAL(map_copy.size(), nb_values + nb_values / 2);
+
+  slab_map map_moved = std::move(map_copy);
+  map_copy = map;
+  BOOST_CHECK(map_copy == map);
+
+  map_moved.shrink_to_fit();
+  map_moved.insert("new key", 1);
+  swap(map_moved, map_copy);
+  BOOST_CHECK(map_copy.at("new key") == 1);
+  BOOST_CHECK(map_moved == map);
+
+  serializer serial;
+  map_copy.serialize(serial);
+
+  deserializer dserial(serial.str());
+  slab_map map_deserialized = slab_map::deserialize(dserial, true);
+  BOOST_CHECK(map_deserialized == map_copy);
+
+  for (std::size_t i = 1; i < nb_values * 2; i += 2) {
+    BOOST_CHECK_EQUAL(map_deserialized.erase(utils::get_key<char>(i)), 1);
+    BOOST_CHECK_EQUAL(map_copy.erase(utils::get_key<char>(i)), 1);
+  }
+  BOOST_CHECK(map_deserialized == map_copy);
+  BOOST_CHECK_EQUAL(map_deserialized.size(), nb_values / 2 + 1);
+
+  map_deserialized.clear();
+  BOOST_CHECK(map_deserialized.empty());
+  map_deserialized.insert("key", 2);
+  BOOST_CHECK_EQUAL(map_deserialized.at("key"), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_incremental_rehash) {
+  // lookups, copies and serializations of a hash node while some of its old
+  // buckets are not migrated yet.
+  using incremental_map =
+      tsl::htrie_map<char, std::string, tsl::ah::str_hash<char>, std::uint16_t,
+                     std::allocator<char>, false, false, false, false, false,
+                     true>;
+  const std::size_t nb_values = 5000;
+
+  incremental_map map(nb_values * 2);
+  for (std::size_t i = 0; i < nb_values; i++) {
+    map.insert(utils::get_key<char>(i), utils::get_value<std::string>(i));
+    BOOST_CHECK_EQUAL(map.at(utils::get_key<char>(i / 2)),
+                      utils::get_value<std::string>(i / 2));
+    BOOST_CHECK(map.find(utils::get_key<char>(i + 1)) == map.end());
+
+    if (i % 997 == 0) {
+      const incremental_map map_copy = map;
+      BOOST_CHECK(map_copy == map);
+      BOOST_CHECK_EQUAL(std::distance(map_copy.begin(), map_copy.end()),
+                        i + 1);
+
+      serializer serial;
+      map.serialize(serial);
+
+      deserializer dserial(serial.str());
+      BOOST_CHECK(incremental_map::deserialize(dserial, true) == map);
+    }
+  }
+
+  for (std::size_t i = 0; i < nb_values; i += 2) {
+    BOOST_CHECK_EQUAL(map.erase(utils::get_key<char>(i)), 1);
+  }
+  BOOST_CHECK_EQUAL(map.size(), nb_values / 2);
+  BOOST_CHECK_EQUAL(std::distance(map.begin(), map.end()), nb_values / 2);
+}
+
 /**
  * swap
  */
@@ -763,6 +1673,164 @@ BOOST_AUTO_TEST_CASE(test_serialize_deserialize_map) {
   BOOST_CHECK(map_deserialized == map);
 }
 
+BOOST_AUTO_TEST_CASE(test_serialize_deserialize_fingerprint_map) {
+  // serialize a map with hash fingerprints; deserialize it in a map without
+  // them and the other way around.
+  using fingerprint_map =
+      tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>,
+                     std::uint16_t, std::allocator<char>, true>;
+  const std::size_t nb_values = 1000;
+
+  fingerprint_map map(7);
+  for (std::size_t i = 0; i < nb_values; i++) {
+    map.insert(utils::get_key<char>(i), utils::get_value<std::int64_t>(i));
+  }
+
+  serializer serial;
+  map.serialize(serial);
+
+  for (const bool hash_compatible : {true, false}) {
+    deserializer dserial(serial.str());
+    const auto map_deserialized =
+        tsl::htrie_map<char, std::int64_t>::deserialize(dserial,
+                                                        hash_compatible);
+    BOOST_CHECK_EQUAL(map_deserialized.size(), nb_values);
+    for (std::size_t i = 0; i < nb_values; i++) {
+      BOOST_CHECK_EQUAL(map_deserialized.at(utils::get_key<char>(i)),
+                        utils::get_value<std::int64_t>(i));
+    }
+
+    serializer serial2;
+    map_deserialized.serialize(serial2);
+
+    deserializer dserial2(serial2.str());
+    BOOST_CHECK(fingerprint_map::deserialize(dserial2, hash_compatible) ==
+                map);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_serialize_deserialize_varint_key_size_map) {
+  // keys long enough to need multiple units for their size, in a map with
+  // variable-length key sizes serialized and deserialized in a map without
+  // them and the other way around.
+  using varint_map =
+      tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>,
+                     std::uint16_t, std::allocator<char>, false, false, false,
+                     true>;
+  const std::size_t nb_values = 1000;
+
+  varint_map map(7);
+  for (std::size_t i = 0; i < nb_values; i++) {
+    map.insert(std::string(i % 300, 'a') + utils::get_key<char>(i),
+               utils::get_value<std::int64_t>(i));
+  }
+  BOOST_CHECK_EQUAL(map.size(), nb_values);
+
+  serializer serial;
+  map.serialize(serial);
+
+  for (const bool hash_compatible : {true, false}) {
+    deserializer dserial(serial.str());
+    const auto map_deserialized =
+        tsl::htrie_map<char, std::int64_t>::deserialize(dserial,
+                                                        hash_compatible);
+    BOOST_CHECK_EQUAL(map_deserialized.size(), nb_values);
+    for (std::size_t i = 0; i < nb_values; i++) {
+      BOOST_CHECK_EQUAL(map_deserialized.at(std::string(i % 300, 'a') +
+                                            utils::get_key<char>(i)),
+                        utils::get_value<std::int64_t>(i));
+    }
+
+    serializer serial2;
+    map_deserialized.serialize(serial2);
+
+    deserializer dserial2(serial2.str());
+    BOOST_CHECK(varint_map::deserialize(dserial2, hash_compatible) == map);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_serialize_deserialize_inline_values_map) {
+  // the values stored in the buckets are serialized like the values of a map
+  // without inline values.
+  using inline_values_map =
+      tsl::htrie_map<char, std::int64_t, tsl::ah::str_hash<char>,
+                     std::uint16_t, std::allocator<char>, false, false, false,
+                     false, true>;
+  const std::size_t nb_values = 1000;
+
+  inline_values_map map(7);
+  for (std::size_t i = 0; i < nb_values; i++) {
+    map.insert(utils::get_key<char>(i), utils::get_value<std::int64_t>(i));
+  }
+
+  serializer serial;
+  map.serialize(serial);
+
+  for (const bool hash_compatible : {true, false}) {
+    deserializer dserial(serial.str());
+    const auto map_deserialized =
+        tsl::htrie_map<char, std::int64_t>::deserialize(dserial,
+                                                        hash_compatible);
+    BOOST_CHECK_EQUAL(map_deserialized.size(), nb_values);
+    for (std::size_t i = 0; i < nb_values; i++) {
+      BOOST_CHECK_EQUAL(map_deserialized.at(utils::get_key<char>(i)),
+                        utils::get_value<std::int64_t>(i));
+    }
+
+    serializer serial2;
+    map_deserialized.serialize(serial2);
+
+    deserializer dserial2(serial2.str());
+    BOOST_CHECK(inline_values_map::deserialize(dserial2, hash_compatible) ==
+                map);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_serialize_deserialize_hybrid_map) {
+  const std::size_t nb_values = 1000;
+
+  tsl::htrie_map<char, std::string> map(7);
+  map.hybrid_mode(true);
+
+  map.insert("", utils::get_value<std::string>(0));
+  for (std::size_t i = 1; i < nb_values; i++) {
+    map.insert(std::to_string(i * 7919 % 100003),
+               utils::get_value<std::string>(i));
+  }
+
+  const auto map_copy = map;
+  BOOST_CHECK(map_copy == map);
+
+  serializer serial;
+  map.serialize(serial);
+
+  deserializer dserial(serial.str());
+  auto map_deserialized = decltype(map)::deserialize(dserial, true);
+  BOOST_CHECK(map_deserialized.hybrid_mode());
+  BOOST_CHECK(map == map_deserialized);
+
+  deserializer dserial2(serial.str());
+  map_deserialized = decltype(map)::deserialize(dserial2, false);
+  BOOST_CHECK(map_deserialized == map);
+}
+
+BOOST_AUTO_TEST_CASE(test_serialize_deserialize_adaptive_burst_map) {
+  tsl::htrie_map<char, std::int64_t> map(7);
+  map.adaptive_burst(true);
+  for (std::size_t i = 0; i < 1000; i++) {
+    map.insert(std::to_string(i * 7919 % 100003), i);
+  }
+
+  serializer serial;
+  map.serialize(serial);
+
+  deserializer dserial(serial.str());
+  auto map_deserialized = decltype(map)::deserialize(dserial, true);
+  BOOST_CHECK(map_deserialized.adaptive_burst());
+  BOOST_CHECK(!map_deserialized.hybrid_mode());
+  BOOST_CHECK(map == map_deserialized);
+}
+
 BOOST_AUTO_TEST_CASE(test_serialize_deserialize_with_different_hash) {
   // insert x values; delete some values; serialize map; deserialize it in a new
   // map with an incompatible hash; check equal.
@@ -801,6 +1869,27 @@ BOOST_AUTO_TEST_CASE(test_serialize_deserialize_with_different_hash) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_str_hash_values) {
+  // the default hash must give the same values on every platform and in every
+  // language mode to keep the serialized maps hash compatible. Check some
+  // values, one for each code path of the hash.
+  const std::vector<std::pair<std::string, std::uint64_t>> keys_hashes = {
+      {"", 0x0409638ee2bde459ull},
+      {"a", 0x28d2053309d28531ull},
+      {"abc", 0x02a4f1d7cb516c72ull},
+      {"Key 1", 0x53a93a564a32fea6ull},
+      {"0123456789abcdef", 0xc304e72c387cd229ull},
+      {"0123456789abcdefg", 0xb496f8f306600195ull},
+      {"http://www.example.com/some/long/shared/prefix/000000000042/page.html",
+       0x246b8acd2f87034cull}};
+
+  const tsl::ah::str_hash<char> hash;
+  for (const auto& key_hash : keys_hashes) {
+    BOOST_CHECK_EQUAL(hash(key_hash.first.data(), key_hash.first.size()),
+                      static_cast<std::size_t>(key_hash.second));
+  }
+}
+
 BOOST_AUTO_TEST_CASE(test_serialize_deserialize_map_no_burst) {
   // test deserialization when there is only a hash node.
   // set burst_threshold to x+1; insert x values; serialize map; deserialize in
@@ -23,15 +23,22 @@
  */
 #include <boost/mpl/list.hpp>
 #include <boost/test/unit_test.hpp>
+#include <algorithm>
+#include <iterator>
+#include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include "tsl/htrie_set.h"
 #include "utils.h"
 
 BOOST_AUTO_TEST_SUITE(test_htrie_set)
 
-using test_types = boost::mpl::list<tsl::htrie_set<char>>;
+using test_types = boost::mpl::list<
+    tsl::htrie_set<char>,
+    tsl::htrie_set<char, tsl::ah::str_hash<char>, std::uint16_t,
+                   std::allocator<char>, false, false, false, false, true>>;
 
 /**
  * insert
@@ -75,6 +82,50 @@ BOOST_AUTO_TEST_CASE_TEMPLATE(test_insert, TMap, test_types) {
   }
 }
 
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_insert_sorted, TMap, test_types) {
+  using char_tt = typename TMap::char_type;
+
+  std::vector<std::basic_string<char_tt>> keys;
+  for (std::size_t i = 0; i < 20000; i++) {
+    keys.push_back(utils::get_key<char_tt>(i));
+  }
+  std::sort(keys.begin(), keys.end());
+
+  for (const bool hybrid : {false, true}) {
+    TMap set(64);
+    set.hybrid_mode(hybrid);
+    set.insert_sorted(keys.begin(), keys.end());
+
+    BOOST_CHECK_EQUAL(set.size(), keys.size());
+    BOOST_CHECK(set == TMap(keys.begin(), keys.end()));
+
+    set.insert(utils::get_key<char_tt>(100000));
+    BOOST_CHECK_EQUAL(set.erase(utils::get_key<char_tt>(5)), 1);
+    BOOST_CHECK_EQUAL(set.size(), keys.size());
+
+    const std::basic_string<char_tt> batch[] = {
+        utils::get_key<char_tt>(5), utils::get_key<char_tt>(6),
+        utils::get_key<char_tt>(200000), utils::get_key<char_tt>(5)};
+    BOOST_CHECK_EQUAL(set.insert_batch(std::begin(batch), std::end(batch)), 2);
+    BOOST_CHECK_EQUAL(set.size(), keys.size() + 2);
+    BOOST_CHECK_EQUAL(set.count(utils::get_key<char_tt>(200000)), 1);
+  }
+
+  std::vector<std::basic_string<char_tt>> shuffled_keys = keys;
+  std::reverse(shuffled_keys.begin(), shuffled_keys.end());
+  std::rotate(shuffled_keys.begin(), shuffled_keys.begin() + 1234,
+              shuffled_keys.end());
+
+  TMap parallel_set(64);
+  parallel_set.insert_parallel(shuffled_keys.begin(), shuffled_keys.end(), 3);
+  BOOST_CHECK(parallel_set == TMap(keys.begin(), keys.end()));
+
+  const char_tt* raw_keys[] = {"a", "ab", "abc", "b"};
+  const TMap set = TMap::from_sorted(std::begin(raw_keys), std::end(raw_keys));
+  BOOST_CHECK_EQUAL(set.size(), 4);
+  BOOST_CHECK_EQUAL(set.count("ab"), 1);
+}
+
 /**
  * operator=
  */
@@ -27,6 +27,7 @@
 #include <boost/numeric/conversion/cast.hpp>
 #include <memory>
 #include <ostream>
+#include <stdexcept>
 #include <string>
 
 class move_only_test {
@@ -105,6 +106,27 @@ class throw_move_test {
   std::int64_t m_value;
 };
 
+class throw_copy_test {
+ public:
+  throw_copy_test(std::int64_t value, bool throw_on_copy)
+      : m_value(value), m_throw_on_copy(throw_on_copy) {}
+
+  throw_copy_test(const throw_copy_test& other)
+      : m_value(other.m_value), m_throw_on_copy(other.m_throw_on_copy) {
+    if (m_throw_on_copy) {
+      throw std::runtime_error("throw_copy_test copy.");
+    }
+  }
+
+  throw_copy_test(throw_copy_test&& other) noexcept = default;
+
+  operator std::int64_t() const { return m_value; }
+
+ private:
+  std::int64_t m_value;
+  bool m_throw_on_copy;
+};
+
 class utils {
  public:
   template <typename CharT>